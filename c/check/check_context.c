@@ -0,0 +1,144 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "kmeans_config.h"
+#include "kmeans.h"
+
+// an engine called repeatedly with a context on inputs of the same size has
+// to draw all of its auxiliary memory from what the first call reserved
+
+#define ROWS 256u
+#define COLS 320u
+#define N_PIXELS (ROWS * COLS)
+#define N_CENTROIDS 16u
+#define SEED 42u
+#define REPETITIONS 5
+
+static unsigned char image[3u * N_PIXELS];
+static struct pixel pixels[N_PIXELS];
+static struct pixel centroids[N_CENTROIDS];
+static size_t labels[N_PIXELS];
+
+static struct pixel_bgr bgr_image(void)
+{
+    struct pixel_bgr bgr = { image, ROWS, COLS, 3u * COLS };
+    return bgr;
+}
+
+static void run_omp(void)
+{
+    kmeans_omp(pixels, N_PIXELS, centroids, N_CENTROIDS, labels);
+}
+
+static void run_omp_hamerly(void)
+{
+    kmeans_omp_hamerly(pixels, N_PIXELS, centroids, N_CENTROIDS, labels);
+}
+
+static void run_omp_bisecting(void)
+{
+    kmeans_omp_bisecting(pixels, N_PIXELS, centroids, N_CENTROIDS, labels);
+}
+
+static void run_omp_minibatch(void)
+{
+    kmeans_omp_minibatch(bgr_image(), centroids, N_CENTROIDS, labels,
+                         KMEANS_MINIBATCH_BATCHSIZE);
+}
+
+static void run_omp_histogram(void)
+{
+    kmeans_omp_histogram(bgr_image(), centroids, N_CENTROIDS, labels,
+                         KMEANS_HISTOGRAM_BITS);
+}
+
+static void run_omp_compact(void)
+{
+    kmeans_omp_compact(bgr_image(), centroids, N_CENTROIDS, labels,
+                       KMEANS_LABEL_U8);
+}
+
+struct engine
+{
+    char const *name;
+    void (*run)(void);
+};
+
+static struct engine const engines[] = {
+    { "kmeans_omp", run_omp },
+    { "kmeans_omp_hamerly", run_omp_hamerly },
+    { "kmeans_omp_bisecting", run_omp_bisecting },
+    { "kmeans_omp_minibatch", run_omp_minibatch },
+    { "kmeans_omp_histogram", run_omp_histogram },
+    { "kmeans_omp_compact", run_omp_compact }
+};
+
+// deterministic image independent of the C library's rand()
+static void fill_image(void)
+{
+    uint64_t state = SEED;
+
+    for (size_t i = 0u; i < N_PIXELS; ++i) {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+
+        unsigned char *p = &image[3u * i];
+        p[0] = (unsigned char) (state >> 40);
+        p[1] = (unsigned char) ((state >> 48) % 200u);
+        p[2] = (unsigned char) (((state >> 56) % 50u) * 5u);
+
+        pixels[i].b = p[0];
+        pixels[i].g = p[1];
+        pixels[i].r = p[2];
+    }
+}
+
+int main(void)
+{
+    fill_image();
+
+    kmeans_set_seeding(KMEANS_INIT_PLUSPLUS, SEED);
+
+    // a few iterations suffice, scratch memory is sized per call
+    struct kmeans_options options;
+    kmeans_default_options(&options);
+    options.max_iter = 10;
+    kmeans_set_options(&options);
+
+    int failed = 0;
+
+    for (size_t e = 0u; e < sizeof(engines) / sizeof(engines[0]); ++e) {
+        struct kmeans_context *ctx = kmeans_context_create();
+        if (!ctx) {
+            perror("kmeans_context_create");
+            return EXIT_FAILURE;
+        }
+
+        kmeans_set_context(ctx);
+
+        // the first call reserves everything
+        engines[e].run();
+        size_t reserved = kmeans_context_get_stats(ctx).bytes_reserved;
+
+        kmeans_context_reset_stats(ctx);
+
+        for (int i = 0; i < REPETITIONS; ++i)
+            engines[e].run();
+
+        struct kmeans_context_stats stats = kmeans_context_get_stats(ctx);
+
+        int ok = stats.calls == REPETITIONS && stats.allocations == 0u &&
+                 stats.bytes_reserved == reserved;
+
+        printf("%s: %zu calls, %zu allocations, %zu bytes reserved %s\n",
+               engines[e].name, stats.calls, stats.allocations,
+               stats.bytes_reserved, ok ? "ok" : "FAILED");
+
+        failed |= !ok;
+
+        kmeans_set_context(NULL);
+        kmeans_context_destroy(ctx);
+    }
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,122 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kmeans.h"
+
+// kmeans_sharded has to reproduce kmeans_omp exactly: same seeding, same
+// iterations and the same labels for every number of workers
+
+#define N_PIXELS 100000u
+#define N_CENTROIDS 16u
+#define SEED 42u
+#define MAX_WORKERS 4
+
+// deterministic image independent of the C library's rand()
+static void fill_pixels(struct pixel *pixels, size_t n_pixels)
+{
+    uint64_t state = SEED;
+
+    for (size_t i = 0u; i < n_pixels; ++i) {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+
+        pixels[i].r = (double) ((state >> 40) & 0xffu);
+        pixels[i].g = (double) ((state >> 48) % 200u);
+        pixels[i].b = (double) (((state >> 56) % 50u) * 5u);
+    }
+}
+
+static int check(char const *name, struct pixel *pixels, size_t n_pixels,
+                 size_t n_centroids, enum kmeans_init init,
+                 struct pixel const *initial)
+{
+    struct pixel *centroids = malloc(n_centroids * sizeof(struct pixel));
+    size_t *expected = malloc(n_pixels * sizeof(size_t));
+    size_t *labels = malloc(n_pixels * sizeof(size_t));
+
+    if (!centroids || !expected || !labels) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    struct kmeans_result result;
+    memset(&result, 0, sizeof(result));
+    kmeans_set_result(&result);
+
+    kmeans_set_seeding(init, SEED);
+
+    if (initial)
+        memcpy(centroids, initial, n_centroids * sizeof(struct pixel));
+
+    kmeans_omp(pixels, n_pixels, centroids, n_centroids, expected);
+    int expected_iterations = result.iterations;
+
+    int failed = 0;
+
+    for (int n_workers = 1; n_workers <= MAX_WORKERS; ++n_workers) {
+        if (initial)
+            memcpy(centroids, initial, n_centroids * sizeof(struct pixel));
+
+        if (kmeans_sharded(pixels, n_pixels, centroids, n_centroids, labels,
+                           n_workers, NULL) != 0) {
+            perror("kmeans_sharded");
+            exit(EXIT_FAILURE);
+        }
+
+        size_t n_different = 0u;
+        for (size_t i = 0u; i < n_pixels; ++i)
+            n_different += labels[i] != expected[i];
+
+        int ok = n_different == 0u && result.iterations == expected_iterations;
+
+        printf("%s, %d worker(s): %zu labels differ, %d vs. %d iterations"
+               " %s\n", name, n_workers, n_different, result.iterations,
+               expected_iterations, ok ? "ok" : "FAILED");
+
+        failed |= !ok;
+    }
+
+    kmeans_set_result(NULL);
+
+    free(centroids);
+    free(expected);
+    free(labels);
+
+    return failed;
+}
+
+int main(void)
+{
+    struct pixel *pixels = malloc(N_PIXELS * sizeof(struct pixel));
+    if (!pixels) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+
+    fill_pixels(pixels, N_PIXELS);
+
+    int failed = check("k-means++", pixels, N_PIXELS, N_CENTROIDS,
+                       KMEANS_INIT_PLUSPLUS, NULL);
+
+    // three distinct colours and centroids far away from all of them, so
+    // that every iteration has to repair empty clusters
+    size_t n_repair = 999u;
+    for (size_t i = 0u; i < n_repair; ++i) {
+        pixels[i].r = (double) (i % 3u);
+        pixels[i].g = pixels[i].b = 0.0;
+    }
+
+    struct pixel initial[8];
+    for (size_t j = 0u; j < 8u; ++j) {
+        initial[j].r = 1000.0 + j;
+        initial[j].g = initial[j].b = 0.0;
+    }
+
+    failed |= check("empty cluster repair", pixels, n_repair, 8u,
+                    KMEANS_INIT_PROVIDED, initial);
+
+    free(pixels);
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
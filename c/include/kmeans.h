@@ -1,11 +1,227 @@
 #ifndef KMEANS_H
 #define KMEANS_H
 
+#include <stddef.h>
+
 struct pixel
 {
     double r, g, b;
 };
 
+struct pixel_planar
+{
+    float *r, *g, *b;
+};
+
+// packed 8-bit BGR image (e.g. a CV_8UC3 cv::Mat), step is the distance
+// between rows in bytes and may exceed 3 * cols
+struct pixel_bgr
+{
+    unsigned char *data;
+    size_t rows, cols, step;
+};
+
+// storage order of a feature matrix
+enum kmeans_layout
+{
+    KMEANS_ROW_MAJOR, // features of a point are contiguous
+    KMEANS_COL_MAJOR  // each feature is stored contiguously for all points
+};
+
+// n_rows points of n_cols features each, element (i, j) is data[i * ld + j]
+// if row-major and data[j * ld + i] if column-major (ld is at least n_cols
+// resp. n_rows)
+struct kmeans_matrix
+{
+    float const *data;
+    size_t n_rows, n_cols;
+    size_t ld;
+    enum kmeans_layout layout;
+};
+
+// storage type of labels for engines operating on compact data
+enum kmeans_label_type
+{
+    KMEANS_LABEL_U8,
+    KMEANS_LABEL_U16,
+    KMEANS_LABEL_U32,
+    KMEANS_LABEL_SIZE
+};
+
+enum kmeans_init
+{
+    KMEANS_INIT_RANDOM,
+    KMEANS_INIT_PLUSPLUS,
+    KMEANS_INIT_PARALLEL,
+    KMEANS_INIT_PROVIDED // use centroids as passed in (warm start)
+};
+
+// distance kernels of the feature engines
+enum kmeans_distance
+{
+    KMEANS_DISTANCE_AUTO,   // choose by numbers of points, clusters, features
+    KMEANS_DISTANCE_SCALAR, // squared distances one centroid at a time
+    KMEANS_DISTANCE_GEMM    // ||x||^2 - 2 x.c + ||c||^2 as blocked GEMM
+};
+
+// scratch memory (host and device) kept alive between engine calls
+struct kmeans_context;
+
+struct kmeans_context_stats
+{
+    size_t calls;          // engine calls made with the context
+    size_t allocations;    // host / device allocations made on its behalf
+    size_t bytes_reserved; // memory currently held
+};
+
+struct kmeans_context *kmeans_context_create(void);
+
+void kmeans_context_destroy(struct kmeans_context *ctx);
+
+// make all engines called from this thread draw their auxiliary memory from
+// ctx, which is only reallocated if an input exceeds all previous ones, NULL
+// restores per-call allocation
+void kmeans_set_context(struct kmeans_context *ctx);
+
+struct kmeans_context *kmeans_get_context(void);
+
+struct kmeans_context_stats kmeans_context_get_stats(
+    struct kmeans_context const *ctx);
+
+// zero calls and allocations (bytes_reserved is left intact)
+void kmeans_context_reset_stats(struct kmeans_context *ctx);
+
+// account for an allocation of size bytes made by a caller on behalf of ctx
+void kmeans_context_record_allocation(struct kmeans_context *ctx, size_t size);
+
+// run-time termination criteria, an engine stops as soon as any criterion is
+// met (but never directly after repairing an empty cluster)
+struct kmeans_options
+{
+    int max_iter;       // maximum number of iterations
+    double shift_tol;   // no centroid moved further than this (0: off)
+    double inertia_tol; // inertia decreased by less than this share (0: off)
+    double changed_tol; // at most this fraction of labels changed
+};
+
+// telemetry of a single engine call
+struct kmeans_result
+{
+    int iterations;
+    int converged;  // zero if max_iter was reached
+    double inertia; // sum of squared distances of pixels to their centroids
+                    // (as of the last assignment step, NAN for kmeans_cuda)
+    double time;    // seconds, including initialization
+
+    // seconds per iteration, filled up to iteration_times_size entries if
+    // provided by the caller
+    double *iteration_times;
+    size_t iteration_times_size;
+};
+
+// max_iter = KMEANS_MAX_ITER, stop only if no label changed
+void kmeans_default_options(struct kmeans_options *options);
+
+// options used by engines called from this thread (copied), NULL restores
+// the defaults
+void kmeans_set_options(struct kmeans_options const *options);
+
+// make engines called from this thread report into result (NULL: don't)
+void kmeans_set_result(struct kmeans_result *result);
+
+// phases of an engine call recorded by a trace
+enum kmeans_phase
+{
+    KMEANS_PHASE_SEED,    // centroid initialization
+    KMEANS_PHASE_ASSIGN,  // reassigning pixels to closest centroids
+    KMEANS_PHASE_REPAIR,  // repairing empty clusters
+    KMEANS_PHASE_AVERAGE, // recomputing centroids (and derived bounds)
+    KMEANS_PHASE_LABEL,   // final labelling pass (mini-batch / histogram)
+    KMEANS_PHASES
+};
+
+// hardware counters optionally recorded per phase
+enum kmeans_counter
+{
+    KMEANS_COUNTER_CYCLES,
+    KMEANS_COUNTER_INSTRUCTIONS,
+    KMEANS_COUNTER_CACHE_MISSES,
+    KMEANS_COUNTERS
+};
+
+// wall time and label changes of every phase / iteration of the engine calls
+// made while it is active
+struct kmeans_trace;
+
+struct kmeans_phase_stats
+{
+    size_t count;                             // number of times entered
+    double time;                              // total seconds
+    unsigned long long counters[KMEANS_COUNTERS];
+};
+
+// hw_counters requests hardware counters via perf_event_open, these only
+// count the thread creating the trace (not e.g. OpenMP workers), check
+// kmeans_trace_has_counters whether they are available
+struct kmeans_trace *kmeans_trace_create(int hw_counters);
+
+void kmeans_trace_destroy(struct kmeans_trace *trace);
+
+// make engines called from this thread record into trace (NULL: don't), a
+// trace must not be active on several threads at once
+void kmeans_set_trace(struct kmeans_trace *trace);
+
+int kmeans_trace_has_counters(struct kmeans_trace const *trace);
+
+// drop all recorded events
+void kmeans_trace_clear(struct kmeans_trace *trace);
+
+// totals over all recorded events of one phase
+struct kmeans_phase_stats kmeans_trace_get_phase_stats(
+    struct kmeans_trace const *trace, enum kmeans_phase phase);
+
+char const *kmeans_phase_name(enum kmeans_phase phase);
+
+// write recorded events in Chrome trace event format (JSON, viewable with
+// chrome://tracing or Perfetto), returns zero on success
+int kmeans_trace_write(struct kmeans_trace const *trace, char const *filename);
+
+// select centroid initialization used by engines called from this thread, a
+// seed of zero derives the seed from the current time
+void kmeans_set_seeding(enum kmeans_init init, unsigned long seed);
+
+// seed for engines which need further random numbers beyond initialization
+unsigned long kmeans_get_seed(void);
+
+// initialization selected by kmeans_set_seeding (for engines which construct
+// their initial centroids themselves)
+enum kmeans_init kmeans_get_init(void);
+
+// select distance kernel used by the feature engines (process-wide)
+void kmeans_set_distance(enum kmeans_distance distance);
+
+// kernel the feature engines run for n_points points of n_features features
+// and n_centroids clusters under the current selection
+enum kmeans_distance kmeans_select_distance(size_t n_points,
+                                            size_t n_centroids,
+                                            size_t n_features);
+
+void kmeans_seed(struct pixel const *pixels, size_t n_pixels,
+                 struct pixel *centroids, size_t n_centroids, int parallel);
+
+// as kmeans_seed with pixel i occurring weights[i] times
+void kmeans_seed_weighted(struct pixel const *pixels, size_t const *weights,
+                          size_t n_pixels, struct pixel *centroids,
+                          size_t n_centroids, int parallel);
+
+void kmeans_seed_planar(struct pixel_planar pixels, size_t n_pixels,
+                        struct pixel *centroids, size_t n_centroids,
+                        int parallel);
+
+void kmeans_seed_bgr(struct pixel_bgr pixels,
+                     struct pixel *centroids, size_t n_centroids,
+                     int parallel);
+
 void kmeans_c(struct pixel *pixels, size_t n_pixels,
               struct pixel *centroids, size_t n_centroids,
               size_t *labels);
@@ -14,8 +230,300 @@ void kmeans_omp(struct pixel *pixels, size_t n_pixels,
                 struct pixel *centroids, size_t n_centroids,
                 size_t *labels);
 
+void kmeans_hamerly(struct pixel *pixels, size_t n_pixels,
+                    struct pixel *centroids, size_t n_centroids,
+                    size_t *labels);
+
+void kmeans_omp_hamerly(struct pixel *pixels, size_t n_pixels,
+                        struct pixel *centroids, size_t n_centroids,
+                        size_t *labels);
+
+// kmeans_omp for multi-socket machines: threads are pinned to the CPUs of
+// NUMA nodes in contiguous blocks and each works on the pixels / labels of
+// kmeans_numa_range in every iteration, per-thread sums are reduced per node
+// before being merged, pages should be first touched the same way (e.g.
+// allocated by kmeans_numa_alloc and initialized in a parallel region calling
+// kmeans_numa_bind / kmeans_numa_range with the same number of threads)
+void kmeans_omp_numa(struct pixel *pixels, size_t n_pixels,
+                     struct pixel *centroids, size_t n_centroids,
+                     size_t *labels);
+
+// number of NUMA nodes with CPUs this process may run on (1 if unknown)
+int kmeans_numa_nodes(void);
+
+// node the threads of a team of n_threads are placed on by kmeans_numa_bind
+int kmeans_numa_thread_node(int tid, int n_threads, int n_nodes);
+
+// pin the calling thread of an OpenMP team to a CPU of its node (Linux only),
+// threads stay pinned across parallel regions until kmeans_numa_unbind
+void kmeans_numa_bind(void);
+
+// restore the calling thread's affinity from before kmeans_numa_bind
+void kmeans_numa_unbind(void);
+
+// contiguous range [begin, end) of n items owned by the calling thread of an
+// OpenMP team
+void kmeans_numa_range(size_t n, size_t *begin, size_t *end);
+
+// page-aligned memory whose pages are not placed until first written to
+void *kmeans_numa_alloc(size_t size);
+void kmeans_numa_free(void *ptr, size_t size);
+
+// Lloyd's algorithm as OpenMP tasks, to be called from within a parallel
+// region (e.g. from a task per image): every iteration assigns pixels in tasks
+// of KMEANS_TASK_GRAINSIZE pixels which idle threads of the team pick up, the
+// rest of the call runs on the calling thread, without an enclosing parallel
+// region it runs serially
+void kmeans_task(struct pixel *pixels, size_t n_pixels,
+                 struct pixel *centroids, size_t n_centroids,
+                 size_t *labels);
+
+// seeds by recursively bisecting the cluster with the largest sum of squared
+// errors, then refines with Lloyd iterations using a k-d tree over the
+// centroids, intended for large n_centroids (hundreds to thousands)
+void kmeans_bisecting(struct pixel *pixels, size_t n_pixels,
+                      struct pixel *centroids, size_t n_centroids,
+                      size_t *labels);
+
+void kmeans_omp_bisecting(struct pixel *pixels, size_t n_pixels,
+                          struct pixel *centroids, size_t n_centroids,
+                          size_t *labels);
+
+// mini-batch k-means: every iteration moves the centroids towards the means of
+// batch_size pixels drawn at random, a final pass labels all pixels, n_changed
+// counts batch pixels whose label differs from the one they were last given,
+// changed_tol is ignored and a shift_tol of zero is replaced by
+// KMEANS_MINIBATCH_TOL (nothing else would stop the engine before max_iter)
+void kmeans_minibatch(struct pixel_bgr pixels,
+                      struct pixel *centroids, size_t n_centroids,
+                      size_t *labels, size_t batch_size);
+
+void kmeans_omp_minibatch(struct pixel_bgr pixels,
+                          struct pixel *centroids, size_t n_centroids,
+                          size_t *labels, size_t batch_size);
+
+// Lloyd's algorithm with point i occurring weights[i] times, n_changed and the
+// termination options refer to the total weight
+void kmeans_weighted(struct pixel *points, size_t const *weights,
+                     size_t n_points,
+                     struct pixel *centroids, size_t n_centroids,
+                     size_t *labels);
+
+void kmeans_omp_weighted(struct pixel *points, size_t const *weights,
+                         size_t n_points,
+                         struct pixel *centroids, size_t n_centroids,
+                         size_t *labels);
+
+// fit a lightweight coreset instead of all pixels: every pixel is sampled with
+// probability proportional to a bound on its sensitivity (half uniform, half
+// its squared distance from the mean, about sample_size pixels in total) and
+// weighted by the inverse, Lloyd's algorithm runs on the weighted sample and
+// only the final labelling pass touches all pixels, reported inertia is that
+// of all pixels
+void kmeans_coreset(struct pixel_bgr pixels,
+                    struct pixel *centroids, size_t n_centroids,
+                    size_t *labels, size_t sample_size);
+
+void kmeans_omp_coreset(struct pixel_bgr pixels,
+                        struct pixel *centroids, size_t n_centroids,
+                        size_t *labels, size_t sample_size);
+
+// cluster the histogram of the image's colours, each reduced to its quant_bits
+// (1 to 8, 8 keeps colours exact) most significant bits per channel, instead
+// of the individual pixels, labels (rows * cols, without padding) are mapped
+// back to all pixels, reported inertia is that of the histogram
+void kmeans_histogram(struct pixel_bgr pixels,
+                      struct pixel *centroids, size_t n_centroids,
+                      size_t *labels, int quant_bits);
+
+void kmeans_omp_histogram(struct pixel_bgr pixels,
+                          struct pixel *centroids, size_t n_centroids,
+                          size_t *labels, int quant_bits);
+
+// Lloyd's algorithm on points of any number of features (e.g. RGB + XY for
+// segmentation or embeddings), centroids are n_centroids x n_cols row-major,
+// 3, 4, 8 and 16 features run code specialized for that dimension, k-means||
+// seeding is replaced by k-means++, points are assigned in blocks using the
+// kernel chosen by kmeans_select_distance
+void kmeans_features(struct kmeans_matrix points,
+                     float *centroids, size_t n_centroids,
+                     size_t *labels);
+
+void kmeans_omp_features(struct kmeans_matrix points,
+                         float *centroids, size_t n_centroids,
+                         size_t *labels);
+
+// labels (rows * cols, without padding) are of the given type, which must be
+// able to hold n_centroids - 1
+void kmeans_compact(struct pixel_bgr pixels,
+                    struct pixel *centroids, size_t n_centroids,
+                    void *labels, enum kmeans_label_type label_type);
+
+void kmeans_omp_compact(struct pixel_bgr pixels,
+                        struct pixel *centroids, size_t n_centroids,
+                        void *labels, enum kmeans_label_type label_type);
+
+// cluster the pixels of a raw file of packed 8-bit RGB triplets without
+// reading it into memory: the file is memory-mapped and streamed through in
+// tiles of KMEANS_STREAM_TILESIZE pixels in every iteration, labels of the
+// given type are written to label_file (created or truncated) through a
+// mapping as well, so that resident memory does not grow with the file,
+// centroids are seeded from a sample of at most KMEANS_STREAM_SAMPLE pixels,
+// returns 0 on success and -1 (with errno set) if a file could not be mapped
+int kmeans_stream(char const *pixel_file, char const *label_file,
+                  struct pixel *centroids, size_t n_centroids,
+                  enum kmeans_label_type label_type);
+
+int kmeans_omp_stream(char const *pixel_file, char const *label_file,
+                      struct pixel *centroids, size_t n_centroids,
+                      enum kmeans_label_type label_type);
+
+// smallest label type able to hold labels for n_centroids clusters
+enum kmeans_label_type kmeans_label_type_for(size_t n_centroids);
+
+// size of a single label of the given type in bytes
+size_t kmeans_label_size(enum kmeans_label_type label_type);
+
+// write the (8-bit rounded down) centroid of each pixel's cluster to image
+void kmeans_palette_map(void const *labels, enum kmeans_label_type label_type,
+                        struct pixel const *centroids, size_t n_centroids,
+                        struct pixel_bgr image);
+
+// element type of the centroids of a model
+enum kmeans_dtype
+{
+    KMEANS_DTYPE_F32, // float, as used by the feature engines
+    KMEANS_DTYPE_F64  // double, as used by struct pixel
+};
+
+// fitted centroids and their provenance, models of pixel engines have dim 3
+// and KMEANS_DTYPE_F64 centroids laid out as struct pixel (r, g, b)
+struct kmeans_model
+{
+    enum kmeans_dtype dtype;
+    size_t dim;
+    size_t n_centroids;
+    void *centroids;    // n_centroids x dim, row-major
+    unsigned long seed; // seed of the fit (0 if unknown)
+    double inertia;     // of the fit (negative if unknown)
+};
+
+// write model to a compact little-endian binary file (a 48 byte header
+// followed by the centroids), returns 0 on success and -1 (with errno set)
+// otherwise
+int kmeans_model_save(struct kmeans_model const *model, char const *filename);
+
+// read a model written by kmeans_model_save, centroids are allocated with
+// malloc and released by kmeans_model_free, returns 0 on success and -1 (with
+// errno set, EINVAL for malformed files) otherwise
+int kmeans_model_load(struct kmeans_model *model, char const *filename);
+
+void kmeans_model_free(struct kmeans_model *model);
+
+// label pixels with their closest centroid without fitting (a single
+// vectorized nearest-centroid pass in single precision, so that near ties may
+// be resolved differently than by the engines), labels as for kmeans_compact
+void kmeans_predict(struct pixel_bgr pixels,
+                    struct pixel const *centroids, size_t n_centroids,
+                    void *labels, enum kmeans_label_type label_type);
+
+void kmeans_omp_predict(struct pixel_bgr pixels,
+                        struct pixel const *centroids, size_t n_centroids,
+                        void *labels, enum kmeans_label_type label_type);
+
+// a superpixel: mean colour and position (column x, row y) of its pixels and
+// their number
+struct kmeans_superpixel
+{
+    struct pixel colour;
+    double x, y;
+    size_t size;
+};
+
+// SLIC superpixels: centres start on a regular grid of at most n_superpixels
+// cells of side S (moved off edges), each pixel is only compared to centres at
+// most S away in either direction, with squared colour distance plus
+// (compactness / S)^2 times squared spatial distance, so that an iteration
+// costs O(n_pixels) regardless of the number of superpixels. At most
+// KMEANS_SLIC_MAX_ITER iterations are run, fragments are merged into a
+// neighbouring superpixel at the end so that every superpixel is connected.
+// superpixels (n_superpixels entries) and labels receive the result, returns
+// the number of superpixels placed (some may end up empty)
+size_t kmeans_slic(struct pixel_bgr pixels,
+                   struct kmeans_superpixel *superpixels,
+                   size_t n_superpixels, size_t *labels, double compactness);
+
+size_t kmeans_omp_slic(struct pixel_bgr pixels,
+                       struct kmeans_superpixel *superpixels,
+                       size_t n_superpixels, size_t *labels,
+                       double compactness);
+
+// Lloyd's algorithm from n_restarts independent seedings advanced together:
+// each pixel is loaded once per iteration and scored against the centroids of
+// every restart that is still running, restarts drop out as soon as they meet
+// the termination criteria. Restart 0 is seeded exactly as by kmeans_omp
+// (from centroids if those are provided), every other one randomly or with the
+// configured initialization from a seed derived from the configured one.
+// centroids / labels receive the solution of least inertia and inertias
+// (n_restarts entries, may be NULL) the final inertia of every restart,
+// returns the index of the best restart. Labels of all restarts are held at
+// once, n_restarts * n_pixels of them.
+size_t kmeans_restarts(struct pixel *pixels, size_t n_pixels,
+                       struct pixel *centroids, size_t n_centroids,
+                       size_t *labels, size_t n_restarts, double *inertias);
+
+size_t kmeans_omp_restarts(struct pixel *pixels, size_t n_pixels,
+                           struct pixel *centroids, size_t n_centroids,
+                           size_t *labels, size_t n_restarts,
+                           double *inertias);
+
+// communication accounting of a kmeans_sharded call
+struct kmeans_shard_stats
+{
+    // seconds per iteration spent exchanging messages (round trip time less
+    // the slowest worker's compute time) and computing in the slowest worker,
+    // filled up to times_size entries if provided by the caller
+    double *comm_times;
+    double *compute_times;
+    size_t times_size;
+
+    double comm_time; // total, including setup and gathering labels
+    unsigned long long bytes_sent;     // by the coordinator
+    unsigned long long bytes_received; // by the coordinator
+};
+
+// Lloyd's algorithm over n_workers processes that each own a contiguous slice
+// of the pixels: every iteration the coordinator (the calling process) sends
+// the centroids to all workers, merges the sums / counts of their assignment
+// steps, repairs empty clusters globally (one more round trip for the
+// furthest pixels of the donor clusters) and averages. Workers are forked
+// from the caller and connected through Unix domain sockets, messages are
+// framed and little-endian so that the protocol does not depend on the
+// transport. Workers run single-threaded, stats (may be NULL) receives
+// per-iteration communication / compute times and traffic, returns 0 on
+// success and -1 (with errno set) if a worker could not be started or the
+// exchange with one failed
+int kmeans_sharded(struct pixel *pixels, size_t n_pixels,
+                   struct pixel *centroids, size_t n_centroids,
+                   size_t *labels, int n_workers,
+                   struct kmeans_shard_stats *stats);
+
+// serve a kmeans_sharded coordinator over the connected stream socket fd
+// until it says stop, pixels is this worker's slice (n_pixels of them, as
+// announced by the coordinator), returns 0 on success and -1 (with errno set,
+// EPROTO for malformed messages) otherwise
+int kmeans_shard_worker(int fd, struct pixel const *pixels, size_t n_pixels);
+
 void kmeans_cuda(struct pixel *pixels, size_t n_pixels,
                  struct pixel *centroids, size_t n_centroids,
                  size_t *labels);
 
+void kmeans_simd(struct pixel_planar pixels, size_t n_pixels,
+                 struct pixel *centroids, size_t n_centroids,
+                 size_t *labels);
+
+void kmeans_omp_simd(struct pixel_planar pixels, size_t n_pixels,
+                     struct pixel *centroids, size_t n_centroids,
+                     size_t *labels);
+
 #endif
@@ -1,16 +1,17 @@
 #include <float.h>
 #include <math.h>
 #include <omp.h>
-#ifdef PROFILE
-#include <stdio.h>
-#endif
 #include <stdlib.h>
-#include <time.h>
 
 #include "kmeans_config.h"
 #include "kmeans.h"
+#include "kmeans_control.h"
+#include "kmeans_reduce.h"
+#include "kmeans_scratch.h"
+#include "kmeans_util.h"
 
-// compute euclidean distance between two pixel values
+// compute euclidean distance between two pixel values (Hamerly's bounds need
+// actual distances, everything else compares squared ones)
 static inline double pixel_dist(struct pixel p1, struct pixel p2)
 {
     double dr = p1.r - p2.r;
@@ -20,73 +21,87 @@ static inline double pixel_dist(struct pixel p1, struct pixel p2)
     return sqrt(dr * dr + dg * dg + db * db);
 }
 
-// find index of centroid with least distance to some pixel
-static inline size_t find_closest_centroid(
-    struct pixel pixel, struct pixel *centroids, size_t n_centroids)
+// average accumulated cluster sums, returns the largest squared distance any
+// centroid has moved
+static double average_centroids(struct pixel *centroids, size_t n_centroids,
+                                double const *sums, size_t const *counts)
 {
-    size_t closest_centroid = 0u;
-    double min_dist = DBL_MAX;
+    double max_shift2 = 0.0;
 
-    for (size_t i = 0; i < n_centroids; ++i) {
-        double dist = pixel_dist(pixel, centroids[i]);
+    for (size_t j = 0u; j < n_centroids; ++j) {
+        struct pixel *centroid = &centroids[j];
+        struct pixel old_centroid = *centroid;
 
-        if (dist < min_dist) {
-            closest_centroid = i;
-            min_dist = dist;
-        }
+        double const *sum = &sums[3 * j];
+        size_t count = counts[j];
+
+        centroid->r = sum[0] / count;
+        centroid->g = sum[1] / count;
+        centroid->b = sum[2] / count;
+
+        double dr = centroid->r - old_centroid.r;
+        double dg = centroid->g - old_centroid.g;
+        double db = centroid->b - old_centroid.b;
+
+        double shift2 = dr * dr + dg * dg + db * db;
+        if (shift2 > max_shift2)
+            max_shift2 = shift2;
     }
 
-    return closest_centroid;
+    return max_shift2;
 }
 
 void kmeans_c(struct pixel *pixels, size_t n_pixels,
               struct pixel *centroids, size_t n_centroids,
               size_t *labels)
 {
-#ifdef PROFILE
-    clock_t exec_begin;
-    double exec_time_kernel1;
-    double exec_time_kernel2;
-    double exec_time_kernel3;
-#endif
+    struct kmeans_scratch_scope scope;
+    kmeans_scratch_begin(&scope);
 
-    // seed rand
-    srand(time(NULL));
+    // allocate auxiliary memory
+    struct pixel *sums =
+        kmeans_scratch_alloc(n_centroids * sizeof(struct pixel));
+    size_t *counts = kmeans_scratch_alloc(n_centroids *  sizeof(size_t));
 
-    // allocate auxiliary heap memory
-    struct pixel *sums = malloc(n_centroids * sizeof(struct pixel));
-    size_t *counts = malloc(n_centroids *  sizeof(size_t));
+    struct kmeans_control ctl;
+    kmeans_control_begin(&ctl, "kmeans_c", n_pixels);
 
-    // randomly initialize centroids
-    for (size_t i = 0u; i < n_centroids; ++i) {
-        centroids[i] = pixels[rand() % n_pixels];
+    // initialize centroids
+    kmeans_control_phase(&ctl, KMEANS_PHASE_SEED);
+    kmeans_seed(pixels, n_pixels, centroids, n_centroids, 0);
 
+    for (size_t i = 0u; i < n_centroids; ++i) {
         struct pixel tmp = { 0.0, 0.0, 0.0 };
         sums[i] = tmp;
 
         counts[i] = 0u;
     }
 
-    // repeat for KMEANS_MAX_ITER or until solution is stationary
-    for (int iter = 0; iter < KMEANS_MAX_ITER; ++iter) {
-        int done = 1;
+    // repeat until converged or for at most max_iter iterations
+    for (int iter = 0; iter < kmeans_control_max_iter(&ctl); ++iter) {
+        size_t n_changed = 0u;
+        double inertia = 0.0;
+        int repaired = 0;
+
+        kmeans_control_iteration_begin(&ctl);
 
         // reassign points to closest centroids
-#ifdef PROFILE
-        exec_begin = clock();
-#endif
+        kmeans_control_phase(&ctl, KMEANS_PHASE_ASSIGN);
         for (size_t i = 0u; i < n_pixels; ++i) {
             struct pixel pixel = pixels[i];
 
             // find centroid closest to pixel
+            double min_dist;
             size_t closest_centroid =
-                find_closest_centroid(pixel, centroids, n_centroids);
+                find_closest_centroid(pixel, centroids, n_centroids, &min_dist);
+
+            inertia += min_dist;
 
             // if pixel has changed cluster...
             if (closest_centroid != labels[i]) {
                 labels[i] = closest_centroid;
 
-                done = 0;
+                ++n_changed;
             }
 
             // update cluster sum
@@ -98,19 +113,14 @@ void kmeans_c(struct pixel *pixels, size_t n_pixels,
             // update cluster size
             counts[closest_centroid]++;
         }
-#ifdef PROFILE
-        exec_time_kernel1 = (double) (clock() - exec_begin) / CLOCKS_PER_SEC;
-#endif
 
         // repair empty clusters
-#ifdef PROFILE
-        exec_begin = clock();
-#endif
+        kmeans_control_phase(&ctl, KMEANS_PHASE_REPAIR);
         for (size_t i = 0u; i < n_centroids; ++i) {
             if (counts[i])
                 continue;
 
-            done = 0;
+            repaired = 1;
 
             // determine largest cluster
             size_t largest_cluster = 0u;
@@ -134,7 +144,7 @@ void kmeans_c(struct pixel *pixels, size_t n_pixels,
                 if (labels[j] != largest_cluster)
                     continue;
 
-                double dist = pixel_dist(pixels[j], largest_cluster_centroid);
+                double dist = pixel_dist2(pixels[j], largest_cluster_centroid);
 
                 if (dist > max_dist) {
                     furthest_pixel = j;
@@ -159,22 +169,25 @@ void kmeans_c(struct pixel *pixels, size_t n_pixels,
             counts[i] = 1u;
             counts[largest_cluster]--;
         }
-#ifdef PROFILE
-        exec_time_kernel2 = (double) (clock() - exec_begin) / CLOCKS_PER_SEC;
-#endif
 
         // average accumulated cluster sums
-#ifdef PROFILE
-        exec_begin = clock();
-#endif
+        kmeans_control_phase(&ctl, KMEANS_PHASE_AVERAGE);
+        double max_shift2 = 0.0;
+
         for (int j = 0; j < n_centroids; ++j) {
             struct pixel *centroid = &centroids[j];
             struct pixel *sum = &sums[j];
             size_t count = counts[j];
 
-            centroid->r = sum->r / count;
-            centroid->g = sum->g / count;
-            centroid->b = sum->b / count;
+            struct pixel new_centroid = {
+                sum->r / count, sum->g / count, sum->b / count
+            };
+
+            double shift2 = pixel_dist2(new_centroid, *centroid);
+            if (shift2 > max_shift2)
+                max_shift2 = shift2;
+
+            *centroid = new_centroid;
 
             sum->r = 0.0;
             sum->g = 0.0;
@@ -182,71 +195,238 @@ void kmeans_c(struct pixel *pixels, size_t n_pixels,
 
             counts[j] = 0u;
         }
-#ifdef PROFILE
-        exec_time_kernel3 = (double) (clock() - exec_begin) / CLOCKS_PER_SEC;
-#endif
 
-        // break if no pixel has changed cluster
-        if (done)
+        // break if the solution has converged
+        if (kmeans_control_iteration_end(&ctl, n_changed, inertia,
+                                         max_shift2, repaired))
             break;
     }
-#ifdef PROFILE
-    printf("Total kernel execution times:\n");
-    printf("Kernel 1 (reassigning points to closest centroids): %.3e\n",
-           exec_time_kernel1);
-    printf("Kernel 2 (repairing empty clusters): %.3e\n",
-           exec_time_kernel2);
-    printf("Kernel 3 (average accumulated centroids): %.3e\n",
-           exec_time_kernel3);
-#endif
-
-    free(sums);
-    free(counts);
+
+    kmeans_control_end(&ctl);
+
+    kmeans_scratch_end(&scope);
 }
 
 void kmeans_omp(struct pixel *pixels, size_t n_pixels,
                 struct pixel *centroids, size_t n_centroids,
                 size_t *labels)
 {
-    // seed rand
-    srand(time(NULL));
+    struct kmeans_scratch_scope scope;
+    kmeans_scratch_begin(&scope);
 
-    // allocate auxiliary heap memory
-    double *sums = malloc(3 * n_centroids * sizeof(double));
-    size_t *counts = malloc(n_centroids * sizeof(size_t));
+    // allocate auxiliary memory
+    double *sums = kmeans_scratch_alloc(3 * n_centroids * sizeof(double));
+    size_t *counts = kmeans_scratch_alloc(n_centroids * sizeof(size_t));
 
-    // randomly initialize centroids
-    for (size_t i = 0u; i < n_centroids; ++i) {
-        centroids[i] = pixels[rand() % n_pixels];
+    struct kmeans_accumulators acc;
+    kmeans_accumulators_init(&acc, n_centroids, omp_get_max_threads());
+
+    struct kmeans_control ctl;
+    kmeans_control_begin(&ctl, "kmeans_omp", n_pixels);
+
+    // initialize centroids
+    kmeans_control_phase(&ctl, KMEANS_PHASE_SEED);
+    kmeans_seed(pixels, n_pixels, centroids, n_centroids, 1);
+
+    // repeat until converged or for at most max_iter iterations
+    for (int iter = 0; iter < kmeans_control_max_iter(&ctl); ++iter) {
+        size_t n_changed = 0u;
+        double inertia = 0.0;
+
+        kmeans_control_iteration_begin(&ctl);
+
+        // reassign points to closest centroids, accumulating into padded
+        // per-thread sums / counts
+        kmeans_control_phase(&ctl, KMEANS_PHASE_ASSIGN);
+        #pragma omp parallel reduction(+ : n_changed, inertia)
+        {
+            kmeans_accumulators_reset(&acc);
+
+            int tid = omp_get_thread_num();
+            double *thread_sums = kmeans_accumulators_sums(&acc, tid);
+            size_t *thread_counts = kmeans_accumulators_counts(&acc, tid);
+
+            #pragma omp for schedule(static)
+            for (size_t i = 0u; i < n_pixels; ++i) {
+                struct pixel pixel = pixels[i];
+
+                // find centroid closest to pixel
+                double min_dist;
+                size_t closest_centroid = find_closest_centroid(
+                    pixel, centroids, n_centroids, &min_dist);
+
+                inertia += min_dist;
+
+                // if pixel has changed cluster...
+                if (closest_centroid != labels[i]) {
+                    labels[i] = closest_centroid;
 
+                    ++n_changed;
+                }
+
+                // update cluster sum
+                double *sum = &thread_sums[3 * closest_centroid];
+                sum[0] += pixel.r;
+                sum[1] += pixel.g;
+                sum[2] += pixel.b;
+
+                // update cluster size
+                thread_counts[closest_centroid]++;
+            }
+        }
+
+        kmeans_accumulators_merge(&acc, sums, counts);
+
+        // repair all empty clusters at once
+        kmeans_control_phase(&ctl, KMEANS_PHASE_REPAIR);
+        int repaired = kmeans_repair_empty_clusters(pixels, n_pixels,
+                                                    centroids, n_centroids,
+                                                    labels, sums, counts) > 0;
+
+        // average accumulated cluster sums
+        kmeans_control_phase(&ctl, KMEANS_PHASE_AVERAGE);
+        double max_shift2 =
+            average_centroids(centroids, n_centroids, sums, counts);
+
+        // break if the solution has converged
+        if (kmeans_control_iteration_end(&ctl, n_changed, inertia,
+                                         max_shift2, repaired))
+            break;
+    }
+
+    kmeans_control_end(&ctl);
+
+    kmeans_scratch_end(&scope);
+}
+
+// Hamerly's algorithm: every pixel keeps an upper bound on the distance to its
+// assigned centroid and a lower bound on the distance to all other centroids,
+// the closest centroid is only searched for if these bounds overlap
+static void kmeans_hamerly_impl(struct pixel *pixels, size_t n_pixels,
+                                struct pixel *centroids, size_t n_centroids,
+                                size_t *labels, int parallel)
+{
+    struct kmeans_scratch_scope scope;
+    kmeans_scratch_begin(&scope);
+
+    // allocate auxiliary memory
+    double *sums = kmeans_scratch_alloc(3 * n_centroids * sizeof(double));
+    size_t *counts = kmeans_scratch_alloc(n_centroids * sizeof(size_t));
+
+    double *upper = kmeans_scratch_alloc(n_pixels * sizeof(double));
+    double *lower = kmeans_scratch_alloc(n_pixels * sizeof(double));
+
+    struct pixel *old_centroids =
+        kmeans_scratch_alloc(n_centroids * sizeof(struct pixel));
+    double *half_separations =
+        kmeans_scratch_alloc(n_centroids * sizeof(double));
+    double *shifts = kmeans_scratch_alloc(n_centroids * sizeof(double));
+
+    struct kmeans_control ctl;
+    kmeans_control_begin(
+        &ctl, parallel ? "kmeans_omp_hamerly" : "kmeans_hamerly", n_pixels);
+
+    // initialize centroids
+    kmeans_control_phase(&ctl, KMEANS_PHASE_SEED);
+    kmeans_seed(pixels, n_pixels, centroids, n_centroids, parallel);
+
+    for (size_t i = 0u; i < n_centroids; ++i) {
         double *sum = &sums[3 * i];
         sum[0] = sum[1] = sum[2] = 0.0;
 
         counts[i] = 0u;
     }
 
-    // repeat for KMEANS_MAX_ITER or until solution is stationary
-    for (int iter = 0; iter < KMEANS_MAX_ITER; ++iter) {
-        int done = 1;
+    // repeat until converged or for at most max_iter iterations
+    for (int iter = 0; iter < kmeans_control_max_iter(&ctl); ++iter) {
+        size_t n_changed = 0u;
+        double inertia = 0.0;
+        int repaired = 0;
+
+        kmeans_control_iteration_begin(&ctl);
+
+        // determine half the distance from each centroid to its closest
+        // neighbour, no pixel within that radius can change cluster
+        kmeans_control_phase(&ctl, KMEANS_PHASE_ASSIGN);
+        for (size_t j = 0u; j < n_centroids; ++j) {
+            double min_dist = DBL_MAX;
+
+            for (size_t jj = 0u; jj < n_centroids; ++jj) {
+                if (jj == j)
+                    continue;
+
+                double dist = pixel_dist(centroids[j], centroids[jj]);
+
+                if (dist < min_dist)
+                    min_dist = dist;
+            }
+
+            half_separations[j] = min_dist / 2.0;
+        }
 
         // reassign points to closest centroids
-        #pragma omp parallel for \
-            reduction(+ : sums[:(3 * n_centroids)], counts[:n_centroids])
-        for (int i = 0; i < n_pixels; ++i) {
+        #pragma omp parallel for if (parallel) schedule(static) \
+            reduction(+ : sums[:(3 * n_centroids)], counts[:n_centroids]) \
+            reduction(+ : n_changed, inertia)
+        for (size_t i = 0u; i < n_pixels; ++i) {
             struct pixel pixel = pixels[i];
+            size_t closest_centroid = labels[i];
 
-            // find centroid closest to pixel
-            int closest_centroid =
-                find_closest_centroid(pixel, centroids, n_centroids);
+            // in the first iteration the bounds are not yet valid
+            int search = iter == 0;
 
-            // if pixel has changed cluster...
-            if (closest_centroid != labels[i]) {
-                labels[i] = closest_centroid;
+            if (!search) {
+                double bound = half_separations[closest_centroid];
+                if (lower[i] > bound)
+                    bound = lower[i];
 
-                #pragma omp atomic write
-                done = 0;
+                // tighten upper bound if necessary, ties are always
+                // searched for so that labels agree with kmeans_c
+                if (!(upper[i] < bound)) {
+                    upper[i] = pixel_dist(pixel, centroids[closest_centroid]);
+                    search = !(upper[i] < bound);
+                }
+            }
+
+            // squared distance to the closest centroid, if searched for
+            double min_dist2 = 0.0;
+
+            if (search) {
+                // find closest and second closest centroid, ranked by squared
+                // distance exactly as kmeans_c does (distinct squared
+                // distances may share a rounded square root)
+                double second_min_dist2 = DBL_MAX;
+                min_dist2 = DBL_MAX;
+
+                for (size_t j = 0u; j < n_centroids; ++j) {
+                    double dist2 = pixel_dist2(pixel, centroids[j]);
+
+                    if (dist2 < min_dist2) {
+                        second_min_dist2 = min_dist2;
+                        closest_centroid = j;
+                        min_dist2 = dist2;
+                    } else if (dist2 < second_min_dist2) {
+                        second_min_dist2 = dist2;
+                    }
+                }
+
+                // bounds are kept as plain distances
+                upper[i] = sqrt(min_dist2);
+                lower[i] = sqrt(second_min_dist2);
+
+                // if pixel has changed cluster...
+                if (closest_centroid != labels[i]) {
+                    labels[i] = closest_centroid;
+
+                    ++n_changed;
+                }
             }
 
+            // the distance is only known exactly after a search
+            if (ctl.track_inertia)
+                inertia += search ?
+                    min_dist2 : pixel_dist2(pixel, centroids[closest_centroid]);
+
             // update cluster sum
             double *sum = &sums[3 * closest_centroid];
             sum[0] += pixel.r;
@@ -257,12 +437,17 @@ void kmeans_omp(struct pixel *pixels, size_t n_pixels,
             counts[closest_centroid]++;
         }
 
+        // remember centroids the bounds currently refer to
+        for (size_t j = 0u; j < n_centroids; ++j)
+            old_centroids[j] = centroids[j];
+
         // repair empty clusters
+        kmeans_control_phase(&ctl, KMEANS_PHASE_REPAIR);
         for (size_t i = 0u; i < n_centroids; ++i) {
             if (counts[i])
                 continue;
 
-            done = 0;
+            repaired = 1;
 
             // determine largest cluster
             size_t largest_cluster = 0u;
@@ -282,28 +467,27 @@ void kmeans_omp(struct pixel *pixels, size_t n_pixels,
 
             size_t furthest_pixel = 0u;
             double max_dist = 0.0;
-
-            #pragma omp parallel for
             for (size_t j = 0u; j < n_pixels; ++j) {
                 if (labels[j] != largest_cluster)
                     continue;
 
                 double dist = pixel_dist(pixels[j], largest_cluster_centroid);
 
-                #pragma omp critical
-                {
-                    if (dist > max_dist) {
-                        furthest_pixel = j;
-                        max_dist = dist;
-                    }
+                if (dist > max_dist) {
+                    furthest_pixel = j;
+                    max_dist = dist;
                 }
             }
 
-            // move that pixel to the empty cluster
+            // move that pixel to the empty cluster, it will coincide with
+            // its new centroid but its lower bound is no longer valid
             struct pixel replacement_pixel = pixels[furthest_pixel];
             centroids[i] = replacement_pixel;
             labels[furthest_pixel] = i;
 
+            upper[furthest_pixel] = 0.0;
+            lower[furthest_pixel] = 0.0;
+
             // correct cluster sums
             double *sum = &sums[3 * i];
             sum[0] = replacement_pixel.r;
@@ -321,8 +505,8 @@ void kmeans_omp(struct pixel *pixels, size_t n_pixels,
         }
 
         // average accumulated cluster sums
-        #pragma omp parallel for
-        for (int j = 0; j < n_centroids; ++j) {
+        kmeans_control_phase(&ctl, KMEANS_PHASE_AVERAGE);
+        for (size_t j = 0u; j < n_centroids; ++j) {
             struct pixel *centroid = &centroids[j];
             double *sum = &sums[3 * j];
             size_t count = counts[j];
@@ -335,11 +519,57 @@ void kmeans_omp(struct pixel *pixels, size_t n_pixels,
             counts[j] = 0u;
         }
 
-        // break if no pixel has changed cluster
-        if (done)
+        // determine how far each centroid has moved
+        size_t max_shift_centroid = 0u;
+        double max_shift = 0.0;
+        double second_max_shift = 0.0;
+
+        for (size_t j = 0u; j < n_centroids; ++j) {
+            shifts[j] = pixel_dist(old_centroids[j], centroids[j]);
+
+            if (shifts[j] > max_shift) {
+                second_max_shift = max_shift;
+                max_shift_centroid = j;
+                max_shift = shifts[j];
+            } else if (shifts[j] > second_max_shift) {
+                second_max_shift = shifts[j];
+            }
+        }
+
+        // loosen bounds accordingly
+        #pragma omp parallel for if (parallel) schedule(static)
+        for (size_t i = 0u; i < n_pixels; ++i) {
+            size_t label = labels[i];
+
+            upper[i] += shifts[label];
+
+            if (label == max_shift_centroid)
+                lower[i] -= second_max_shift;
+            else
+                lower[i] -= max_shift;
+        }
+
+        // break if the solution has converged
+        if (kmeans_control_iteration_end(&ctl, n_changed, inertia,
+                                         max_shift * max_shift, repaired))
             break;
     }
 
-    free(sums);
-    free(counts);
+    kmeans_control_end(&ctl);
+
+    kmeans_scratch_end(&scope);
+}
+
+void kmeans_hamerly(struct pixel *pixels, size_t n_pixels,
+                    struct pixel *centroids, size_t n_centroids,
+                    size_t *labels)
+{
+    kmeans_hamerly_impl(pixels, n_pixels, centroids, n_centroids, labels, 0);
+}
+
+void kmeans_omp_hamerly(struct pixel *pixels, size_t n_pixels,
+                        struct pixel *centroids, size_t n_centroids,
+                        size_t *labels)
+{
+    kmeans_hamerly_impl(pixels, n_pixels, centroids, n_centroids, labels, 1);
 }
@@ -3,10 +3,11 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
 
 extern "C" {
 #include "kmeans.h"
+#include "kmeans_control.h"
+#include "kmeans_scratch.h"
 }
 #include "kmeans_config.h"
 
@@ -22,6 +23,20 @@ extern "C" {
 
 #define cudaCheck(code) do { cudaAssert(code, __FILE__, __LINE__); } while(0)
 
+// device memory (de)allocation for buffers cached in the scratch context
+static void *device_alloc(size_t size)
+{
+    void *ptr;
+    cudaCheck(cudaMalloc(&ptr, size));
+
+    return ptr;
+}
+
+static void device_release(void *ptr)
+{
+    cudaCheck(cudaFree(ptr));
+}
+
 /* CUDA kernels ***************************************************************/
 
 // reassign points to closest centroids (#threads must be a power of two)
@@ -29,7 +44,7 @@ __global__
 static void reassign(struct pixel *pixels, size_t n_pixels,
                      struct pixel *centroids, size_t n_centroids,
                      size_t *labels, struct pixel *sums, size_t *counts,
-                     int *empty, int *done)
+                     int *empty, unsigned long long *n_changed)
 {
     // index alias
     size_t tid = threadIdx.x;
@@ -73,7 +88,7 @@ static void reassign(struct pixel *pixels, size_t n_pixels,
             double dg = p->g - c->g;
             double db = p->b - c->b;
 
-            double dist = sqrt(dr * dr + dg * dg + db * db);
+            double dist = dr * dr + dg * dg + db * db;
 
             if (dist < min_dist) {
                 closest_centroid = j;
@@ -85,7 +100,7 @@ static void reassign(struct pixel *pixels, size_t n_pixels,
         if (closest_centroid != labels[index]) {
             labels[index] = closest_centroid;
 
-            *done = 0;
+            atomicAdd(n_changed, 1ull);
         }
     }
 
@@ -219,13 +234,18 @@ extern "C" void kmeans_cuda(struct pixel *pixels, size_t n_pixels,
     size_t shm_reassign = shm_slots * (sizeof(struct pixel) + sizeof(size_t));
     shm_reassign += sizeof(size_t) - sizeof(struct pixel) % sizeof(size_t);
 
-    // initialize centroids with random pixels
-    srand(time(NULL));
+    struct kmeans_scratch_scope scope;
+    kmeans_scratch_begin(&scope);
 
-    for (size_t i = 0u; i < n_centroids; ++i)
-        centroids[i] = pixels[rand() % n_pixels];
+    // inertia is not computed on the device
+    struct kmeans_control ctl;
+    kmeans_control_begin(&ctl, "kmeans_cuda", n_pixels);
 
-    // initialize device memory
+    // initialize centroids
+    kmeans_control_phase(&ctl, KMEANS_PHASE_SEED);
+    kmeans_seed(pixels, n_pixels, centroids, n_centroids, 1);
+
+    // initialize device memory (reused between calls of the same context)
     size_t pixels_sz = n_pixels * sizeof(struct pixel);
     size_t centroids_sz = n_centroids * sizeof(struct pixel);
     size_t labels_sz = n_pixels * sizeof(size_t);
@@ -234,9 +254,14 @@ extern "C" void kmeans_cuda(struct pixel *pixels, size_t n_pixels,
     struct pixel *centroids_dev;
     size_t *labels_dev;
 
-    cudaCheck(cudaMalloc(&pixels_dev, pixels_sz));
-    cudaCheck(cudaMalloc(&centroids_dev, centroids_sz));
-    cudaCheck(cudaMalloc(&labels_dev, labels_sz));
+    pixels_dev = (struct pixel *) kmeans_scratch_device(
+        KMEANS_DEVICE_PIXELS, pixels_sz, device_alloc, device_release);
+
+    centroids_dev = (struct pixel *) kmeans_scratch_device(
+        KMEANS_DEVICE_CENTROIDS, centroids_sz, device_alloc, device_release);
+
+    labels_dev = (size_t *) kmeans_scratch_device(
+        KMEANS_DEVICE_LABELS, labels_sz, device_alloc, device_release);
 
     cudaCheck(cudaMemcpy(pixels_dev, pixels, pixels_sz,
                          cudaMemcpyHostToDevice));
@@ -257,16 +282,27 @@ extern "C" void kmeans_cuda(struct pixel *pixels, size_t n_pixels,
     struct pixel *sums, *sums_dev;
     size_t *counts, *counts_dev;
     int *empty, *empty_dev;
-    int done, *done_dev;
+    unsigned long long n_changed, *n_changed_dev;
+
+    sums = (struct pixel *) kmeans_scratch_alloc(sums_sz);
+    counts = (size_t *) kmeans_scratch_alloc(counts_sz);
+    empty = (int *) kmeans_scratch_alloc(empty_sz);
+
+    struct pixel *old_centroids =
+        (struct pixel *) kmeans_scratch_alloc(centroids_sz);
+
+    sums_dev = (struct pixel *) kmeans_scratch_device(
+        KMEANS_DEVICE_SUMS, sums_dev_sz, device_alloc, device_release);
 
-    sums = (struct pixel *) malloc(sums_sz);
-    counts = (size_t *) malloc(counts_sz);
-    empty = (int *) malloc(empty_sz);
+    counts_dev = (size_t *) kmeans_scratch_device(
+        KMEANS_DEVICE_COUNTS, counts_dev_sz, device_alloc, device_release);
 
-    cudaCheck(cudaMalloc(&sums_dev, sums_dev_sz));
-    cudaCheck(cudaMalloc(&counts_dev, counts_dev_sz));
-    cudaCheck(cudaMalloc(&empty_dev, empty_sz));
-    cudaCheck(cudaMalloc(&done_dev, sizeof(int)));
+    empty_dev = (int *) kmeans_scratch_device(
+        KMEANS_DEVICE_EMPTY, empty_sz, device_alloc, device_release);
+
+    n_changed_dev = (unsigned long long *) kmeans_scratch_device(
+        KMEANS_DEVICE_CHANGED, sizeof(unsigned long long),
+        device_alloc, device_release);
 
     for (size_t i = 0u; i < n_centroids; ++i) {
         struct pixel tmp = { 0.0, 0.0, 0.0 };
@@ -274,23 +310,30 @@ extern "C" void kmeans_cuda(struct pixel *pixels, size_t n_pixels,
         counts[i] = 0u;
     }
 
-    // repeat for KMEANS_MAX_ITER or until solution is stationary
-    for (int iter = 0; iter < KMEANS_MAX_ITER; ++iter) {
-        for (size_t i = 0u; i < n_centroids; ++i)
+    // repeat until converged or for at most max_iter iterations
+    for (int iter = 0; iter < kmeans_control_max_iter(&ctl); ++iter) {
+        kmeans_control_iteration_begin(&ctl);
+
+        // reset device flags, reassign and fetch them back
+        kmeans_control_phase(&ctl, KMEANS_PHASE_ASSIGN);
+        for (size_t i = 0u; i < n_centroids; ++i) {
             empty[i] = 1;
+            old_centroids[i] = centroids[i];
+        }
 
-        done = 1;
+        n_changed = 0u;
 
         cudaCheck(cudaMemcpy(empty_dev, empty, empty_sz,
                              cudaMemcpyHostToDevice));
 
-        cudaCheck(cudaMemcpy(done_dev, &done, sizeof(int),
+        cudaCheck(cudaMemcpy(n_changed_dev, &n_changed,
+                             sizeof(unsigned long long),
                              cudaMemcpyHostToDevice));
 
         // reassign points to closest centroids
         reassign<<<n_blocks_reassign, KMEANS_CUDA_BLOCKSIZE, shm_reassign>>>(
             pixels_dev, n_pixels, centroids_dev, n_centroids, labels_dev,
-            sums_dev, counts_dev, empty_dev, done_dev
+            sums_dev, counts_dev, empty_dev, n_changed_dev
         );
 
         cudaCheck(cudaPeekAtLastError());
@@ -298,10 +341,12 @@ extern "C" void kmeans_cuda(struct pixel *pixels, size_t n_pixels,
         cudaCheck(cudaMemcpy(empty, empty_dev, empty_sz,
                              cudaMemcpyDeviceToHost));
 
-        cudaCheck(cudaMemcpy(&done, done_dev, sizeof(int),
+        cudaCheck(cudaMemcpy(&n_changed, n_changed_dev,
+                             sizeof(unsigned long long),
                              cudaMemcpyDeviceToHost));
 
         // check whether empty clusters need to be repaired
+        kmeans_control_phase(&ctl, KMEANS_PHASE_REPAIR);
         int repair = 0;
         for (size_t i = 0u; i < n_centroids; ++i) {
             if (!empty[i])
@@ -318,7 +363,6 @@ extern "C" void kmeans_cuda(struct pixel *pixels, size_t n_pixels,
             cudaCheck(cudaMemcpy(counts, counts_dev, counts_sz,
                                  cudaMemcpyDeviceToHost));
 
-            done = 0;
             repair = 1;
             break;
         }
@@ -329,8 +373,6 @@ extern "C" void kmeans_cuda(struct pixel *pixels, size_t n_pixels,
                 if (!empty[i])
                     continue;
 
-                done = 0;
-
                 // determine largest cluster
                 size_t largest_cluster = 0u;
                 size_t largest_cluster_count = 0u;
@@ -360,7 +402,7 @@ extern "C" void kmeans_cuda(struct pixel *pixels, size_t n_pixels,
                     double dg = p->g - largest_cluster_centroid->g;
                     double db = p->b - largest_cluster_centroid->b;
 
-                    double dist = sqrt(dr * dr + dg * dg + db * db);
+                    double dist = dr * dr + dg * dg + db * db;
 
                     if (dist > max_dist) {
                         furthest_pixel = j;
@@ -394,6 +436,7 @@ extern "C" void kmeans_cuda(struct pixel *pixels, size_t n_pixels,
         }
 
         // re-calculate centroids
+        kmeans_control_phase(&ctl, KMEANS_PHASE_AVERAGE);
         average<<<n_block_reduce, KMEANS_CUDA_BLOCKSIZE>>>(
             n_blocks_reassign, centroids_dev, n_centroids,
             sums_dev, counts_dev, !repair
@@ -402,11 +445,29 @@ extern "C" void kmeans_cuda(struct pixel *pixels, size_t n_pixels,
         cudaCheck(cudaPeekAtLastError());
         cudaCheck(cudaDeviceSynchronize());
 
-        // break if no pixel has changed cluster
-        if (done)
+        // fetch new centroids to determine how far they have moved
+        cudaCheck(cudaMemcpy(centroids, centroids_dev, centroids_sz,
+                             cudaMemcpyDeviceToHost));
+
+        double max_shift2 = 0.0;
+        for (size_t i = 0u; i < n_centroids; ++i) {
+            double dr = centroids[i].r - old_centroids[i].r;
+            double dg = centroids[i].g - old_centroids[i].g;
+            double db = centroids[i].b - old_centroids[i].b;
+
+            double shift2 = dr * dr + dg * dg + db * db;
+            if (shift2 > max_shift2)
+                max_shift2 = shift2;
+        }
+
+        // break if the solution has converged
+        if (kmeans_control_iteration_end(&ctl, n_changed, NAN,
+                                         max_shift2, repair))
             break;
     }
 
+    kmeans_control_end(&ctl);
+
     // copy device memory back to host
     cudaCheck(cudaMemcpy(pixels, pixels_dev, pixels_sz,
                          cudaMemcpyDeviceToHost));
@@ -417,13 +478,6 @@ extern "C" void kmeans_cuda(struct pixel *pixels, size_t n_pixels,
     cudaCheck(cudaMemcpy(labels, labels_dev, labels_sz,
                          cudaMemcpyDeviceToHost));
 
-    // free host and device memory
-    free(sums);
-    free(counts);
-
-    cudaCheck(cudaFree(pixels_dev));
-    cudaCheck(cudaFree(centroids_dev));
-    cudaCheck(cudaFree(labels_dev));
-    cudaCheck(cudaFree(sums_dev));
-    cudaCheck(cudaFree(counts_dev));
+    // release host memory, device memory is freed along with the context
+    kmeans_scratch_end(&scope);
 }
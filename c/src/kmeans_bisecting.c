@@ -0,0 +1,393 @@
+#include <omp.h>
+#include <stdlib.h>
+
+#include "kmeans_config.h"
+#include "kmeans.h"
+#include "kmeans_control.h"
+#include "kmeans_kdtree.h"
+#include "kmeans_reduce.h"
+#include "kmeans_scratch.h"
+#include "kmeans_util.h"
+
+// a cluster of the bisection, its pixels are order[begin, begin + size)
+struct segment
+{
+    size_t begin, size;
+    double sse;
+};
+
+/* Helper Functions ***********************************************************/
+
+// index (into order) of the pixel furthest from some point, the lowest one on
+// ties
+static size_t furthest_pixel(struct pixel const *pixels, size_t const *order,
+                             size_t n, struct pixel from, int parallel)
+{
+    size_t furthest = 0u;
+    double max_dist = -1.0;
+
+    #pragma omp parallel if (parallel)
+    {
+        size_t thread_furthest = 0u;
+        double thread_max_dist = -1.0;
+
+        #pragma omp for schedule(static) nowait
+        for (size_t i = 0u; i < n; ++i) {
+            double dist = pixel_dist2(pixels[order[i]], from);
+
+            if (dist > thread_max_dist) {
+                thread_furthest = i;
+                thread_max_dist = dist;
+            }
+        }
+
+        #pragma omp critical
+        {
+            if (thread_max_dist > max_dist ||
+                (thread_max_dist == max_dist && thread_furthest < furthest)) {
+                furthest = thread_furthest;
+                max_dist = thread_max_dist;
+            }
+        }
+    }
+
+    return furthest;
+}
+
+// sum of squared distances from the mean given sum, sum of squared norms and
+// count of a set of pixels
+static double sse_from_moments(double const *sum, double sum_sq, size_t n)
+{
+    double mean_sq = (sum[0] * sum[0] + sum[1] * sum[1] + sum[2] * sum[2]) / n;
+    double sse = sum_sq - mean_sq;
+
+    return sse > 0.0 ? sse : 0.0;
+}
+
+/* Bisection ******************************************************************/
+
+// split a cluster in two with 2-means, the pixels of the first half are moved
+// to the front of the segment, returns zero if it cannot be split
+static int bisect(struct pixel const *pixels, size_t *order,
+                  struct segment *seg, struct pixel *centroid,
+                  struct segment *new_seg, struct pixel *new_centroid,
+                  int parallel)
+{
+    size_t *members = &order[seg->begin];
+    size_t n = seg->size;
+
+    if (n < 2u)
+        return 0;
+
+    // start from two far apart pixels: the one furthest from the centroid and
+    // the one furthest from that
+    struct pixel a = pixels[members[
+        furthest_pixel(pixels, members, n, *centroid, parallel)]];
+
+    struct pixel b = pixels[members[
+        furthest_pixel(pixels, members, n, a, parallel)]];
+
+    if (pixel_dist2(a, b) == 0.0)
+        return 0;
+
+    for (int iter = 0; iter < KMEANS_BISECT_MAX_ITER; ++iter) {
+        double sum_a[3] = { 0.0, 0.0, 0.0 };
+        double sum_b[3] = { 0.0, 0.0, 0.0 };
+        size_t n_a = 0u;
+        size_t n_b = 0u;
+
+        #pragma omp parallel for if (parallel) schedule(static) \
+            reduction(+ : sum_a[:3], sum_b[:3], n_a, n_b)
+        for (size_t i = 0u; i < n; ++i) {
+            struct pixel p = pixels[members[i]];
+
+            if (pixel_dist2(p, a) <= pixel_dist2(p, b)) {
+                sum_a[0] += p.r;
+                sum_a[1] += p.g;
+                sum_a[2] += p.b;
+                ++n_a;
+            } else {
+                sum_b[0] += p.r;
+                sum_b[1] += p.g;
+                sum_b[2] += p.b;
+                ++n_b;
+            }
+        }
+
+        if (!n_a || !n_b)
+            break;
+
+        struct pixel new_a = { sum_a[0] / n_a, sum_a[1] / n_a, sum_a[2] / n_a };
+        struct pixel new_b = { sum_b[0] / n_b, sum_b[1] / n_b, sum_b[2] / n_b };
+
+        int moved = pixel_dist2(a, new_a) > 0.0 || pixel_dist2(b, new_b) > 0.0;
+
+        a = new_a;
+        b = new_b;
+
+        if (!moved)
+            break;
+    }
+
+    // partition members, accumulating the moments of both halves
+    double sum_a[3] = { 0.0, 0.0, 0.0 };
+    double sum_b[3] = { 0.0, 0.0, 0.0 };
+    double sum_sq_a = 0.0;
+    double sum_sq_b = 0.0;
+
+    size_t lo = 0u;
+    size_t hi = n;
+
+    while (lo < hi) {
+        struct pixel p = pixels[members[lo]];
+        double sq = p.r * p.r + p.g * p.g + p.b * p.b;
+
+        if (pixel_dist2(p, a) <= pixel_dist2(p, b)) {
+            sum_a[0] += p.r;
+            sum_a[1] += p.g;
+            sum_a[2] += p.b;
+            sum_sq_a += sq;
+            ++lo;
+        } else {
+            sum_b[0] += p.r;
+            sum_b[1] += p.g;
+            sum_b[2] += p.b;
+            sum_sq_b += sq;
+
+            size_t tmp = members[lo];
+            members[lo] = members[--hi];
+            members[hi] = tmp;
+        }
+    }
+
+    if (lo == 0u || lo == n)
+        return 0;
+
+    size_t n_a = lo;
+    size_t n_b = n - lo;
+
+    centroid->r = sum_a[0] / n_a;
+    centroid->g = sum_a[1] / n_a;
+    centroid->b = sum_a[2] / n_a;
+
+    new_centroid->r = sum_b[0] / n_b;
+    new_centroid->g = sum_b[1] / n_b;
+    new_centroid->b = sum_b[2] / n_b;
+
+    new_seg->begin = seg->begin + n_a;
+    new_seg->size = n_b;
+    new_seg->sse = sse_from_moments(sum_b, sum_sq_b, n_b);
+
+    seg->size = n_a;
+    seg->sse = sse_from_moments(sum_a, sum_sq_a, n_a);
+
+    return 1;
+}
+
+// construct initial centroids and labels by repeatedly bisecting the cluster
+// with the largest sum of squared errors
+static void bisect_all(struct pixel const *pixels, size_t n_pixels,
+                       struct pixel *centroids, size_t n_centroids,
+                       size_t *labels, int parallel)
+{
+    struct kmeans_scratch_scope scope;
+    kmeans_scratch_begin(&scope);
+
+    size_t *order = kmeans_scratch_alloc(n_pixels * sizeof(size_t));
+    struct segment *segs =
+        kmeans_scratch_alloc(n_centroids * sizeof(struct segment));
+
+    // a single cluster containing all pixels
+    double sum[3] = { 0.0, 0.0, 0.0 };
+    double sum_sq = 0.0;
+
+    #pragma omp parallel for if (parallel) schedule(static) \
+        reduction(+ : sum[:3], sum_sq)
+    for (size_t i = 0u; i < n_pixels; ++i) {
+        struct pixel p = pixels[i];
+
+        sum[0] += p.r;
+        sum[1] += p.g;
+        sum[2] += p.b;
+        sum_sq += p.r * p.r + p.g * p.g + p.b * p.b;
+
+        order[i] = i;
+    }
+
+    centroids[0].r = sum[0] / n_pixels;
+    centroids[0].g = sum[1] / n_pixels;
+    centroids[0].b = sum[2] / n_pixels;
+
+    segs[0].begin = 0u;
+    segs[0].size = n_pixels;
+    segs[0].sse = sse_from_moments(sum, sum_sq, n_pixels);
+
+    size_t n_clusters = 1u;
+
+    while (n_clusters < n_centroids) {
+        size_t largest = 0u;
+        for (size_t j = 1u; j < n_clusters; ++j) {
+            if (segs[j].sse > segs[largest].sse)
+                largest = j;
+        }
+
+        // no cluster is left that could be split any further
+        if (segs[largest].sse <= 0.0)
+            break;
+
+        if (!bisect(pixels, order, &segs[largest], &centroids[largest],
+                    &segs[n_clusters], &centroids[n_clusters], parallel)) {
+            segs[largest].sse = 0.0;
+            continue;
+        }
+
+        ++n_clusters;
+    }
+
+    // with fewer distinct colours than centroids, the remaining clusters
+    // start out empty and are repaired like any other empty cluster
+    for (size_t j = n_clusters; j < n_centroids; ++j)
+        centroids[j] = centroids[0];
+
+    #pragma omp parallel for if (parallel) schedule(dynamic)
+    for (size_t j = 0u; j < n_clusters; ++j) {
+        struct segment seg = segs[j];
+
+        for (size_t i = seg.begin; i < seg.begin + seg.size; ++i)
+            labels[order[i]] = j;
+    }
+
+    kmeans_scratch_end(&scope);
+}
+
+/* Main Functions *************************************************************/
+
+static void kmeans_bisecting_impl(struct pixel *pixels, size_t n_pixels,
+                                  struct pixel *centroids, size_t n_centroids,
+                                  size_t *labels, int parallel)
+{
+    struct kmeans_scratch_scope scope;
+    kmeans_scratch_begin(&scope);
+
+    // allocate auxiliary memory
+    double *sums = kmeans_scratch_alloc(3 * n_centroids * sizeof(double));
+    size_t *counts = kmeans_scratch_alloc(n_centroids * sizeof(size_t));
+
+    struct kmeans_accumulators acc;
+    kmeans_accumulators_init(&acc, n_centroids,
+                             parallel ? omp_get_max_threads() : 1);
+
+    struct kmeans_kdtree tree;
+    kmeans_kdtree_init(&tree, n_centroids);
+
+    struct kmeans_control ctl;
+    kmeans_control_begin(
+        &ctl, parallel ? "kmeans_omp_bisecting" : "kmeans_bisecting",
+        n_pixels);
+
+    // initialize centroids by bisection (unless warm starting)
+    kmeans_control_phase(&ctl, KMEANS_PHASE_SEED);
+    if (kmeans_get_init() != KMEANS_INIT_PROVIDED)
+        bisect_all(pixels, n_pixels, centroids, n_centroids, labels, parallel);
+
+    // refine with Lloyd iterations, answering closest centroid queries in
+    // O(log n_centroids) through a k-d tree
+    for (int iter = 0; iter < kmeans_control_max_iter(&ctl); ++iter) {
+        size_t n_changed = 0u;
+        double inertia = 0.0;
+
+        kmeans_control_iteration_begin(&ctl);
+
+        // reassign points to closest centroids, accumulating into padded
+        // per-thread sums / counts
+        kmeans_control_phase(&ctl, KMEANS_PHASE_ASSIGN);
+        kmeans_kdtree_build(&tree, centroids);
+
+        #pragma omp parallel if (parallel) reduction(+ : n_changed, inertia)
+        {
+            kmeans_accumulators_reset(&acc);
+
+            int tid = omp_get_thread_num();
+            double *thread_sums = kmeans_accumulators_sums(&acc, tid);
+            size_t *thread_counts = kmeans_accumulators_counts(&acc, tid);
+
+            #pragma omp for schedule(static)
+            for (size_t i = 0u; i < n_pixels; ++i) {
+                struct pixel pixel = pixels[i];
+
+                // find centroid closest to pixel
+                double min_dist;
+                size_t closest_centroid =
+                    kmeans_kdtree_nearest(&tree, pixel, &min_dist);
+
+                inertia += min_dist;
+
+                // if pixel has changed cluster...
+                if (closest_centroid != labels[i]) {
+                    labels[i] = closest_centroid;
+
+                    ++n_changed;
+                }
+
+                // update cluster sum
+                double *sum = &thread_sums[3 * closest_centroid];
+                sum[0] += pixel.r;
+                sum[1] += pixel.g;
+                sum[2] += pixel.b;
+
+                // update cluster size
+                thread_counts[closest_centroid]++;
+            }
+        }
+
+        kmeans_accumulators_merge(&acc, sums, counts);
+
+        // repair all empty clusters at once
+        kmeans_control_phase(&ctl, KMEANS_PHASE_REPAIR);
+        int repaired = kmeans_repair_empty_clusters(pixels, n_pixels,
+                                                    centroids, n_centroids,
+                                                    labels, sums, counts) > 0;
+
+        // average accumulated cluster sums
+        kmeans_control_phase(&ctl, KMEANS_PHASE_AVERAGE);
+        double max_shift2 = 0.0;
+
+        for (size_t j = 0u; j < n_centroids; ++j) {
+            double const *sum = &sums[3 * j];
+            size_t count = counts[j];
+
+            struct pixel new_centroid = {
+                sum[0] / count, sum[1] / count, sum[2] / count
+            };
+
+            double shift2 = pixel_dist2(new_centroid, centroids[j]);
+            if (shift2 > max_shift2)
+                max_shift2 = shift2;
+
+            centroids[j] = new_centroid;
+        }
+
+        // break if the solution has converged
+        if (kmeans_control_iteration_end(&ctl, n_changed, inertia,
+                                         max_shift2, repaired))
+            break;
+    }
+
+    kmeans_control_end(&ctl);
+
+    kmeans_scratch_end(&scope);
+}
+
+void kmeans_bisecting(struct pixel *pixels, size_t n_pixels,
+                      struct pixel *centroids, size_t n_centroids,
+                      size_t *labels)
+{
+    kmeans_bisecting_impl(pixels, n_pixels, centroids, n_centroids, labels, 0);
+}
+
+void kmeans_omp_bisecting(struct pixel *pixels, size_t n_pixels,
+                          struct pixel *centroids, size_t n_centroids,
+                          size_t *labels)
+{
+    kmeans_bisecting_impl(pixels, n_pixels, centroids, n_centroids, labels, 1);
+}
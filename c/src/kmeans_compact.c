@@ -0,0 +1,172 @@
+#include <assert.h>
+#include <omp.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "kmeans_config.h"
+#include "kmeans.h"
+#include "kmeans_control.h"
+#include "kmeans_reduce.h"
+#include "kmeans_scratch.h"
+#include "kmeans_util.h"
+
+/* Label Type Specializations *************************************************/
+
+#define LABEL_T uint8_t
+#define LABEL_TYPE KMEANS_LABEL_U8
+#define KMEANS_COMPACT_IMPL kmeans_compact_u8
+#include "kmeans_compact_impl.h"
+#undef LABEL_T
+#undef LABEL_TYPE
+#undef KMEANS_COMPACT_IMPL
+
+#define LABEL_T uint16_t
+#define LABEL_TYPE KMEANS_LABEL_U16
+#define KMEANS_COMPACT_IMPL kmeans_compact_u16
+#include "kmeans_compact_impl.h"
+#undef LABEL_T
+#undef LABEL_TYPE
+#undef KMEANS_COMPACT_IMPL
+
+#define LABEL_T uint32_t
+#define LABEL_TYPE KMEANS_LABEL_U32
+#define KMEANS_COMPACT_IMPL kmeans_compact_u32
+#include "kmeans_compact_impl.h"
+#undef LABEL_T
+#undef LABEL_TYPE
+#undef KMEANS_COMPACT_IMPL
+
+#define LABEL_T size_t
+#define LABEL_TYPE KMEANS_LABEL_SIZE
+#define KMEANS_COMPACT_IMPL kmeans_compact_size
+#include "kmeans_compact_impl.h"
+#undef LABEL_T
+#undef LABEL_TYPE
+#undef KMEANS_COMPACT_IMPL
+
+/* Palette Mapping ************************************************************/
+
+// map labels of some type to centroid colours, one row at a time
+#define PALETTE_MAP(label_t) do { \
+    label_t const *typed_labels = (label_t const *) labels; \
+    \
+    _Pragma("omp parallel for schedule(static)") \
+    for (size_t y = 0u; y < image.rows; ++y) { \
+        label_t const *row_labels = &typed_labels[y * image.cols]; \
+        unsigned char *row = &image.data[y * image.step]; \
+        \
+        for (size_t x = 0u; x < image.cols; ++x) { \
+            unsigned char const *colour = &palette[3 * row_labels[x]]; \
+            row[3 * x] = colour[0]; \
+            row[3 * x + 1u] = colour[1]; \
+            row[3 * x + 2u] = colour[2]; \
+        } \
+    } \
+} while (0)
+
+/* Main Functions *************************************************************/
+
+static void kmeans_compact_dispatch(struct pixel_bgr pixels,
+                                    struct pixel *centroids,
+                                    size_t n_centroids,
+                                    void *labels,
+                                    enum kmeans_label_type label_type,
+                                    int parallel)
+{
+    switch (label_type) {
+    case KMEANS_LABEL_U8:
+        assert(n_centroids <= (size_t) UINT8_MAX + 1u);
+        kmeans_compact_u8(pixels, centroids, n_centroids,
+                          (uint8_t *) labels, parallel);
+        break;
+    case KMEANS_LABEL_U16:
+        assert(n_centroids <= (size_t) UINT16_MAX + 1u);
+        kmeans_compact_u16(pixels, centroids, n_centroids,
+                           (uint16_t *) labels, parallel);
+        break;
+    case KMEANS_LABEL_U32:
+        assert(n_centroids <= (size_t) UINT32_MAX + 1u);
+        kmeans_compact_u32(pixels, centroids, n_centroids,
+                           (uint32_t *) labels, parallel);
+        break;
+    case KMEANS_LABEL_SIZE:
+        kmeans_compact_size(pixels, centroids, n_centroids,
+                            (size_t *) labels, parallel);
+        break;
+    }
+}
+
+enum kmeans_label_type kmeans_label_type_for(size_t n_centroids)
+{
+    if (n_centroids <= (size_t) UINT8_MAX + 1u)
+        return KMEANS_LABEL_U8;
+
+    if (n_centroids <= (size_t) UINT16_MAX + 1u)
+        return KMEANS_LABEL_U16;
+
+    return KMEANS_LABEL_U32;
+}
+
+size_t kmeans_label_size(enum kmeans_label_type label_type)
+{
+    switch (label_type) {
+    case KMEANS_LABEL_U8:
+        return sizeof(uint8_t);
+    case KMEANS_LABEL_U16:
+        return sizeof(uint16_t);
+    case KMEANS_LABEL_U32:
+        return sizeof(uint32_t);
+    default:
+        return sizeof(size_t);
+    }
+}
+
+void kmeans_palette_map(void const *labels, enum kmeans_label_type label_type,
+                        struct pixel const *centroids, size_t n_centroids,
+                        struct pixel_bgr image)
+{
+    struct kmeans_scratch_scope scope;
+    kmeans_scratch_begin(&scope);
+
+    // narrow centroids to 8-bit BGR once
+    unsigned char *palette = kmeans_scratch_alloc(3 * n_centroids);
+
+    for (size_t j = 0u; j < n_centroids; ++j) {
+        palette[3 * j] = (unsigned char) centroids[j].b;
+        palette[3 * j + 1u] = (unsigned char) centroids[j].g;
+        palette[3 * j + 2u] = (unsigned char) centroids[j].r;
+    }
+
+    switch (label_type) {
+    case KMEANS_LABEL_U8:
+        PALETTE_MAP(uint8_t);
+        break;
+    case KMEANS_LABEL_U16:
+        PALETTE_MAP(uint16_t);
+        break;
+    case KMEANS_LABEL_U32:
+        PALETTE_MAP(uint32_t);
+        break;
+    case KMEANS_LABEL_SIZE:
+        PALETTE_MAP(size_t);
+        break;
+    }
+
+    kmeans_scratch_end(&scope);
+}
+
+void kmeans_compact(struct pixel_bgr pixels,
+                    struct pixel *centroids, size_t n_centroids,
+                    void *labels, enum kmeans_label_type label_type)
+{
+    kmeans_compact_dispatch(pixels, centroids, n_centroids,
+                            labels, label_type, 0);
+}
+
+void kmeans_omp_compact(struct pixel_bgr pixels,
+                        struct pixel *centroids, size_t n_centroids,
+                        void *labels, enum kmeans_label_type label_type)
+{
+    kmeans_compact_dispatch(pixels, centroids, n_centroids,
+                            labels, label_type, 1);
+}
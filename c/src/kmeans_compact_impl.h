@@ -0,0 +1,119 @@
+// compact engine body, included once per label type by kmeans_compact.c with
+// LABEL_T (label storage type), LABEL_TYPE (the matching kmeans_label_type)
+// and KMEANS_COMPACT_IMPL (function name) defined
+
+static void KMEANS_COMPACT_IMPL(struct pixel_bgr pixels,
+                                struct pixel *centroids, size_t n_centroids,
+                                LABEL_T *labels, int parallel)
+{
+    size_t n_pixels = pixels.rows * pixels.cols;
+
+    struct kmeans_scratch_scope scope;
+    kmeans_scratch_begin(&scope);
+
+    // allocate auxiliary memory
+    double *sums = kmeans_scratch_alloc(3 * n_centroids * sizeof(double));
+    size_t *counts = kmeans_scratch_alloc(n_centroids * sizeof(size_t));
+
+    struct kmeans_accumulators acc;
+    kmeans_accumulators_init(&acc, n_centroids,
+                             parallel ? omp_get_max_threads() : 1);
+
+    struct kmeans_control ctl;
+    kmeans_control_begin(
+        &ctl, parallel ? "kmeans_omp_compact" : "kmeans_compact", n_pixels);
+
+    // initialize centroids
+    kmeans_control_phase(&ctl, KMEANS_PHASE_SEED);
+    kmeans_seed_bgr(pixels, centroids, n_centroids, parallel);
+
+    // repeat until converged or for at most max_iter iterations
+    for (int iter = 0; iter < kmeans_control_max_iter(&ctl); ++iter) {
+        size_t n_changed = 0u;
+        double inertia = 0.0;
+
+        kmeans_control_iteration_begin(&ctl);
+
+        // reassign points to closest centroids
+        kmeans_control_phase(&ctl, KMEANS_PHASE_ASSIGN);
+        #pragma omp parallel if (parallel) reduction(+ : n_changed, inertia)
+        {
+            kmeans_accumulators_reset(&acc);
+
+            int tid = omp_get_thread_num();
+            double *thread_sums = kmeans_accumulators_sums(&acc, tid);
+            size_t *thread_counts = kmeans_accumulators_counts(&acc, tid);
+
+            // image rows may be padded, labels are not
+            #pragma omp for schedule(static) collapse(2)
+            for (size_t y = 0u; y < pixels.rows; ++y) {
+                for (size_t x = 0u; x < pixels.cols; ++x) {
+                    size_t i = y * pixels.cols + x;
+
+                    struct pixel pixel =
+                        bgr_widen(&pixels.data[y * pixels.step + 3 * x]);
+
+                    // find centroid closest to pixel
+                    double min_dist;
+                    LABEL_T closest_centroid = (LABEL_T) find_closest_centroid(
+                        pixel, centroids, n_centroids, &min_dist);
+
+                    inertia += min_dist;
+
+                    // if pixel has changed cluster...
+                    if (closest_centroid != labels[i]) {
+                        labels[i] = closest_centroid;
+
+                        ++n_changed;
+                    }
+
+                    // update cluster sum
+                    double *sum = &thread_sums[3 * closest_centroid];
+                    sum[0] += pixel.r;
+                    sum[1] += pixel.g;
+                    sum[2] += pixel.b;
+
+                    // update cluster size
+                    thread_counts[closest_centroid]++;
+                }
+            }
+        }
+
+        kmeans_accumulators_merge(&acc, sums, counts);
+
+        // repair all empty clusters at once
+        kmeans_control_phase(&ctl, KMEANS_PHASE_REPAIR);
+        int repaired = kmeans_repair_empty_clusters_bgr(
+            pixels, centroids, n_centroids, labels, LABEL_TYPE, sums, counts,
+            parallel) > 0;
+
+        // average accumulated cluster sums
+        kmeans_control_phase(&ctl, KMEANS_PHASE_AVERAGE);
+        double max_shift2 = 0.0;
+
+        for (size_t j = 0u; j < n_centroids; ++j) {
+            struct pixel *centroid = &centroids[j];
+            double *sum = &sums[3 * j];
+            size_t count = counts[j];
+
+            struct pixel new_centroid = {
+                sum[0] / count, sum[1] / count, sum[2] / count
+            };
+
+            double shift2 = pixel_dist2(new_centroid, *centroid);
+            if (shift2 > max_shift2)
+                max_shift2 = shift2;
+
+            *centroid = new_centroid;
+        }
+
+        // break if the solution has converged
+        if (kmeans_control_iteration_end(&ctl, n_changed, inertia,
+                                         max_shift2, repaired))
+            break;
+    }
+
+    kmeans_control_end(&ctl);
+
+    kmeans_scratch_end(&scope);
+}
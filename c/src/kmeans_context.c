@@ -0,0 +1,269 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kmeans_config.h"
+#include "kmeans.h"
+#include "kmeans_scratch.h"
+
+/* Data Structures ************************************************************/
+
+struct kmeans_arena_block
+{
+    struct kmeans_arena_block *next;
+    char *data;
+    size_t size;
+};
+
+struct kmeans_device_buffer
+{
+    void *ptr;
+    size_t size;
+    void (*release)(void *);
+};
+
+struct kmeans_context
+{
+    // blocks are used front to back, current is the one allocated from
+    struct kmeans_arena_block *blocks;
+    struct kmeans_arena_block *current;
+    size_t offset;
+
+    int depth;
+    int temporary;
+
+    struct kmeans_device_buffer device[KMEANS_DEVICE_SLOTS];
+
+    struct kmeans_context_stats stats;
+};
+
+// context used by engines called from this thread
+static __thread struct kmeans_context *active_context = NULL;
+
+/* Helper Functions ***********************************************************/
+
+static size_t align_up(size_t size)
+{
+    return (size + KMEANS_CACHELINE - 1u) / KMEANS_CACHELINE * KMEANS_CACHELINE;
+}
+
+static struct kmeans_arena_block *block_create(struct kmeans_context *ctx,
+                                               size_t size)
+{
+    size_t header = align_up(sizeof(struct kmeans_arena_block));
+
+    // over-allocate so that data can start on a cache line
+    char *raw = malloc(header + size + KMEANS_CACHELINE);
+
+    uintptr_t addr = (uintptr_t) raw;
+    addr = (addr + KMEANS_CACHELINE - 1u) & ~((uintptr_t) KMEANS_CACHELINE - 1u);
+
+    struct kmeans_arena_block *block = (struct kmeans_arena_block *) raw;
+    block->next = NULL;
+    block->data = (char *) addr + header;
+    block->size = size;
+
+    ctx->stats.allocations++;
+    ctx->stats.bytes_reserved += size;
+
+    return block;
+}
+
+static void blocks_free(struct kmeans_context *ctx,
+                        struct kmeans_arena_block *block)
+{
+    while (block) {
+        struct kmeans_arena_block *next = block->next;
+
+        ctx->stats.bytes_reserved -= block->size;
+        free(block);
+
+        block = next;
+    }
+}
+
+// replace a chain of blocks by a single one large enough to serve the same
+// sequence of allocations, so that the next call of the same size does not
+// need to allocate at all
+static void blocks_coalesce(struct kmeans_context *ctx)
+{
+    if (!ctx->blocks || !ctx->blocks->next)
+        return;
+
+    size_t total = 0u;
+    for (struct kmeans_arena_block *b = ctx->blocks; b; b = b->next)
+        total += b->size;
+
+    blocks_free(ctx, ctx->blocks);
+
+    ctx->blocks = block_create(ctx, total);
+    ctx->current = NULL;
+    ctx->offset = 0u;
+}
+
+/* Main Functions *************************************************************/
+
+struct kmeans_context *kmeans_context_create(void)
+{
+    struct kmeans_context *ctx = calloc(1, sizeof(struct kmeans_context));
+
+    return ctx;
+}
+
+void kmeans_context_destroy(struct kmeans_context *ctx)
+{
+    if (!ctx)
+        return;
+
+    if (active_context == ctx)
+        active_context = NULL;
+
+    blocks_free(ctx, ctx->blocks);
+
+    for (int slot = 0; slot < KMEANS_DEVICE_SLOTS; ++slot) {
+        struct kmeans_device_buffer *buf = &ctx->device[slot];
+
+        if (buf->ptr)
+            buf->release(buf->ptr);
+    }
+
+    free(ctx);
+}
+
+void kmeans_set_context(struct kmeans_context *ctx)
+{
+    active_context = ctx;
+}
+
+struct kmeans_context *kmeans_get_context(void)
+{
+    return active_context;
+}
+
+struct kmeans_context_stats kmeans_context_get_stats(
+    struct kmeans_context const *ctx)
+{
+    return ctx->stats;
+}
+
+void kmeans_context_reset_stats(struct kmeans_context *ctx)
+{
+    ctx->stats.calls = 0u;
+    ctx->stats.allocations = 0u;
+}
+
+void kmeans_context_record_allocation(struct kmeans_context *ctx, size_t size)
+{
+    ctx->stats.allocations++;
+    ctx->stats.bytes_reserved += size;
+}
+
+/* Scratch Memory *************************************************************/
+
+void kmeans_scratch_begin(struct kmeans_scratch_scope *scope)
+{
+    struct kmeans_context *ctx = active_context;
+
+    if (!ctx) {
+        ctx = kmeans_context_create();
+        ctx->temporary = 1;
+
+        active_context = ctx;
+    }
+
+    if (ctx->depth++ == 0)
+        ctx->stats.calls++;
+
+    scope->ctx = ctx;
+    scope->block = ctx->current;
+    scope->offset = ctx->offset;
+}
+
+void kmeans_scratch_end(struct kmeans_scratch_scope *scope)
+{
+    struct kmeans_context *ctx = scope->ctx;
+
+    ctx->current = scope->block;
+    ctx->offset = scope->offset;
+
+    if (--ctx->depth > 0)
+        return;
+
+    // temporary contexts die with the outermost scope
+    if (ctx->temporary) {
+        kmeans_context_destroy(ctx);
+        return;
+    }
+
+    blocks_coalesce(ctx);
+}
+
+void *kmeans_scratch_alloc(size_t size)
+{
+    struct kmeans_context *ctx = active_context;
+
+    size = align_up(size ? size : 1u);
+
+    struct kmeans_arena_block *block = ctx->current;
+
+    if (!block || ctx->offset + size > block->size) {
+        // move on to the next block (the first one if none is in use yet)
+        struct kmeans_arena_block *prev = block;
+        struct kmeans_arena_block *next = prev ? prev->next : ctx->blocks;
+
+        if (!next || next->size < size) {
+            // too small to be of any use, drop it and everything after it
+            if (next)
+                blocks_free(ctx, next);
+
+            size_t grow = prev ? 2u * prev->size : KMEANS_ARENA_BLOCKSIZE;
+
+            next = block_create(ctx, size > grow ? size : grow);
+
+            if (prev)
+                prev->next = next;
+            else
+                ctx->blocks = next;
+        }
+
+        ctx->current = block = next;
+        ctx->offset = 0u;
+    }
+
+    void *ptr = &block->data[ctx->offset];
+    ctx->offset += size;
+
+    return ptr;
+}
+
+void *kmeans_scratch_calloc(size_t size)
+{
+    void *ptr = kmeans_scratch_alloc(size);
+    memset(ptr, 0, size);
+
+    return ptr;
+}
+
+void *kmeans_scratch_device(enum kmeans_device_slot slot, size_t size,
+                            void *(*device_alloc)(size_t),
+                            void (*device_release)(void *))
+{
+    struct kmeans_device_buffer *buf = &active_context->device[slot];
+
+    if (buf->ptr && buf->size >= size)
+        return buf->ptr;
+
+    if (buf->ptr) {
+        buf->release(buf->ptr);
+        active_context->stats.bytes_reserved -= buf->size;
+    }
+
+    buf->ptr = device_alloc(size);
+    buf->size = size;
+    buf->release = device_release;
+
+    active_context->stats.allocations++;
+    active_context->stats.bytes_reserved += size;
+
+    return buf->ptr;
+}
@@ -0,0 +1,229 @@
+#include <omp.h>
+#include <string.h>
+
+#include "kmeans_config.h"
+#include "kmeans.h"
+#include "kmeans_control.h"
+
+/* Per-Thread Settings ********************************************************/
+
+static __thread int options_set = 0;
+static __thread struct kmeans_options thread_options;
+static __thread struct kmeans_result *thread_result = NULL;
+
+void kmeans_default_options(struct kmeans_options *options)
+{
+    options->max_iter = KMEANS_MAX_ITER;
+    options->shift_tol = 0.0;
+    options->inertia_tol = 0.0;
+    options->changed_tol = 0.0;
+}
+
+void kmeans_set_options(struct kmeans_options const *options)
+{
+    options_set = options != NULL;
+
+    if (options)
+        thread_options = *options;
+}
+
+void kmeans_set_result(struct kmeans_result *result)
+{
+    thread_result = result;
+}
+
+/* Engine Interface ***********************************************************/
+
+static void phase_close(struct kmeans_control *ctl)
+{
+    if (ctl->phase < 0)
+        return;
+
+    struct kmeans_trace_event event;
+    memset(&event, 0, sizeof(event));
+
+    event.type = KMEANS_EVENT_PHASE;
+    event.engine = ctl->engine;
+    event.call = ctl->call;
+    event.iteration = ctl->phase_iteration;
+    event.phase = (enum kmeans_phase) ctl->phase;
+    event.start = ctl->phase_start;
+    event.duration = omp_get_wtime() - ctl->phase_start;
+
+    kmeans_trace_read_counters(ctl->trace, event.counters);
+
+    for (int i = 0; i < KMEANS_COUNTERS; ++i)
+        event.counters[i] -= ctl->phase_counters[i];
+
+    kmeans_trace_record(ctl->trace, &event);
+
+    ctl->phase = -1;
+}
+
+void kmeans_control_begin(struct kmeans_control *ctl, char const *engine,
+                          size_t n_pixels)
+{
+    if (options_set)
+        ctl->options = thread_options;
+    else
+        kmeans_default_options(&ctl->options);
+
+    ctl->result = thread_result;
+
+    ctl->n_pixels = n_pixels;
+    ctl->iterations = 0;
+    ctl->converged = 0;
+    ctl->inertia = 0.0;
+
+    ctl->trace = kmeans_get_trace();
+    ctl->engine = engine;
+    ctl->call = ctl->trace ? kmeans_trace_begin_call(ctl->trace) : 0u;
+    ctl->phase = -1;
+
+    ctl->track_inertia =
+        ctl->result || ctl->trace || ctl->options.inertia_tol > 0.0;
+
+    ctl->in_iteration = 0;
+    ctl->start = omp_get_wtime();
+}
+
+void kmeans_control_iteration_begin(struct kmeans_control *ctl)
+{
+    ctl->in_iteration = 1;
+    ctl->iteration_start = omp_get_wtime();
+}
+
+void kmeans_control_phase(struct kmeans_control *ctl, enum kmeans_phase phase)
+{
+    if (!ctl->trace || ctl->phase == (int) phase)
+        return;
+
+    phase_close(ctl);
+
+    ctl->phase = phase;
+    ctl->phase_iteration = ctl->in_iteration ? ctl->iterations : -1;
+
+    kmeans_trace_read_counters(ctl->trace, ctl->phase_counters);
+
+    ctl->phase_start = omp_get_wtime();
+}
+
+static int iteration_end(struct kmeans_control *ctl, size_t n_changed,
+                         double inertia, double max_shift2, int repaired,
+                         int sampled)
+{
+    struct kmeans_options opts = ctl->options;
+    struct kmeans_result *res = ctl->result;
+
+    int iter = ctl->iterations++;
+    double iteration_time = omp_get_wtime() - ctl->iteration_start;
+
+    ctl->in_iteration = 0;
+
+    if (res && (size_t) iter < res->iteration_times_size && res->iteration_times)
+        res->iteration_times[iter] = iteration_time;
+
+    if (ctl->trace) {
+        phase_close(ctl);
+
+        struct kmeans_trace_event event;
+        memset(&event, 0, sizeof(event));
+
+        event.type = KMEANS_EVENT_ITERATION;
+        event.engine = ctl->engine;
+        event.call = ctl->call;
+        event.iteration = iter;
+        event.start = ctl->iteration_start;
+        event.duration = iteration_time;
+        event.n_changed = n_changed;
+        event.inertia = inertia;
+
+        kmeans_trace_record(ctl->trace, &event);
+    }
+
+    double prev_inertia = ctl->inertia;
+    ctl->inertia = inertia;
+
+    if (repaired) {
+        ctl->converged = 0;
+        return 0;
+    }
+
+    // a sample's label changes say nothing about the fraction of all labels
+    // that changed
+    if (sampled)
+        opts.changed_tol = -1.0;
+
+    int converged = kmeans_control_converged(
+        &opts, ctl->n_pixels, n_changed, inertia,
+        iter > 0 ? prev_inertia : -1.0, max_shift2);
+
+    ctl->converged = converged;
+
+    return converged;
+}
+
+int kmeans_control_iteration_end(struct kmeans_control *ctl,
+                                 size_t n_changed, double inertia,
+                                 double max_shift2, int repaired)
+{
+    return iteration_end(ctl, n_changed, inertia, max_shift2, repaired, 0);
+}
+
+int kmeans_control_sample_end(struct kmeans_control *ctl,
+                              size_t n_changed, double inertia,
+                              double max_shift2, int repaired)
+{
+    return iteration_end(ctl, n_changed, inertia, max_shift2, repaired, 1);
+}
+
+int kmeans_control_converged(struct kmeans_options const *options,
+                             size_t n_pixels, size_t n_changed,
+                             double inertia, double prev_inertia,
+                             double max_shift2)
+{
+    int converged = n_changed <= options->changed_tol * (double) n_pixels;
+
+    if (options->shift_tol > 0.0 &&
+        max_shift2 <= options->shift_tol * options->shift_tol)
+        converged = 1;
+
+    if (options->inertia_tol > 0.0 && prev_inertia >= 0.0 &&
+        prev_inertia - inertia <= options->inertia_tol * prev_inertia)
+        converged = 1;
+
+    return converged;
+}
+
+void kmeans_control_end(struct kmeans_control *ctl)
+{
+    struct kmeans_result *res = ctl->result;
+
+    double time = omp_get_wtime() - ctl->start;
+
+    if (ctl->trace) {
+        phase_close(ctl);
+
+        struct kmeans_trace_event event;
+        memset(&event, 0, sizeof(event));
+
+        event.type = KMEANS_EVENT_CALL;
+        event.engine = ctl->engine;
+        event.call = ctl->call;
+        event.iteration = ctl->iterations;
+        event.start = ctl->start;
+        event.duration = time;
+        event.inertia = ctl->inertia;
+        event.converged = ctl->converged;
+
+        kmeans_trace_record(ctl->trace, &event);
+    }
+
+    if (!res)
+        return;
+
+    res->iterations = ctl->iterations;
+    res->converged = ctl->converged;
+    res->inertia = ctl->inertia;
+    res->time = time;
+}
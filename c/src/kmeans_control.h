@@ -0,0 +1,81 @@
+#ifndef KMEANS_CONTROL_H
+#define KMEANS_CONTROL_H
+
+#include <stddef.h>
+
+#include "kmeans.h"
+#include "kmeans_trace.h"
+
+// termination / telemetry state of a single engine call
+struct kmeans_control
+{
+    struct kmeans_options options;
+    struct kmeans_result *result;
+
+    size_t n_pixels;
+    int iterations;
+    int converged;
+    double inertia;
+
+    // whether inertia is needed at all, engines that would have to compute
+    // extra distances for it may skip it otherwise
+    int track_inertia;
+
+    double start;
+    double iteration_start;
+    int in_iteration;
+
+    // trace active for this thread (NULL if none) and its open phase
+    struct kmeans_trace *trace;
+    char const *engine;
+    size_t call;
+
+    int phase; // -1 if none
+    int phase_iteration;
+    double phase_start;
+    unsigned long long phase_counters[KMEANS_COUNTERS];
+};
+
+// snapshot this thread's options, start timing, engine names the calling
+// engine in traces
+void kmeans_control_begin(struct kmeans_control *ctl, char const *engine,
+                          size_t n_pixels);
+
+static inline int kmeans_control_max_iter(struct kmeans_control const *ctl)
+{
+    return ctl->options.max_iter;
+}
+
+void kmeans_control_iteration_begin(struct kmeans_control *ctl);
+
+// close the open phase (if any) and open another one, a no-op if phase is
+// already open or no trace is active
+void kmeans_control_phase(struct kmeans_control *ctl, enum kmeans_phase phase);
+
+// record an iteration (closing the open phase), max_shift2 is the largest
+// squared distance any centroid has moved, returns non-zero if the engine
+// should stop
+int kmeans_control_iteration_end(struct kmeans_control *ctl,
+                                 size_t n_changed, double inertia,
+                                 double max_shift2, int repaired);
+
+// like kmeans_control_iteration_end for engines that assign a sample of the
+// pixels per iteration, n_changed (counted within the sample) is recorded but
+// changed_tol plays no part in termination
+int kmeans_control_sample_end(struct kmeans_control *ctl,
+                              size_t n_changed, double inertia,
+                              double max_shift2, int repaired);
+
+// whether an iteration that changed n_changed of n_pixels labels, reached
+// inertia (prev_inertia in the iteration before, negative if there was none)
+// and moved no centroid further than sqrt(max_shift2) meets any termination
+// criterion of options (for engines tracking several solutions at once)
+int kmeans_control_converged(struct kmeans_options const *options,
+                             size_t n_pixels, size_t n_changed,
+                             double inertia, double prev_inertia,
+                             double max_shift2);
+
+// report to the result registered for this thread (if any)
+void kmeans_control_end(struct kmeans_control *ctl);
+
+#endif
@@ -0,0 +1,221 @@
+#include <math.h>
+#include <omp.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "kmeans_config.h"
+#include "kmeans.h"
+#include "kmeans_control.h"
+#include "kmeans_reduce.h"
+#include "kmeans_scratch.h"
+#include "kmeans_util.h"
+
+// sample weights (at least 1) are kept as fixed-point integers so that the
+// weighted Lloyd iterations of the histogram engine can be reused, scaling
+// does not change weighted means
+#define WEIGHT_SCALE ((double) KMEANS_CORESET_WEIGHT_SCALE)
+
+/* Coreset Construction *******************************************************/
+
+// sensitivity bound of a lightweight coreset: half uniform, half
+// proportional to the squared distance from the mean
+struct sensitivity
+{
+    struct pixel mean;
+    double uniform;  // sample_size / (2 n)
+    double scale;    // sample_size / (2 sum of squared distances), 0 if none
+    uint64_t seed;
+};
+
+// inclusion probability of a pixel, capped at 1
+static inline double inclusion(struct sensitivity const *sens,
+                               struct pixel pixel)
+{
+    double p = sens->uniform + sens->scale * pixel_dist2(pixel, sens->mean);
+    return p < 1.0 ? p : 1.0;
+}
+
+// whether the i-th pixel is sampled, decided by a hash of seed and index so
+// that counting and gathering passes agree regardless of thread count
+static inline int sampled(struct sensitivity const *sens, size_t i, double p)
+{
+    return to_unit(mix64(sens->seed ^ mix64(i))) < p;
+}
+
+// one pass for the mean and sum of squared distances from it, every pixel is
+// then sampled independently with probability min(1, sample_size * q) for
+// q = 1/(2n) + d^2/(2 sum d^2) and weighted by the inverse of it, in one pass
+// that counts each thread's share of the sample and one that gathers it,
+// returns the size of the sample
+static size_t build_coreset(struct pixel_bgr const *pixels, size_t n_pixels,
+                            size_t sample_size, uint64_t seed,
+                            struct pixel **points, size_t **weights,
+                            size_t *total_weight, int parallel)
+{
+    int n_threads = parallel ? omp_get_max_threads() : 1;
+
+    double sum_r = 0.0, sum_g = 0.0, sum_b = 0.0, sum_sq = 0.0;
+
+    #pragma omp parallel for if (parallel) schedule(static) \
+        reduction(+ : sum_r, sum_g, sum_b, sum_sq)
+    for (size_t i = 0u; i < n_pixels; ++i) {
+        struct pixel pixel = bgr_get(pixels, i);
+
+        sum_r += pixel.r;
+        sum_g += pixel.g;
+        sum_b += pixel.b;
+        sum_sq += pixel.r * pixel.r + pixel.g * pixel.g + pixel.b * pixel.b;
+    }
+
+    struct sensitivity sens;
+    sens.mean.r = sum_r / n_pixels;
+    sens.mean.g = sum_g / n_pixels;
+    sens.mean.b = sum_b / n_pixels;
+    sens.uniform = 0.5 * sample_size / n_pixels;
+    sens.seed = seed;
+
+    // sum of squared distances from the mean (zero for a uniform image)
+    struct pixel origin = { 0.0, 0.0, 0.0 };
+    double total = sum_sq - n_pixels * pixel_dist2(sens.mean, origin);
+    sens.scale = total > 0.0 ? 0.5 * sample_size / total : 0.0;
+
+    size_t *thread_counts = kmeans_scratch_calloc(
+        (n_threads + 1) * sizeof(size_t));
+
+    #pragma omp parallel if (parallel)
+    {
+        size_t count = 0u;
+
+        #pragma omp for schedule(static)
+        for (size_t i = 0u; i < n_pixels; ++i) {
+            struct pixel pixel = bgr_get(pixels, i);
+
+            if (sampled(&sens, i, inclusion(&sens, pixel)))
+                ++count;
+        }
+
+        thread_counts[omp_get_thread_num() + 1] = count;
+    }
+
+    // prefix sums give each thread's offset into the sample
+    thread_counts[0] = 0u;
+    for (int t = 0; t < n_threads; ++t)
+        thread_counts[t + 1] += thread_counts[t];
+
+    size_t n_sample = thread_counts[n_threads];
+
+    *points = kmeans_scratch_alloc(n_sample * sizeof(struct pixel));
+    *weights = kmeans_scratch_alloc(n_sample * sizeof(size_t));
+
+    size_t weight_sum = 0u;
+
+    // the static schedule hands every thread the same pixels as before
+    #pragma omp parallel if (parallel) reduction(+ : weight_sum)
+    {
+        size_t next = thread_counts[omp_get_thread_num()];
+
+        #pragma omp for schedule(static)
+        for (size_t i = 0u; i < n_pixels; ++i) {
+            struct pixel pixel = bgr_get(pixels, i);
+            double p = inclusion(&sens, pixel);
+
+            if (!sampled(&sens, i, p))
+                continue;
+
+            size_t weight = (size_t) llround(WEIGHT_SCALE / p);
+
+            (*points)[next] = pixel;
+            (*weights)[next] = weight;
+            ++next;
+
+            weight_sum += weight;
+        }
+    }
+
+    *total_weight = weight_sum;
+
+    return n_sample;
+}
+
+/* Main Functions *************************************************************/
+
+static void kmeans_coreset_impl(struct pixel_bgr pixels,
+                                struct pixel *centroids, size_t n_centroids,
+                                size_t *labels, size_t sample_size,
+                                int parallel)
+{
+    size_t n_pixels = pixels.rows * pixels.cols;
+
+    if (sample_size < n_centroids)
+        sample_size = n_centroids;
+
+    struct kmeans_scratch_scope scope;
+    kmeans_scratch_begin(&scope);
+
+    struct kmeans_control ctl;
+    kmeans_control_begin(
+        &ctl, parallel ? "kmeans_omp_coreset" : "kmeans_coreset", n_pixels);
+
+    // build coreset as part of initialization
+    kmeans_control_phase(&ctl, KMEANS_PHASE_SEED);
+
+    struct pixel *points;
+    size_t *weights;
+    size_t total_weight;
+
+    size_t n_points =
+        build_coreset(&pixels, n_pixels, sample_size, kmeans_get_seed(),
+                      &points, &weights, &total_weight, parallel);
+
+    size_t *point_labels = kmeans_scratch_alloc(n_points * sizeof(size_t));
+    for (size_t i = 0u; i < n_points; ++i)
+        point_labels[i] = SIZE_MAX;
+
+    // fit the weighted sample only, termination options refer to its total
+    // weight
+    ctl.n_pixels = total_weight;
+
+    kmeans_weighted_lloyd(&ctl, points, weights, n_points, centroids,
+                          n_centroids, point_labels, parallel);
+
+    // final labelling pass over all pixels
+    kmeans_control_phase(&ctl, KMEANS_PHASE_LABEL);
+    double inertia = 0.0;
+
+    #pragma omp parallel for if (parallel) schedule(static) collapse(2) \
+        reduction(+ : inertia)
+    for (size_t y = 0u; y < pixels.rows; ++y) {
+        for (size_t x = 0u; x < pixels.cols; ++x) {
+            struct pixel pixel =
+                bgr_widen(&pixels.data[y * pixels.step + 3 * x]);
+
+            double min_dist;
+            labels[y * pixels.cols + x] =
+                find_closest_centroid(pixel, centroids, n_centroids, &min_dist);
+
+            inertia += min_dist;
+        }
+    }
+
+    // report inertia over all pixels rather than that of the sample
+    ctl.inertia = inertia;
+    kmeans_control_end(&ctl);
+
+    kmeans_scratch_end(&scope);
+}
+
+void kmeans_coreset(struct pixel_bgr pixels,
+                    struct pixel *centroids, size_t n_centroids,
+                    size_t *labels, size_t sample_size)
+{
+    kmeans_coreset_impl(pixels, centroids, n_centroids, labels, sample_size,
+                        0);
+}
+
+void kmeans_omp_coreset(struct pixel_bgr pixels,
+                        struct pixel *centroids, size_t n_centroids,
+                        size_t *labels, size_t sample_size)
+{
+    kmeans_coreset_impl(pixels, centroids, n_centroids, labels, sample_size,
+                        1);
+}
@@ -0,0 +1,165 @@
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kmeans_config.h"
+#include "kmeans.h"
+#include "kmeans_distance.h"
+#include "kmeans_scratch.h"
+
+#define TILE_POINTS ((size_t) KMEANS_GEMM_TILE_POINTS)
+#define TILE_CLUSTERS ((size_t) KMEANS_GEMM_TILE_CLUSTERS)
+#define TILE_FEATURES ((size_t) KMEANS_GEMM_TILE_FEATURES)
+
+/* Backend Selection **********************************************************/
+
+// process-wide distance kernel, see kmeans_set_distance
+static enum kmeans_distance distance_backend = KMEANS_DISTANCE_AUTO;
+
+void kmeans_set_distance(enum kmeans_distance distance)
+{
+    distance_backend = distance;
+}
+
+// the matrix product only pays off once a block of points is compared against
+// enough centroids with enough features each (n_centroids * n_features) to
+// amortize the norms, padding and tile bookkeeping, see the crossover table
+// written by the benchmark's --distance
+enum kmeans_distance kmeans_select_distance(size_t n_points,
+                                            size_t n_centroids,
+                                            size_t n_features)
+{
+    if (distance_backend != KMEANS_DISTANCE_AUTO)
+        return distance_backend;
+
+    if (n_points >= TILE_POINTS &&
+        n_centroids >= KMEANS_GEMM_MIN_CLUSTERS &&
+        n_centroids * n_features >= KMEANS_GEMM_MIN_PRODUCT)
+        return KMEANS_DISTANCE_GEMM;
+
+    return KMEANS_DISTANCE_SCALAR;
+}
+
+/* Blocked GEMM Kernel ********************************************************/
+
+void kmeans_gemm_init(struct kmeans_gemm_centroids *gc, size_t n_centroids,
+                      size_t dim)
+{
+    gc->n_centroids = n_centroids;
+    gc->dim = dim;
+    gc->n_tiles = (n_centroids + TILE_CLUSTERS - 1u) / TILE_CLUSTERS;
+
+    gc->packed = kmeans_scratch_alloc(gc->n_tiles * dim * TILE_CLUSTERS *
+                                      sizeof(float));
+    gc->norms = kmeans_scratch_alloc(gc->n_tiles * TILE_CLUSTERS *
+                                     sizeof(float));
+}
+
+void kmeans_gemm_pack(struct kmeans_gemm_centroids *gc,
+                      float const *centroids)
+{
+    size_t dim = gc->dim;
+
+    for (size_t t = 0u; t < gc->n_tiles; ++t) {
+        float *tile = &gc->packed[t * dim * TILE_CLUSTERS];
+        float *norms = &gc->norms[t * TILE_CLUSTERS];
+
+        for (size_t j = 0u; j < TILE_CLUSTERS; ++j) {
+            size_t centroid = t * TILE_CLUSTERS + j;
+
+            if (centroid >= gc->n_centroids) {
+                for (size_t c = 0u; c < dim; ++c)
+                    tile[c * TILE_CLUSTERS + j] = 0.0f;
+
+                norms[j] = INFINITY;
+                continue;
+            }
+
+            float const *src = &centroids[centroid * dim];
+
+            float norm = 0.0f;
+            for (size_t c = 0u; c < dim; ++c) {
+                tile[c * TILE_CLUSTERS + j] = src[c];
+                norm += src[c] * src[c];
+            }
+
+            norms[j] = norm;
+        }
+    }
+}
+
+size_t kmeans_gemm_workspace(void)
+{
+    return TILE_POINTS * TILE_CLUSTERS + TILE_POINTS;
+}
+
+void kmeans_gemm_assign(float const *points, size_t n, size_t ld,
+                        struct kmeans_gemm_centroids const *gc,
+                        size_t *closest, float *dist2, float *work)
+{
+    size_t dim = gc->dim;
+
+    // TILE_POINTS x TILE_CLUSTERS dot products, then the points' norms
+    float *dots = work;
+    float *point_norms = &work[TILE_POINTS * TILE_CLUSTERS];
+
+    for (size_t i = 0u; i < n; ++i) {
+        float const *x = &points[i * ld];
+
+        float norm = 0.0f;
+        for (size_t c = 0u; c < dim; ++c)
+            norm += x[c] * x[c];
+
+        point_norms[i] = norm;
+        dist2[i] = FLT_MAX;
+        closest[i] = 0u;
+    }
+
+    for (size_t t = 0u; t < gc->n_tiles; ++t) {
+        float const *tile = &gc->packed[t * dim * TILE_CLUSTERS];
+        float const *norms = &gc->norms[t * TILE_CLUSTERS];
+
+        memset(dots, 0, n * TILE_CLUSTERS * sizeof(float));
+
+        // a TILE_FEATURES x TILE_CLUSTERS slice of the packed centroids stays
+        // in L1 while all points of the block are multiplied with it, the
+        // inner loop runs over contiguous centroids and vectorizes
+        for (size_t fb = 0u; fb < dim; fb += TILE_FEATURES) {
+            size_t fe = fb + TILE_FEATURES < dim ? fb + TILE_FEATURES : dim;
+
+            for (size_t i = 0u; i < n; ++i) {
+                float const *x = &points[i * ld];
+                float *row = &dots[i * TILE_CLUSTERS];
+
+                for (size_t c = fb; c < fe; ++c) {
+                    float xc = x[c];
+                    float const *col = &tile[c * TILE_CLUSTERS];
+
+                    for (size_t j = 0u; j < TILE_CLUSTERS; ++j)
+                        row[j] += xc * col[j];
+                }
+            }
+        }
+
+        // ties go to the lower index as in the scalar kernel
+        for (size_t i = 0u; i < n; ++i) {
+            float const *row = &dots[i * TILE_CLUSTERS];
+
+            for (size_t j = 0u; j < TILE_CLUSTERS; ++j) {
+                float dist = point_norms[i] - 2.0f * row[j] + norms[j];
+
+                if (dist < dist2[i]) {
+                    dist2[i] = dist;
+                    closest[i] = t * TILE_CLUSTERS + j;
+                }
+            }
+        }
+    }
+
+    // cancellation may leave tiny negative distances
+    for (size_t i = 0u; i < n; ++i) {
+        if (dist2[i] < 0.0f)
+            dist2[i] = 0.0f;
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef KMEANS_DISTANCE_H
+#define KMEANS_DISTANCE_H
+
+#include <stddef.h>
+
+#include "kmeans.h"
+
+// centroids packed for kmeans_gemm_assign: tiles of KMEANS_GEMM_TILE_CLUSTERS
+// centroids, stored feature by feature (the values of a feature for all
+// centroids of a tile are contiguous), and their squared norms, padding
+// centroids of the last tile have infinite norm so that they never win
+struct kmeans_gemm_centroids
+{
+    float *packed;
+    float *norms;
+    size_t n_centroids;
+    size_t dim;
+    size_t n_tiles;
+};
+
+// buffers are drawn from the scratch arena and live until the caller's
+// scratch scope is closed
+void kmeans_gemm_init(struct kmeans_gemm_centroids *gc, size_t n_centroids,
+                      size_t dim);
+
+// to be called whenever the centroids (n_centroids x dim, row-major) change
+void kmeans_gemm_pack(struct kmeans_gemm_centroids *gc,
+                      float const *centroids);
+
+// floats of working memory kmeans_gemm_assign needs per thread
+size_t kmeans_gemm_workspace(void);
+
+// closest centroid and squared distance to it for n (at most
+// KMEANS_GEMM_TILE_POINTS) row-major points, ld floats apart, computed as
+// ||x||^2 - 2 x.c + ||c||^2 tile by tile
+void kmeans_gemm_assign(float const *points, size_t n, size_t ld,
+                        struct kmeans_gemm_centroids const *gc,
+                        size_t *closest, float *dist2, float *work);
+
+#endif
@@ -0,0 +1,329 @@
+#include <assert.h>
+#include <float.h>
+#include <omp.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kmeans_config.h"
+#include "kmeans.h"
+#include "kmeans_control.h"
+#include "kmeans_distance.h"
+#include "kmeans_reduce.h"
+#include "kmeans_scratch.h"
+#include "kmeans_seed.h"
+#include "kmeans_util.h"
+
+/* Helper Functions ***********************************************************/
+
+// the i-th point, gathered into buf (n_cols floats) unless stored row-major
+static inline float const *point_at(struct kmeans_matrix const *m, size_t i,
+                                    float *buf)
+{
+    if (m->layout == KMEANS_ROW_MAJOR)
+        return &m->data[i * m->ld];
+
+    for (size_t c = 0u; c < m->n_cols; ++c)
+        buf[c] = m->data[c * m->ld + i];
+
+    return buf;
+}
+
+// n points starting at the begin-th one, *ld floats apart, gathered into buf
+// (n x n_cols floats) unless stored row-major
+static inline float const *block_at(struct kmeans_matrix const *m,
+                                    size_t begin, size_t n, float *buf,
+                                    size_t *ld)
+{
+    if (m->layout == KMEANS_ROW_MAJOR) {
+        *ld = m->ld;
+        return &m->data[begin * m->ld];
+    }
+
+    for (size_t c = 0u; c < m->n_cols; ++c) {
+        float const *src = &m->data[c * m->ld + begin];
+
+        for (size_t i = 0u; i < n; ++i)
+            buf[i * m->n_cols + c] = src[i];
+    }
+
+    *ld = m->n_cols;
+    return buf;
+}
+
+// compute squared euclidean distance between two feature vectors
+static inline double features_dist2(float const *a, float const *b,
+                                    size_t dim)
+{
+    double dist = 0.0;
+
+    for (size_t c = 0u; c < dim; ++c) {
+        double diff = (double) a[c] - b[c];
+        dist += diff * diff;
+    }
+
+    return dist;
+}
+
+/* Initializers ***************************************************************/
+
+static void seed_features_random(struct kmeans_matrix const *points,
+                                 float *centroids, size_t n_centroids,
+                                 uint64_t *state, float *buf)
+{
+    size_t dim = points->n_cols;
+
+    for (size_t j = 0u; j < n_centroids; ++j) {
+        size_t i = rng_next(state) % points->n_rows;
+
+        memcpy(&centroids[j * dim], point_at(points, i, buf),
+               dim * sizeof(float));
+    }
+}
+
+// k-means++: choose each further centroid with probability proportional to
+// its squared distance from the closest centroid chosen so far
+static void seed_features_plusplus(struct kmeans_matrix const *points,
+                                   float *centroids, size_t n_centroids,
+                                   uint64_t *state, float *gather,
+                                   int parallel)
+{
+    size_t n_points = points->n_rows;
+    size_t dim = points->n_cols;
+
+    size_t n_blocks =
+        (n_points + KMEANS_SEED_BLOCKSIZE - 1u) / KMEANS_SEED_BLOCKSIZE;
+
+    struct kmeans_scratch_scope scope;
+    kmeans_scratch_begin(&scope);
+
+    double *dists = kmeans_scratch_alloc(n_points * sizeof(double));
+    double *block_sums = kmeans_scratch_alloc(n_blocks * sizeof(double));
+
+    seed_features_random(points, centroids, 1u, state, gather);
+
+    for (size_t j = 0u; j < n_centroids; ++j) {
+        float const *centroid = &centroids[j * dim];
+
+        #pragma omp parallel if (parallel)
+        {
+            float *buf = &gather[omp_get_thread_num() * dim];
+
+            #pragma omp for schedule(static)
+            for (size_t i = 0u; i < n_points; ++i) {
+                double dist =
+                    features_dist2(point_at(points, i, buf), centroid, dim);
+
+                if (j == 0u || dist < dists[i])
+                    dists[i] = dist;
+            }
+        }
+
+        if (j + 1u == n_centroids)
+            break;
+
+        double total =
+            kmeans_weight_sum(dists, n_points, block_sums, parallel);
+
+        // all points coincide with some centroid, fall back to random choice
+        if (total <= 0.0) {
+            seed_features_random(points, &centroids[(j + 1u) * dim],
+                                 n_centroids - j - 1u, state, gather);
+            break;
+        }
+
+        size_t chosen =
+            kmeans_weighted_draw(dists, n_points, block_sums, total, state);
+
+        memcpy(&centroids[(j + 1u) * dim], point_at(points, chosen, gather),
+               dim * sizeof(float));
+    }
+
+    kmeans_scratch_end(&scope);
+}
+
+// k-means|| is not available for features, it is replaced by k-means++
+static void seed_features(struct kmeans_matrix const *points,
+                          float *centroids, size_t n_centroids, int parallel)
+{
+    int n_threads = parallel ? omp_get_max_threads() : 1;
+    uint64_t state = kmeans_get_seed();
+
+    struct kmeans_scratch_scope scope;
+    kmeans_scratch_begin(&scope);
+
+    float *gather = kmeans_scratch_alloc(n_threads * points->n_cols *
+                                         sizeof(float));
+
+    switch (kmeans_get_init()) {
+    case KMEANS_INIT_PLUSPLUS:
+    case KMEANS_INIT_PARALLEL:
+        seed_features_plusplus(points, centroids, n_centroids, &state, gather,
+                               parallel);
+        break;
+    case KMEANS_INIT_PROVIDED:
+        break;
+    default:
+        seed_features_random(points, centroids, n_centroids, &state, gather);
+        break;
+    }
+
+    kmeans_scratch_end(&scope);
+}
+
+/* Empty Cluster Repair *******************************************************/
+
+// move the point furthest from the centroid of the then largest cluster into
+// every empty cluster in turn (one pass over the points each), returns the
+// number of repaired clusters
+static size_t repair_empty_features(struct kmeans_matrix const *points,
+                                    float *centroids, size_t n_centroids,
+                                    size_t *labels, double *sums,
+                                    size_t *counts, float *gather,
+                                    int parallel)
+{
+    size_t n_points = points->n_rows;
+    size_t dim = points->n_cols;
+    size_t n_repaired = 0u;
+
+    for (size_t e = 0u; e < n_centroids; ++e) {
+        if (counts[e])
+            continue;
+
+        // determine largest cluster
+        size_t largest_cluster = 0u;
+        for (size_t j = 1u; j < n_centroids; ++j) {
+            if (counts[j] > counts[largest_cluster])
+                largest_cluster = j;
+        }
+
+        if (counts[largest_cluster] < 2u)
+            break;
+
+        // determine point in this cluster furthest from its centroid
+        float const *centroid = &centroids[largest_cluster * dim];
+        struct kmeans_maxloc furthest = { -1.0, SIZE_MAX };
+
+        #pragma omp parallel if (parallel)
+        {
+            float *buf = &gather[omp_get_thread_num() * dim];
+            struct kmeans_maxloc thread_furthest = { -1.0, SIZE_MAX };
+
+            #pragma omp for schedule(static) nowait
+            for (size_t i = 0u; i < n_points; ++i) {
+                if (labels[i] != largest_cluster)
+                    continue;
+
+                double dist =
+                    features_dist2(point_at(points, i, buf), centroid, dim);
+
+                if (dist > thread_furthest.dist) {
+                    thread_furthest.dist = dist;
+                    thread_furthest.index = i;
+                }
+            }
+
+            #pragma omp critical
+            {
+                if (thread_furthest.dist > furthest.dist ||
+                    (thread_furthest.dist == furthest.dist &&
+                     thread_furthest.index < furthest.index))
+                    furthest = thread_furthest;
+            }
+        }
+
+        // move that point to the empty cluster
+        float const *point = point_at(points, furthest.index, gather);
+
+        memcpy(&centroids[e * dim], point, dim * sizeof(float));
+        labels[furthest.index] = e;
+
+        // correct cluster sums and sizes
+        for (size_t c = 0u; c < dim; ++c) {
+            sums[e * dim + c] = point[c];
+            sums[largest_cluster * dim + c] -= point[c];
+        }
+
+        counts[e] = 1u;
+        counts[largest_cluster]--;
+
+        ++n_repaired;
+    }
+
+    return n_repaired;
+}
+
+/* Dimension Specializations **************************************************/
+
+#define BLOCKSIZE ((size_t) KMEANS_GEMM_TILE_POINTS)
+
+#define FEATURES_DIM 3
+#define KMEANS_FEATURES_IMPL kmeans_features_3
+#include "kmeans_features_impl.h"
+#undef FEATURES_DIM
+#undef KMEANS_FEATURES_IMPL
+
+#define FEATURES_DIM 4
+#define KMEANS_FEATURES_IMPL kmeans_features_4
+#include "kmeans_features_impl.h"
+#undef FEATURES_DIM
+#undef KMEANS_FEATURES_IMPL
+
+#define FEATURES_DIM 8
+#define KMEANS_FEATURES_IMPL kmeans_features_8
+#include "kmeans_features_impl.h"
+#undef FEATURES_DIM
+#undef KMEANS_FEATURES_IMPL
+
+#define FEATURES_DIM 16
+#define KMEANS_FEATURES_IMPL kmeans_features_16
+#include "kmeans_features_impl.h"
+#undef FEATURES_DIM
+#undef KMEANS_FEATURES_IMPL
+
+#define FEATURES_DIM 0
+#define KMEANS_FEATURES_IMPL kmeans_features_n
+#include "kmeans_features_impl.h"
+#undef FEATURES_DIM
+#undef KMEANS_FEATURES_IMPL
+
+/* Main Functions *************************************************************/
+
+static void kmeans_features_impl(struct kmeans_matrix points,
+                                 float *centroids, size_t n_centroids,
+                                 size_t *labels, int parallel)
+{
+    assert(points.n_rows > 0u && points.n_cols > 0u);
+
+    switch (points.n_cols) {
+    case 3:
+        kmeans_features_3(&points, centroids, n_centroids, labels, parallel);
+        break;
+    case 4:
+        kmeans_features_4(&points, centroids, n_centroids, labels, parallel);
+        break;
+    case 8:
+        kmeans_features_8(&points, centroids, n_centroids, labels, parallel);
+        break;
+    case 16:
+        kmeans_features_16(&points, centroids, n_centroids, labels, parallel);
+        break;
+    default:
+        kmeans_features_n(&points, centroids, n_centroids, labels, parallel);
+        break;
+    }
+}
+
+void kmeans_features(struct kmeans_matrix points,
+                     float *centroids, size_t n_centroids,
+                     size_t *labels)
+{
+    kmeans_features_impl(points, centroids, n_centroids, labels, 0);
+}
+
+void kmeans_omp_features(struct kmeans_matrix points,
+                         float *centroids, size_t n_centroids,
+                         size_t *labels)
+{
+    kmeans_features_impl(points, centroids, n_centroids, labels, 1);
+}
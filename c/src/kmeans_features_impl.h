@@ -0,0 +1,216 @@
+// Lloyd's algorithm on features, included once per specialization by
+// kmeans_features.c with FEATURES_DIM (number of features, 0 for a runtime
+// dimension) and KMEANS_FEATURES_IMPL (function name) defined
+
+#if FEATURES_DIM
+#define FDIM ((size_t) FEATURES_DIM)
+#else
+#define FDIM dim
+#endif
+
+#define KMEANS_FEATURES_CONCAT(a, b) a##b
+#define KMEANS_FEATURES_NAME(a, b) KMEANS_FEATURES_CONCAT(a, b)
+#define KMEANS_FEATURES_CLOSEST \
+    KMEANS_FEATURES_NAME(KMEANS_FEATURES_IMPL, _closest)
+
+// find index of centroid with least (squared, returned in dist2) distance to
+// some point
+static inline size_t KMEANS_FEATURES_CLOSEST(float const *point,
+                                             float const *centroids,
+                                             size_t n_centroids, size_t dim,
+                                             float *dist2)
+{
+    size_t closest_centroid = 0u;
+    float min_dist = FLT_MAX;
+
+    (void) dim;
+
+    for (size_t j = 0u; j < n_centroids; ++j) {
+        float const *centroid = &centroids[j * FDIM];
+
+        float dist = 0.0f;
+        for (size_t c = 0u; c < FDIM; ++c) {
+            float diff = point[c] - centroid[c];
+            dist += diff * diff;
+        }
+
+        if (dist < min_dist) {
+            closest_centroid = j;
+            min_dist = dist;
+        }
+    }
+
+    *dist2 = min_dist;
+
+    return closest_centroid;
+}
+
+static void KMEANS_FEATURES_IMPL(struct kmeans_matrix const *points,
+                                 float *centroids, size_t n_centroids,
+                                 size_t *labels, int parallel)
+{
+    size_t n_points = points->n_rows;
+    size_t dim = points->n_cols;
+
+    int n_threads = parallel ? omp_get_max_threads() : 1;
+
+    struct kmeans_scratch_scope scope;
+    kmeans_scratch_begin(&scope);
+
+    // allocate auxiliary memory
+    double *sums = kmeans_scratch_alloc(FDIM * n_centroids * sizeof(double));
+    size_t *counts = kmeans_scratch_alloc(n_centroids * sizeof(size_t));
+
+    // per-thread buffers column-major blocks of points are gathered into
+    float *gather =
+        kmeans_scratch_alloc(n_threads * BLOCKSIZE * FDIM * sizeof(float));
+
+    // per-thread closest centroids / distances of a block, and the working
+    // memory and packed centroids of the GEMM kernel
+    size_t *block_closest =
+        kmeans_scratch_alloc(n_threads * BLOCKSIZE * sizeof(size_t));
+    float *block_dist2 =
+        kmeans_scratch_alloc(n_threads * BLOCKSIZE * sizeof(float));
+
+    int gemm = kmeans_select_distance(n_points, n_centroids, FDIM) ==
+               KMEANS_DISTANCE_GEMM;
+
+    struct kmeans_gemm_centroids packed;
+    float *gemm_work = NULL;
+    if (gemm) {
+        kmeans_gemm_init(&packed, n_centroids, FDIM);
+        gemm_work = kmeans_scratch_alloc(n_threads * kmeans_gemm_workspace() *
+                                         sizeof(float));
+    }
+
+    size_t n_blocks = (n_points + BLOCKSIZE - 1u) / BLOCKSIZE;
+
+    struct kmeans_accumulators acc;
+    kmeans_accumulators_init_dim(&acc, n_centroids, FDIM, n_threads);
+
+    struct kmeans_control ctl;
+    kmeans_control_begin(
+        &ctl, parallel ? "kmeans_omp_features" : "kmeans_features", n_points);
+
+    // initialize centroids
+    kmeans_control_phase(&ctl, KMEANS_PHASE_SEED);
+    seed_features(points, centroids, n_centroids, parallel);
+
+    // repeat until converged or for at most max_iter iterations
+    for (int iter = 0; iter < kmeans_control_max_iter(&ctl); ++iter) {
+        size_t n_changed = 0u;
+        double inertia = 0.0;
+
+        kmeans_control_iteration_begin(&ctl);
+
+        // reassign points to closest centroids, accumulating into padded
+        // per-thread sums / counts
+        kmeans_control_phase(&ctl, KMEANS_PHASE_ASSIGN);
+        if (gemm)
+            kmeans_gemm_pack(&packed, centroids);
+
+        #pragma omp parallel if (parallel) reduction(+ : n_changed, inertia)
+        {
+            kmeans_accumulators_reset(&acc);
+
+            int tid = omp_get_thread_num();
+            double *thread_sums = kmeans_accumulators_sums(&acc, tid);
+            size_t *thread_counts = kmeans_accumulators_counts(&acc, tid);
+            float *buf = &gather[tid * BLOCKSIZE * FDIM];
+            size_t *closest = &block_closest[tid * BLOCKSIZE];
+            float *dist2 = &block_dist2[tid * BLOCKSIZE];
+
+            #pragma omp for schedule(static)
+            for (size_t b = 0u; b < n_blocks; ++b) {
+                size_t begin = b * BLOCKSIZE;
+                size_t n = n_points - begin < BLOCKSIZE ? n_points - begin
+                                                        : BLOCKSIZE;
+
+                size_t ld;
+                float const *block = block_at(points, begin, n, buf, &ld);
+
+                // find centroids closest to the points of the block
+                if (gemm) {
+                    kmeans_gemm_assign(
+                        block, n, ld, &packed, closest, dist2,
+                        &gemm_work[tid * kmeans_gemm_workspace()]);
+                } else {
+                    for (size_t i = 0u; i < n; ++i)
+                        closest[i] = KMEANS_FEATURES_CLOSEST(
+                            &block[i * ld], centroids, n_centroids, dim,
+                            &dist2[i]);
+                }
+
+                for (size_t i = 0u; i < n; ++i) {
+                    float const *point = &block[i * ld];
+                    size_t closest_centroid = closest[i];
+
+                    inertia += dist2[i];
+
+                    // if point has changed cluster...
+                    if (closest_centroid != labels[begin + i]) {
+                        labels[begin + i] = closest_centroid;
+
+                        ++n_changed;
+                    }
+
+                    // update cluster sum
+                    double *sum = &thread_sums[FDIM * closest_centroid];
+                    for (size_t c = 0u; c < FDIM; ++c)
+                        sum[c] += point[c];
+
+                    // update cluster size
+                    thread_counts[closest_centroid]++;
+                }
+            }
+        }
+
+        kmeans_accumulators_merge(&acc, sums, counts);
+
+        // repair empty clusters
+        kmeans_control_phase(&ctl, KMEANS_PHASE_REPAIR);
+        int repaired = repair_empty_features(points, centroids, n_centroids,
+                                             labels, sums, counts, gather,
+                                             parallel) > 0;
+
+        // average accumulated cluster sums
+        kmeans_control_phase(&ctl, KMEANS_PHASE_AVERAGE);
+        double max_shift2 = 0.0;
+
+        for (size_t j = 0u; j < n_centroids; ++j) {
+            float *centroid = &centroids[j * FDIM];
+            double const *sum = &sums[j * FDIM];
+            size_t count = counts[j];
+
+            // fewer distinct points than clusters
+            if (!count)
+                continue;
+
+            double shift2 = 0.0;
+            for (size_t c = 0u; c < FDIM; ++c) {
+                double value = sum[c] / count;
+                double diff = value - centroid[c];
+
+                shift2 += diff * diff;
+                centroid[c] = (float) value;
+            }
+
+            if (shift2 > max_shift2)
+                max_shift2 = shift2;
+        }
+
+        // break if the solution has converged
+        if (kmeans_control_iteration_end(&ctl, n_changed, inertia,
+                                         max_shift2, repaired))
+            break;
+    }
+
+    kmeans_control_end(&ctl);
+
+    kmeans_scratch_end(&scope);
+}
+
+#undef KMEANS_FEATURES_CLOSEST
+#undef KMEANS_FEATURES_NAME
+#undef KMEANS_FEATURES_CONCAT
+#undef FDIM
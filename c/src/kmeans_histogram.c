@@ -0,0 +1,425 @@
+#include <assert.h>
+#include <omp.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "kmeans_config.h"
+#include "kmeans.h"
+#include "kmeans_control.h"
+#include "kmeans_reduce.h"
+#include "kmeans_scratch.h"
+#include "kmeans_util.h"
+
+#define EMPTY_KEY UINT32_MAX
+
+// distinct (quantised) colours of an image, each represented by the mean of
+// the pixels falling into it and weighted by their number
+struct histogram
+{
+    struct pixel *colours;
+    size_t *weights;
+    size_t n_colours;
+};
+
+// open addressing hash table slot mapping a colour key to a bin index local
+// to its shard
+struct bin_slot
+{
+    uint32_t key;
+    uint32_t bin;
+};
+
+/* Helper Functions ***********************************************************/
+
+// pack the quant_bits most significant bits of each channel
+static inline uint32_t colour_key(unsigned char const *p, int shift)
+{
+    return ((uint32_t) (p[2] >> shift) << 16) |
+           ((uint32_t) (p[1] >> shift) << 8) |
+           (uint32_t) (p[0] >> shift);
+}
+
+static inline size_t key_shard(uint64_t hash)
+{
+    return (size_t) (hash >> 32) % KMEANS_HISTOGRAM_SHARDS;
+}
+
+/* Histogram ******************************************************************/
+
+// build the histogram of all pixels, bins[i] receives the bin of pixel i,
+// pixels are hashed into shards (in fixed-size blocks, so that the bin order
+// does not depend on the number of threads) which are then binned
+// independently of each other, all memory is drawn from the caller's scope
+static void build_histogram(struct pixel_bgr const *pixels, int quant_bits,
+                            size_t *bins, struct histogram *hist, int parallel)
+{
+    size_t n_pixels = pixels->rows * pixels->cols;
+    size_t n_shards = KMEANS_HISTOGRAM_SHARDS;
+    size_t n_blocks = (n_pixels + KMEANS_HISTOGRAM_BLOCKSIZE - 1u) /
+                      KMEANS_HISTOGRAM_BLOCKSIZE;
+
+    int shift = 8 - quant_bits;
+
+    size_t *block_offsets =
+        kmeans_scratch_calloc(n_blocks * n_shards * sizeof(size_t));
+    size_t *order = kmeans_scratch_alloc(n_pixels * sizeof(size_t));
+    size_t *shard_begin = kmeans_scratch_alloc((n_shards + 1u) * sizeof(size_t));
+    size_t *table_begin = kmeans_scratch_alloc((n_shards + 1u) * sizeof(size_t));
+    size_t *bin_begin = kmeans_scratch_alloc((n_shards + 1u) * sizeof(size_t));
+
+    // count pixels per block and shard
+    #pragma omp parallel for if (parallel) schedule(static)
+    for (size_t b = 0u; b < n_blocks; ++b) {
+        size_t *counts = &block_offsets[b * n_shards];
+
+        size_t end = (b + 1u) * KMEANS_HISTOGRAM_BLOCKSIZE;
+        if (end > n_pixels)
+            end = n_pixels;
+
+        for (size_t i = b * KMEANS_HISTOGRAM_BLOCKSIZE; i < end; ++i) {
+            uint32_t key = colour_key(bgr_at(pixels, i), shift);
+            counts[key_shard(mix64(key))]++;
+        }
+    }
+
+    // turn counts into offsets, shard by shard and block by block within
+    size_t offset = 0u;
+    for (size_t s = 0u; s < n_shards; ++s) {
+        shard_begin[s] = offset;
+
+        for (size_t b = 0u; b < n_blocks; ++b) {
+            size_t count = block_offsets[b * n_shards + s];
+            block_offsets[b * n_shards + s] = offset;
+            offset += count;
+        }
+    }
+    shard_begin[n_shards] = n_pixels;
+
+    // group pixel indices by shard
+    #pragma omp parallel for if (parallel) schedule(static)
+    for (size_t b = 0u; b < n_blocks; ++b) {
+        size_t *next = &block_offsets[b * n_shards];
+
+        size_t end = (b + 1u) * KMEANS_HISTOGRAM_BLOCKSIZE;
+        if (end > n_pixels)
+            end = n_pixels;
+
+        for (size_t i = b * KMEANS_HISTOGRAM_BLOCKSIZE; i < end; ++i) {
+            uint32_t key = colour_key(bgr_at(pixels, i), shift);
+            order[next[key_shard(mix64(key))]++] = i;
+        }
+    }
+
+    // size tables to a load factor of at most one half, a shard never holds
+    // more keys than there are quantised colours
+    size_t max_keys = (size_t) 1u << (3 * quant_bits);
+
+    size_t n_slots = 0u;
+    for (size_t s = 0u; s < n_shards; ++s) {
+        size_t n = shard_begin[s + 1u] - shard_begin[s];
+        if (n > max_keys)
+            n = max_keys;
+
+        size_t capacity = 1u;
+        while (capacity < 2u * n)
+            capacity <<= 1;
+
+        table_begin[s] = n_slots;
+        n_slots += capacity;
+    }
+    table_begin[n_shards] = n_slots;
+
+    struct bin_slot *slots =
+        kmeans_scratch_alloc(n_slots * sizeof(struct bin_slot));
+
+    // assign bins local to each shard in pixel order
+    #pragma omp parallel for if (parallel) schedule(dynamic)
+    for (size_t s = 0u; s < n_shards; ++s) {
+        struct bin_slot *table = &slots[table_begin[s]];
+        size_t mask = table_begin[s + 1u] - table_begin[s] - 1u;
+
+        for (size_t j = 0u; j <= mask; ++j)
+            table[j].key = EMPTY_KEY;
+
+        uint32_t n_bins = 0u;
+
+        for (size_t o = shard_begin[s]; o < shard_begin[s + 1u]; ++o) {
+            size_t i = order[o];
+            uint32_t key = colour_key(bgr_at(pixels, i), shift);
+
+            size_t slot = mix64(key) & mask;
+            while (table[slot].key != key && table[slot].key != EMPTY_KEY)
+                slot = (slot + 1u) & mask;
+
+            if (table[slot].key == EMPTY_KEY) {
+                table[slot].key = key;
+                table[slot].bin = n_bins++;
+            }
+
+            bins[i] = table[slot].bin;
+        }
+
+        bin_begin[s + 1u] = n_bins;
+    }
+
+    bin_begin[0] = 0u;
+    for (size_t s = 0u; s < n_shards; ++s)
+        bin_begin[s + 1u] += bin_begin[s];
+
+    size_t n_colours = bin_begin[n_shards];
+
+    struct pixel *colours =
+        kmeans_scratch_alloc(n_colours * sizeof(struct pixel));
+    size_t *weights = kmeans_scratch_calloc(n_colours * sizeof(size_t));
+    double *sums = kmeans_scratch_calloc(3 * n_colours * sizeof(double));
+
+    // make bins global and accumulate them, shards own disjoint bins
+    #pragma omp parallel for if (parallel) schedule(dynamic)
+    for (size_t s = 0u; s < n_shards; ++s) {
+        for (size_t o = shard_begin[s]; o < shard_begin[s + 1u]; ++o) {
+            size_t i = order[o];
+            size_t bin = bin_begin[s] + bins[i];
+
+            struct pixel pixel = bgr_get(pixels, i);
+
+            double *sum = &sums[3 * bin];
+            sum[0] += pixel.r;
+            sum[1] += pixel.g;
+            sum[2] += pixel.b;
+
+            weights[bin]++;
+
+            bins[i] = bin;
+        }
+    }
+
+    #pragma omp parallel for if (parallel) schedule(static)
+    for (size_t bin = 0u; bin < n_colours; ++bin) {
+        double const *sum = &sums[3 * bin];
+        size_t weight = weights[bin];
+
+        struct pixel colour = {
+            sum[0] / weight, sum[1] / weight, sum[2] / weight
+        };
+
+        colours[bin] = colour;
+    }
+
+    hist->colours = colours;
+    hist->weights = weights;
+    hist->n_colours = n_colours;
+}
+
+/* Weighted K-means ***********************************************************/
+
+void kmeans_weighted_lloyd(struct kmeans_control *ctl,
+                           struct pixel *points, size_t const *weights,
+                           size_t n_points,
+                           struct pixel *centroids, size_t n_centroids,
+                           size_t *labels, int parallel)
+{
+    struct kmeans_scratch_scope scope;
+    kmeans_scratch_begin(&scope);
+
+    // allocate auxiliary memory
+    double *sums = kmeans_scratch_alloc(3 * n_centroids * sizeof(double));
+    size_t *counts = kmeans_scratch_alloc(n_centroids * sizeof(size_t));
+
+    struct kmeans_accumulators acc;
+    kmeans_accumulators_init(&acc, n_centroids,
+                             parallel ? omp_get_max_threads() : 1);
+
+    // initialize centroids
+    kmeans_control_phase(ctl, KMEANS_PHASE_SEED);
+    kmeans_seed_weighted(points, weights, n_points, centroids, n_centroids,
+                         parallel);
+
+    // repeat until converged or for at most max_iter iterations
+    for (int iter = 0; iter < kmeans_control_max_iter(ctl); ++iter) {
+        size_t n_changed = 0u;
+        double inertia = 0.0;
+
+        kmeans_control_iteration_begin(ctl);
+
+        // reassign points to closest centroids, accumulating weighted sums
+        // into padded per-thread sums / counts
+        kmeans_control_phase(ctl, KMEANS_PHASE_ASSIGN);
+        #pragma omp parallel if (parallel) reduction(+ : n_changed, inertia)
+        {
+            kmeans_accumulators_reset(&acc);
+
+            int tid = omp_get_thread_num();
+            double *thread_sums = kmeans_accumulators_sums(&acc, tid);
+            size_t *thread_counts = kmeans_accumulators_counts(&acc, tid);
+
+            #pragma omp for schedule(static)
+            for (size_t i = 0u; i < n_points; ++i) {
+                struct pixel point = points[i];
+                size_t weight = weights[i];
+
+                // find centroid closest to point
+                double min_dist2;
+                size_t closest_centroid = find_closest_centroid(
+                    point, centroids, n_centroids, &min_dist2);
+
+                inertia += weight * min_dist2;
+
+                // if point has changed cluster...
+                if (closest_centroid != labels[i]) {
+                    labels[i] = closest_centroid;
+
+                    n_changed += weight;
+                }
+
+                // update cluster sum
+                double *sum = &thread_sums[3 * closest_centroid];
+                sum[0] += weight * point.r;
+                sum[1] += weight * point.g;
+                sum[2] += weight * point.b;
+
+                // update cluster size
+                thread_counts[closest_centroid] += weight;
+            }
+        }
+
+        kmeans_accumulators_merge(&acc, sums, counts);
+
+        // repair all empty clusters at once
+        kmeans_control_phase(ctl, KMEANS_PHASE_REPAIR);
+        int repaired = kmeans_repair_empty_clusters_weighted(
+            points, weights, n_points, centroids, n_centroids,
+            labels, sums, counts) > 0;
+
+        // average accumulated cluster sums, clusters that could not be
+        // repaired (too few distinct points) keep their centroid
+        kmeans_control_phase(ctl, KMEANS_PHASE_AVERAGE);
+        double max_shift2 = 0.0;
+
+        for (size_t j = 0u; j < n_centroids; ++j) {
+            double const *sum = &sums[3 * j];
+            size_t count = counts[j];
+
+            if (!count)
+                continue;
+
+            struct pixel new_centroid = {
+                sum[0] / count, sum[1] / count, sum[2] / count
+            };
+
+            double shift2 = pixel_dist2(new_centroid, centroids[j]);
+            if (shift2 > max_shift2)
+                max_shift2 = shift2;
+
+            centroids[j] = new_centroid;
+        }
+
+        // break if the solution has converged
+        if (kmeans_control_iteration_end(ctl, n_changed, inertia,
+                                         max_shift2, repaired))
+            break;
+    }
+
+    kmeans_scratch_end(&scope);
+}
+
+/* Main Functions *************************************************************/
+
+static void kmeans_weighted_impl(struct pixel *points, size_t const *weights,
+                                 size_t n_points,
+                                 struct pixel *centroids, size_t n_centroids,
+                                 size_t *labels, int parallel)
+{
+    // options refer to pixels, i.e. total weight
+    size_t n_pixels = 0u;
+
+    #pragma omp parallel for if (parallel) schedule(static) \
+        reduction(+ : n_pixels)
+    for (size_t i = 0u; i < n_points; ++i)
+        n_pixels += weights[i];
+
+    struct kmeans_control ctl;
+    kmeans_control_begin(
+        &ctl, parallel ? "kmeans_omp_weighted" : "kmeans_weighted", n_pixels);
+
+    kmeans_weighted_lloyd(&ctl, points, weights, n_points, centroids,
+                          n_centroids, labels, parallel);
+
+    kmeans_control_end(&ctl);
+}
+
+static void kmeans_histogram_impl(struct pixel_bgr pixels,
+                                  struct pixel *centroids, size_t n_centroids,
+                                  size_t *labels, int quant_bits, int parallel)
+{
+    size_t n_pixels = pixels.rows * pixels.cols;
+
+    // keys pack 3 * quant_bits bits, shifts outside 0 to 7 are undefined
+    assert(quant_bits >= 1 && quant_bits <= 8);
+
+    struct kmeans_scratch_scope scope;
+    kmeans_scratch_begin(&scope);
+
+    struct kmeans_control ctl;
+    kmeans_control_begin(
+        &ctl, parallel ? "kmeans_omp_histogram" : "kmeans_histogram",
+        n_pixels);
+
+    // build histogram as part of initialization, pixel labels temporarily
+    // hold bin indices
+    kmeans_control_phase(&ctl, KMEANS_PHASE_SEED);
+
+    struct histogram hist;
+    build_histogram(&pixels, quant_bits, labels, &hist, parallel);
+
+    size_t *bin_labels = kmeans_scratch_alloc(hist.n_colours * sizeof(size_t));
+    for (size_t bin = 0u; bin < hist.n_colours; ++bin)
+        bin_labels[bin] = SIZE_MAX;
+
+    kmeans_weighted_lloyd(&ctl, hist.colours, hist.weights, hist.n_colours,
+                          centroids, n_centroids, bin_labels, parallel);
+
+    // map bin labels back to pixels
+    kmeans_control_phase(&ctl, KMEANS_PHASE_LABEL);
+
+    #pragma omp parallel for if (parallel) schedule(static)
+    for (size_t i = 0u; i < n_pixels; ++i)
+        labels[i] = bin_labels[labels[i]];
+
+    kmeans_control_end(&ctl);
+
+    kmeans_scratch_end(&scope);
+}
+
+void kmeans_weighted(struct pixel *points, size_t const *weights,
+                     size_t n_points,
+                     struct pixel *centroids, size_t n_centroids,
+                     size_t *labels)
+{
+    kmeans_weighted_impl(points, weights, n_points, centroids, n_centroids,
+                         labels, 0);
+}
+
+void kmeans_omp_weighted(struct pixel *points, size_t const *weights,
+                         size_t n_points,
+                         struct pixel *centroids, size_t n_centroids,
+                         size_t *labels)
+{
+    kmeans_weighted_impl(points, weights, n_points, centroids, n_centroids,
+                         labels, 1);
+}
+
+void kmeans_histogram(struct pixel_bgr pixels,
+                      struct pixel *centroids, size_t n_centroids,
+                      size_t *labels, int quant_bits)
+{
+    kmeans_histogram_impl(pixels, centroids, n_centroids, labels, quant_bits,
+                          0);
+}
+
+void kmeans_omp_histogram(struct pixel_bgr pixels,
+                          struct pixel *centroids, size_t n_centroids,
+                          size_t *labels, int quant_bits)
+{
+    kmeans_histogram_impl(pixels, centroids, n_centroids, labels, quant_bits,
+                          1);
+}
@@ -0,0 +1,153 @@
+#include <float.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "kmeans_config.h"
+#include "kmeans.h"
+#include "kmeans_kdtree.h"
+#include "kmeans_scratch.h"
+
+/* Construction ***************************************************************/
+
+// order nodes along one axis, ties are broken by centroid index so that the
+// tree does not depend on the sort implementation
+#define KDNODE_CMP(axis) \
+static int kdnode_cmp_##axis(void const *a, void const *b) \
+{ \
+    struct kmeans_kdnode const *na = a; \
+    struct kmeans_kdnode const *nb = b; \
+    \
+    if (na->c[axis] != nb->c[axis]) \
+        return na->c[axis] < nb->c[axis] ? -1 : 1; \
+    \
+    return na->index < nb->index ? -1 : na->index > nb->index; \
+}
+
+KDNODE_CMP(0)
+KDNODE_CMP(1)
+KDNODE_CMP(2)
+
+static int (*const kdnode_cmp[3])(void const *, void const *) = {
+    kdnode_cmp_0, kdnode_cmp_1, kdnode_cmp_2
+};
+
+static void build(struct kmeans_kdnode *nodes, size_t lo, size_t hi)
+{
+    if (hi - lo < 2u) {
+        if (hi > lo)
+            nodes[lo].axis = 0;
+        return;
+    }
+
+    // split along the axis of greatest extent
+    double min[3] = { DBL_MAX, DBL_MAX, DBL_MAX };
+    double max[3] = { -DBL_MAX, -DBL_MAX, -DBL_MAX };
+
+    for (size_t i = lo; i < hi; ++i) {
+        for (int a = 0; a < 3; ++a) {
+            if (nodes[i].c[a] < min[a])
+                min[a] = nodes[i].c[a];
+            if (nodes[i].c[a] > max[a])
+                max[a] = nodes[i].c[a];
+        }
+    }
+
+    int axis = 0;
+    for (int a = 1; a < 3; ++a) {
+        if (max[a] - min[a] > max[axis] - min[axis])
+            axis = a;
+    }
+
+    qsort(&nodes[lo], hi - lo, sizeof(struct kmeans_kdnode), kdnode_cmp[axis]);
+
+    size_t mid = lo + (hi - lo) / 2u;
+    nodes[mid].axis = axis;
+
+    build(nodes, lo, mid);
+    build(nodes, mid + 1u, hi);
+}
+
+void kmeans_kdtree_init(struct kmeans_kdtree *tree, size_t n_centroids)
+{
+    tree->n = n_centroids;
+    tree->nodes =
+        kmeans_scratch_alloc(n_centroids * sizeof(struct kmeans_kdnode));
+}
+
+void kmeans_kdtree_build(struct kmeans_kdtree *tree,
+                         struct pixel const *centroids)
+{
+    size_t n_centroids = tree->n;
+
+    for (size_t j = 0u; j < n_centroids; ++j) {
+        struct kmeans_kdnode *node = &tree->nodes[j];
+        node->c[0] = centroids[j].r;
+        node->c[1] = centroids[j].g;
+        node->c[2] = centroids[j].b;
+        node->index = j;
+    }
+
+    build(tree->nodes, 0u, n_centroids);
+}
+
+/* Queries ********************************************************************/
+
+static inline void consider(struct kmeans_kdnode const *node, double const *p,
+                            size_t *best, double *best_dist2)
+{
+    double d0 = p[0] - node->c[0];
+    double d1 = p[1] - node->c[1];
+    double d2 = p[2] - node->c[2];
+
+    double dist2 = d0 * d0 + d1 * d1 + d2 * d2;
+
+    if (dist2 < *best_dist2 || (dist2 == *best_dist2 && node->index < *best)) {
+        *best = node->index;
+        *best_dist2 = dist2;
+    }
+}
+
+static void search(struct kmeans_kdnode const *nodes, size_t lo, size_t hi,
+                   double const *p, size_t *best, double *best_dist2)
+{
+    while (hi - lo > KMEANS_KDTREE_LEAFSIZE) {
+        size_t mid = lo + (hi - lo) / 2u;
+        struct kmeans_kdnode const *node = &nodes[mid];
+
+        consider(node, p, best, best_dist2);
+
+        double diff = p[node->axis] - node->c[node->axis];
+
+        // descend into the half containing p first
+        if (diff < 0.0) {
+            search(nodes, lo, mid, p, best, best_dist2);
+            lo = mid + 1u;
+        } else {
+            search(nodes, mid + 1u, hi, p, best, best_dist2);
+            hi = mid;
+        }
+
+        // the other half can only contain closer centroids (or equally close
+        // ones with a lower index) if the splitting plane is close enough
+        if (diff * diff > *best_dist2)
+            return;
+    }
+
+    for (size_t i = lo; i < hi; ++i)
+        consider(&nodes[i], p, best, best_dist2);
+}
+
+size_t kmeans_kdtree_nearest(struct kmeans_kdtree const *tree,
+                             struct pixel p, double *dist2)
+{
+    double coords[3] = { p.r, p.g, p.b };
+
+    size_t best = SIZE_MAX;
+    double best_dist2 = DBL_MAX;
+
+    search(tree->nodes, 0u, tree->n, coords, &best, &best_dist2);
+
+    *dist2 = best_dist2;
+
+    return best;
+}
@@ -0,0 +1,37 @@
+#ifndef KMEANS_KDTREE_H
+#define KMEANS_KDTREE_H
+
+#include <stddef.h>
+
+#include "kmeans.h"
+
+// balanced k-d tree over a set of centroids, stored implicitly: the node
+// covering nodes[lo, hi) is nodes[(lo + hi) / 2] and splits its range along
+// axis
+struct kmeans_kdnode
+{
+    double c[3];
+    size_t index;
+    int axis;
+};
+
+struct kmeans_kdtree
+{
+    struct kmeans_kdnode *nodes;
+    size_t n;
+};
+
+// nodes are drawn from the scratch arena, must only be called from serial code
+void kmeans_kdtree_init(struct kmeans_kdtree *tree, size_t n_centroids);
+
+// (re)build the tree over n_centroids (as passed to kmeans_kdtree_init)
+// centroids
+void kmeans_kdtree_build(struct kmeans_kdtree *tree,
+                         struct pixel const *centroids);
+
+// index of the centroid closest to p (the lowest index on ties, just like a
+// linear scan), its squared distance is returned in dist2
+size_t kmeans_kdtree_nearest(struct kmeans_kdtree const *tree,
+                             struct pixel p, double *dist2);
+
+#endif
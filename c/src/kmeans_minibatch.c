@@ -0,0 +1,274 @@
+#include <omp.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "kmeans_config.h"
+#include "kmeans.h"
+#include "kmeans_control.h"
+#include "kmeans_scratch.h"
+#include "kmeans_util.h"
+
+// draw a batch of pixels uniformly at random (with replacement), indices
+// receives their positions in the image
+static void draw_batch(struct pixel_bgr const *pixels, size_t n_pixels,
+                       struct pixel *batch, size_t *indices,
+                       size_t batch_size, uint64_t *state)
+{
+    for (size_t i = 0u; i < batch_size; ++i) {
+        indices[i] = rng_next(state) % n_pixels;
+        batch[i] = bgr_get(pixels, indices[i]);
+    }
+}
+
+static void kmeans_minibatch_impl(struct pixel_bgr pixels,
+                                  struct pixel *centroids, size_t n_centroids,
+                                  size_t *labels, size_t batch_size,
+                                  int parallel)
+{
+    size_t n_pixels = pixels.rows * pixels.cols;
+
+    uint64_t state = kmeans_get_seed();
+
+    if (batch_size > n_pixels)
+        batch_size = n_pixels;
+
+    if (batch_size < n_centroids)
+        batch_size = n_centroids;
+
+    struct kmeans_scratch_scope scope;
+    kmeans_scratch_begin(&scope);
+
+    // allocate auxiliary memory, none of it scales with n_pixels
+    struct pixel *batch =
+        kmeans_scratch_alloc(batch_size * sizeof(struct pixel));
+    size_t *batch_labels = kmeans_scratch_alloc(batch_size * sizeof(size_t));
+    size_t *batch_indices = kmeans_scratch_alloc(batch_size * sizeof(size_t));
+
+    double *sums = kmeans_scratch_alloc(3 * n_centroids * sizeof(double));
+    size_t *counts = kmeans_scratch_alloc(n_centroids * sizeof(size_t));
+    size_t *totals = kmeans_scratch_alloc(n_centroids * sizeof(size_t));
+
+    // a batch covers only a sample of the pixels, so the fraction of changed
+    // labels is no convergence criterion and the centroid shift has to be one
+    struct kmeans_control ctl;
+    kmeans_control_begin(
+        &ctl, parallel ? "kmeans_omp_minibatch" : "kmeans_minibatch",
+        n_pixels);
+
+    if (ctl.options.shift_tol <= 0.0)
+        ctl.options.shift_tol = KMEANS_MINIBATCH_TOL;
+
+    // initialize centroids from a first sample
+    kmeans_control_phase(&ctl, KMEANS_PHASE_SEED);
+    draw_batch(&pixels, n_pixels, batch, batch_indices, batch_size, &state);
+
+    kmeans_seed(batch, batch_size, centroids, n_centroids, parallel);
+
+    for (size_t i = 0u; i < n_centroids; ++i) {
+        double *sum = &sums[3 * i];
+        sum[0] = sum[1] = sum[2] = 0.0;
+
+        counts[i] = 0u;
+        totals[i] = 0u;
+    }
+
+    // labels holds the label each pixel was last assigned in a batch until the
+    // final labelling pass, SIZE_MAX for pixels not drawn yet
+    #pragma omp parallel for if (parallel) schedule(static)
+    for (size_t i = 0u; i < n_pixels; ++i)
+        labels[i] = SIZE_MAX;
+
+    // repeat for at most max_iter batches or until centroids settle
+    for (int iter = 0; iter < kmeans_control_max_iter(&ctl); ++iter) {
+        double inertia = 0.0;
+        int repaired = 0;
+
+        kmeans_control_iteration_begin(&ctl);
+
+        // draw and assign a new batch
+        kmeans_control_phase(&ctl, KMEANS_PHASE_ASSIGN);
+        draw_batch(&pixels, n_pixels, batch, batch_indices, batch_size,
+                   &state);
+
+        // assign batch pixels to closest centroids
+        #pragma omp parallel for if (parallel) schedule(static) \
+            reduction(+ : sums[:(3 * n_centroids)], counts[:n_centroids]) \
+            reduction(+ : inertia)
+        for (size_t i = 0u; i < batch_size; ++i) {
+            struct pixel pixel = batch[i];
+
+            double min_dist;
+            size_t closest_centroid =
+                find_closest_centroid(pixel, centroids, n_centroids, &min_dist);
+
+            inertia += min_dist;
+
+            batch_labels[i] = closest_centroid;
+
+            // update cluster sum
+            double *sum = &sums[3 * closest_centroid];
+            sum[0] += pixel.r;
+            sum[1] += pixel.g;
+            sum[2] += pixel.b;
+
+            // update cluster size
+            counts[closest_centroid]++;
+        }
+
+        // repair clusters which have never been assigned a single pixel
+        kmeans_control_phase(&ctl, KMEANS_PHASE_REPAIR);
+        for (size_t i = 0u; i < n_centroids; ++i) {
+            if (counts[i] || totals[i])
+                continue;
+
+            // determine largest cluster in this batch
+            size_t largest_cluster = 0u;
+            size_t largest_cluster_count = 0u;
+            for (size_t j = 0u; j < n_centroids; ++j) {
+                if (j == i)
+                    continue;
+
+                if (counts[j] > largest_cluster_count) {
+                    largest_cluster = j;
+                    largest_cluster_count = counts[j];
+                }
+            }
+
+            if (largest_cluster_count < 2u)
+                continue;
+
+            repaired = 1;
+
+            // determine batch pixel in this cluster furthest from its centroid
+            struct pixel largest_cluster_centroid = centroids[largest_cluster];
+
+            size_t furthest_pixel = 0u;
+            double max_dist = -1.0;
+            for (size_t j = 0u; j < batch_size; ++j) {
+                if (batch_labels[j] != largest_cluster)
+                    continue;
+
+                double dist = pixel_dist2(batch[j], largest_cluster_centroid);
+
+                if (dist > max_dist) {
+                    furthest_pixel = j;
+                    max_dist = dist;
+                }
+            }
+
+            // move that pixel to the empty cluster
+            struct pixel replacement_pixel = batch[furthest_pixel];
+            batch_labels[furthest_pixel] = i;
+
+            // correct cluster sums
+            double *sum = &sums[3 * i];
+            sum[0] = replacement_pixel.r;
+            sum[1] = replacement_pixel.g;
+            sum[2] = replacement_pixel.b;
+
+            sum = &sums[3 * largest_cluster];
+            sum[0] -= replacement_pixel.r;
+            sum[1] -= replacement_pixel.g;
+            sum[2] -= replacement_pixel.b;
+
+            // correct cluster sizes
+            counts[i] = 1u;
+            counts[largest_cluster]--;
+        }
+
+        // count batch pixels whose label differs from their last one (a pixel
+        // drawn twice in a batch is compared with its first occurrence)
+        size_t n_changed = 0u;
+
+        for (size_t i = 0u; i < batch_size; ++i) {
+            size_t *label = &labels[batch_indices[i]];
+
+            if (*label != batch_labels[i]) {
+                *label = batch_labels[i];
+                n_changed++;
+            }
+        }
+
+        // move centroids towards batch means, the per-centroid learning rate
+        // is the inverse of the number of pixels it has been assigned so far
+        kmeans_control_phase(&ctl, KMEANS_PHASE_AVERAGE);
+        double max_shift = 0.0;
+
+        for (size_t j = 0u; j < n_centroids; ++j) {
+            struct pixel *centroid = &centroids[j];
+            double *sum = &sums[3 * j];
+            size_t count = counts[j];
+
+            if (count) {
+                totals[j] += count;
+
+                double eta = 1.0 / totals[j];
+
+                struct pixel shift = {
+                    eta * (sum[0] - count * centroid->r),
+                    eta * (sum[1] - count * centroid->g),
+                    eta * (sum[2] - count * centroid->b)
+                };
+
+                centroid->r += shift.r;
+                centroid->g += shift.g;
+                centroid->b += shift.b;
+
+                struct pixel origin = { 0.0, 0.0, 0.0 };
+                double shift_dist = pixel_dist2(shift, origin);
+
+                if (shift_dist > max_shift)
+                    max_shift = shift_dist;
+            }
+
+            sum[0] = sum[1] = sum[2] = 0.0;
+            counts[j] = 0u;
+        }
+
+        // break if no centroid has moved noticeably
+        if (kmeans_control_sample_end(&ctl, n_changed, inertia,
+                                      max_shift, repaired))
+            break;
+    }
+
+    // final labelling pass over all pixels
+    kmeans_control_phase(&ctl, KMEANS_PHASE_LABEL);
+    double inertia = 0.0;
+
+    #pragma omp parallel for if (parallel) schedule(static) collapse(2) \
+        reduction(+ : inertia)
+    for (size_t y = 0u; y < pixels.rows; ++y) {
+        for (size_t x = 0u; x < pixels.cols; ++x) {
+            struct pixel pixel =
+                bgr_widen(&pixels.data[y * pixels.step + 3 * x]);
+
+            double min_dist;
+            labels[y * pixels.cols + x] =
+                find_closest_centroid(pixel, centroids, n_centroids, &min_dist);
+
+            inertia += min_dist;
+        }
+    }
+
+    // report inertia over all pixels rather than that of the last batch
+    ctl.inertia = inertia;
+    kmeans_control_end(&ctl);
+
+    kmeans_scratch_end(&scope);
+}
+
+void kmeans_minibatch(struct pixel_bgr pixels,
+                      struct pixel *centroids, size_t n_centroids,
+                      size_t *labels, size_t batch_size)
+{
+    kmeans_minibatch_impl(pixels, centroids, n_centroids,
+                          labels, batch_size, 0);
+}
+
+void kmeans_omp_minibatch(struct pixel_bgr pixels,
+                          struct pixel *centroids, size_t n_centroids,
+                          size_t *labels, size_t batch_size)
+{
+    kmeans_minibatch_impl(pixels, centroids, n_centroids,
+                          labels, batch_size, 1);
+}
@@ -0,0 +1,252 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kmeans.h"
+
+// file layout (all integers and floats little-endian):
+//   magic        8 bytes  "KMEANS\0" followed by the format version
+//   dtype        4 bytes  enum kmeans_dtype
+//   reserved     4 bytes  zero
+//   dim          8 bytes
+//   n_centroids  8 bytes
+//   seed         8 bytes
+//   inertia      8 bytes  IEEE 754 double
+//   centroids    n_centroids * dim values of the given dtype, row-major
+static unsigned char const model_magic[8] = { 'K', 'M', 'E', 'A', 'N', 'S',
+                                              '\0', 1u };
+
+#define MODEL_HEADER_SIZE 48u
+
+/* Helper Functions ***********************************************************/
+
+static void put_u32(unsigned char *p, uint32_t v)
+{
+    for (int b = 0; b < 4; ++b)
+        p[b] = (unsigned char) (v >> (8 * b));
+}
+
+static void put_u64(unsigned char *p, uint64_t v)
+{
+    for (int b = 0; b < 8; ++b)
+        p[b] = (unsigned char) (v >> (8 * b));
+}
+
+static uint32_t get_u32(unsigned char const *p)
+{
+    uint32_t v = 0u;
+    for (int b = 0; b < 4; ++b)
+        v |= (uint32_t) p[b] << (8 * b);
+    return v;
+}
+
+static uint64_t get_u64(unsigned char const *p)
+{
+    uint64_t v = 0u;
+    for (int b = 0; b < 8; ++b)
+        v |= (uint64_t) p[b] << (8 * b);
+    return v;
+}
+
+static size_t dtype_size(enum kmeans_dtype dtype)
+{
+    return dtype == KMEANS_DTYPE_F32 ? sizeof(float) : sizeof(double);
+}
+
+// encode / decode a single centroid value of either dtype
+static void put_value(unsigned char *p, void const *src, size_t i,
+                      enum kmeans_dtype dtype)
+{
+    if (dtype == KMEANS_DTYPE_F32) {
+        uint32_t bits;
+        memcpy(&bits, &((float const *) src)[i], sizeof(bits));
+        put_u32(p, bits);
+    } else {
+        uint64_t bits;
+        memcpy(&bits, &((double const *) src)[i], sizeof(bits));
+        put_u64(p, bits);
+    }
+}
+
+static void get_value(unsigned char const *p, void *dst, size_t i,
+                      enum kmeans_dtype dtype)
+{
+    if (dtype == KMEANS_DTYPE_F32) {
+        uint32_t bits = get_u32(p);
+        memcpy(&((float *) dst)[i], &bits, sizeof(bits));
+    } else {
+        uint64_t bits = get_u64(p);
+        memcpy(&((double *) dst)[i], &bits, sizeof(bits));
+    }
+}
+
+/* Main Functions *************************************************************/
+
+int kmeans_model_save(struct kmeans_model const *model, char const *filename)
+{
+    int err = 0;
+
+    FILE *f = NULL;
+    unsigned char *buf = NULL;
+
+    if ((model->dtype != KMEANS_DTYPE_F32 &&
+         model->dtype != KMEANS_DTYPE_F64) ||
+        !model->dim || !model->n_centroids) {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    f = fopen(filename, "wb");
+    if (!f)
+        goto fail;
+
+    // header
+    unsigned char header[MODEL_HEADER_SIZE];
+    uint64_t inertia;
+    memcpy(&inertia, &model->inertia, sizeof(inertia));
+
+    memcpy(header, model_magic, sizeof(model_magic));
+    put_u32(&header[8], (uint32_t) model->dtype);
+    put_u32(&header[12], 0u);
+    put_u64(&header[16], model->dim);
+    put_u64(&header[24], model->n_centroids);
+    put_u64(&header[32], model->seed);
+    put_u64(&header[40], inertia);
+
+    if (fwrite(header, sizeof(header), 1u, f) != 1u)
+        goto fail;
+
+    // centroids, one at a time
+    size_t size = dtype_size(model->dtype);
+
+    buf = malloc(model->dim * size);
+    if (!buf)
+        goto fail;
+
+    for (size_t j = 0u; j < model->n_centroids; ++j) {
+        for (size_t c = 0u; c < model->dim; ++c)
+            put_value(&buf[c * size], model->centroids, j * model->dim + c,
+                      model->dtype);
+
+        if (fwrite(buf, size, model->dim, f) != model->dim)
+            goto fail;
+    }
+
+    // buffered data may only fail to be written here
+    int closed = fclose(f);
+    f = NULL;
+
+    if (closed != 0)
+        goto fail;
+
+    goto done;
+
+fail:
+    err = errno ? errno : EIO;
+
+done:
+    free(buf);
+    if (f)
+        fclose(f);
+
+    if (err) {
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+int kmeans_model_load(struct kmeans_model *model, char const *filename)
+{
+    int err = 0;
+
+    FILE *f = NULL;
+    unsigned char *buf = NULL;
+    void *centroids = NULL;
+
+    memset(model, 0, sizeof(*model));
+
+    f = fopen(filename, "rb");
+    if (!f)
+        goto fail;
+
+    // header
+    unsigned char header[MODEL_HEADER_SIZE];
+
+    if (fread(header, sizeof(header), 1u, f) != 1u ||
+        memcmp(header, model_magic, sizeof(model_magic)) != 0) {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    uint32_t dtype = get_u32(&header[8]);
+    uint64_t dim = get_u64(&header[16]);
+    uint64_t n_centroids = get_u64(&header[24]);
+    uint64_t inertia = get_u64(&header[40]);
+
+    if ((dtype != KMEANS_DTYPE_F32 && dtype != KMEANS_DTYPE_F64) ||
+        !dim || !n_centroids ||
+        dim > SIZE_MAX / n_centroids / sizeof(double)) {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    // centroids, one at a time
+    size_t size = dtype_size((enum kmeans_dtype) dtype);
+
+    buf = malloc(dim * size);
+    centroids = malloc(n_centroids * dim * size);
+    if (!buf || !centroids)
+        goto fail;
+
+    for (size_t j = 0u; j < n_centroids; ++j) {
+        if (fread(buf, size, dim, f) != dim) {
+            errno = EINVAL;
+            goto fail;
+        }
+
+        for (size_t c = 0u; c < dim; ++c)
+            get_value(&buf[c * size], centroids, j * dim + c,
+                      (enum kmeans_dtype) dtype);
+    }
+
+    // trailing data means this is not a model of this version
+    if (fgetc(f) != EOF) {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    model->dtype = (enum kmeans_dtype) dtype;
+    model->dim = dim;
+    model->n_centroids = n_centroids;
+    model->centroids = centroids;
+    model->seed = (unsigned long) get_u64(&header[32]);
+    memcpy(&model->inertia, &inertia, sizeof(inertia));
+
+    goto done;
+
+fail:
+    err = errno ? errno : EIO;
+    free(centroids);
+
+done:
+    free(buf);
+    if (f)
+        fclose(f);
+
+    if (err) {
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+void kmeans_model_free(struct kmeans_model *model)
+{
+    free(model->centroids);
+    model->centroids = NULL;
+}
@@ -0,0 +1,422 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+
+#include "kmeans_config.h"
+#include "kmeans.h"
+#include "kmeans_control.h"
+#include "kmeans_reduce.h"
+#include "kmeans_scratch.h"
+#include "kmeans_util.h"
+
+/* Topology *******************************************************************/
+
+#ifdef __linux__
+
+// nodes with at least one CPU this process may run on, in ascending order
+struct numa_topology
+{
+    int n_nodes;
+    int n_cpus[KMEANS_NUMA_MAX_NODES];
+    cpu_set_t cpus[KMEANS_NUMA_MAX_NODES];
+};
+
+static struct numa_topology topology;
+static int topology_valid = 0;
+
+// original affinity of a thread pinned by kmeans_numa_bind
+static __thread cpu_set_t bound_mask;
+static __thread int bound_cpu = -1;
+
+// parse a sysfs cpu list ("0-3,8-11") into set, returns 0 on success
+static int read_cpulist(char const *path, cpu_set_t *set)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return -1;
+
+    CPU_ZERO(set);
+
+    int first, last;
+    char sep;
+    int res = 0;
+
+    while ((res = fscanf(f, "%d", &first)) == 1) {
+        last = first;
+
+        if (fscanf(f, "%c", &sep) == 1 && sep == '-') {
+            if (fscanf(f, "%d", &last) != 1)
+                break;
+
+            if (fscanf(f, "%c", &sep) != 1)
+                sep = '\n';
+        }
+
+        for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu)
+            CPU_SET(cpu, set);
+
+        if (sep != ',')
+            break;
+    }
+
+    fclose(f);
+
+    return 0;
+}
+
+static void topology_init(void)
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        CPU_ZERO(&allowed);
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            CPU_SET(cpu, &allowed);
+    }
+
+    topology.n_nodes = 0;
+
+    for (int node = 0; node < KMEANS_NUMA_MAX_NODES; ++node) {
+        char path[64];
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/node/node%d/cpulist", node);
+
+        cpu_set_t cpus;
+        if (read_cpulist(path, &cpus) != 0)
+            continue;
+
+        // skip memory-only nodes and those outside of our affinity mask
+        CPU_AND(&cpus, &cpus, &allowed);
+        if (CPU_COUNT(&cpus) == 0)
+            continue;
+
+        topology.cpus[topology.n_nodes] = cpus;
+        topology.n_cpus[topology.n_nodes] = CPU_COUNT(&cpus);
+        topology.n_nodes++;
+    }
+
+    // no sysfs, treat the machine as a single node
+    if (topology.n_nodes == 0) {
+        topology.cpus[0] = allowed;
+        topology.n_cpus[0] = CPU_COUNT(&allowed);
+        topology.n_nodes = 1;
+    }
+}
+
+static struct numa_topology const *get_topology(void)
+{
+    #pragma omp critical (kmeans_numa_topology)
+    {
+        if (!topology_valid) {
+            topology_init();
+            topology_valid = 1;
+        }
+    }
+
+    return &topology;
+}
+
+#endif
+
+int kmeans_numa_nodes(void)
+{
+#ifdef __linux__
+    return get_topology()->n_nodes;
+#else
+    return 1;
+#endif
+}
+
+// threads are spread over nodes in contiguous blocks of (almost) equal size,
+// so that a node's threads also own a contiguous range of pixels
+int kmeans_numa_thread_node(int tid, int n_threads, int n_nodes)
+{
+    return (int) ((long long) tid * n_nodes / n_threads);
+}
+
+// lowest thread id mapped to node
+static int node_first_thread(int node, int n_threads, int n_nodes)
+{
+    return (int) (((long long) node * n_threads + n_nodes - 1) / n_nodes);
+}
+
+// whether any thread is mapped to node (not so if there are fewer threads
+// than nodes)
+static int node_has_threads(int node, int n_threads, int n_nodes)
+{
+    int first = node_first_thread(node, n_threads, n_nodes);
+
+    return first < n_threads &&
+           kmeans_numa_thread_node(first, n_threads, n_nodes) == node;
+}
+
+/* Placement ******************************************************************/
+
+void kmeans_numa_bind(void)
+{
+#ifdef __linux__
+    struct numa_topology const *topo = get_topology();
+
+    int tid = omp_get_thread_num();
+    int n_threads = omp_get_num_threads();
+
+    int node = kmeans_numa_thread_node(tid, n_threads, topo->n_nodes);
+    int rank = tid - node_first_thread(node, n_threads, topo->n_nodes);
+
+    // rank-th allowed cpu of the node (wrapping around if oversubscribed)
+    int nth = rank % topo->n_cpus[node];
+    int cpu = 0;
+    for (; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &topo->cpus[node]) && nth-- == 0)
+            break;
+    }
+
+    if (cpu == bound_cpu)
+        return;
+
+    if (bound_cpu == -1 &&
+        sched_getaffinity(0, sizeof(bound_mask), &bound_mask) != 0)
+        return;
+
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    CPU_SET(cpu, &mask);
+
+    if (sched_setaffinity(0, sizeof(mask), &mask) == 0)
+        bound_cpu = cpu;
+#endif
+}
+
+void kmeans_numa_unbind(void)
+{
+#ifdef __linux__
+    if (bound_cpu == -1)
+        return;
+
+    sched_setaffinity(0, sizeof(bound_mask), &bound_mask);
+    bound_cpu = -1;
+#endif
+}
+
+void kmeans_numa_range(size_t n, size_t *begin, size_t *end)
+{
+    size_t tid = (size_t) omp_get_thread_num();
+    size_t n_threads = (size_t) omp_get_num_threads();
+
+    // the first n % n_threads threads take one item more
+    size_t q = n / n_threads;
+    size_t r = n % n_threads;
+
+    *begin = tid * q + (tid < r ? tid : r);
+    *end = *begin + q + (tid < r ? 1u : 0u);
+}
+
+void *kmeans_numa_alloc(size_t size)
+{
+#ifdef __linux__
+    // fresh anonymous pages, placed by whichever thread writes them first
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    return ptr == MAP_FAILED ? NULL : ptr;
+#else
+    return malloc(size);
+#endif
+}
+
+void kmeans_numa_free(void *ptr, size_t size)
+{
+    if (!ptr)
+        return;
+
+#ifdef __linux__
+    munmap(ptr, size);
+#else
+    (void) size;
+    free(ptr);
+#endif
+}
+
+/* Main Functions *************************************************************/
+
+void kmeans_omp_numa(struct pixel *pixels, size_t n_pixels,
+                     struct pixel *centroids, size_t n_centroids,
+                     size_t *labels)
+{
+    struct kmeans_scratch_scope scope;
+    kmeans_scratch_begin(&scope);
+
+    int n_nodes = kmeans_numa_nodes();
+
+    // allocate auxiliary memory
+    double *sums = kmeans_scratch_alloc(3 * n_centroids * sizeof(double));
+    size_t *counts = kmeans_scratch_alloc(n_centroids * sizeof(size_t));
+
+    // per-thread slots, and per-node slots the former are first reduced into
+    struct kmeans_accumulators acc;
+    kmeans_accumulators_init(&acc, n_centroids, omp_get_max_threads());
+
+    struct kmeans_accumulators node_acc;
+    kmeans_accumulators_init(&node_acc, n_centroids, n_nodes);
+
+    struct kmeans_control ctl;
+    kmeans_control_begin(&ctl, "kmeans_omp_numa", n_pixels);
+
+    // initialize centroids
+    kmeans_control_phase(&ctl, KMEANS_PHASE_SEED);
+    kmeans_seed(pixels, n_pixels, centroids, n_centroids, 1);
+
+    // repeat until converged or for at most max_iter iterations
+    for (int iter = 0; iter < kmeans_control_max_iter(&ctl); ++iter) {
+        size_t n_changed = 0u;
+        double inertia = 0.0;
+        int n_threads = 1;
+
+        kmeans_control_iteration_begin(&ctl);
+
+        // reassign points to closest centroids, every pinned thread works on
+        // the range of pixels it owns (see kmeans_numa_range), which is where
+        // the caller's first touch placed its pages
+        kmeans_control_phase(&ctl, KMEANS_PHASE_ASSIGN);
+        #pragma omp parallel reduction(+ : n_changed, inertia)
+        {
+            kmeans_numa_bind();
+            kmeans_accumulators_reset(&acc);
+
+            int tid = omp_get_thread_num();
+            double *thread_sums = kmeans_accumulators_sums(&acc, tid);
+            size_t *thread_counts = kmeans_accumulators_counts(&acc, tid);
+
+            size_t begin, end;
+            kmeans_numa_range(n_pixels, &begin, &end);
+
+            for (size_t i = begin; i < end; ++i) {
+                struct pixel pixel = pixels[i];
+
+                // find centroid closest to pixel
+                double min_dist;
+                size_t closest_centroid = find_closest_centroid(
+                    pixel, centroids, n_centroids, &min_dist);
+
+                inertia += min_dist;
+
+                // if pixel has changed cluster...
+                if (closest_centroid != labels[i]) {
+                    labels[i] = closest_centroid;
+
+                    ++n_changed;
+                }
+
+                // update cluster sum
+                double *sum = &thread_sums[3 * closest_centroid];
+                sum[0] += pixel.r;
+                sum[1] += pixel.g;
+                sum[2] += pixel.b;
+
+                // update cluster size
+                thread_counts[closest_centroid]++;
+            }
+
+            #pragma omp barrier
+
+            // the first thread of every node sums up the slots of its node,
+            // so that only one slot per node crosses the interconnect below
+            int team = omp_get_num_threads();
+            int node = kmeans_numa_thread_node(tid, team, n_nodes);
+
+            if (tid == 0)
+                n_threads = team;
+
+            if (tid == node_first_thread(node, team, n_nodes)) {
+                double *node_sums = kmeans_accumulators_sums(&node_acc, node);
+                size_t *node_counts = kmeans_accumulators_counts(&node_acc, node);
+
+                memset(node_sums, 0, 3 * n_centroids * sizeof(double));
+                memset(node_counts, 0, n_centroids * sizeof(size_t));
+
+                for (int t = tid;
+                     t < team && kmeans_numa_thread_node(t, team, n_nodes) == node;
+                     ++t) {
+                    double const *s = kmeans_accumulators_sums(&acc, t);
+                    size_t const *c = kmeans_accumulators_counts(&acc, t);
+
+                    for (size_t j = 0u; j < 3 * n_centroids; ++j)
+                        node_sums[j] += s[j];
+
+                    for (size_t j = 0u; j < n_centroids; ++j)
+                        node_counts[j] += c[j];
+                }
+            }
+        }
+
+        // merge node slots (in node order, so that the result does not depend
+        // on the number of threads per node)
+        for (size_t j = 0u; j < 3 * n_centroids; ++j)
+            sums[j] = 0.0;
+
+        for (size_t j = 0u; j < n_centroids; ++j)
+            counts[j] = 0u;
+
+        for (int node = 0; node < n_nodes; ++node) {
+            if (!node_has_threads(node, n_threads, n_nodes))
+                continue;
+
+            double const *s = kmeans_accumulators_sums(&node_acc, node);
+            size_t const *c = kmeans_accumulators_counts(&node_acc, node);
+
+            for (size_t j = 0u; j < 3 * n_centroids; ++j)
+                sums[j] += s[j];
+
+            for (size_t j = 0u; j < n_centroids; ++j)
+                counts[j] += c[j];
+        }
+
+        // repair all empty clusters at once
+        kmeans_control_phase(&ctl, KMEANS_PHASE_REPAIR);
+        int repaired = kmeans_repair_empty_clusters(pixels, n_pixels,
+                                                    centroids, n_centroids,
+                                                    labels, sums, counts) > 0;
+
+        // average accumulated cluster sums
+        kmeans_control_phase(&ctl, KMEANS_PHASE_AVERAGE);
+        double max_shift2 = 0.0;
+
+        for (size_t j = 0u; j < n_centroids; ++j) {
+            double const *sum = &sums[3 * j];
+            size_t count = counts[j];
+
+            struct pixel new_centroid = {
+                sum[0] / count, sum[1] / count, sum[2] / count
+            };
+
+            double shift2 = pixel_dist2(new_centroid, centroids[j]);
+            if (shift2 > max_shift2)
+                max_shift2 = shift2;
+
+            centroids[j] = new_centroid;
+        }
+
+        // break if the solution has converged
+        if (kmeans_control_iteration_end(&ctl, n_changed, inertia,
+                                         max_shift2, repaired))
+            break;
+    }
+
+    // release every thread of the team, so that later engines in this process
+    // are free to be scheduled anywhere
+    #pragma omp parallel
+    kmeans_numa_unbind();
+
+    kmeans_control_end(&ctl);
+
+    kmeans_scratch_end(&scope);
+}
@@ -0,0 +1,157 @@
+#include <float.h>
+#include <omp.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "kmeans_config.h"
+#include "kmeans.h"
+#include "kmeans_scratch.h"
+
+#define CHUNKSIZE ((size_t) KMEANS_PREDICT_CHUNKSIZE)
+
+/* Helper Functions ***********************************************************/
+
+// centroids and a chunk of pixels as separate single precision planes, so
+// that the distance loop runs over contiguous pixels and vectorizes
+struct planes
+{
+    float *r, *g, *b;
+};
+
+// label n packed 8-bit BGR pixels, closest must hold n entries and chunk
+// CHUNKSIZE entries per plane plus CHUNKSIZE distances
+static void predict_chunk(unsigned char const *bgr, size_t n,
+                          struct planes centroids, size_t n_centroids,
+                          struct planes chunk, float *min_dist,
+                          uint32_t *closest)
+{
+    for (size_t i = 0u; i < n; ++i) {
+        chunk.b[i] = bgr[3 * i];
+        chunk.g[i] = bgr[3 * i + 1u];
+        chunk.r[i] = bgr[3 * i + 2u];
+
+        min_dist[i] = FLT_MAX;
+        closest[i] = 0u;
+    }
+
+    // ties go to the lower index as in the engines
+    for (size_t j = 0u; j < n_centroids; ++j) {
+        float cr = centroids.r[j];
+        float cg = centroids.g[j];
+        float cb = centroids.b[j];
+        uint32_t label = (uint32_t) j;
+
+        // labels are blended through a mask, which (unlike a select) GCC
+        // turns into branch-free vector code
+        for (size_t i = 0u; i < n; ++i) {
+            float dr = chunk.r[i] - cr;
+            float dg = chunk.g[i] - cg;
+            float db = chunk.b[i] - cb;
+
+            float dist = dr * dr + dg * dg + db * db;
+            uint32_t closer = 0u - (uint32_t) (dist < min_dist[i]);
+
+            min_dist[i] = dist < min_dist[i] ? dist : min_dist[i];
+            closest[i] = (label & closer) | (closest[i] & ~closer);
+        }
+    }
+}
+
+// store n labels starting at the offset-th one
+static void store_labels(void *labels, enum kmeans_label_type label_type,
+                         size_t offset, uint32_t const *closest, size_t n)
+{
+    switch (label_type) {
+    case KMEANS_LABEL_U8:
+        for (size_t i = 0u; i < n; ++i)
+            ((uint8_t *) labels)[offset + i] = (uint8_t) closest[i];
+        break;
+    case KMEANS_LABEL_U16:
+        for (size_t i = 0u; i < n; ++i)
+            ((uint16_t *) labels)[offset + i] = (uint16_t) closest[i];
+        break;
+    case KMEANS_LABEL_U32:
+        for (size_t i = 0u; i < n; ++i)
+            ((uint32_t *) labels)[offset + i] = closest[i];
+        break;
+    case KMEANS_LABEL_SIZE:
+        for (size_t i = 0u; i < n; ++i)
+            ((size_t *) labels)[offset + i] = closest[i];
+        break;
+    }
+}
+
+/* Main Functions *************************************************************/
+
+static void kmeans_predict_impl(struct pixel_bgr pixels,
+                                struct pixel const *centroids,
+                                size_t n_centroids, void *labels,
+                                enum kmeans_label_type label_type,
+                                int parallel)
+{
+    int n_threads = parallel ? omp_get_max_threads() : 1;
+
+    struct kmeans_scratch_scope scope;
+    kmeans_scratch_begin(&scope);
+
+    // narrow centroids to single precision planes once
+    struct planes planar = {
+        kmeans_scratch_alloc(n_centroids * sizeof(float)),
+        kmeans_scratch_alloc(n_centroids * sizeof(float)),
+        kmeans_scratch_alloc(n_centroids * sizeof(float))
+    };
+
+    for (size_t j = 0u; j < n_centroids; ++j) {
+        planar.r[j] = (float) centroids[j].r;
+        planar.g[j] = (float) centroids[j].g;
+        planar.b[j] = (float) centroids[j].b;
+    }
+
+    // per-thread chunk planes, distances and labels
+    float *chunk_buf =
+        kmeans_scratch_alloc(n_threads * 4u * CHUNKSIZE * sizeof(float));
+    uint32_t *closest_buf =
+        kmeans_scratch_alloc(n_threads * CHUNKSIZE * sizeof(uint32_t));
+
+    // image rows may be padded, labels are not
+    #pragma omp parallel if (parallel)
+    {
+        int tid = omp_get_thread_num();
+
+        float *buf = &chunk_buf[tid * 4u * CHUNKSIZE];
+        struct planes chunk = { buf, &buf[CHUNKSIZE], &buf[2u * CHUNKSIZE] };
+        float *min_dist = &buf[3u * CHUNKSIZE];
+        uint32_t *closest = &closest_buf[tid * CHUNKSIZE];
+
+        #pragma omp for schedule(static)
+        for (size_t y = 0u; y < pixels.rows; ++y) {
+            unsigned char const *row = &pixels.data[y * pixels.step];
+
+            for (size_t x = 0u; x < pixels.cols; x += CHUNKSIZE) {
+                size_t n = pixels.cols - x < CHUNKSIZE ? pixels.cols - x
+                                                       : CHUNKSIZE;
+
+                predict_chunk(&row[3 * x], n, planar, n_centroids, chunk,
+                              min_dist, closest);
+                store_labels(labels, label_type, y * pixels.cols + x,
+                             closest, n);
+            }
+        }
+    }
+
+    kmeans_scratch_end(&scope);
+}
+
+void kmeans_predict(struct pixel_bgr pixels,
+                    struct pixel const *centroids, size_t n_centroids,
+                    void *labels, enum kmeans_label_type label_type)
+{
+    kmeans_predict_impl(pixels, centroids, n_centroids, labels, label_type, 0);
+}
+
+void kmeans_omp_predict(struct pixel_bgr pixels,
+                        struct pixel const *centroids, size_t n_centroids,
+                        void *labels, enum kmeans_label_type label_type)
+{
+    kmeans_predict_impl(pixels, centroids, n_centroids, labels, label_type, 1);
+}
@@ -0,0 +1,375 @@
+#include <omp.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kmeans_config.h"
+#include "kmeans.h"
+#include "kmeans_reduce.h"
+#include "kmeans_scratch.h"
+#include "kmeans_util.h"
+
+/* Accumulators ***************************************************************/
+
+void kmeans_accumulators_init(struct kmeans_accumulators *acc,
+                              size_t n_centroids, int n_threads)
+{
+    kmeans_accumulators_init_dim(acc, n_centroids, 3u, n_threads);
+}
+
+void kmeans_accumulators_init_dim(struct kmeans_accumulators *acc,
+                                  size_t n_centroids, size_t dim,
+                                  int n_threads)
+{
+    size_t slot = n_centroids * (dim * sizeof(double) + sizeof(size_t));
+
+    acc->stride = (slot + KMEANS_CACHELINE - 1u) /
+                  KMEANS_CACHELINE * KMEANS_CACHELINE;
+
+    acc->n_centroids = n_centroids;
+    acc->dim = dim;
+    acc->n_threads = n_threads;
+    acc->n_active = 0;
+
+    // scratch memory is cache line aligned already
+    acc->buf = kmeans_scratch_alloc(n_threads * acc->stride);
+}
+
+void kmeans_accumulators_reset(struct kmeans_accumulators *acc)
+{
+    int tid = omp_get_thread_num();
+
+    memset(&acc->buf[tid * acc->stride], 0, acc->stride);
+
+    if (tid == 0)
+        acc->n_active = omp_get_num_threads();
+}
+
+void kmeans_accumulators_merge(struct kmeans_accumulators *acc,
+                               double *sums, size_t *counts)
+{
+    size_t n_centroids = acc->n_centroids;
+    size_t dim = acc->dim;
+    int n_active = acc->n_active;
+
+    #pragma omp parallel for if (n_active > 1) schedule(static)
+    for (size_t j = 0u; j < n_centroids; ++j) {
+        double *sum = &sums[dim * j];
+        for (size_t c = 0u; c < dim; ++c)
+            sum[c] = 0.0;
+
+        counts[j] = 0u;
+
+        for (int tid = 0; tid < n_active; ++tid) {
+            double *thread_sum = &kmeans_accumulators_sums(acc, tid)[dim * j];
+            for (size_t c = 0u; c < dim; ++c)
+                sum[c] += thread_sum[c];
+
+            counts[j] += kmeans_accumulators_counts(acc, tid)[j];
+        }
+    }
+}
+
+/* Empty Cluster Repair *******************************************************/
+
+// order by descending distance, ties are broken by ascending pixel index
+static inline int maxloc_before(struct kmeans_maxloc a, struct kmeans_maxloc b)
+{
+    return a.dist > b.dist || (a.dist == b.dist && a.index < b.index);
+}
+
+// insert into sorted list of n entries (only the top n are retained)
+static inline void maxloc_insert(struct kmeans_maxloc *list, size_t n,
+                                 struct kmeans_maxloc entry)
+{
+    if (!maxloc_before(entry, list[n - 1u]))
+        return;
+
+    size_t pos = n - 1u;
+    while (pos > 0u && maxloc_before(entry, list[pos - 1u])) {
+        list[pos] = list[pos - 1u];
+        --pos;
+    }
+
+    list[pos] = entry;
+}
+
+// pixels are either stored as an array of structs or as a packed 8-bit BGR
+// image, labels as any of the label types
+struct repair_input
+{
+    struct pixel const *aos;
+    struct pixel_bgr const *bgr;
+
+    void *labels;
+    enum kmeans_label_type label_type;
+};
+
+static inline struct pixel input_pixel(struct repair_input const *in,
+                                       size_t j)
+{
+    return in->bgr ? bgr_get(in->bgr, j) : in->aos[j];
+}
+
+static inline size_t input_label(struct repair_input const *in, size_t j)
+{
+    switch (in->label_type) {
+    case KMEANS_LABEL_U8:
+        return ((uint8_t const *) in->labels)[j];
+    case KMEANS_LABEL_U16:
+        return ((uint16_t const *) in->labels)[j];
+    case KMEANS_LABEL_U32:
+        return ((uint32_t const *) in->labels)[j];
+    default:
+        return ((size_t const *) in->labels)[j];
+    }
+}
+
+static inline void input_relabel(struct repair_input const *in, size_t j,
+                                 size_t label)
+{
+    switch (in->label_type) {
+    case KMEANS_LABEL_U8:
+        ((uint8_t *) in->labels)[j] = (uint8_t) label;
+        break;
+    case KMEANS_LABEL_U16:
+        ((uint16_t *) in->labels)[j] = (uint16_t) label;
+        break;
+    case KMEANS_LABEL_U32:
+        ((uint32_t *) in->labels)[j] = (uint32_t) label;
+        break;
+    default:
+        ((size_t *) in->labels)[j] = label;
+        break;
+    }
+}
+
+// pixel j is counted weights[j] times (once if weights is NULL), a weighted
+// cluster only donates a pixel if it keeps at least one other
+static size_t repair_empty_clusters(struct repair_input const *in,
+                                    size_t const *weights, size_t n_pixels,
+                                    struct pixel *centroids, size_t n_centroids,
+                                    double *sums, size_t *counts,
+                                    int parallel)
+{
+    size_t n_empty = 0u;
+    for (size_t i = 0u; i < n_centroids; ++i) {
+        if (!counts[i])
+            ++n_empty;
+    }
+
+    if (!n_empty)
+        return 0u;
+
+    struct kmeans_scratch_scope scope;
+    kmeans_scratch_begin(&scope);
+
+    size_t *empty = kmeans_scratch_alloc(n_empty * sizeof(size_t));
+    size_t *donors = kmeans_scratch_alloc(n_empty * sizeof(size_t));
+    size_t *sim_counts = kmeans_scratch_alloc(n_centroids * sizeof(size_t));
+    size_t *needed = kmeans_scratch_calloc(n_centroids * sizeof(size_t));
+    size_t *offsets = kmeans_scratch_alloc(n_centroids * sizeof(size_t));
+
+    // with weights, counts no longer tell how many pixels a cluster has
+    size_t *members = NULL;
+
+    if (weights) {
+        members = kmeans_scratch_calloc(n_centroids * sizeof(size_t));
+
+        for (size_t j = 0u; j < n_pixels; ++j)
+            members[input_label(in, j)]++;
+    }
+
+    // determine which cluster donates to which empty cluster up front, this
+    // only depends on the cluster sizes, so that all furthest pixels can be
+    // found in a single pass
+    memcpy(sim_counts, counts, n_centroids * sizeof(size_t));
+
+    size_t e = 0u;
+    for (size_t i = 0u; i < n_centroids; ++i) {
+        if (counts[i])
+            continue;
+
+        // determine largest (originally non-empty) cluster
+        size_t largest_cluster = 0u;
+        size_t largest_cluster_count = 0u;
+        for (size_t j = 0u; j < n_centroids; ++j) {
+            if (!counts[j] || (members && members[j] < 2u))
+                continue;
+
+            if (sim_counts[j] > largest_cluster_count) {
+                largest_cluster = j;
+                largest_cluster_count = sim_counts[j];
+            }
+        }
+
+        empty[e] = i;
+
+        // no cluster can spare a pixel
+        if (members && !largest_cluster_count) {
+            donors[e++] = SIZE_MAX;
+            continue;
+        }
+
+        donors[e++] = largest_cluster;
+
+        sim_counts[i] = 1u;
+        sim_counts[largest_cluster]--;
+
+        if (members)
+            members[largest_cluster]--;
+
+        needed[largest_cluster]++;
+    }
+
+    size_t offset = 0u;
+    for (size_t j = 0u; j < n_centroids; ++j) {
+        offsets[j] = offset;
+        offset += needed[j];
+    }
+
+    // per-thread sorted lists of the furthest pixels of each donor cluster
+    size_t slot = n_empty * sizeof(struct kmeans_maxloc);
+    size_t stride = (slot + KMEANS_CACHELINE - 1u) /
+                    KMEANS_CACHELINE * KMEANS_CACHELINE;
+
+    int n_threads = parallel ? omp_get_max_threads() : 1;
+    char *lists = kmeans_scratch_alloc(n_threads * stride);
+    int n_active = 1;
+
+    #pragma omp parallel if (parallel)
+    {
+        int tid = omp_get_thread_num();
+
+        struct kmeans_maxloc *list =
+            (struct kmeans_maxloc *) &lists[tid * stride];
+
+        for (size_t l = 0u; l < n_empty; ++l) {
+            list[l].dist = -1.0;
+            list[l].index = SIZE_MAX;
+        }
+
+        if (tid == 0)
+            n_active = omp_get_num_threads();
+
+        #pragma omp for schedule(static)
+        for (size_t j = 0u; j < n_pixels; ++j) {
+            size_t label = input_label(in, j);
+            size_t n = needed[label];
+
+            if (!n)
+                continue;
+
+            struct kmeans_maxloc entry = {
+                pixel_dist2(input_pixel(in, j), centroids[label]), j
+            };
+
+            maxloc_insert(&list[offsets[label]], n, entry);
+        }
+    }
+
+    // merge per-thread lists into those of the first thread
+    struct kmeans_maxloc *merged = (struct kmeans_maxloc *) lists;
+
+    for (int tid = 1; tid < n_active; ++tid) {
+        struct kmeans_maxloc *list =
+            (struct kmeans_maxloc *) &lists[tid * stride];
+
+        for (size_t j = 0u; j < n_centroids; ++j) {
+            for (size_t l = 0u; l < needed[j]; ++l) {
+                if (list[offsets[j] + l].index == SIZE_MAX)
+                    break;
+
+                maxloc_insert(&merged[offsets[j]], needed[j],
+                              list[offsets[j] + l]);
+            }
+        }
+    }
+
+    // move pixels in the order in which the empty clusters were encountered
+    size_t n_repaired = 0u;
+
+    for (size_t j = 0u; j < n_centroids; ++j)
+        needed[j] = 0u;
+
+    for (e = 0u; e < n_empty; ++e) {
+        size_t i = empty[e];
+        size_t largest_cluster = donors[e];
+
+        if (largest_cluster == SIZE_MAX)
+            continue;
+
+        struct kmeans_maxloc furthest =
+            merged[offsets[largest_cluster] + needed[largest_cluster]++];
+
+        if (furthest.index == SIZE_MAX)
+            continue;
+
+        // move that pixel to the empty cluster
+        struct pixel replacement_pixel = input_pixel(in, furthest.index);
+        centroids[i] = replacement_pixel;
+        input_relabel(in, furthest.index, i);
+
+        size_t weight = weights ? weights[furthest.index] : 1u;
+
+        // correct cluster sums
+        double *sum = &sums[3 * i];
+        sum[0] = weight * replacement_pixel.r;
+        sum[1] = weight * replacement_pixel.g;
+        sum[2] = weight * replacement_pixel.b;
+
+        sum = &sums[3 * largest_cluster];
+        sum[0] -= weight * replacement_pixel.r;
+        sum[1] -= weight * replacement_pixel.g;
+        sum[2] -= weight * replacement_pixel.b;
+
+        // correct cluster sizes
+        counts[i] = weight;
+        counts[largest_cluster] -= weight;
+
+        ++n_repaired;
+    }
+
+    kmeans_scratch_end(&scope);
+
+    return n_repaired;
+}
+
+size_t kmeans_repair_empty_clusters(struct pixel *pixels, size_t n_pixels,
+                                    struct pixel *centroids, size_t n_centroids,
+                                    size_t *labels, double *sums,
+                                    size_t *counts)
+{
+    struct repair_input in = { pixels, NULL, labels, KMEANS_LABEL_SIZE };
+
+    return repair_empty_clusters(&in, NULL, n_pixels, centroids, n_centroids,
+                                 sums, counts, 1);
+}
+
+size_t kmeans_repair_empty_clusters_weighted(struct pixel *pixels,
+                                             size_t const *weights,
+                                             size_t n_pixels,
+                                             struct pixel *centroids,
+                                             size_t n_centroids,
+                                             size_t *labels, double *sums,
+                                             size_t *counts)
+{
+    struct repair_input in = { pixels, NULL, labels, KMEANS_LABEL_SIZE };
+
+    return repair_empty_clusters(&in, weights, n_pixels, centroids,
+                                 n_centroids, sums, counts, 1);
+}
+
+size_t kmeans_repair_empty_clusters_bgr(struct pixel_bgr pixels,
+                                        struct pixel *centroids,
+                                        size_t n_centroids, void *labels,
+                                        enum kmeans_label_type label_type,
+                                        double *sums, size_t *counts,
+                                        int parallel)
+{
+    struct repair_input in = { NULL, &pixels, labels, label_type };
+
+    return repair_empty_clusters(&in, NULL, pixels.rows * pixels.cols,
+                                 centroids, n_centroids, sums, counts,
+                                 parallel);
+}
@@ -0,0 +1,99 @@
+#ifndef KMEANS_REDUCE_H
+#define KMEANS_REDUCE_H
+
+#include <stddef.h>
+
+#include "kmeans.h"
+
+struct kmeans_control;
+
+// per-thread cluster sums (dim per cluster) / counts, each thread's slot is
+// padded to a multiple of the cache line size so that threads never write to
+// a shared line
+struct kmeans_accumulators
+{
+    char *buf;
+    size_t stride;
+    size_t n_centroids;
+    size_t dim;
+    int n_threads;
+    int n_active;
+};
+
+// (distance, pixel index) pair used in max-loc reductions
+struct kmeans_maxloc
+{
+    double dist;
+    size_t index;
+};
+
+// slots are drawn from the scratch arena and live until the caller's scratch
+// scope is closed
+void kmeans_accumulators_init(struct kmeans_accumulators *acc,
+                              size_t n_centroids, int n_threads);
+
+// as kmeans_accumulators_init for clusters of dim-dimensional features
+void kmeans_accumulators_init_dim(struct kmeans_accumulators *acc,
+                                  size_t n_centroids, size_t dim,
+                                  int n_threads);
+
+static inline double *kmeans_accumulators_sums(
+    struct kmeans_accumulators *acc, int tid)
+{
+    return (double *) &acc->buf[tid * acc->stride];
+}
+
+static inline size_t *kmeans_accumulators_counts(
+    struct kmeans_accumulators *acc, int tid)
+{
+    return (size_t *) &acc->buf[tid * acc->stride +
+                                acc->dim * acc->n_centroids * sizeof(double)];
+}
+
+// zero this thread's slot and register the team size, must be called by every
+// thread of a parallel region before accumulating
+void kmeans_accumulators_reset(struct kmeans_accumulators *acc);
+
+// sum all active per-thread slots into sums / counts (in parallel)
+void kmeans_accumulators_merge(struct kmeans_accumulators *acc,
+                               double *sums, size_t *counts);
+
+// repair all empty clusters in a single parallel pass over the pixels, each
+// empty cluster receives the pixel furthest from the centroid of the cluster
+// that is largest at that point, returns the number of repaired clusters
+size_t kmeans_repair_empty_clusters(struct pixel *pixels, size_t n_pixels,
+                                    struct pixel *centroids,
+                                    size_t n_centroids, size_t *labels,
+                                    double *sums, size_t *counts);
+
+// as kmeans_repair_empty_clusters with pixel j occurring weights[j] times
+// (counts hold total weights), clusters of a single distinct pixel never
+// donate it, so clusters may remain empty if there are too few of those
+size_t kmeans_repair_empty_clusters_weighted(struct pixel *pixels,
+                                             size_t const *weights,
+                                             size_t n_pixels,
+                                             struct pixel *centroids,
+                                             size_t n_centroids,
+                                             size_t *labels, double *sums,
+                                             size_t *counts);
+
+// as kmeans_repair_empty_clusters for a packed 8-bit BGR image with labels of
+// the given type, the pass over the pixels only runs in parallel if parallel
+// is non-zero
+size_t kmeans_repair_empty_clusters_bgr(struct pixel_bgr pixels,
+                                        struct pixel *centroids,
+                                        size_t n_centroids, void *labels,
+                                        enum kmeans_label_type label_type,
+                                        double *sums, size_t *counts,
+                                        int parallel);
+
+// Lloyd's algorithm with point i counted weights[i] times (weighted seeding,
+// repair and averaging), reporting to ctl, labels must start out as SIZE_MAX
+// unless warm starting, for engines that fit a weighted summary of the pixels
+void kmeans_weighted_lloyd(struct kmeans_control *ctl,
+                           struct pixel *points, size_t const *weights,
+                           size_t n_points,
+                           struct pixel *centroids, size_t n_centroids,
+                           size_t *labels, int parallel);
+
+#endif
@@ -0,0 +1,308 @@
+#include <float.h>
+#include <omp.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "kmeans_config.h"
+#include "kmeans.h"
+#include "kmeans_control.h"
+#include "kmeans_reduce.h"
+#include "kmeans_scratch.h"
+#include "kmeans_seed.h"
+#include "kmeans_util.h"
+
+// per-thread statistics of all restarts, padded so that threads never write
+// to a shared cache line
+#define STATS_ALIGN (KMEANS_CACHELINE / sizeof(double))
+
+#define BLOCKSIZE ((size_t) KMEANS_RESTARTS_BLOCKSIZE)
+
+/* Helper Functions ***********************************************************/
+
+// average accumulated cluster sums, returns the largest squared distance any
+// centroid has moved
+static double average_centroids(struct pixel *centroids, size_t n_centroids,
+                                double const *sums, size_t const *counts)
+{
+    double max_shift2 = 0.0;
+
+    for (size_t j = 0u; j < n_centroids; ++j) {
+        struct pixel *centroid = &centroids[j];
+        struct pixel old_centroid = *centroid;
+
+        double const *sum = &sums[3 * j];
+        size_t count = counts[j];
+
+        centroid->r = sum[0] / count;
+        centroid->g = sum[1] / count;
+        centroid->b = sum[2] / count;
+
+        double shift2 = pixel_dist2(*centroid, old_centroid);
+        if (shift2 > max_shift2)
+            max_shift2 = shift2;
+    }
+
+    return max_shift2;
+}
+
+/* Main Functions *************************************************************/
+
+static size_t kmeans_restarts_impl(struct pixel *pixels, size_t n_pixels,
+                                   struct pixel *centroids,
+                                   size_t n_centroids, size_t *labels,
+                                   size_t n_restarts, double *inertias,
+                                   int parallel)
+{
+    int n_threads = parallel ? omp_get_max_threads() : 1;
+
+    if (!n_restarts)
+        n_restarts = 1u;
+
+    struct kmeans_scratch_scope scope;
+    kmeans_scratch_begin(&scope);
+
+    // all centroid sets back to back, restart r owns the r-th set of
+    // n_centroids and is tracked as a block of the accumulators
+    size_t n_all = n_restarts * n_centroids;
+
+    struct pixel *sets = kmeans_scratch_alloc(n_all * sizeof(struct pixel));
+    double *sums = kmeans_scratch_alloc(3 * n_all * sizeof(double));
+    size_t *counts = kmeans_scratch_alloc(n_all * sizeof(size_t));
+
+    struct kmeans_accumulators acc;
+    kmeans_accumulators_init(&acc, n_all, n_threads);
+
+    // labels of restart 0 are the caller's, the others start out zeroed
+    size_t **restart_labels =
+        kmeans_scratch_alloc(n_restarts * sizeof(size_t *));
+
+    restart_labels[0] = labels;
+    for (size_t r = 1u; r < n_restarts; ++r) {
+        restart_labels[r] = kmeans_scratch_alloc(n_pixels * sizeof(size_t));
+        memset(restart_labels[r], 0, n_pixels * sizeof(size_t));
+    }
+
+    // per-thread number of changed labels / inertia of every restart
+    size_t stats_stride =
+        (n_restarts + STATS_ALIGN - 1u) / STATS_ALIGN * STATS_ALIGN;
+
+    size_t *thread_changed =
+        kmeans_scratch_alloc(n_threads * stats_stride * sizeof(size_t));
+    double *thread_inertia =
+        kmeans_scratch_alloc(n_threads * stats_stride * sizeof(double));
+
+    // restarts still iterating, their final (or latest) inertia and state
+    size_t *active = kmeans_scratch_alloc(n_restarts * sizeof(size_t));
+    double *inertia = kmeans_scratch_alloc(n_restarts * sizeof(double));
+    int *converged = kmeans_scratch_alloc(n_restarts * sizeof(int));
+
+    size_t n_blocks = (n_pixels + BLOCKSIZE - 1u) / BLOCKSIZE;
+    size_t n_active = n_restarts;
+    for (size_t r = 0u; r < n_restarts; ++r) {
+        active[r] = r;
+        inertia[r] = -1.0;
+        converged[r] = 0;
+    }
+
+    struct kmeans_control ctl;
+    kmeans_control_begin(
+        &ctl, parallel ? "kmeans_omp_restarts" : "kmeans_restarts", n_pixels);
+
+    // initialize centroids, restart 0 exactly as the single-solution engines
+    // (keeping provided centroids), every other one with a seed of its own
+    kmeans_control_phase(&ctl, KMEANS_PHASE_SEED);
+    enum kmeans_init init = kmeans_get_init();
+    uint64_t base = kmeans_get_seed();
+
+    memcpy(sets, centroids, n_centroids * sizeof(struct pixel));
+
+    for (size_t r = 0u; r < n_restarts; ++r) {
+        enum kmeans_init restart_init = init;
+        uint64_t state = r ? mix64(base + r) : base;
+
+        if (r && init == KMEANS_INIT_PROVIDED)
+            restart_init = KMEANS_INIT_RANDOM;
+
+        kmeans_seed_with(pixels, n_pixels, &sets[r * n_centroids],
+                         n_centroids, restart_init, state, parallel);
+    }
+
+    // repeat until all restarts have converged or for at most max_iter
+    // iterations
+    for (int iter = 0;
+         iter < kmeans_control_max_iter(&ctl) && n_active; ++iter) {
+        kmeans_control_iteration_begin(&ctl);
+
+        // reassign pixels to the closest centroids of every active restart,
+        // one cache-sized block of pixels at a time so that each pixel is
+        // loaded from memory once, accumulating into padded per-thread
+        // sums / counts
+        kmeans_control_phase(&ctl, KMEANS_PHASE_ASSIGN);
+        #pragma omp parallel if (parallel)
+        {
+            kmeans_accumulators_reset(&acc);
+
+            int tid = omp_get_thread_num();
+            double *thread_sums = kmeans_accumulators_sums(&acc, tid);
+            size_t *thread_counts = kmeans_accumulators_counts(&acc, tid);
+
+            size_t *changed = &thread_changed[tid * stats_stride];
+            double *dists = &thread_inertia[tid * stats_stride];
+
+            for (size_t r = 0u; r < n_restarts; ++r) {
+                changed[r] = 0u;
+                dists[r] = 0.0;
+            }
+
+            #pragma omp for schedule(static)
+            for (size_t b = 0u; b < n_blocks; ++b) {
+                size_t begin = b * BLOCKSIZE;
+                size_t end = n_pixels - begin < BLOCKSIZE ? n_pixels
+                                                          : begin + BLOCKSIZE;
+
+                // the block stays cached while the restarts take turns
+                for (size_t a = 0u; a < n_active; ++a) {
+                    size_t r = active[a];
+                    size_t offset = r * n_centroids;
+
+                    struct pixel const *restart_centroids = &sets[offset];
+                    size_t *restart_label = restart_labels[r];
+                    double *restart_sums = &thread_sums[3 * offset];
+                    size_t *restart_counts = &thread_counts[offset];
+
+                    size_t block_changed = 0u;
+                    double block_inertia = 0.0;
+
+                    for (size_t i = begin; i < end; ++i) {
+                        struct pixel pixel = pixels[i];
+
+                        // find centroid of this restart closest to pixel
+                        double min_dist;
+                        size_t closest_centroid = find_closest_centroid(
+                            pixel, restart_centroids, n_centroids, &min_dist);
+
+                        block_inertia += min_dist;
+
+                        // if pixel has changed cluster...
+                        if (closest_centroid != restart_label[i]) {
+                            restart_label[i] = closest_centroid;
+
+                            ++block_changed;
+                        }
+
+                        // update cluster sum
+                        double *sum = &restart_sums[3 * closest_centroid];
+                        sum[0] += pixel.r;
+                        sum[1] += pixel.g;
+                        sum[2] += pixel.b;
+
+                        // update cluster size
+                        restart_counts[closest_centroid]++;
+                    }
+
+                    changed[r] += block_changed;
+                    dists[r] += block_inertia;
+                }
+            }
+        }
+
+        kmeans_accumulators_merge(&acc, sums, counts);
+
+        // repair, average and test every active restart on its own, dropping
+        // the converged ones
+        size_t n_changed = 0u;
+        double best_inertia = DBL_MAX;
+        double max_shift2 = 0.0;
+        int repaired = 0;
+
+        size_t n_still_active = 0u;
+
+        for (size_t a = 0u; a < n_active; ++a) {
+            size_t r = active[a];
+            size_t offset = r * n_centroids;
+
+            size_t restart_changed = 0u;
+            double restart_inertia = 0.0;
+            for (int t = 0; t < n_threads; ++t) {
+                restart_changed += thread_changed[t * stats_stride + r];
+                restart_inertia += thread_inertia[t * stats_stride + r];
+            }
+
+            kmeans_control_phase(&ctl, KMEANS_PHASE_REPAIR);
+            int restart_repaired =
+                kmeans_repair_empty_clusters(
+                    pixels, n_pixels, &sets[offset], n_centroids,
+                    restart_labels[r], &sums[3 * offset], &counts[offset]) > 0;
+
+            kmeans_control_phase(&ctl, KMEANS_PHASE_AVERAGE);
+            double restart_shift2 = average_centroids(
+                &sets[offset], n_centroids, &sums[3 * offset], &counts[offset]);
+
+            converged[r] = !restart_repaired &&
+                           kmeans_control_converged(
+                               &ctl.options, n_pixels, restart_changed,
+                               restart_inertia, inertia[r], restart_shift2);
+            inertia[r] = restart_inertia;
+
+            if (!converged[r])
+                active[n_still_active++] = r;
+
+            n_changed += restart_changed;
+            repaired |= restart_repaired;
+
+            if (restart_inertia < best_inertia)
+                best_inertia = restart_inertia;
+            if (restart_shift2 > max_shift2)
+                max_shift2 = restart_shift2;
+        }
+
+        n_active = n_still_active;
+
+        // the iteration as a whole is reported with the summed changes and
+        // the least inertia, termination is up to the restarts themselves
+        kmeans_control_iteration_end(&ctl, n_changed, best_inertia,
+                                     max_shift2, repaired);
+    }
+
+    // hand out the restart of least inertia
+    size_t best = 0u;
+    for (size_t r = 1u; r < n_restarts; ++r) {
+        if (inertia[r] < inertia[best])
+            best = r;
+    }
+
+    memcpy(centroids, &sets[best * n_centroids],
+           n_centroids * sizeof(struct pixel));
+
+    if (best)
+        memcpy(labels, restart_labels[best], n_pixels * sizeof(size_t));
+
+    if (inertias)
+        memcpy(inertias, inertia, n_restarts * sizeof(double));
+
+    ctl.converged = converged[best];
+    ctl.inertia = inertia[best];
+
+    kmeans_control_end(&ctl);
+
+    kmeans_scratch_end(&scope);
+
+    return best;
+}
+
+size_t kmeans_restarts(struct pixel *pixels, size_t n_pixels,
+                       struct pixel *centroids, size_t n_centroids,
+                       size_t *labels, size_t n_restarts, double *inertias)
+{
+    return kmeans_restarts_impl(pixels, n_pixels, centroids, n_centroids,
+                                labels, n_restarts, inertias, 0);
+}
+
+size_t kmeans_omp_restarts(struct pixel *pixels, size_t n_pixels,
+                           struct pixel *centroids, size_t n_centroids,
+                           size_t *labels, size_t n_restarts,
+                           double *inertias)
+{
+    return kmeans_restarts_impl(pixels, n_pixels, centroids, n_centroids,
+                                labels, n_restarts, inertias, 1);
+}
@@ -0,0 +1,51 @@
+#ifndef KMEANS_SCRATCH_H
+#define KMEANS_SCRATCH_H
+
+#include <stddef.h>
+
+#include "kmeans.h"
+
+// device memory slots a context keeps alive between calls
+enum kmeans_device_slot
+{
+    KMEANS_DEVICE_PIXELS,
+    KMEANS_DEVICE_CENTROIDS,
+    KMEANS_DEVICE_LABELS,
+    KMEANS_DEVICE_SUMS,
+    KMEANS_DEVICE_COUNTS,
+    KMEANS_DEVICE_EMPTY,
+    KMEANS_DEVICE_CHANGED,
+    KMEANS_DEVICE_SLOTS
+};
+
+struct kmeans_arena_block;
+
+// position in the scratch arena of the active context, all allocations made
+// between kmeans_scratch_begin and the matching kmeans_scratch_end are
+// released together
+struct kmeans_scratch_scope
+{
+    struct kmeans_context *ctx;
+    struct kmeans_arena_block *block;
+    size_t offset;
+};
+
+// open a scope, if no context is active a temporary one is used until the
+// outermost scope is closed
+void kmeans_scratch_begin(struct kmeans_scratch_scope *scope);
+
+void kmeans_scratch_end(struct kmeans_scratch_scope *scope);
+
+// cache line aligned, only valid until the enclosing scope is closed, must
+// only be called from serial code
+void *kmeans_scratch_alloc(size_t size);
+
+void *kmeans_scratch_calloc(size_t size);
+
+// device buffer of at least size bytes that persists as long as the active
+// context, device_alloc / device_release are only called if it must grow
+void *kmeans_scratch_device(enum kmeans_device_slot slot, size_t size,
+                            void *(*device_alloc)(size_t),
+                            void (*device_release)(void *));
+
+#endif
@@ -0,0 +1,469 @@
+#include <float.h>
+#include <omp.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "kmeans_config.h"
+#include "kmeans.h"
+#include "kmeans_scratch.h"
+#include "kmeans_seed.h"
+#include "kmeans_util.h"
+
+/* Helper Functions ***********************************************************/
+
+// per-thread seeding configuration, see kmeans_set_seeding
+static __thread enum kmeans_init seeding_init = KMEANS_INIT_RANDOM;
+static __thread unsigned long seeding_seed = 0u;
+
+// pixels are either stored as an array of structs, as separate planes or as
+// packed 8-bit BGR triples, array of structs may come with multiplicities
+struct pixel_source
+{
+    struct pixel const *aos;
+    struct pixel_planar planar;
+    struct pixel_bgr const *bgr;
+
+    // multiplicities as doubles (NULL: all one) and their block sums / total,
+    // see kmeans_weight_sum
+    double const *weights;
+    double const *weight_block_sums;
+    double weight_total;
+};
+
+static inline struct pixel source_get(struct pixel_source const *src, size_t i)
+{
+    if (src->aos)
+        return src->aos[i];
+
+    if (src->bgr)
+        return bgr_get(src->bgr, i);
+
+    struct pixel p = { src->planar.r[i], src->planar.g[i], src->planar.b[i] };
+    return p;
+}
+
+static inline double source_weight(struct pixel_source const *src, size_t i)
+{
+    return src->weights ? src->weights[i] : 1.0;
+}
+
+double kmeans_weight_sum(double const *weights, size_t n, double *block_sums,
+                         int parallel)
+{
+    size_t n_blocks =
+        (n + KMEANS_SEED_BLOCKSIZE - 1u) / KMEANS_SEED_BLOCKSIZE;
+
+    #pragma omp parallel for if (parallel) schedule(static)
+    for (size_t b = 0u; b < n_blocks; ++b) {
+        size_t end = (b + 1u) * KMEANS_SEED_BLOCKSIZE;
+        if (end > n)
+            end = n;
+
+        double sum = 0.0;
+        for (size_t i = b * KMEANS_SEED_BLOCKSIZE; i < end; ++i)
+            sum += weights[i];
+
+        block_sums[b] = sum;
+    }
+
+    double total = 0.0;
+    for (size_t b = 0u; b < n_blocks; ++b)
+        total += block_sums[b];
+
+    return total;
+}
+
+size_t kmeans_weighted_draw(double const *weights, size_t n,
+                            double const *block_sums, double total,
+                            uint64_t *state)
+{
+    double target = to_unit(rng_next(state)) * total;
+
+    size_t n_blocks =
+        (n + KMEANS_SEED_BLOCKSIZE - 1u) / KMEANS_SEED_BLOCKSIZE;
+
+    size_t b = 0u;
+    while (b + 1u < n_blocks && target >= block_sums[b]) {
+        target -= block_sums[b];
+        ++b;
+    }
+
+    size_t end = (b + 1u) * KMEANS_SEED_BLOCKSIZE;
+    if (end > n)
+        end = n;
+
+    size_t last = b * KMEANS_SEED_BLOCKSIZE;
+    for (size_t i = b * KMEANS_SEED_BLOCKSIZE; i < end; ++i) {
+        if (weights[i] <= 0.0)
+            continue;
+
+        last = i;
+
+        if (target < weights[i])
+            return i;
+
+        target -= weights[i];
+    }
+
+    // only reached due to rounding
+    return last;
+}
+
+// draw pixel index with probability proportional to its multiplicity
+static size_t source_draw(struct pixel_source const *src, size_t n_pixels,
+                          uint64_t *state)
+{
+    if (!src->weights)
+        return rng_next(state) % n_pixels;
+
+    return kmeans_weighted_draw(src->weights, n_pixels,
+                                src->weight_block_sums, src->weight_total,
+                                state);
+}
+
+/* Initializers ***************************************************************/
+
+static void seed_random(struct pixel_source const *src, size_t n_pixels,
+                        struct pixel *centroids, size_t n_centroids,
+                        uint64_t *state)
+{
+    for (size_t i = 0u; i < n_centroids; ++i)
+        centroids[i] = source_get(src, source_draw(src, n_pixels, state));
+}
+
+// k-means++: choose each further centroid with probability proportional to
+// its squared distance from the closest centroid chosen so far
+static void seed_plusplus(struct pixel_source const *src, size_t n_pixels,
+                          struct pixel *centroids, size_t n_centroids,
+                          uint64_t *state, int parallel)
+{
+    size_t n_blocks =
+        (n_pixels + KMEANS_SEED_BLOCKSIZE - 1u) / KMEANS_SEED_BLOCKSIZE;
+
+    struct kmeans_scratch_scope scope;
+    kmeans_scratch_begin(&scope);
+
+    double *dists = kmeans_scratch_alloc(n_pixels * sizeof(double));
+    double *block_sums = kmeans_scratch_alloc(n_blocks * sizeof(double));
+
+    centroids[0] = source_get(src, source_draw(src, n_pixels, state));
+
+    // distances are scaled by multiplicity, which does not change which
+    // centroid is closest
+    #pragma omp parallel for if (parallel) schedule(static)
+    for (size_t i = 0u; i < n_pixels; ++i) {
+        dists[i] = source_weight(src, i) *
+                   pixel_dist2(source_get(src, i), centroids[0]);
+    }
+
+    for (size_t j = 1u; j < n_centroids; ++j) {
+        double total =
+            kmeans_weight_sum(dists, n_pixels, block_sums, parallel);
+
+        // all pixels coincide with some centroid, fall back to random choice
+        if (total <= 0.0) {
+            seed_random(src, n_pixels, &centroids[j], n_centroids - j, state);
+            break;
+        }
+
+        size_t chosen =
+            kmeans_weighted_draw(dists, n_pixels, block_sums, total, state);
+
+        struct pixel centroid = source_get(src, chosen);
+        centroids[j] = centroid;
+
+        if (j + 1u == n_centroids)
+            break;
+
+        #pragma omp parallel for if (parallel) schedule(static)
+        for (size_t i = 0u; i < n_pixels; ++i) {
+            double dist = source_weight(src, i) *
+                          pixel_dist2(source_get(src, i), centroid);
+
+            if (dist < dists[i])
+                dists[i] = dist;
+        }
+    }
+
+    kmeans_scratch_end(&scope);
+}
+
+// k-means||: sample O(k) candidates in each of a few rounds, each pixel being
+// picked independently with probability proportional to its squared distance
+// to the candidates so far, then reduce the candidates (weighted by the number
+// of pixels closest to them) to k centroids via k-means++
+static void seed_parallel(struct pixel_source const *src, size_t n_pixels,
+                          struct pixel *centroids, size_t n_centroids,
+                          uint64_t *state, int parallel)
+{
+    size_t n_blocks =
+        (n_pixels + KMEANS_SEED_BLOCKSIZE - 1u) / KMEANS_SEED_BLOCKSIZE;
+
+    double oversampling = KMEANS_SEED_OVERSAMPLING * (double) n_centroids;
+
+    struct kmeans_scratch_scope scope;
+    kmeans_scratch_begin(&scope);
+
+    double *dists = kmeans_scratch_alloc(n_pixels * sizeof(double));
+    double *block_sums = kmeans_scratch_alloc(n_blocks * sizeof(double));
+    unsigned char *sampled = kmeans_scratch_alloc(n_pixels);
+
+    size_t n_candidates = 0u;
+    size_t max_candidates = 1u + KMEANS_SEED_ROUNDS * 2u * (size_t) oversampling;
+    struct pixel *candidates =
+        kmeans_scratch_alloc(max_candidates * sizeof(struct pixel));
+
+    candidates[n_candidates++] =
+        source_get(src, source_draw(src, n_pixels, state));
+
+    #pragma omp parallel for if (parallel) schedule(static)
+    for (size_t i = 0u; i < n_pixels; ++i) {
+        dists[i] = source_weight(src, i) *
+                   pixel_dist2(source_get(src, i), candidates[0]);
+    }
+
+    uint64_t round_seed = rng_next(state);
+
+    for (int round = 0; round < KMEANS_SEED_ROUNDS; ++round) {
+        double total =
+            kmeans_weight_sum(dists, n_pixels, block_sums, parallel);
+        if (total <= 0.0)
+            break;
+
+        // sample pixels independently, the per-pixel random numbers are
+        // derived from the pixel index alone and thus thread-count agnostic
+        uint64_t salt = mix64(round_seed + (uint64_t) round);
+
+        #pragma omp parallel for if (parallel) schedule(static)
+        for (size_t i = 0u; i < n_pixels; ++i) {
+            double p = oversampling * dists[i] / total;
+            sampled[i] = to_unit(mix64(salt ^ (uint64_t) i)) < p;
+        }
+
+        // gather candidates in pixel order
+        size_t first_new = n_candidates;
+        for (size_t i = 0u; i < n_pixels; ++i) {
+            if (!sampled[i])
+                continue;
+
+            // grow by copying, the old buffer is reclaimed with the scope
+            if (n_candidates == max_candidates) {
+                struct pixel *grown =
+                    kmeans_scratch_alloc(2u * max_candidates *
+                                         sizeof(struct pixel));
+
+                memcpy(grown, candidates,
+                       max_candidates * sizeof(struct pixel));
+
+                candidates = grown;
+                max_candidates *= 2u;
+            }
+
+            candidates[n_candidates++] = source_get(src, i);
+        }
+
+        // update distances with respect to the new candidates only
+        #pragma omp parallel for if (parallel) schedule(static)
+        for (size_t i = 0u; i < n_pixels; ++i) {
+            struct pixel pixel = source_get(src, i);
+            double weight = source_weight(src, i);
+
+            for (size_t c = first_new; c < n_candidates; ++c) {
+                double dist = weight * pixel_dist2(pixel, candidates[c]);
+
+                if (dist < dists[i])
+                    dists[i] = dist;
+            }
+        }
+    }
+
+    if (n_candidates <= n_centroids) {
+        // too few distinct candidates, fill up with random pixels
+        for (size_t j = 0u; j < n_candidates; ++j)
+            centroids[j] = candidates[j];
+
+        seed_random(src, n_pixels, &centroids[n_candidates],
+                    n_centroids - n_candidates, state);
+    } else {
+        // weigh candidates by the number of pixels closest to them
+        double *weights =
+            kmeans_scratch_calloc(n_candidates * sizeof(double));
+
+        #pragma omp parallel for if (parallel) schedule(static) \
+            reduction(+ : weights[:n_candidates])
+        for (size_t i = 0u; i < n_pixels; ++i) {
+            struct pixel pixel = source_get(src, i);
+
+            size_t closest_candidate = 0u;
+            double min_dist = DBL_MAX;
+
+            for (size_t c = 0u; c < n_candidates; ++c) {
+                double dist = pixel_dist2(pixel, candidates[c]);
+
+                if (dist < min_dist) {
+                    closest_candidate = c;
+                    min_dist = dist;
+                }
+            }
+
+            weights[closest_candidate] += source_weight(src, i);
+        }
+
+        // weighted k-means++ over the candidates
+        double *cand_dists =
+            kmeans_scratch_alloc(n_candidates * sizeof(double));
+        double *cand_weights =
+            kmeans_scratch_alloc(n_candidates * sizeof(double));
+        double *cand_block_sums = kmeans_scratch_alloc(
+            ((n_candidates + KMEANS_SEED_BLOCKSIZE - 1u) /
+             KMEANS_SEED_BLOCKSIZE) * sizeof(double));
+
+        double total =
+            kmeans_weight_sum(weights, n_candidates, cand_block_sums, 0);
+        centroids[0] = candidates[
+            kmeans_weighted_draw(weights, n_candidates, cand_block_sums, total,
+                                 state)];
+
+        for (size_t c = 0u; c < n_candidates; ++c)
+            cand_dists[c] = DBL_MAX;
+
+        for (size_t j = 1u; j < n_centroids; ++j) {
+            for (size_t c = 0u; c < n_candidates; ++c) {
+                double dist = pixel_dist2(candidates[c], centroids[j - 1u]);
+
+                if (dist < cand_dists[c])
+                    cand_dists[c] = dist;
+            }
+
+            for (size_t c = 0u; c < n_candidates; ++c)
+                cand_weights[c] = weights[c] * cand_dists[c];
+
+            total = kmeans_weight_sum(cand_weights, n_candidates,
+                                      cand_block_sums, 0);
+
+            if (total <= 0.0) {
+                seed_random(src, n_pixels, &centroids[j], n_centroids - j,
+                            state);
+                break;
+            }
+
+            centroids[j] = candidates[
+                kmeans_weighted_draw(cand_weights, n_candidates,
+                                     cand_block_sums, total, state)];
+        }
+    }
+
+    kmeans_scratch_end(&scope);
+}
+
+static void seed_with(struct pixel_source const *src, size_t n_pixels,
+                      struct pixel *centroids, size_t n_centroids,
+                      enum kmeans_init init, uint64_t state, int parallel)
+{
+    switch (init) {
+    case KMEANS_INIT_PLUSPLUS:
+        seed_plusplus(src, n_pixels, centroids, n_centroids, &state, parallel);
+        break;
+    case KMEANS_INIT_PARALLEL:
+        seed_parallel(src, n_pixels, centroids, n_centroids, &state, parallel);
+        break;
+    case KMEANS_INIT_PROVIDED:
+        break;
+    default:
+        seed_random(src, n_pixels, centroids, n_centroids, &state);
+        break;
+    }
+}
+
+static void seed(struct pixel_source const *src, size_t n_pixels,
+                 struct pixel *centroids, size_t n_centroids, int parallel)
+{
+    seed_with(src, n_pixels, centroids, n_centroids, seeding_init,
+              kmeans_get_seed(), parallel);
+}
+
+/* Main Functions *************************************************************/
+
+void kmeans_set_seeding(enum kmeans_init init, unsigned long seed)
+{
+    seeding_init = init;
+    seeding_seed = seed;
+}
+
+unsigned long kmeans_get_seed(void)
+{
+    return seeding_seed ? seeding_seed : (unsigned long) time(NULL);
+}
+
+enum kmeans_init kmeans_get_init(void)
+{
+    return seeding_init;
+}
+
+void kmeans_seed(struct pixel const *pixels, size_t n_pixels,
+                 struct pixel *centroids, size_t n_centroids, int parallel)
+{
+    struct pixel_source src = { pixels, { NULL, NULL, NULL }, NULL };
+
+    seed(&src, n_pixels, centroids, n_centroids, parallel);
+}
+
+void kmeans_seed_with(struct pixel const *pixels, size_t n_pixels,
+                      struct pixel *centroids, size_t n_centroids,
+                      enum kmeans_init init, uint64_t state, int parallel)
+{
+    struct pixel_source src = { pixels, { NULL, NULL, NULL }, NULL };
+
+    seed_with(&src, n_pixels, centroids, n_centroids, init, state, parallel);
+}
+
+void kmeans_seed_weighted(struct pixel const *pixels, size_t const *weights,
+                          size_t n_pixels, struct pixel *centroids,
+                          size_t n_centroids, int parallel)
+{
+    if (seeding_init == KMEANS_INIT_PROVIDED)
+        return;
+
+    struct kmeans_scratch_scope scope;
+    kmeans_scratch_begin(&scope);
+
+    size_t n_blocks =
+        (n_pixels + KMEANS_SEED_BLOCKSIZE - 1u) / KMEANS_SEED_BLOCKSIZE;
+
+    double *dweights = kmeans_scratch_alloc(n_pixels * sizeof(double));
+    double *block_sums = kmeans_scratch_alloc(n_blocks * sizeof(double));
+
+    #pragma omp parallel for if (parallel) schedule(static)
+    for (size_t i = 0u; i < n_pixels; ++i)
+        dweights[i] = (double) weights[i];
+
+    struct pixel_source src = { pixels, { NULL, NULL, NULL }, NULL,
+                                dweights, block_sums, 0.0 };
+
+    src.weight_total =
+        kmeans_weight_sum(dweights, n_pixels, block_sums, parallel);
+
+    seed(&src, n_pixels, centroids, n_centroids, parallel);
+
+    kmeans_scratch_end(&scope);
+}
+
+void kmeans_seed_planar(struct pixel_planar pixels, size_t n_pixels,
+                        struct pixel *centroids, size_t n_centroids,
+                        int parallel)
+{
+    struct pixel_source src = { NULL, pixels, NULL };
+
+    seed(&src, n_pixels, centroids, n_centroids, parallel);
+}
+
+void kmeans_seed_bgr(struct pixel_bgr pixels,
+                     struct pixel *centroids, size_t n_centroids,
+                     int parallel)
+{
+    struct pixel_source src = { NULL, { NULL, NULL, NULL }, &pixels };
+
+    seed(&src, pixels.rows * pixels.cols, centroids, n_centroids, parallel);
+}
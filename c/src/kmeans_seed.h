@@ -0,0 +1,27 @@
+#ifndef KMEANS_SEED_H
+#define KMEANS_SEED_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kmeans.h"
+
+// sum of weights, computed over blocks of KMEANS_SEED_BLOCKSIZE so that the
+// result does not depend on the number of threads, block_sums receives one
+// sum per block
+double kmeans_weight_sum(double const *weights, size_t n, double *block_sums,
+                         int parallel);
+
+// draw index with probability proportional to its weight, block_sums and
+// total must have been computed by kmeans_weight_sum
+size_t kmeans_weighted_draw(double const *weights, size_t n,
+                            double const *block_sums, double total,
+                            uint64_t *state);
+
+// kmeans_seed with the given initialization and seed instead of the
+// configured ones (e.g. for independent restarts within a single call)
+void kmeans_seed_with(struct pixel const *pixels, size_t n_pixels,
+                      struct pixel *centroids, size_t n_centroids,
+                      enum kmeans_init init, uint64_t seed, int parallel);
+
+#endif
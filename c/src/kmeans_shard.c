@@ -0,0 +1,1184 @@
+#ifdef __linux__
+#define _DEFAULT_SOURCE
+#endif
+
+#include <errno.h>
+#include <omp.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "kmeans_config.h"
+#include "kmeans.h"
+#include "kmeans_control.h"
+#include "kmeans_scratch.h"
+#include "kmeans_util.h"
+
+// wire format: every message is a 16 byte header (type and reserved as 32-bit,
+// payload size as 64-bit integer) followed by the payload, all integers and
+// doubles little-endian, so that the same messages can cross machines
+//
+//   INIT      coordinator -> worker  offset, count, n_centroids, count labels
+//   ASSIGN    coordinator -> worker  n_centroids centroids (r, g, b)
+//             worker -> coordinator  compute seconds, n_changed, inertia,
+//                                    3 * n_centroids sums, n_centroids counts
+//   FURTHEST  coordinator -> worker  n, n (cluster, needed) pairs
+//             worker -> coordinator  compute seconds, per pair needed
+//                                    (dist, index, r, g, b) in descending
+//                                    distance (dist < 0 for missing entries)
+//   RELABEL   coordinator -> worker  n, n (index, label) pairs, no reply
+//   LABELS    coordinator -> worker  empty
+//             worker -> coordinator  count labels
+//   STOP      coordinator -> worker  empty, no reply
+//
+// pixel indices are global, labels refer to the worker's slice [offset,
+// offset + count) of them
+enum shard_message
+{
+    SHARD_INIT = 1,
+    SHARD_ASSIGN,
+    SHARD_FURTHEST,
+    SHARD_RELABEL,
+    SHARD_LABELS,
+    SHARD_STOP
+};
+
+#define SHARD_HEADER_SIZE 16u
+
+// size of an encoded (dist, index, r, g, b) entry of a FURTHEST reply
+#define SHARD_MAXLOC_SIZE 40u
+
+/* Helper Functions ***********************************************************/
+
+static void put_u32(unsigned char *p, uint32_t v)
+{
+    for (int b = 0; b < 4; ++b)
+        p[b] = (unsigned char) (v >> (8 * b));
+}
+
+static void put_u64(unsigned char *p, uint64_t v)
+{
+    for (int b = 0; b < 8; ++b)
+        p[b] = (unsigned char) (v >> (8 * b));
+}
+
+static uint32_t get_u32(unsigned char const *p)
+{
+    uint32_t v = 0u;
+    for (int b = 0; b < 4; ++b)
+        v |= (uint32_t) p[b] << (8 * b);
+    return v;
+}
+
+static uint64_t get_u64(unsigned char const *p)
+{
+    uint64_t v = 0u;
+    for (int b = 0; b < 8; ++b)
+        v |= (uint64_t) p[b] << (8 * b);
+    return v;
+}
+
+static void put_f64(unsigned char *p, double v)
+{
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    put_u64(p, bits);
+}
+
+static double get_f64(unsigned char const *p)
+{
+    uint64_t bits = get_u64(p);
+    double v;
+    memcpy(&v, &bits, sizeof(v));
+    return v;
+}
+
+// one end of a connection and the bytes that went through it
+struct shard_channel
+{
+    int fd;
+    unsigned long long sent, received;
+};
+
+// growable message payload
+struct shard_buffer
+{
+    unsigned char *data;
+    size_t size, capacity;
+};
+
+// make room for size bytes (contents are not preserved), returns 0 on success
+static int buffer_reserve(struct shard_buffer *buf, size_t size)
+{
+    buf->size = size;
+
+    if (size <= buf->capacity)
+        return 0;
+
+    unsigned char *data = realloc(buf->data, size);
+    if (!data)
+        return -1;
+
+    buf->data = data;
+    buf->capacity = size;
+
+    return 0;
+}
+
+static int send_all(struct shard_channel *ch, void const *data, size_t size)
+{
+    unsigned char const *p = data;
+
+    while (size) {
+        // a closed peer must fail the call rather than raise SIGPIPE
+        ssize_t n = send(ch->fd, p, size, MSG_NOSIGNAL);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        p += n;
+        size -= (size_t) n;
+        ch->sent += (unsigned long long) n;
+    }
+
+    return 0;
+}
+
+static int recv_all(struct shard_channel *ch, void *data, size_t size)
+{
+    unsigned char *p = data;
+
+    while (size) {
+        ssize_t n = recv(ch->fd, p, size, 0);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        // peer went away in the middle of a message
+        if (n == 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+
+        p += n;
+        size -= (size_t) n;
+        ch->received += (unsigned long long) n;
+    }
+
+    return 0;
+}
+
+static int send_message(struct shard_channel *ch, enum shard_message type,
+                        struct shard_buffer const *payload)
+{
+    unsigned char header[SHARD_HEADER_SIZE];
+    size_t size = payload ? payload->size : 0u;
+
+    put_u32(&header[0], (uint32_t) type);
+    put_u32(&header[4], 0u);
+    put_u64(&header[8], size);
+
+    if (send_all(ch, header, sizeof(header)))
+        return -1;
+
+    return size ? send_all(ch, payload->data, size) : 0;
+}
+
+// receive the next message into payload, returns its type or -1 on failure,
+// a connection closed between messages is reported as type 0
+static int recv_message(struct shard_channel *ch,
+                        struct shard_buffer *payload)
+{
+    unsigned char header[SHARD_HEADER_SIZE];
+
+    ssize_t n;
+    do {
+        n = recv(ch->fd, header, 1u, 0);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0)
+        return -1;
+    if (n == 0)
+        return 0;
+
+    ch->received += 1u;
+
+    if (recv_all(ch, &header[1], sizeof(header) - 1u))
+        return -1;
+
+    uint32_t type = get_u32(&header[0]);
+    uint64_t size = get_u64(&header[8]);
+
+    if (type < SHARD_INIT || type > SHARD_STOP || size > SIZE_MAX) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    if (buffer_reserve(payload, (size_t) size) ||
+        recv_all(ch, payload->data, (size_t) size))
+        return -1;
+
+    return (int) type;
+}
+
+// receive a message that must be of the given type and at least min_size
+// bytes long
+static int expect_message(struct shard_channel *ch,
+                          struct shard_buffer *payload,
+                          enum shard_message type, size_t min_size)
+{
+    int received = recv_message(ch, payload);
+
+    if (received < 0)
+        return -1;
+
+    if (received != (int) type || payload->size < min_size) {
+        errno = received ? EPROTO : ECONNRESET;
+        return -1;
+    }
+
+    return 0;
+}
+
+// order by descending distance, ties are broken by ascending pixel index
+static inline int maxloc_before(double dist_a, uint64_t index_a,
+                                double dist_b, uint64_t index_b)
+{
+    return dist_a > dist_b || (dist_a == dist_b && index_a < index_b);
+}
+
+// furthest pixels of a donor cluster (as in kmeans_repair_empty_clusters)
+struct shard_maxloc
+{
+    double dist;
+    uint64_t index;
+    struct pixel pixel;
+};
+
+// insert into sorted list of n entries (only the top n are retained)
+static void maxloc_insert(struct shard_maxloc *list, size_t n,
+                          struct shard_maxloc entry)
+{
+    if (!maxloc_before(entry.dist, entry.index, list[n - 1u].dist,
+                       list[n - 1u].index))
+        return;
+
+    size_t pos = n - 1u;
+    while (pos > 0u && maxloc_before(entry.dist, entry.index,
+                                     list[pos - 1u].dist,
+                                     list[pos - 1u].index)) {
+        list[pos] = list[pos - 1u];
+        --pos;
+    }
+
+    list[pos] = entry;
+}
+
+/* Worker *********************************************************************/
+
+// state of a worker between messages
+struct shard_state
+{
+    struct pixel const *pixels;
+    size_t n_pixels;
+
+    uint64_t offset;
+    size_t n_centroids;
+
+    size_t *labels;
+    struct pixel *centroids;
+    double *sums;
+    size_t *counts;
+};
+
+static int worker_init(struct shard_state *state,
+                       struct shard_buffer const *msg)
+{
+    if (msg->size < 24u) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    uint64_t offset = get_u64(&msg->data[0]);
+    uint64_t count = get_u64(&msg->data[8]);
+    uint64_t n_centroids = get_u64(&msg->data[16]);
+
+    // the slice must be the one this worker holds
+    if (count != state->n_pixels || !n_centroids ||
+        n_centroids > SIZE_MAX / (3u * sizeof(double)) ||
+        msg->size != 24u + 8u * count) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    free(state->labels);
+    free(state->centroids);
+    free(state->sums);
+    free(state->counts);
+
+    state->offset = offset;
+    state->n_centroids = (size_t) n_centroids;
+
+    // one spare label so that an empty slice still allocates
+    state->labels = malloc((state->n_pixels + 1u) * sizeof(size_t));
+    state->centroids = malloc(state->n_centroids * sizeof(struct pixel));
+    state->sums = malloc(3u * state->n_centroids * sizeof(double));
+    state->counts = malloc(state->n_centroids * sizeof(size_t));
+
+    if (!state->labels || !state->centroids || !state->sums ||
+        !state->counts)
+        return -1;
+
+    for (size_t i = 0u; i < state->n_pixels; ++i)
+        state->labels[i] = (size_t) get_u64(&msg->data[24u + 8u * i]);
+
+    return 0;
+}
+
+// assignment step over the slice, replies with its sums / counts
+static int worker_assign(struct shard_state *state, struct shard_channel *ch,
+                         struct shard_buffer *msg)
+{
+    size_t n_centroids = state->n_centroids;
+
+    if (!state->labels || msg->size != 24u * n_centroids) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    double start = omp_get_wtime();
+
+    for (size_t j = 0u; j < n_centroids; ++j) {
+        state->centroids[j].r = get_f64(&msg->data[24u * j]);
+        state->centroids[j].g = get_f64(&msg->data[24u * j + 8u]);
+        state->centroids[j].b = get_f64(&msg->data[24u * j + 16u]);
+    }
+
+    memset(state->sums, 0, 3u * n_centroids * sizeof(double));
+    memset(state->counts, 0, n_centroids * sizeof(size_t));
+
+    size_t n_changed = 0u;
+    double inertia = 0.0;
+
+    // a worker is a single process, parallelism comes from running several
+    for (size_t i = 0u; i < state->n_pixels; ++i) {
+        struct pixel pixel = state->pixels[i];
+
+        // find centroid closest to pixel
+        double min_dist;
+        size_t closest_centroid = find_closest_centroid(
+            pixel, state->centroids, n_centroids, &min_dist);
+
+        inertia += min_dist;
+
+        // if pixel has changed cluster...
+        if (closest_centroid != state->labels[i]) {
+            state->labels[i] = closest_centroid;
+
+            ++n_changed;
+        }
+
+        // update cluster sum
+        double *sum = &state->sums[3 * closest_centroid];
+        sum[0] += pixel.r;
+        sum[1] += pixel.g;
+        sum[2] += pixel.b;
+
+        // update cluster size
+        state->counts[closest_centroid]++;
+    }
+
+    if (buffer_reserve(msg, 24u + 32u * n_centroids))
+        return -1;
+
+    put_u64(&msg->data[8], n_changed);
+    put_f64(&msg->data[16], inertia);
+
+    unsigned char *p = &msg->data[24];
+    for (size_t j = 0u; j < 3u * n_centroids; ++j, p += 8)
+        put_f64(p, state->sums[j]);
+    for (size_t j = 0u; j < n_centroids; ++j, p += 8)
+        put_u64(p, state->counts[j]);
+
+    put_f64(&msg->data[0], omp_get_wtime() - start);
+
+    return send_message(ch, SHARD_ASSIGN, msg);
+}
+
+// furthest pixels of the slice from the centroids of the requested clusters
+static int worker_furthest(struct shard_state *state,
+                           struct shard_channel *ch, struct shard_buffer *msg)
+{
+    size_t n_centroids = state->n_centroids;
+
+    if (!state->labels || msg->size < 8u) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    double start = omp_get_wtime();
+
+    uint64_t n_requests = get_u64(&msg->data[0]);
+    if (n_requests > n_centroids || msg->size != 8u + 16u * n_requests) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    // per cluster where its list starts (SIZE_MAX if not requested)
+    size_t *needed = calloc(n_centroids, sizeof(size_t));
+    size_t *offsets = malloc(n_centroids * sizeof(size_t));
+    struct shard_maxloc *lists = NULL;
+
+    int err = 0;
+
+    if (!needed || !offsets)
+        goto fail;
+
+    size_t n_entries = 0u;
+    for (size_t r = 0u; r < n_requests; ++r) {
+        uint64_t cluster = get_u64(&msg->data[8u + 16u * r]);
+        uint64_t n = get_u64(&msg->data[16u + 16u * r]);
+
+        if (cluster >= n_centroids || needed[cluster] || !n ||
+            n > n_centroids) {
+            errno = EPROTO;
+            goto fail;
+        }
+
+        needed[cluster] = (size_t) n;
+        offsets[cluster] = n_entries;
+        n_entries += (size_t) n;
+    }
+
+    lists = malloc((n_entries + 1u) * sizeof(struct shard_maxloc));
+    if (!lists)
+        goto fail;
+
+    struct pixel none = { 0.0, 0.0, 0.0 };
+    for (size_t l = 0u; l < n_entries; ++l) {
+        lists[l].dist = -1.0;
+        lists[l].index = UINT64_MAX;
+        lists[l].pixel = none;
+    }
+
+    for (size_t i = 0u; i < state->n_pixels; ++i) {
+        size_t label = state->labels[i];
+        size_t n = needed[label];
+
+        if (!n)
+            continue;
+
+        struct shard_maxloc entry = {
+            pixel_dist2(state->pixels[i], state->centroids[label]),
+            state->offset + i, state->pixels[i]
+        };
+
+        maxloc_insert(&lists[offsets[label]], n, entry);
+    }
+
+    if (buffer_reserve(msg, 8u + SHARD_MAXLOC_SIZE * n_entries))
+        goto fail;
+
+    for (size_t l = 0u; l < n_entries; ++l) {
+        unsigned char *p = &msg->data[8u + SHARD_MAXLOC_SIZE * l];
+
+        put_f64(&p[0], lists[l].dist);
+        put_u64(&p[8], lists[l].index);
+        put_f64(&p[16], lists[l].pixel.r);
+        put_f64(&p[24], lists[l].pixel.g);
+        put_f64(&p[32], lists[l].pixel.b);
+    }
+
+    put_f64(&msg->data[0], omp_get_wtime() - start);
+
+    if (send_message(ch, SHARD_FURTHEST, msg))
+        goto fail;
+
+    goto done;
+
+fail:
+    err = errno ? errno : EIO;
+
+done:
+    free(lists);
+    free(offsets);
+    free(needed);
+
+    if (err) {
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int worker_relabel(struct shard_state *state,
+                          struct shard_buffer const *msg)
+{
+    if (!state->labels || msg->size < 8u) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    uint64_t n = get_u64(&msg->data[0]);
+    if (n > state->n_pixels || msg->size != 8u + 16u * n) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    for (size_t r = 0u; r < n; ++r) {
+        uint64_t index = get_u64(&msg->data[8u + 16u * r]);
+        uint64_t label = get_u64(&msg->data[16u + 16u * r]);
+
+        if (index < state->offset || index - state->offset >= state->n_pixels ||
+            label >= state->n_centroids) {
+            errno = EPROTO;
+            return -1;
+        }
+
+        state->labels[index - state->offset] = (size_t) label;
+    }
+
+    return 0;
+}
+
+static int worker_labels(struct shard_state *state, struct shard_channel *ch,
+                         struct shard_buffer *msg)
+{
+    if (!state->labels) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    if (buffer_reserve(msg, 8u * state->n_pixels))
+        return -1;
+
+    for (size_t i = 0u; i < state->n_pixels; ++i)
+        put_u64(&msg->data[8u * i], state->labels[i]);
+
+    return send_message(ch, SHARD_LABELS, msg);
+}
+
+int kmeans_shard_worker(int fd, struct pixel const *pixels, size_t n_pixels)
+{
+    int err = 0;
+
+    struct shard_channel ch = { fd, 0u, 0u };
+    struct shard_buffer msg = { NULL, 0u, 0u };
+    struct shard_state state = { pixels, n_pixels, 0u, 0u,
+                                 NULL, NULL, NULL, NULL };
+
+    for (;;) {
+        int type = recv_message(&ch, &msg);
+
+        if (type < 0)
+            goto fail;
+
+        // the coordinator is gone without saying goodbye
+        if (type == 0) {
+            errno = ECONNRESET;
+            goto fail;
+        }
+
+        int res = 0;
+
+        switch (type) {
+        case SHARD_INIT:
+            res = worker_init(&state, &msg);
+            break;
+        case SHARD_ASSIGN:
+            res = worker_assign(&state, &ch, &msg);
+            break;
+        case SHARD_FURTHEST:
+            res = worker_furthest(&state, &ch, &msg);
+            break;
+        case SHARD_RELABEL:
+            res = worker_relabel(&state, &msg);
+            break;
+        case SHARD_LABELS:
+            res = worker_labels(&state, &ch, &msg);
+            break;
+        case SHARD_STOP:
+            goto done;
+        }
+
+        if (res)
+            goto fail;
+    }
+
+fail:
+    err = errno ? errno : EIO;
+
+done:
+    free(state.counts);
+    free(state.sums);
+    free(state.centroids);
+    free(state.labels);
+    free(msg.data);
+
+    if (err) {
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Coordinator ****************************************************************/
+
+// local workers and their connections
+struct shard_pool
+{
+    int n_workers;
+    struct shard_channel *channels;
+    pid_t *pids;
+    size_t *begin; // worker w owns pixels [begin[w], begin[w + 1])
+};
+
+// fork n_workers processes serving slices of pixels over socket pairs, the
+// children only ever run kmeans_shard_worker (serially, the OpenMP runtime
+// is not usable after a fork), returns the number of workers started
+static int spawn_workers(struct shard_pool *pool, struct pixel const *pixels)
+{
+    for (int w = 0; w < pool->n_workers; ++w) {
+        int fds[2];
+
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+            return w;
+
+        pid_t pid = fork();
+
+        if (pid < 0) {
+            int err = errno;
+            close(fds[0]);
+            close(fds[1]);
+            errno = err;
+            return w;
+        }
+
+        if (pid == 0) {
+            // only keep this worker's end
+            close(fds[0]);
+            for (int v = 0; v < w; ++v)
+                close(pool->channels[v].fd);
+
+            size_t begin = pool->begin[w];
+            int res = kmeans_shard_worker(fds[1], &pixels[begin],
+                                          pool->begin[w + 1] - begin);
+            _exit(res ? EXIT_FAILURE : EXIT_SUCCESS);
+        }
+
+        close(fds[1]);
+        pool->channels[w].fd = fds[0];
+        pool->pids[w] = pid;
+    }
+
+    return pool->n_workers;
+}
+
+// close connections to the first n_started workers and reap them (killing
+// them unless they were asked to stop), returns 0 if all exited cleanly
+static int reap_workers(struct shard_pool *pool, int n_started, int kill_all)
+{
+    int res = 0;
+
+    for (int w = 0; w < n_started; ++w) {
+        close(pool->channels[w].fd);
+
+        if (kill_all)
+            kill(pool->pids[w], SIGKILL);
+    }
+
+    for (int w = 0; w < n_started; ++w) {
+        int status;
+
+        while (waitpid(pool->pids[w], &status, 0) < 0) {
+            if (errno != EINTR) {
+                status = -1;
+                break;
+            }
+        }
+
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+            res = -1;
+    }
+
+    return res;
+}
+
+// send the same message to all workers
+static int broadcast(struct shard_pool *pool, enum shard_message type,
+                     struct shard_buffer const *payload)
+{
+    for (int w = 0; w < pool->n_workers; ++w) {
+        if (send_message(&pool->channels[w], type, payload))
+            return -1;
+    }
+
+    return 0;
+}
+
+// determine which cluster donates to which empty cluster as
+// kmeans_repair_empty_clusters does, fetch the furthest pixels of the donors
+// from all workers in a single round trip and move them, returns the number
+// of repaired clusters or -1 on failure, compute receives the time the
+// slowest worker spent searching
+static long repair_empty_clusters(struct shard_pool *pool,
+                                  struct shard_buffer *msg,
+                                  struct pixel *centroids, size_t n_centroids,
+                                  double *sums, size_t *counts,
+                                  double *compute)
+{
+    *compute = 0.0;
+
+    size_t n_empty = 0u;
+    for (size_t i = 0u; i < n_centroids; ++i) {
+        if (!counts[i])
+            ++n_empty;
+    }
+
+    if (!n_empty)
+        return 0;
+
+    struct kmeans_scratch_scope scope;
+    kmeans_scratch_begin(&scope);
+
+    size_t *empty = kmeans_scratch_alloc(n_empty * sizeof(size_t));
+    size_t *donors = kmeans_scratch_alloc(n_empty * sizeof(size_t));
+    size_t *sim_counts = kmeans_scratch_alloc(n_centroids * sizeof(size_t));
+    size_t *needed = kmeans_scratch_calloc(n_centroids * sizeof(size_t));
+    size_t *offsets = kmeans_scratch_alloc(n_centroids * sizeof(size_t));
+
+    memcpy(sim_counts, counts, n_centroids * sizeof(size_t));
+
+    size_t e = 0u;
+    for (size_t i = 0u; i < n_centroids; ++i) {
+        if (counts[i])
+            continue;
+
+        // determine largest (originally non-empty) cluster
+        size_t largest_cluster = 0u;
+        size_t largest_cluster_count = 0u;
+        for (size_t j = 0u; j < n_centroids; ++j) {
+            if (!counts[j])
+                continue;
+
+            if (sim_counts[j] > largest_cluster_count) {
+                largest_cluster = j;
+                largest_cluster_count = sim_counts[j];
+            }
+        }
+
+        empty[e] = i;
+        donors[e++] = largest_cluster;
+
+        sim_counts[i] = 1u;
+        sim_counts[largest_cluster]--;
+
+        needed[largest_cluster]++;
+    }
+
+    // request the top needed pixels of every donor
+    size_t n_donors = 0u;
+    size_t n_entries = 0u;
+    for (size_t j = 0u; j < n_centroids; ++j) {
+        offsets[j] = n_entries;
+        n_entries += needed[j];
+
+        if (needed[j])
+            ++n_donors;
+    }
+
+    struct shard_maxloc *merged =
+        kmeans_scratch_alloc(n_entries * sizeof(struct shard_maxloc));
+
+    for (size_t l = 0u; l < n_entries; ++l) {
+        merged[l].dist = -1.0;
+        merged[l].index = UINT64_MAX;
+    }
+
+    long n_repaired = -1;
+
+    if (buffer_reserve(msg, 8u + 16u * n_donors))
+        goto done;
+
+    put_u64(&msg->data[0], n_donors);
+
+    size_t r = 0u;
+    for (size_t j = 0u; j < n_centroids; ++j) {
+        if (!needed[j])
+            continue;
+
+        put_u64(&msg->data[8u + 16u * r], j);
+        put_u64(&msg->data[16u + 16u * r], needed[j]);
+        ++r;
+    }
+
+    if (broadcast(pool, SHARD_FURTHEST, msg))
+        goto done;
+
+    // merge the workers' lists
+    for (int w = 0; w < pool->n_workers; ++w) {
+        if (expect_message(&pool->channels[w], msg, SHARD_FURTHEST,
+                           8u + SHARD_MAXLOC_SIZE * n_entries))
+            goto done;
+
+        double worker_compute = get_f64(&msg->data[0]);
+        if (worker_compute > *compute)
+            *compute = worker_compute;
+
+        for (size_t j = 0u; j < n_centroids; ++j) {
+            for (size_t l = 0u; l < needed[j]; ++l) {
+                unsigned char const *p =
+                    &msg->data[8u + SHARD_MAXLOC_SIZE * (offsets[j] + l)];
+
+                struct shard_maxloc entry;
+                entry.dist = get_f64(&p[0]);
+                entry.index = get_u64(&p[8]);
+
+                if (entry.dist < 0.0)
+                    break;
+
+                entry.pixel.r = get_f64(&p[16]);
+                entry.pixel.g = get_f64(&p[24]);
+                entry.pixel.b = get_f64(&p[32]);
+
+                maxloc_insert(&merged[offsets[j]], needed[j], entry);
+            }
+        }
+    }
+
+    // move pixels in the order in which the empty clusters were encountered,
+    // collecting the new labels per owning worker
+    size_t *relabels = kmeans_scratch_alloc(2u * n_empty * sizeof(size_t));
+    size_t *owners = kmeans_scratch_alloc(n_empty * sizeof(size_t));
+    size_t n_moved = 0u;
+
+    for (size_t j = 0u; j < n_centroids; ++j)
+        needed[j] = 0u;
+
+    for (e = 0u; e < n_empty; ++e) {
+        size_t i = empty[e];
+        size_t largest_cluster = donors[e];
+
+        struct shard_maxloc furthest =
+            merged[offsets[largest_cluster] + needed[largest_cluster]++];
+
+        if (furthest.index == UINT64_MAX)
+            continue;
+
+        // move that pixel to the empty cluster
+        struct pixel replacement_pixel = furthest.pixel;
+        centroids[i] = replacement_pixel;
+
+        int owner = 0;
+        while (owner + 1 < pool->n_workers &&
+               furthest.index >= pool->begin[owner + 1])
+            ++owner;
+
+        relabels[2u * n_moved] = (size_t) furthest.index;
+        relabels[2u * n_moved + 1u] = i;
+        owners[n_moved++] = (size_t) owner;
+
+        // correct cluster sums
+        double *sum = &sums[3 * i];
+        sum[0] = replacement_pixel.r;
+        sum[1] = replacement_pixel.g;
+        sum[2] = replacement_pixel.b;
+
+        sum = &sums[3 * largest_cluster];
+        sum[0] -= replacement_pixel.r;
+        sum[1] -= replacement_pixel.g;
+        sum[2] -= replacement_pixel.b;
+
+        // correct cluster sizes
+        counts[i] = 1u;
+        counts[largest_cluster]--;
+    }
+
+    // tell the owners, stream order makes them apply the new labels before
+    // the next assignment step
+    for (int w = 0; w < pool->n_workers; ++w) {
+        size_t n = 0u;
+        for (size_t m = 0u; m < n_moved; ++m) {
+            if (owners[m] == (size_t) w)
+                ++n;
+        }
+
+        if (!n)
+            continue;
+
+        if (buffer_reserve(msg, 8u + 16u * n))
+            goto done;
+
+        put_u64(&msg->data[0], n);
+
+        unsigned char *p = &msg->data[8];
+        for (size_t m = 0u; m < n_moved; ++m) {
+            if (owners[m] != (size_t) w)
+                continue;
+
+            put_u64(&p[0], relabels[2u * m]);
+            put_u64(&p[8], relabels[2u * m + 1u]);
+            p += 16;
+        }
+
+        if (send_message(&pool->channels[w], SHARD_RELABEL, msg))
+            goto done;
+    }
+
+    n_repaired = (long) n_moved;
+
+done:
+    kmeans_scratch_end(&scope);
+
+    return n_repaired;
+}
+
+int kmeans_sharded(struct pixel *pixels, size_t n_pixels,
+                   struct pixel *centroids, size_t n_centroids,
+                   size_t *labels, int n_workers,
+                   struct kmeans_shard_stats *stats)
+{
+    int err = 0;
+
+    if (n_workers < 1)
+        n_workers = 1;
+    if ((size_t) n_workers > n_pixels)
+        n_workers = n_pixels ? (int) n_pixels : 1;
+
+    struct kmeans_scratch_scope scope;
+    kmeans_scratch_begin(&scope);
+
+    // allocate auxiliary memory
+    double *sums = kmeans_scratch_alloc(3 * n_centroids * sizeof(double));
+    size_t *counts = kmeans_scratch_alloc(n_centroids * sizeof(size_t));
+
+    struct shard_pool pool;
+    pool.n_workers = n_workers;
+    pool.channels =
+        kmeans_scratch_alloc(n_workers * sizeof(struct shard_channel));
+    pool.pids = kmeans_scratch_alloc(n_workers * sizeof(pid_t));
+    pool.begin = kmeans_scratch_alloc((n_workers + 1) * sizeof(size_t));
+
+    for (int w = 0; w <= n_workers; ++w)
+        pool.begin[w] = n_pixels / n_workers * w +
+                        (n_pixels % n_workers) * w / n_workers;
+
+    for (int w = 0; w < n_workers; ++w) {
+        pool.channels[w].fd = -1;
+        pool.channels[w].sent = 0u;
+        pool.channels[w].received = 0u;
+    }
+
+    struct shard_buffer msg = { NULL, 0u, 0u };
+    int n_started = 0;
+    int stopped = 0;
+
+    double comm_time = 0.0;
+
+    struct kmeans_control ctl;
+    kmeans_control_begin(&ctl, "kmeans_sharded", n_pixels);
+
+    // initialize centroids on the coordinator, which holds all pixels here
+    // (a remote coordinator would seed from a sample)
+    kmeans_control_phase(&ctl, KMEANS_PHASE_SEED);
+    kmeans_seed(pixels, n_pixels, centroids, n_centroids, 1);
+
+    n_started = spawn_workers(&pool, pixels);
+    if (n_started < n_workers)
+        goto fail;
+
+    // hand every worker its slice and initial labels
+    double start = omp_get_wtime();
+
+    for (int w = 0; w < n_workers; ++w) {
+        size_t begin = pool.begin[w];
+        size_t count = pool.begin[w + 1] - begin;
+
+        if (buffer_reserve(&msg, 24u + 8u * count))
+            goto fail;
+
+        put_u64(&msg.data[0], begin);
+        put_u64(&msg.data[8], count);
+        put_u64(&msg.data[16], n_centroids);
+
+        for (size_t i = 0u; i < count; ++i)
+            put_u64(&msg.data[24u + 8u * i], labels[begin + i]);
+
+        if (send_message(&pool.channels[w], SHARD_INIT, &msg))
+            goto fail;
+    }
+
+    comm_time += omp_get_wtime() - start;
+
+    // repeat until converged or for at most max_iter iterations
+    for (int iter = 0; iter < kmeans_control_max_iter(&ctl); ++iter) {
+        size_t n_changed = 0u;
+        double inertia = 0.0;
+
+        kmeans_control_iteration_begin(&ctl);
+
+        // broadcast centroids and merge the workers' sums / counts in worker
+        // order, time not spent computing in the slowest worker is
+        // communication
+        kmeans_control_phase(&ctl, KMEANS_PHASE_ASSIGN);
+        start = omp_get_wtime();
+
+        if (buffer_reserve(&msg, 24u * n_centroids))
+            goto fail;
+
+        for (size_t j = 0u; j < n_centroids; ++j) {
+            put_f64(&msg.data[24u * j], centroids[j].r);
+            put_f64(&msg.data[24u * j + 8u], centroids[j].g);
+            put_f64(&msg.data[24u * j + 16u], centroids[j].b);
+        }
+
+        if (broadcast(&pool, SHARD_ASSIGN, &msg))
+            goto fail;
+
+        memset(sums, 0, 3 * n_centroids * sizeof(double));
+        memset(counts, 0, n_centroids * sizeof(size_t));
+
+        double compute = 0.0;
+
+        for (int w = 0; w < n_workers; ++w) {
+            if (expect_message(&pool.channels[w], &msg, SHARD_ASSIGN,
+                               24u + 32u * n_centroids))
+                goto fail;
+
+            double worker_compute = get_f64(&msg.data[0]);
+            if (worker_compute > compute)
+                compute = worker_compute;
+
+            n_changed += (size_t) get_u64(&msg.data[8]);
+            inertia += get_f64(&msg.data[16]);
+
+            unsigned char const *p = &msg.data[24];
+            for (size_t j = 0u; j < 3u * n_centroids; ++j, p += 8)
+                sums[j] += get_f64(p);
+            for (size_t j = 0u; j < n_centroids; ++j, p += 8)
+                counts[j] += (size_t) get_u64(p);
+        }
+
+        double iteration_comm = omp_get_wtime() - start - compute;
+
+        // repair empty clusters globally
+        kmeans_control_phase(&ctl, KMEANS_PHASE_REPAIR);
+        start = omp_get_wtime();
+
+        double repair_compute;
+        long n_repaired =
+            repair_empty_clusters(&pool, &msg, centroids, n_centroids, sums,
+                                  counts, &repair_compute);
+        if (n_repaired < 0)
+            goto fail;
+
+        if (n_repaired)
+            iteration_comm += omp_get_wtime() - start - repair_compute;
+
+        compute += repair_compute;
+        comm_time += iteration_comm;
+
+        if (stats && (size_t) iter < stats->times_size) {
+            if (stats->comm_times)
+                stats->comm_times[iter] = iteration_comm;
+            if (stats->compute_times)
+                stats->compute_times[iter] = compute;
+        }
+
+        // average accumulated cluster sums
+        kmeans_control_phase(&ctl, KMEANS_PHASE_AVERAGE);
+        double max_shift2 = 0.0;
+
+        for (size_t j = 0u; j < n_centroids; ++j) {
+            struct pixel *centroid = &centroids[j];
+            double *sum = &sums[3 * j];
+            size_t count = counts[j];
+
+            struct pixel new_centroid = {
+                sum[0] / count, sum[1] / count, sum[2] / count
+            };
+
+            double shift2 = pixel_dist2(new_centroid, *centroid);
+            if (shift2 > max_shift2)
+                max_shift2 = shift2;
+
+            *centroid = new_centroid;
+        }
+
+        // break if the solution has converged
+        if (kmeans_control_iteration_end(&ctl, n_changed, inertia,
+                                         max_shift2, n_repaired > 0))
+            break;
+    }
+
+    // gather labels
+    kmeans_control_phase(&ctl, KMEANS_PHASE_LABEL);
+    start = omp_get_wtime();
+
+    if (broadcast(&pool, SHARD_LABELS, NULL))
+        goto fail;
+
+    for (int w = 0; w < n_workers; ++w) {
+        size_t begin = pool.begin[w];
+        size_t count = pool.begin[w + 1] - begin;
+
+        if (expect_message(&pool.channels[w], &msg, SHARD_LABELS, 8u * count))
+            goto fail;
+
+        for (size_t i = 0u; i < count; ++i)
+            labels[begin + i] = (size_t) get_u64(&msg.data[8u * i]);
+    }
+
+    if (broadcast(&pool, SHARD_STOP, NULL))
+        goto fail;
+
+    comm_time += omp_get_wtime() - start;
+    stopped = 1;
+
+    goto done;
+
+fail:
+    err = errno ? errno : EIO;
+
+done:
+    if (stats) {
+        stats->comm_time = comm_time;
+        stats->bytes_sent = 0u;
+        stats->bytes_received = 0u;
+
+        for (int w = 0; w < n_started; ++w) {
+            stats->bytes_sent += pool.channels[w].sent;
+            stats->bytes_received += pool.channels[w].received;
+        }
+    }
+
+    // a worker failing after it has delivered its labels still fails the call
+    if (reap_workers(&pool, n_started, !stopped) && !err)
+        err = EIO;
+
+    free(msg.data);
+
+    kmeans_control_end(&ctl);
+
+    kmeans_scratch_end(&scope);
+
+    if (err) {
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
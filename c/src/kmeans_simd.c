@@ -0,0 +1,422 @@
+#include <float.h>
+#include <omp.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KMEANS_SIMD_X86
+#include <immintrin.h>
+#endif
+
+#include "kmeans_config.h"
+#include "kmeans.h"
+#include "kmeans_control.h"
+#include "kmeans_scratch.h"
+
+// reassign pixels [begin, end) to closest centroids, accumulating cluster
+// sums / counts and inertia, returns the number of pixels that have changed
+// cluster
+typedef size_t (*assign_kernel)(struct pixel_planar pixels,
+                                size_t begin, size_t end,
+                                struct pixel_planar centroids,
+                                size_t n_centroids, size_t *labels,
+                                double *sums, size_t *counts,
+                                double *inertia);
+
+// update labels, sums, counts and inertia for a block of already classified
+// pixels
+static inline size_t accumulate(struct pixel_planar pixels,
+                                size_t begin, size_t end,
+                                int const *closest, float const *min_dist,
+                                size_t *labels, double *sums, size_t *counts,
+                                double *inertia)
+{
+    size_t n_changed = 0u;
+
+    for (size_t i = begin; i < end; ++i) {
+        size_t closest_centroid = (size_t) closest[i - begin];
+
+        *inertia += min_dist[i - begin];
+
+        // if pixel has changed cluster...
+        if (closest_centroid != labels[i]) {
+            labels[i] = closest_centroid;
+
+            ++n_changed;
+        }
+
+        // update cluster sum
+        double *sum = &sums[3 * closest_centroid];
+        sum[0] += pixels.r[i];
+        sum[1] += pixels.g[i];
+        sum[2] += pixels.b[i];
+
+        // update cluster size
+        counts[closest_centroid]++;
+    }
+
+    return n_changed;
+}
+
+/* Scalar Kernel **************************************************************/
+
+static size_t assign_scalar(struct pixel_planar pixels,
+                            size_t begin, size_t end,
+                            struct pixel_planar centroids, size_t n_centroids,
+                            size_t *labels, double *sums, size_t *counts,
+                            double *inertia)
+{
+    int closest[1];
+    size_t n_changed = 0u;
+
+    for (size_t i = begin; i < end; ++i) {
+        float r = pixels.r[i];
+        float g = pixels.g[i];
+        float b = pixels.b[i];
+
+        // find centroid closest to pixel (squared distances suffice here)
+        int closest_centroid = 0;
+        float min_dist = FLT_MAX;
+
+        for (size_t j = 0u; j < n_centroids; ++j) {
+            float dr = r - centroids.r[j];
+            float dg = g - centroids.g[j];
+            float db = b - centroids.b[j];
+
+            float dist = dr * dr + dg * dg + db * db;
+
+            if (dist < min_dist) {
+                closest_centroid = (int) j;
+                min_dist = dist;
+            }
+        }
+
+        closest[0] = closest_centroid;
+        n_changed += accumulate(pixels, i, i + 1u, closest, &min_dist,
+                                labels, sums, counts, inertia);
+    }
+
+    return n_changed;
+}
+
+#ifdef KMEANS_SIMD_X86
+
+/* AVX2 Kernel (8 pixels at a time) *******************************************/
+
+__attribute__((target("avx2")))
+static size_t assign_avx2(struct pixel_planar pixels,
+                          size_t begin, size_t end,
+                          struct pixel_planar centroids, size_t n_centroids,
+                          size_t *labels, double *sums, size_t *counts,
+                          double *inertia)
+{
+    int closest[8];
+    float dists[8];
+    size_t n_changed = 0u;
+
+    size_t i = begin;
+    for (; i + 8u <= end; i += 8u) {
+        __m256 r = _mm256_loadu_ps(&pixels.r[i]);
+        __m256 g = _mm256_loadu_ps(&pixels.g[i]);
+        __m256 b = _mm256_loadu_ps(&pixels.b[i]);
+
+        __m256 min_dist = _mm256_set1_ps(FLT_MAX);
+        __m256i closest_centroid = _mm256_setzero_si256();
+
+        // score all eight pixels against every centroid
+        for (size_t j = 0u; j < n_centroids; ++j) {
+            __m256 dr = _mm256_sub_ps(r, _mm256_set1_ps(centroids.r[j]));
+            __m256 dg = _mm256_sub_ps(g, _mm256_set1_ps(centroids.g[j]));
+            __m256 db = _mm256_sub_ps(b, _mm256_set1_ps(centroids.b[j]));
+
+            __m256 dist = _mm256_add_ps(
+                _mm256_add_ps(_mm256_mul_ps(dr, dr), _mm256_mul_ps(dg, dg)),
+                _mm256_mul_ps(db, db));
+
+            __m256 closer = _mm256_cmp_ps(dist, min_dist, _CMP_LT_OQ);
+
+            min_dist = _mm256_blendv_ps(min_dist, dist, closer);
+            closest_centroid = _mm256_castps_si256(_mm256_blendv_ps(
+                _mm256_castsi256_ps(closest_centroid),
+                _mm256_castsi256_ps(_mm256_set1_epi32((int) j)),
+                closer));
+        }
+
+        _mm256_storeu_si256((__m256i *) closest, closest_centroid);
+        _mm256_storeu_ps(dists, min_dist);
+
+        n_changed += accumulate(pixels, i, i + 8u, closest, dists,
+                                labels, sums, counts, inertia);
+    }
+
+    // handle remainder
+    n_changed += assign_scalar(pixels, i, end, centroids, n_centroids,
+                               labels, sums, counts, inertia);
+
+    return n_changed;
+}
+
+/* AVX-512 Kernel (16 pixels at a time) ***************************************/
+
+__attribute__((target("avx512f")))
+static size_t assign_avx512(struct pixel_planar pixels,
+                            size_t begin, size_t end,
+                            struct pixel_planar centroids, size_t n_centroids,
+                            size_t *labels, double *sums, size_t *counts,
+                            double *inertia)
+{
+    int closest[16];
+    float dists[16];
+    size_t n_changed = 0u;
+
+    size_t i = begin;
+    for (; i + 16u <= end; i += 16u) {
+        __m512 r = _mm512_loadu_ps(&pixels.r[i]);
+        __m512 g = _mm512_loadu_ps(&pixels.g[i]);
+        __m512 b = _mm512_loadu_ps(&pixels.b[i]);
+
+        __m512 min_dist = _mm512_set1_ps(FLT_MAX);
+        __m512i closest_centroid = _mm512_setzero_si512();
+
+        // score all sixteen pixels against every centroid
+        for (size_t j = 0u; j < n_centroids; ++j) {
+            __m512 dr = _mm512_sub_ps(r, _mm512_set1_ps(centroids.r[j]));
+            __m512 dg = _mm512_sub_ps(g, _mm512_set1_ps(centroids.g[j]));
+            __m512 db = _mm512_sub_ps(b, _mm512_set1_ps(centroids.b[j]));
+
+            __m512 dist = _mm512_add_ps(
+                _mm512_add_ps(_mm512_mul_ps(dr, dr), _mm512_mul_ps(dg, dg)),
+                _mm512_mul_ps(db, db));
+
+            __mmask16 closer = _mm512_cmp_ps_mask(dist, min_dist, _CMP_LT_OQ);
+
+            min_dist = _mm512_mask_mov_ps(min_dist, closer, dist);
+            closest_centroid = _mm512_mask_mov_epi32(
+                closest_centroid, closer, _mm512_set1_epi32((int) j));
+        }
+
+        _mm512_storeu_si512(closest, closest_centroid);
+        _mm512_storeu_ps(dists, min_dist);
+
+        n_changed += accumulate(pixels, i, i + 16u, closest, dists,
+                                labels, sums, counts, inertia);
+    }
+
+    // handle remainder
+    n_changed += assign_scalar(pixels, i, end, centroids, n_centroids,
+                               labels, sums, counts, inertia);
+
+    return n_changed;
+}
+
+#endif
+
+/* Runtime Dispatch ***********************************************************/
+
+static assign_kernel select_assign_kernel(void)
+{
+#ifdef KMEANS_SIMD_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx512f"))
+        return assign_avx512;
+
+    if (__builtin_cpu_supports("avx2"))
+        return assign_avx2;
+#endif
+
+    return assign_scalar;
+}
+
+/* Main Functions *************************************************************/
+
+static void kmeans_simd_impl(struct pixel_planar pixels, size_t n_pixels,
+                             struct pixel *centroids, size_t n_centroids,
+                             size_t *labels, int parallel)
+{
+    assign_kernel assign = select_assign_kernel();
+
+    size_t n_chunks =
+        (n_pixels + KMEANS_SIMD_CHUNKSIZE - 1u) / KMEANS_SIMD_CHUNKSIZE;
+
+    struct kmeans_scratch_scope scope;
+    kmeans_scratch_begin(&scope);
+
+    // allocate auxiliary memory
+    float *centroids_planar =
+        kmeans_scratch_alloc(3 * n_centroids * sizeof(float));
+    double *sums = kmeans_scratch_alloc(3 * n_centroids * sizeof(double));
+    size_t *counts = kmeans_scratch_alloc(n_centroids * sizeof(size_t));
+
+    struct pixel_planar centroids_f = {
+        centroids_planar,
+        centroids_planar + n_centroids,
+        centroids_planar + 2 * n_centroids
+    };
+
+    struct kmeans_control ctl;
+    kmeans_control_begin(
+        &ctl, parallel ? "kmeans_omp_simd" : "kmeans_simd", n_pixels);
+
+    // initialize centroids
+    kmeans_control_phase(&ctl, KMEANS_PHASE_SEED);
+    kmeans_seed_planar(pixels, n_pixels, centroids, n_centroids, parallel);
+
+    for (size_t i = 0u; i < n_centroids; ++i) {
+        double *sum = &sums[3 * i];
+        sum[0] = sum[1] = sum[2] = 0.0;
+
+        counts[i] = 0u;
+    }
+
+    // repeat until converged or for at most max_iter iterations
+    for (int iter = 0; iter < kmeans_control_max_iter(&ctl); ++iter) {
+        size_t n_changed = 0u;
+        double inertia = 0.0;
+        int repaired = 0;
+
+        kmeans_control_iteration_begin(&ctl);
+
+        // narrow centroids to planar single precision
+        kmeans_control_phase(&ctl, KMEANS_PHASE_ASSIGN);
+        for (size_t j = 0u; j < n_centroids; ++j) {
+            centroids_f.r[j] = (float) centroids[j].r;
+            centroids_f.g[j] = (float) centroids[j].g;
+            centroids_f.b[j] = (float) centroids[j].b;
+        }
+
+        // reassign points to closest centroids
+        #pragma omp parallel for if (parallel) schedule(static) \
+            reduction(+ : sums[:(3 * n_centroids)], counts[:n_centroids]) \
+            reduction(+ : n_changed, inertia)
+        for (size_t chunk = 0u; chunk < n_chunks; ++chunk) {
+            size_t begin = chunk * KMEANS_SIMD_CHUNKSIZE;
+            size_t end = begin + KMEANS_SIMD_CHUNKSIZE;
+            if (end > n_pixels)
+                end = n_pixels;
+
+            n_changed += assign(pixels, begin, end, centroids_f, n_centroids,
+                                labels, sums, counts, &inertia);
+        }
+
+        // repair empty clusters
+        kmeans_control_phase(&ctl, KMEANS_PHASE_REPAIR);
+        for (size_t i = 0u; i < n_centroids; ++i) {
+            if (counts[i])
+                continue;
+
+            repaired = 1;
+
+            // determine largest cluster
+            size_t largest_cluster = 0u;
+            size_t largest_cluster_count = 0u;
+            for (size_t j = 0u; j < n_centroids; ++j) {
+                if (j == i)
+                    continue;
+
+                if (counts[j] > largest_cluster_count) {
+                    largest_cluster = j;
+                    largest_cluster_count = counts[j];
+                }
+            }
+
+            // determine pixel in this cluster furthest from its centroid
+            float cr = centroids_f.r[largest_cluster];
+            float cg = centroids_f.g[largest_cluster];
+            float cb = centroids_f.b[largest_cluster];
+
+            size_t furthest_pixel = SIZE_MAX;
+            float max_dist = -1.0f;
+            for (size_t j = 0u; j < n_pixels; ++j) {
+                if (labels[j] != largest_cluster)
+                    continue;
+
+                float dr = pixels.r[j] - cr;
+                float dg = pixels.g[j] - cg;
+                float db = pixels.b[j] - cb;
+
+                float dist = dr * dr + dg * dg + db * db;
+
+                if (dist > max_dist) {
+                    furthest_pixel = j;
+                    max_dist = dist;
+                }
+            }
+
+            if (furthest_pixel == SIZE_MAX)
+                continue;
+
+            // move that pixel to the empty cluster
+            double rr = pixels.r[furthest_pixel];
+            double rg = pixels.g[furthest_pixel];
+            double rb = pixels.b[furthest_pixel];
+
+            labels[furthest_pixel] = i;
+
+            // correct cluster sums
+            double *sum = &sums[3 * i];
+            sum[0] = rr;
+            sum[1] = rg;
+            sum[2] = rb;
+
+            sum = &sums[3 * largest_cluster];
+            sum[0] -= rr;
+            sum[1] -= rg;
+            sum[2] -= rb;
+
+            // correct cluster sizes
+            counts[i] = 1u;
+            counts[largest_cluster]--;
+        }
+
+        // average accumulated cluster sums
+        kmeans_control_phase(&ctl, KMEANS_PHASE_AVERAGE);
+        double max_shift2 = 0.0;
+
+        for (size_t j = 0u; j < n_centroids; ++j) {
+            struct pixel *centroid = &centroids[j];
+            double *sum = &sums[3 * j];
+            size_t count = counts[j];
+
+            struct pixel new_centroid = {
+                sum[0] / count, sum[1] / count, sum[2] / count
+            };
+
+            double dr = new_centroid.r - centroid->r;
+            double dg = new_centroid.g - centroid->g;
+            double db = new_centroid.b - centroid->b;
+
+            double shift2 = dr * dr + dg * dg + db * db;
+            if (shift2 > max_shift2)
+                max_shift2 = shift2;
+
+            *centroid = new_centroid;
+
+            sum[0] = sum[1] = sum[2] = 0.0;
+            counts[j] = 0u;
+        }
+
+        // break if the solution has converged
+        if (kmeans_control_iteration_end(&ctl, n_changed, inertia,
+                                         max_shift2, repaired))
+            break;
+    }
+
+    kmeans_control_end(&ctl);
+
+    kmeans_scratch_end(&scope);
+}
+
+void kmeans_simd(struct pixel_planar pixels, size_t n_pixels,
+                 struct pixel *centroids, size_t n_centroids,
+                 size_t *labels)
+{
+    kmeans_simd_impl(pixels, n_pixels, centroids, n_centroids, labels, 0);
+}
+
+void kmeans_omp_simd(struct pixel_planar pixels, size_t n_pixels,
+                     struct pixel *centroids, size_t n_centroids,
+                     size_t *labels)
+{
+    kmeans_simd_impl(pixels, n_pixels, centroids, n_centroids, labels, 1);
+}
@@ -0,0 +1,559 @@
+#include <math.h>
+#include <omp.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kmeans_config.h"
+#include "kmeans.h"
+#include "kmeans_control.h"
+#include "kmeans_reduce.h"
+#include "kmeans_scratch.h"
+#include "kmeans_util.h"
+
+// colour (r, g, b) and position (x, y) sums per superpixel
+#define SLIC_DIM 5u
+
+/* Helper Functions ***********************************************************/
+
+// regular grid the superpixels are seeded on and the search window (centres
+// are compared to pixels at most window away in either direction)
+struct slic_grid
+{
+    size_t nx, ny;
+    double step_x, step_y;
+    double window;
+
+    // weight of squared spatial distances, (compactness / window)^2
+    double spatial_weight;
+};
+
+// combined SLIC distance of a pixel at (x, y) to a superpixel centre
+static inline double slic_dist(struct pixel pixel, double x, double y,
+                               struct kmeans_superpixel const *centre,
+                               double spatial_weight)
+{
+    double dx = x - centre->x;
+    double dy = y - centre->y;
+
+    return pixel_dist2(pixel, centre->colour) +
+           spatial_weight * (dx * dx + dy * dy);
+}
+
+// the largest grid of at most n_superpixels roughly square cells
+static void slic_grid_init(struct slic_grid *grid, size_t rows, size_t cols,
+                           size_t n_superpixels, double compactness)
+{
+    double step = sqrt((double) rows * cols / n_superpixels);
+
+    grid->nx = (size_t) (cols / step + 0.5);
+    grid->ny = (size_t) (rows / step + 0.5);
+
+    if (!grid->nx)
+        grid->nx = 1u;
+    if (!grid->ny)
+        grid->ny = 1u;
+
+    while (grid->nx * grid->ny > n_superpixels) {
+        if (grid->nx > grid->ny)
+            --grid->nx;
+        else
+            --grid->ny;
+    }
+
+    grid->step_x = (double) cols / grid->nx;
+    grid->step_y = (double) rows / grid->ny;
+    grid->window = grid->step_x > grid->step_y ? grid->step_x : grid->step_y;
+    grid->spatial_weight =
+        compactness * compactness / (grid->window * grid->window);
+}
+
+// squared colour gradient at an interior pixel
+static inline double slic_gradient(struct pixel_bgr const *pixels, size_t x,
+                                   size_t y)
+{
+    unsigned char const *p = &pixels->data[y * pixels->step + 3 * x];
+
+    struct pixel left = bgr_widen(p - 3);
+    struct pixel right = bgr_widen(p + 3);
+    struct pixel up = bgr_widen(p - pixels->step);
+    struct pixel down = bgr_widen(p + pixels->step);
+
+    return pixel_dist2(left, right) + pixel_dist2(up, down);
+}
+
+// place centres at grid cell centres, moved to the lowest gradient position
+// of their 3 x 3 neighbourhood so that they do not start on an edge, label
+// every pixel with the cell containing it
+static void slic_seed(struct pixel_bgr const *pixels,
+                      struct slic_grid const *grid,
+                      struct kmeans_superpixel *centres, size_t *labels,
+                      int parallel)
+{
+    size_t n_centres = grid->nx * grid->ny;
+
+    #pragma omp parallel for if (parallel) schedule(static)
+    for (size_t j = 0u; j < n_centres; ++j) {
+        size_t cx = (size_t) ((j % grid->nx + 0.5) * grid->step_x);
+        size_t cy = (size_t) ((j / grid->nx + 0.5) * grid->step_y);
+
+        size_t best_x = cx;
+        size_t best_y = cy;
+        double min_gradient = -1.0;
+
+        for (size_t y = cy ? cy - 1u : 0u; y <= cy + 1u; ++y) {
+            for (size_t x = cx ? cx - 1u : 0u; x <= cx + 1u; ++x) {
+                // gradients are only defined at interior pixels
+                if (x < 1u || y < 1u || x + 1u >= pixels->cols ||
+                    y + 1u >= pixels->rows)
+                    continue;
+
+                double gradient = slic_gradient(pixels, x, y);
+                if (min_gradient < 0.0 || gradient < min_gradient) {
+                    min_gradient = gradient;
+                    best_x = x;
+                    best_y = y;
+                }
+            }
+        }
+
+        centres[j].colour =
+            bgr_widen(&pixels->data[best_y * pixels->step + 3 * best_x]);
+        centres[j].x = (double) best_x;
+        centres[j].y = (double) best_y;
+        centres[j].size = 0u;
+    }
+
+    #pragma omp parallel for if (parallel) schedule(static)
+    for (size_t y = 0u; y < pixels->rows; ++y) {
+        size_t gy = (size_t) (y / grid->step_y);
+        if (gy >= grid->ny)
+            gy = grid->ny - 1u;
+
+        for (size_t x = 0u; x < pixels->cols; ++x) {
+            size_t gx = (size_t) (x / grid->step_x);
+            if (gx >= grid->nx)
+                gx = grid->nx - 1u;
+
+            labels[y * pixels->cols + x] = gy * grid->nx + gx;
+        }
+    }
+}
+
+// tiles of the image and, per tile, the centres whose search windows overlap
+// it (compressed rows: tile t owns centres[first[t]] to centres[first[t + 1]])
+struct slic_tiles
+{
+    size_t size;
+    size_t nx, ny;
+
+    size_t *first;
+    size_t *centres;
+};
+
+static void slic_tiles_init(struct slic_tiles *tiles, size_t rows, size_t cols,
+                            struct slic_grid const *grid)
+{
+    size_t n_centres = grid->nx * grid->ny;
+
+    tiles->size = (size_t) ceil(grid->window);
+    tiles->nx = (cols + tiles->size - 1u) / tiles->size;
+    tiles->ny = (rows + tiles->size - 1u) / tiles->size;
+
+    // a window of twice the tile size overlaps at most 4 x 4 tiles
+    tiles->first =
+        kmeans_scratch_alloc((tiles->nx * tiles->ny + 1u) * sizeof(size_t));
+    tiles->centres = kmeans_scratch_alloc(16u * n_centres * sizeof(size_t));
+}
+
+// range of tiles (along one axis of length extent) a window overlaps
+static inline void window_tiles(double centre, double window, size_t extent,
+                                size_t tile_size, size_t *begin, size_t *end)
+{
+    double lo = centre - window;
+    double hi = centre + window;
+
+    *begin = lo <= 0.0 ? 0u : (size_t) lo / tile_size;
+    *end = hi >= extent - 1.0 ? (extent - 1u) / tile_size + 1u
+                              : (size_t) hi / tile_size + 1u;
+}
+
+static void slic_tiles_build(struct slic_tiles *tiles, size_t rows,
+                             size_t cols, struct slic_grid const *grid,
+                             struct kmeans_superpixel const *centres)
+{
+    size_t n_centres = grid->nx * grid->ny;
+    size_t n_tiles = tiles->nx * tiles->ny;
+
+    memset(tiles->first, 0, (n_tiles + 1u) * sizeof(size_t));
+
+    // count, turn counts into offsets, then fill (offsets move to the end of
+    // each tile's range and are shifted back afterwards)
+    for (int pass = 0; pass < 2; ++pass) {
+        for (size_t j = 0u; j < n_centres; ++j) {
+            size_t tx0, tx1, ty0, ty1;
+            window_tiles(centres[j].x, grid->window, cols, tiles->size,
+                         &tx0, &tx1);
+            window_tiles(centres[j].y, grid->window, rows, tiles->size,
+                         &ty0, &ty1);
+
+            for (size_t ty = ty0; ty < ty1; ++ty) {
+                for (size_t tx = tx0; tx < tx1; ++tx) {
+                    size_t t = ty * tiles->nx + tx;
+
+                    if (pass == 0)
+                        tiles->first[t + 1u]++;
+                    else
+                        tiles->centres[tiles->first[t]++] = j;
+                }
+            }
+        }
+
+        if (pass == 0) {
+            for (size_t t = 0u; t < n_tiles; ++t)
+                tiles->first[t + 1u] += tiles->first[t];
+        } else {
+            memmove(&tiles->first[1], &tiles->first[0],
+                    n_tiles * sizeof(size_t));
+            tiles->first[0] = 0u;
+        }
+    }
+}
+
+// merge fragments smaller than min_size and all but the first sufficiently
+// large fragment of every superpixel into the superpixel left of (or above)
+// their first pixel in scan order, so that every superpixel is connected
+static void slic_enforce_connectivity(size_t *labels, size_t rows,
+                                      size_t cols, size_t n_centres,
+                                      size_t min_size)
+{
+    size_t n_pixels = rows * cols;
+
+    struct kmeans_scratch_scope scope;
+    kmeans_scratch_begin(&scope);
+
+    size_t *final = kmeans_scratch_alloc(n_pixels * sizeof(size_t));
+    size_t *queue = kmeans_scratch_alloc(n_pixels * sizeof(size_t));
+    unsigned char *kept = kmeans_scratch_calloc(n_centres);
+
+    for (size_t i = 0u; i < n_pixels; ++i)
+        final[i] = SIZE_MAX;
+
+    for (size_t y = 0u; y < rows; ++y) {
+        for (size_t x = 0u; x < cols; ++x) {
+            size_t i = y * cols + x;
+
+            if (final[i] != SIZE_MAX)
+                continue;
+
+            size_t label = labels[i];
+
+            // neighbour already visited in scan order
+            size_t adjacent = SIZE_MAX;
+            if (x > 0u)
+                adjacent = final[i - 1u];
+            else if (y > 0u)
+                adjacent = final[i - cols];
+
+            // flood fill the fragment through 4-neighbours
+            size_t size = 0u;
+            queue[size++] = i;
+            final[i] = label;
+
+            for (size_t q = 0u; q < size; ++q) {
+                size_t p = queue[q];
+                size_t px = p % cols;
+                size_t py = p / cols;
+
+                size_t neighbours[4];
+                size_t n_neighbours = 0u;
+
+                if (px > 0u)
+                    neighbours[n_neighbours++] = p - 1u;
+                if (px + 1u < cols)
+                    neighbours[n_neighbours++] = p + 1u;
+                if (py > 0u)
+                    neighbours[n_neighbours++] = p - cols;
+                if (py + 1u < rows)
+                    neighbours[n_neighbours++] = p + cols;
+
+                for (size_t k = 0u; k < n_neighbours; ++k) {
+                    size_t nb = neighbours[k];
+
+                    if (final[nb] == SIZE_MAX && labels[nb] == label) {
+                        final[nb] = label;
+                        queue[size++] = nb;
+                    }
+                }
+            }
+
+            if ((size < min_size || kept[label]) && adjacent != SIZE_MAX) {
+                for (size_t q = 0u; q < size; ++q)
+                    final[queue[q]] = adjacent;
+            } else {
+                kept[label] = 1u;
+            }
+        }
+    }
+
+    memcpy(labels, final, n_pixels * sizeof(size_t));
+
+    kmeans_scratch_end(&scope);
+}
+
+/* Main Functions *************************************************************/
+
+static size_t kmeans_slic_impl(struct pixel_bgr pixels,
+                               struct kmeans_superpixel *superpixels,
+                               size_t n_superpixels, size_t *labels,
+                               double compactness, int parallel)
+{
+    size_t n_pixels = pixels.rows * pixels.cols;
+    int n_threads = parallel ? omp_get_max_threads() : 1;
+
+    if (n_superpixels > n_pixels)
+        n_superpixels = n_pixels;
+    if (!n_superpixels)
+        n_superpixels = 1u;
+
+    struct kmeans_scratch_scope scope;
+    kmeans_scratch_begin(&scope);
+
+    struct slic_grid grid;
+    slic_grid_init(&grid, pixels.rows, pixels.cols, n_superpixels,
+                   compactness);
+
+    size_t n_centres = grid.nx * grid.ny;
+
+    // allocate auxiliary memory
+    double *sums = kmeans_scratch_alloc(SLIC_DIM * n_centres * sizeof(double));
+    size_t *counts = kmeans_scratch_alloc(n_centres * sizeof(size_t));
+
+    struct kmeans_accumulators acc;
+    kmeans_accumulators_init_dim(&acc, n_centres, SLIC_DIM, n_threads);
+
+    struct slic_tiles tiles;
+    slic_tiles_init(&tiles, pixels.rows, pixels.cols, &grid);
+
+    struct kmeans_control ctl;
+    kmeans_control_begin(
+        &ctl, parallel ? "kmeans_omp_slic" : "kmeans_slic", n_pixels);
+
+    // initialize centres on the grid
+    kmeans_control_phase(&ctl, KMEANS_PHASE_SEED);
+    slic_seed(&pixels, &grid, superpixels, labels, parallel);
+
+    // SLIC settles within a few iterations
+    int max_iter = kmeans_control_max_iter(&ctl);
+    if (max_iter > KMEANS_SLIC_MAX_ITER)
+        max_iter = KMEANS_SLIC_MAX_ITER;
+
+    // repeat until converged or for at most max_iter iterations
+    for (int iter = 0; iter < max_iter; ++iter) {
+        size_t n_changed = 0u;
+        double inertia = 0.0;
+
+        kmeans_control_iteration_begin(&ctl);
+
+        // reassign pixels to the closest centre whose window contains them,
+        // one tile at a time against the centres overlapping it, pixels
+        // outside all windows keep their superpixel
+        kmeans_control_phase(&ctl, KMEANS_PHASE_ASSIGN);
+        slic_tiles_build(&tiles, pixels.rows, pixels.cols, &grid,
+                         superpixels);
+
+        #pragma omp parallel if (parallel) reduction(+ : n_changed, inertia)
+        {
+            kmeans_accumulators_reset(&acc);
+
+            int tid = omp_get_thread_num();
+            double *thread_sums = kmeans_accumulators_sums(&acc, tid);
+            size_t *thread_counts = kmeans_accumulators_counts(&acc, tid);
+
+            #pragma omp for schedule(static) collapse(2)
+            for (size_t ty = 0u; ty < tiles.ny; ++ty) {
+                for (size_t tx = 0u; tx < tiles.nx; ++tx) {
+                    size_t t = ty * tiles.nx + tx;
+                    size_t const *candidates = &tiles.centres[tiles.first[t]];
+                    size_t n_candidates = tiles.first[t + 1u] - tiles.first[t];
+
+                    size_t y1 = (ty + 1u) * tiles.size;
+                    size_t x1 = (tx + 1u) * tiles.size;
+                    if (y1 > pixels.rows)
+                        y1 = pixels.rows;
+                    if (x1 > pixels.cols)
+                        x1 = pixels.cols;
+
+                    for (size_t y = ty * tiles.size; y < y1; ++y) {
+                        unsigned char const *row =
+                            &pixels.data[y * pixels.step];
+
+                        for (size_t x = tx * tiles.size; x < x1; ++x) {
+                            size_t i = y * pixels.cols + x;
+                            struct pixel pixel = bgr_widen(&row[3 * x]);
+
+                            // find centre closest to pixel among those
+                            // whose window contains it
+                            size_t closest_centre = labels[i];
+                            double min_dist = -1.0;
+
+                            for (size_t c = 0u; c < n_candidates; ++c) {
+                                struct kmeans_superpixel const *centre =
+                                    &superpixels[candidates[c]];
+
+                                if (fabs(x - centre->x) > grid.window ||
+                                    fabs(y - centre->y) > grid.window)
+                                    continue;
+
+                                double dist = slic_dist(pixel, x, y, centre,
+                                                        grid.spatial_weight);
+
+                                if (min_dist < 0.0 || dist < min_dist) {
+                                    closest_centre = candidates[c];
+                                    min_dist = dist;
+                                }
+                            }
+
+                            if (min_dist < 0.0)
+                                min_dist = slic_dist(
+                                    pixel, x, y, &superpixels[closest_centre],
+                                    grid.spatial_weight);
+
+                            inertia += min_dist;
+
+                            // if pixel has changed superpixel...
+                            if (closest_centre != labels[i]) {
+                                labels[i] = closest_centre;
+
+                                ++n_changed;
+                            }
+
+                            // update superpixel sum
+                            double *sum = &thread_sums[SLIC_DIM * closest_centre];
+                            sum[0] += pixel.r;
+                            sum[1] += pixel.g;
+                            sum[2] += pixel.b;
+                            sum[3] += (double) x;
+                            sum[4] += (double) y;
+
+                            // update superpixel size
+                            thread_counts[closest_centre]++;
+                        }
+                    }
+                }
+            }
+        }
+
+        kmeans_accumulators_merge(&acc, sums, counts);
+
+        // average accumulated sums, empty superpixels keep their centre
+        // (moving pixels far away into them would defeat the spatial
+        // constraint)
+        kmeans_control_phase(&ctl, KMEANS_PHASE_AVERAGE);
+        double max_shift2 = 0.0;
+
+        for (size_t j = 0u; j < n_centres; ++j) {
+            struct kmeans_superpixel *centre = &superpixels[j];
+            double const *sum = &sums[SLIC_DIM * j];
+            size_t count = counts[j];
+
+            if (!count)
+                continue;
+
+            struct kmeans_superpixel moved = {
+                { sum[0] / count, sum[1] / count, sum[2] / count },
+                sum[3] / count, sum[4] / count, count
+            };
+
+            double shift2 = slic_dist(moved.colour, moved.x, moved.y, centre,
+                                      grid.spatial_weight);
+            if (shift2 > max_shift2)
+                max_shift2 = shift2;
+
+            *centre = moved;
+        }
+
+        // break if the solution has converged
+        if (kmeans_control_iteration_end(&ctl, n_changed, inertia,
+                                         max_shift2, 0))
+            break;
+    }
+
+    // make every superpixel connected, dropping fragments below a quarter
+    // of the nominal superpixel size
+    kmeans_control_phase(&ctl, KMEANS_PHASE_LABEL);
+    slic_enforce_connectivity(labels, pixels.rows, pixels.cols, n_centres,
+                              n_pixels / n_centres / 4u);
+
+    // superpixels of the final labels
+    kmeans_control_phase(&ctl, KMEANS_PHASE_AVERAGE);
+
+    #pragma omp parallel if (parallel)
+    {
+        kmeans_accumulators_reset(&acc);
+
+        int tid = omp_get_thread_num();
+        double *thread_sums = kmeans_accumulators_sums(&acc, tid);
+        size_t *thread_counts = kmeans_accumulators_counts(&acc, tid);
+
+        #pragma omp for schedule(static)
+        for (size_t y = 0u; y < pixels.rows; ++y) {
+            unsigned char const *row = &pixels.data[y * pixels.step];
+
+            for (size_t x = 0u; x < pixels.cols; ++x) {
+                size_t label = labels[y * pixels.cols + x];
+                struct pixel pixel = bgr_widen(&row[3 * x]);
+
+                double *sum = &thread_sums[SLIC_DIM * label];
+                sum[0] += pixel.r;
+                sum[1] += pixel.g;
+                sum[2] += pixel.b;
+                sum[3] += (double) x;
+                sum[4] += (double) y;
+
+                thread_counts[label]++;
+            }
+        }
+    }
+
+    kmeans_accumulators_merge(&acc, sums, counts);
+
+    for (size_t j = 0u; j < n_centres; ++j) {
+        double const *sum = &sums[SLIC_DIM * j];
+        size_t count = counts[j];
+
+        superpixels[j].size = count;
+
+        if (!count)
+            continue;
+
+        superpixels[j].colour.r = sum[0] / count;
+        superpixels[j].colour.g = sum[1] / count;
+        superpixels[j].colour.b = sum[2] / count;
+        superpixels[j].x = sum[3] / count;
+        superpixels[j].y = sum[4] / count;
+    }
+
+    kmeans_control_end(&ctl);
+
+    kmeans_scratch_end(&scope);
+
+    return n_centres;
+}
+
+size_t kmeans_slic(struct pixel_bgr pixels,
+                   struct kmeans_superpixel *superpixels,
+                   size_t n_superpixels, size_t *labels, double compactness)
+{
+    return kmeans_slic_impl(pixels, superpixels, n_superpixels, labels,
+                            compactness, 0);
+}
+
+size_t kmeans_omp_slic(struct pixel_bgr pixels,
+                       struct kmeans_superpixel *superpixels,
+                       size_t n_superpixels, size_t *labels,
+                       double compactness)
+{
+    return kmeans_slic_impl(pixels, superpixels, n_superpixels, labels,
+                            compactness, 1);
+}
@@ -0,0 +1,198 @@
+#ifdef __linux__
+#define _DEFAULT_SOURCE
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <omp.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "kmeans_config.h"
+#include "kmeans.h"
+#include "kmeans_control.h"
+#include "kmeans_reduce.h"
+#include "kmeans_scratch.h"
+#include "kmeans_util.h"
+
+/* Helper Functions ***********************************************************/
+
+// widen a single packed 8-bit RGB pixel
+static inline struct pixel rgb_widen(unsigned char const *p)
+{
+    struct pixel pixel = { p[0], p[1], p[2] };
+    return pixel;
+}
+
+// drop the pages fully contained in bytes [begin, end) of a mapping from this
+// process (file contents, including modifications, stay in the page cache),
+// so that resident memory is bounded by the tiles currently being processed
+static void release_pages(void const *map, size_t begin, size_t end)
+{
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+
+    begin = (begin + page - 1u) / page * page;
+    end = end / page * page;
+
+    if (end > begin)
+        madvise((char *) map + begin, end - begin, MADV_DONTNEED);
+}
+
+/* Label Type Specializations *************************************************/
+
+#define LABEL_T uint8_t
+#define KMEANS_STREAM_IMPL kmeans_stream_u8
+#include "kmeans_stream_impl.h"
+#undef LABEL_T
+#undef KMEANS_STREAM_IMPL
+
+#define LABEL_T uint16_t
+#define KMEANS_STREAM_IMPL kmeans_stream_u16
+#include "kmeans_stream_impl.h"
+#undef LABEL_T
+#undef KMEANS_STREAM_IMPL
+
+#define LABEL_T uint32_t
+#define KMEANS_STREAM_IMPL kmeans_stream_u32
+#include "kmeans_stream_impl.h"
+#undef LABEL_T
+#undef KMEANS_STREAM_IMPL
+
+#define LABEL_T size_t
+#define KMEANS_STREAM_IMPL kmeans_stream_size
+#include "kmeans_stream_impl.h"
+#undef LABEL_T
+#undef KMEANS_STREAM_IMPL
+
+/* Main Functions *************************************************************/
+
+static void kmeans_stream_dispatch(unsigned char const *pixels,
+                                   size_t n_pixels,
+                                   struct pixel *centroids,
+                                   size_t n_centroids,
+                                   void *labels,
+                                   enum kmeans_label_type label_type,
+                                   int parallel)
+{
+    switch (label_type) {
+    case KMEANS_LABEL_U8:
+        assert(n_centroids <= (size_t) UINT8_MAX + 1u);
+        kmeans_stream_u8(pixels, n_pixels, centroids, n_centroids,
+                         (uint8_t *) labels, parallel);
+        break;
+    case KMEANS_LABEL_U16:
+        assert(n_centroids <= (size_t) UINT16_MAX + 1u);
+        kmeans_stream_u16(pixels, n_pixels, centroids, n_centroids,
+                          (uint16_t *) labels, parallel);
+        break;
+    case KMEANS_LABEL_U32:
+        assert(n_centroids <= (size_t) UINT32_MAX + 1u);
+        kmeans_stream_u32(pixels, n_pixels, centroids, n_centroids,
+                          (uint32_t *) labels, parallel);
+        break;
+    case KMEANS_LABEL_SIZE:
+        kmeans_stream_size(pixels, n_pixels, centroids, n_centroids,
+                           (size_t *) labels, parallel);
+        break;
+    }
+}
+
+static int kmeans_stream_impl(char const *pixel_file, char const *label_file,
+                              struct pixel *centroids, size_t n_centroids,
+                              enum kmeans_label_type label_type, int parallel)
+{
+    int err = 0;
+
+    int in_fd = -1;
+    int out_fd = -1;
+    void *in_map = MAP_FAILED;
+    void *out_map = MAP_FAILED;
+
+    size_t in_size = 0u;
+    size_t out_size = 0u;
+
+    // map input
+    in_fd = open(pixel_file, O_RDONLY);
+    if (in_fd == -1)
+        goto fail;
+
+    struct stat st;
+    if (fstat(in_fd, &st) == -1)
+        goto fail;
+
+    in_size = (size_t) st.st_size;
+
+    if (in_size == 0u || in_size % 3u) {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    in_map = mmap(NULL, in_size, PROT_READ, MAP_SHARED, in_fd, 0);
+    if (in_map == MAP_FAILED)
+        goto fail;
+
+    madvise(in_map, in_size, MADV_SEQUENTIAL);
+
+    // create and map output, labels start out as zero
+    size_t n_pixels = in_size / 3u;
+    out_size = n_pixels * kmeans_label_size(label_type);
+
+    out_fd = open(label_file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (out_fd == -1)
+        goto fail;
+
+    if (ftruncate(out_fd, (off_t) out_size) == -1)
+        goto fail;
+
+    out_map = mmap(NULL, out_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   out_fd, 0);
+    if (out_map == MAP_FAILED)
+        goto fail;
+
+    madvise(out_map, out_size, MADV_SEQUENTIAL);
+
+    kmeans_stream_dispatch(in_map, n_pixels, centroids, n_centroids, out_map,
+                           label_type, parallel);
+
+    goto done;
+
+fail:
+    err = errno;
+
+done:
+    if (out_map != MAP_FAILED)
+        munmap(out_map, out_size);
+    if (out_fd != -1)
+        close(out_fd);
+    if (in_map != MAP_FAILED)
+        munmap(in_map, in_size);
+    if (in_fd != -1)
+        close(in_fd);
+
+    if (err) {
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+int kmeans_stream(char const *pixel_file, char const *label_file,
+                  struct pixel *centroids, size_t n_centroids,
+                  enum kmeans_label_type label_type)
+{
+    return kmeans_stream_impl(pixel_file, label_file, centroids, n_centroids,
+                              label_type, 0);
+}
+
+int kmeans_omp_stream(char const *pixel_file, char const *label_file,
+                      struct pixel *centroids, size_t n_centroids,
+                      enum kmeans_label_type label_type)
+{
+    return kmeans_stream_impl(pixel_file, label_file, centroids, n_centroids,
+                              label_type, 1);
+}
@@ -0,0 +1,260 @@
+// streaming engine body, included once per label type by kmeans_stream.c with
+// LABEL_T (label storage type) and KMEANS_STREAM_IMPL (function name) defined
+
+#define KMEANS_STREAM_CONCAT(a, b) a##b
+#define KMEANS_STREAM_NAME(a, b) KMEANS_STREAM_CONCAT(a, b)
+#define KMEANS_STREAM_FURTHEST \
+    KMEANS_STREAM_NAME(KMEANS_STREAM_IMPL, _furthest)
+
+// find the pixel of some cluster furthest from its centroid (SIZE_MAX if the
+// cluster is empty), streaming over all tiles
+static size_t KMEANS_STREAM_FURTHEST(unsigned char const *pixels,
+                                     size_t n_pixels, LABEL_T const *labels,
+                                     size_t cluster, struct pixel centroid,
+                                     int parallel)
+{
+    size_t n_tiles = (n_pixels + KMEANS_STREAM_TILESIZE - 1u) /
+                     KMEANS_STREAM_TILESIZE;
+
+    size_t furthest = SIZE_MAX;
+    double max_dist = -1.0;
+
+    #pragma omp parallel if (parallel)
+    {
+        size_t thread_furthest = SIZE_MAX;
+        double thread_max_dist = -1.0;
+
+        #pragma omp for schedule(static) nowait
+        for (size_t t = 0u; t < n_tiles; ++t) {
+            size_t begin = t * KMEANS_STREAM_TILESIZE;
+            size_t end = begin + KMEANS_STREAM_TILESIZE;
+            if (end > n_pixels)
+                end = n_pixels;
+
+            for (size_t i = begin; i < end; ++i) {
+                if (labels[i] != cluster)
+                    continue;
+
+                double dist = pixel_dist2(rgb_widen(&pixels[3 * i]), centroid);
+
+                if (dist > thread_max_dist) {
+                    thread_furthest = i;
+                    thread_max_dist = dist;
+                }
+            }
+
+            release_pages(pixels, 3 * begin, 3 * end);
+            release_pages(labels, begin * sizeof(LABEL_T),
+                          end * sizeof(LABEL_T));
+        }
+
+        #pragma omp critical
+        {
+            if (thread_max_dist > max_dist ||
+                (thread_max_dist == max_dist && thread_furthest < furthest)) {
+                furthest = thread_furthest;
+                max_dist = thread_max_dist;
+            }
+        }
+    }
+
+    return furthest;
+}
+
+static void KMEANS_STREAM_IMPL(unsigned char const *pixels, size_t n_pixels,
+                               struct pixel *centroids, size_t n_centroids,
+                               LABEL_T *labels, int parallel)
+{
+    size_t n_tiles = (n_pixels + KMEANS_STREAM_TILESIZE - 1u) /
+                     KMEANS_STREAM_TILESIZE;
+
+    struct kmeans_scratch_scope scope;
+    kmeans_scratch_begin(&scope);
+
+    // allocate auxiliary memory
+    double *sums = kmeans_scratch_alloc(3 * n_centroids * sizeof(double));
+    size_t *counts = kmeans_scratch_alloc(n_centroids * sizeof(size_t));
+
+    struct kmeans_accumulators acc;
+    kmeans_accumulators_init(&acc, n_centroids,
+                             parallel ? omp_get_max_threads() : 1);
+
+    struct kmeans_control ctl;
+    kmeans_control_begin(
+        &ctl, parallel ? "kmeans_omp_stream" : "kmeans_stream", n_pixels);
+
+    // initialize centroids from an evenly strided sample, so that seeding
+    // memory does not grow with the input either
+    kmeans_control_phase(&ctl, KMEANS_PHASE_SEED);
+
+    size_t n_sample = n_pixels < KMEANS_STREAM_SAMPLE ?
+                      n_pixels : KMEANS_STREAM_SAMPLE;
+    size_t stride = n_pixels / n_sample;
+
+    struct pixel *sample =
+        kmeans_scratch_alloc(n_sample * sizeof(struct pixel));
+
+    // the stride is typically shorter than a page, so pages are dropped
+    // behind the sample as during the iterations
+    size_t released = 0u;
+    for (size_t s = 0u; s < n_sample; ++s) {
+        size_t i = s * stride;
+        sample[s] = rgb_widen(&pixels[3 * i]);
+
+        if (i - released >= KMEANS_STREAM_TILESIZE) {
+            release_pages(pixels, 3 * released, 3 * i);
+            released = i;
+        }
+    }
+
+    release_pages(pixels, 3 * released, 3 * n_pixels);
+
+    kmeans_seed(sample, n_sample, centroids, n_centroids, parallel);
+
+    // repeat until converged or for at most max_iter iterations
+    for (int iter = 0; iter < kmeans_control_max_iter(&ctl); ++iter) {
+        size_t n_changed = 0u;
+        double inertia = 0.0;
+        int repaired = 0;
+
+        kmeans_control_iteration_begin(&ctl);
+
+        // reassign points to closest centroids one tile at a time, each
+        // thread streaming through a contiguous range of tiles
+        kmeans_control_phase(&ctl, KMEANS_PHASE_ASSIGN);
+        #pragma omp parallel if (parallel) reduction(+ : n_changed, inertia)
+        {
+            kmeans_accumulators_reset(&acc);
+
+            int tid = omp_get_thread_num();
+            double *thread_sums = kmeans_accumulators_sums(&acc, tid);
+            size_t *thread_counts = kmeans_accumulators_counts(&acc, tid);
+
+            #pragma omp for schedule(static)
+            for (size_t t = 0u; t < n_tiles; ++t) {
+                size_t begin = t * KMEANS_STREAM_TILESIZE;
+                size_t end = begin + KMEANS_STREAM_TILESIZE;
+                if (end > n_pixels)
+                    end = n_pixels;
+
+                for (size_t i = begin; i < end; ++i) {
+                    struct pixel pixel = rgb_widen(&pixels[3 * i]);
+
+                    // find centroid closest to pixel
+                    double min_dist;
+                    LABEL_T closest_centroid = (LABEL_T) find_closest_centroid(
+                        pixel, centroids, n_centroids, &min_dist);
+
+                    inertia += min_dist;
+
+                    // if pixel has changed cluster...
+                    if (closest_centroid != labels[i]) {
+                        labels[i] = closest_centroid;
+
+                        ++n_changed;
+                    }
+
+                    // update cluster sum
+                    double *sum = &thread_sums[3 * closest_centroid];
+                    sum[0] += pixel.r;
+                    sum[1] += pixel.g;
+                    sum[2] += pixel.b;
+
+                    // update cluster size
+                    thread_counts[closest_centroid]++;
+                }
+
+                // the tile is not touched again during this iteration
+                release_pages(pixels, 3 * begin, 3 * end);
+                release_pages(labels, begin * sizeof(LABEL_T),
+                              end * sizeof(LABEL_T));
+            }
+        }
+
+        kmeans_accumulators_merge(&acc, sums, counts);
+
+        // repair empty clusters, one further pass over the input each
+        kmeans_control_phase(&ctl, KMEANS_PHASE_REPAIR);
+        for (size_t i = 0u; i < n_centroids; ++i) {
+            if (counts[i])
+                continue;
+
+            repaired = 1;
+
+            // determine largest cluster
+            size_t largest_cluster = 0u;
+            size_t largest_cluster_count = 0u;
+            for (size_t j = 0u; j < n_centroids; ++j) {
+                if (j == i)
+                    continue;
+
+                if (counts[j] > largest_cluster_count) {
+                    largest_cluster = j;
+                    largest_cluster_count = counts[j];
+                }
+            }
+
+            // determine pixel in this cluster furthest from its centroid
+            size_t furthest_pixel = KMEANS_STREAM_FURTHEST(
+                pixels, n_pixels, labels, largest_cluster,
+                centroids[largest_cluster], parallel);
+
+            if (furthest_pixel == SIZE_MAX)
+                continue;
+
+            // move that pixel to the empty cluster
+            struct pixel replacement_pixel =
+                rgb_widen(&pixels[3 * furthest_pixel]);
+            centroids[i] = replacement_pixel;
+            labels[furthest_pixel] = (LABEL_T) i;
+
+            // correct cluster sums
+            double *sum = &sums[3 * i];
+            sum[0] = replacement_pixel.r;
+            sum[1] = replacement_pixel.g;
+            sum[2] = replacement_pixel.b;
+
+            sum = &sums[3 * largest_cluster];
+            sum[0] -= replacement_pixel.r;
+            sum[1] -= replacement_pixel.g;
+            sum[2] -= replacement_pixel.b;
+
+            // correct cluster sizes
+            counts[i] = 1u;
+            counts[largest_cluster]--;
+        }
+
+        // average accumulated cluster sums
+        kmeans_control_phase(&ctl, KMEANS_PHASE_AVERAGE);
+        double max_shift2 = 0.0;
+
+        for (size_t j = 0u; j < n_centroids; ++j) {
+            struct pixel *centroid = &centroids[j];
+            double *sum = &sums[3 * j];
+            size_t count = counts[j];
+
+            struct pixel new_centroid = {
+                sum[0] / count, sum[1] / count, sum[2] / count
+            };
+
+            double shift2 = pixel_dist2(new_centroid, *centroid);
+            if (shift2 > max_shift2)
+                max_shift2 = shift2;
+
+            *centroid = new_centroid;
+        }
+
+        // break if the solution has converged
+        if (kmeans_control_iteration_end(&ctl, n_changed, inertia,
+                                         max_shift2, repaired))
+            break;
+    }
+
+    kmeans_control_end(&ctl);
+
+    kmeans_scratch_end(&scope);
+}
+
+#undef KMEANS_STREAM_FURTHEST
+#undef KMEANS_STREAM_NAME
+#undef KMEANS_STREAM_CONCAT
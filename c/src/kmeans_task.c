@@ -0,0 +1,178 @@
+#include <omp.h>
+#include <stdlib.h>
+
+#include "kmeans_config.h"
+#include "kmeans.h"
+#include "kmeans_control.h"
+#include "kmeans_reduce.h"
+#include "kmeans_scratch.h"
+#include "kmeans_util.h"
+
+/* Helper Functions ***********************************************************/
+
+// reassign pixels [begin, end) to their closest centroids, accumulating into
+// the sums / counts of this chunk
+static void assign_chunk(struct pixel const *pixels, size_t begin, size_t end,
+                         struct pixel const *centroids, size_t n_centroids,
+                         size_t *labels, double *sums, size_t *counts,
+                         size_t *n_changed_out, double *inertia_out)
+{
+    size_t n_changed = 0u;
+    double inertia = 0.0;
+
+    for (size_t j = 0u; j < n_centroids; ++j) {
+        sums[3 * j] = 0.0;
+        sums[3 * j + 1] = 0.0;
+        sums[3 * j + 2] = 0.0;
+
+        counts[j] = 0u;
+    }
+
+    for (size_t i = begin; i < end; ++i) {
+        struct pixel pixel = pixels[i];
+
+        // find centroid closest to pixel
+        double min_dist2;
+        size_t closest_centroid =
+            find_closest_centroid(pixel, centroids, n_centroids, &min_dist2);
+
+        inertia += min_dist2;
+
+        // if pixel has changed cluster...
+        if (closest_centroid != labels[i]) {
+            labels[i] = closest_centroid;
+
+            ++n_changed;
+        }
+
+        // update cluster sum
+        double *sum = &sums[3 * closest_centroid];
+        sum[0] += pixel.r;
+        sum[1] += pixel.g;
+        sum[2] += pixel.b;
+
+        // update cluster size
+        counts[closest_centroid]++;
+    }
+
+    *n_changed_out = n_changed;
+    *inertia_out = inertia;
+}
+
+/* Main Functions *************************************************************/
+
+void kmeans_task(struct pixel *pixels, size_t n_pixels,
+                 struct pixel *centroids, size_t n_centroids,
+                 size_t *labels)
+{
+    struct kmeans_scratch_scope scope;
+    kmeans_scratch_begin(&scope);
+
+    // one padded slot of sums / counts per chunk, merged in chunk order so
+    // that the result does not depend on which thread ran which chunk
+    size_t n_chunks = (n_pixels + KMEANS_TASK_GRAINSIZE - 1u) /
+                      KMEANS_TASK_GRAINSIZE;
+
+    size_t slot = 3 * n_centroids * sizeof(double) +
+                  n_centroids * sizeof(size_t);
+    size_t stride = (slot + KMEANS_CACHELINE - 1u) /
+                    KMEANS_CACHELINE * KMEANS_CACHELINE;
+
+    char *chunk_acc = kmeans_scratch_alloc(n_chunks * stride);
+    size_t *chunk_changed = kmeans_scratch_alloc(n_chunks * sizeof(size_t));
+    double *chunk_inertia = kmeans_scratch_alloc(n_chunks * sizeof(double));
+
+    double *sums = kmeans_scratch_alloc(3 * n_centroids * sizeof(double));
+    size_t *counts = kmeans_scratch_alloc(n_centroids * sizeof(size_t));
+
+    struct kmeans_control ctl;
+    kmeans_control_begin(&ctl, "kmeans_task", n_pixels);
+
+    // initialize centroids
+    kmeans_control_phase(&ctl, KMEANS_PHASE_SEED);
+    kmeans_seed(pixels, n_pixels, centroids, n_centroids, 0);
+
+    // repeat until converged or for at most max_iter iterations
+    for (int iter = 0; iter < kmeans_control_max_iter(&ctl); ++iter) {
+        size_t n_changed = 0u;
+        double inertia = 0.0;
+
+        kmeans_control_iteration_begin(&ctl);
+
+        // reassign points to closest centroids, one task per chunk of pixels
+        // (a single chunk runs right away), chunks are untied since they do
+        // not touch any per-thread state, so that any idle thread of the
+        // team may pick them up
+        kmeans_control_phase(&ctl, KMEANS_PHASE_ASSIGN);
+        #pragma omp taskloop untied grainsize(1) if (n_chunks > 1u)
+        for (size_t c = 0u; c < n_chunks; ++c) {
+            size_t begin = c * KMEANS_TASK_GRAINSIZE;
+            size_t end = begin + KMEANS_TASK_GRAINSIZE;
+            if (end > n_pixels)
+                end = n_pixels;
+
+            double *chunk_sums = (double *) &chunk_acc[c * stride];
+            size_t *chunk_counts = (size_t *) &chunk_acc[
+                c * stride + 3 * n_centroids * sizeof(double)];
+
+            assign_chunk(pixels, begin, end, centroids, n_centroids, labels,
+                         chunk_sums, chunk_counts,
+                         &chunk_changed[c], &chunk_inertia[c]);
+        }
+
+        for (size_t j = 0u; j < 3 * n_centroids; ++j)
+            sums[j] = 0.0;
+
+        for (size_t j = 0u; j < n_centroids; ++j)
+            counts[j] = 0u;
+
+        for (size_t c = 0u; c < n_chunks; ++c) {
+            double const *chunk_sums = (double const *) &chunk_acc[c * stride];
+            size_t const *chunk_counts = (size_t const *) &chunk_acc[
+                c * stride + 3 * n_centroids * sizeof(double)];
+
+            for (size_t j = 0u; j < 3 * n_centroids; ++j)
+                sums[j] += chunk_sums[j];
+
+            for (size_t j = 0u; j < n_centroids; ++j)
+                counts[j] += chunk_counts[j];
+
+            n_changed += chunk_changed[c];
+            inertia += chunk_inertia[c];
+        }
+
+        // repair all empty clusters at once
+        kmeans_control_phase(&ctl, KMEANS_PHASE_REPAIR);
+        int repaired = kmeans_repair_empty_clusters(pixels, n_pixels,
+                                                    centroids, n_centroids,
+                                                    labels, sums, counts) > 0;
+
+        // average accumulated cluster sums
+        kmeans_control_phase(&ctl, KMEANS_PHASE_AVERAGE);
+        double max_shift2 = 0.0;
+
+        for (size_t j = 0u; j < n_centroids; ++j) {
+            double const *sum = &sums[3 * j];
+            size_t count = counts[j];
+
+            struct pixel new_centroid = {
+                sum[0] / count, sum[1] / count, sum[2] / count
+            };
+
+            double shift2 = pixel_dist2(new_centroid, centroids[j]);
+            if (shift2 > max_shift2)
+                max_shift2 = shift2;
+
+            centroids[j] = new_centroid;
+        }
+
+        // break if the solution has converged
+        if (kmeans_control_iteration_end(&ctl, n_changed, inertia,
+                                         max_shift2, repaired))
+            break;
+    }
+
+    kmeans_control_end(&ctl);
+
+    kmeans_scratch_end(&scope);
+}
@@ -0,0 +1,317 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <math.h>
+#include <omp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "kmeans_config.h"
+#include "kmeans.h"
+#include "kmeans_trace.h"
+
+/* Data Structures ************************************************************/
+
+struct kmeans_trace
+{
+    struct kmeans_trace_event *events;
+    size_t n_events;
+    size_t capacity;
+
+    size_t calls;
+
+    // wall time the trace was created, event timestamps are relative to it
+    double origin;
+
+    // perf_event_open group (leader first), -1 if not available
+    int counter_fds[KMEANS_COUNTERS];
+};
+
+// trace recorded into by engines called from this thread
+static __thread struct kmeans_trace *active_trace = NULL;
+
+static char const *phase_names[KMEANS_PHASES] = {
+    "seed", "assign", "repair", "average", "label"
+};
+
+static char const *counter_names[KMEANS_COUNTERS] = {
+    "cycles", "instructions", "cache_misses"
+};
+
+/* Hardware Counters **********************************************************/
+
+#ifdef __linux__
+
+static int counter_open(uint64_t config, int group_fd)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = group_fd == -1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+
+    return (int) syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+static void counters_open(struct kmeans_trace *trace)
+{
+    static uint64_t const configs[KMEANS_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES
+    };
+
+    for (int i = 0; i < KMEANS_COUNTERS; ++i) {
+        int fd = counter_open(configs[i], i ? trace->counter_fds[0] : -1);
+
+        // all or nothing
+        if (fd == -1) {
+            for (int j = 0; j < i; ++j) {
+                close(trace->counter_fds[j]);
+                trace->counter_fds[j] = -1;
+            }
+            return;
+        }
+
+        trace->counter_fds[i] = fd;
+    }
+
+    ioctl(trace->counter_fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+static void counters_close(struct kmeans_trace *trace)
+{
+    for (int i = 0; i < KMEANS_COUNTERS; ++i) {
+        if (trace->counter_fds[i] != -1)
+            close(trace->counter_fds[i]);
+    }
+}
+
+#else
+
+static void counters_open(struct kmeans_trace *trace) { (void) trace; }
+
+static void counters_close(struct kmeans_trace *trace) { (void) trace; }
+
+#endif
+
+/* Main Functions *************************************************************/
+
+struct kmeans_trace *kmeans_trace_create(int hw_counters)
+{
+    struct kmeans_trace *trace = calloc(1, sizeof(struct kmeans_trace));
+
+    trace->origin = omp_get_wtime();
+
+    for (int i = 0; i < KMEANS_COUNTERS; ++i)
+        trace->counter_fds[i] = -1;
+
+    if (hw_counters)
+        counters_open(trace);
+
+    return trace;
+}
+
+void kmeans_trace_destroy(struct kmeans_trace *trace)
+{
+    if (!trace)
+        return;
+
+    if (active_trace == trace)
+        active_trace = NULL;
+
+    counters_close(trace);
+
+    free(trace->events);
+    free(trace);
+}
+
+void kmeans_set_trace(struct kmeans_trace *trace)
+{
+    active_trace = trace;
+}
+
+int kmeans_trace_has_counters(struct kmeans_trace const *trace)
+{
+    return trace->counter_fds[0] != -1;
+}
+
+void kmeans_trace_clear(struct kmeans_trace *trace)
+{
+    trace->n_events = 0u;
+    trace->calls = 0u;
+}
+
+struct kmeans_phase_stats kmeans_trace_get_phase_stats(
+    struct kmeans_trace const *trace, enum kmeans_phase phase)
+{
+    struct kmeans_phase_stats stats;
+    memset(&stats, 0, sizeof(stats));
+
+    for (size_t i = 0u; i < trace->n_events; ++i) {
+        struct kmeans_trace_event const *event = &trace->events[i];
+
+        if (event->type != KMEANS_EVENT_PHASE || event->phase != phase)
+            continue;
+
+        stats.count++;
+        stats.time += event->duration;
+
+        for (int j = 0; j < KMEANS_COUNTERS; ++j)
+            stats.counters[j] += event->counters[j];
+    }
+
+    return stats;
+}
+
+char const *kmeans_phase_name(enum kmeans_phase phase)
+{
+    return phase_names[phase];
+}
+
+/* Output *********************************************************************/
+
+// JSON has no representation of NAN / infinity
+static void write_double(FILE *f, double value)
+{
+    if (isfinite(value))
+        fprintf(f, "%.17g", value);
+    else
+        fprintf(f, "null");
+}
+
+static void write_event(FILE *f, struct kmeans_trace const *trace,
+                        struct kmeans_trace_event const *event)
+{
+    char const *name;
+    char const *cat;
+
+    switch (event->type) {
+    case KMEANS_EVENT_CALL:
+        name = event->engine;
+        cat = "call";
+        break;
+    case KMEANS_EVENT_ITERATION:
+        name = "iteration";
+        cat = event->engine;
+        break;
+    default:
+        name = phase_names[event->phase];
+        cat = event->engine;
+        break;
+    }
+
+    // complete events, timestamps in microseconds
+    fprintf(f, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+               "\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f,"
+               "\"args\":{\"call\":%zu",
+            name, cat,
+            1e6 * (event->start - trace->origin), 1e6 * event->duration,
+            event->call);
+
+    switch (event->type) {
+    case KMEANS_EVENT_CALL:
+        fprintf(f, ",\"iterations\":%d,\"converged\":%d,\"inertia\":",
+                event->iteration, event->converged);
+        write_double(f, event->inertia);
+        break;
+    case KMEANS_EVENT_ITERATION:
+        fprintf(f, ",\"iteration\":%d,\"changed\":%zu,\"inertia\":",
+                event->iteration, event->n_changed);
+        write_double(f, event->inertia);
+        break;
+    default:
+        if (event->iteration >= 0)
+            fprintf(f, ",\"iteration\":%d", event->iteration);
+
+        if (kmeans_trace_has_counters(trace)) {
+            for (int i = 0; i < KMEANS_COUNTERS; ++i)
+                fprintf(f, ",\"%s\":%llu", counter_names[i], event->counters[i]);
+        }
+        break;
+    }
+
+    fprintf(f, "}}");
+}
+
+int kmeans_trace_write(struct kmeans_trace const *trace, char const *filename)
+{
+    FILE *f = fopen(filename, "w");
+    if (!f)
+        return -1;
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+    for (size_t i = 0u; i < trace->n_events; ++i) {
+        write_event(f, trace, &trace->events[i]);
+        fprintf(f, i + 1u < trace->n_events ? ",\n" : "\n");
+    }
+
+    fprintf(f, "]}\n");
+
+    int err = ferror(f);
+
+    if (fclose(f) != 0 || err)
+        return -1;
+
+    return 0;
+}
+
+/* Engine Interface ***********************************************************/
+
+struct kmeans_trace *kmeans_get_trace(void)
+{
+    return active_trace;
+}
+
+size_t kmeans_trace_begin_call(struct kmeans_trace *trace)
+{
+    return trace->calls++;
+}
+
+void kmeans_trace_read_counters(struct kmeans_trace *trace,
+                                unsigned long long *values)
+{
+#ifdef __linux__
+    if (kmeans_trace_has_counters(trace)) {
+        struct { uint64_t nr; uint64_t values[KMEANS_COUNTERS]; } buf;
+
+        if (read(trace->counter_fds[0], &buf, sizeof(buf)) == sizeof(buf)) {
+            for (int i = 0; i < KMEANS_COUNTERS; ++i)
+                values[i] = buf.values[i];
+
+            return;
+        }
+    }
+#endif
+
+    for (int i = 0; i < KMEANS_COUNTERS; ++i)
+        values[i] = 0u;
+}
+
+void kmeans_trace_record(struct kmeans_trace *trace,
+                         struct kmeans_trace_event const *event)
+{
+    if (trace->n_events == trace->capacity) {
+        trace->capacity = trace->capacity ? 2u * trace->capacity : 256u;
+        trace->events = realloc(trace->events,
+                                trace->capacity * sizeof(*trace->events));
+    }
+
+    trace->events[trace->n_events++] = *event;
+}
@@ -0,0 +1,51 @@
+#ifndef KMEANS_TRACE_H
+#define KMEANS_TRACE_H
+
+#include <stddef.h>
+
+#include "kmeans.h"
+
+enum kmeans_trace_event_type
+{
+    KMEANS_EVENT_CALL,
+    KMEANS_EVENT_ITERATION,
+    KMEANS_EVENT_PHASE
+};
+
+struct kmeans_trace_event
+{
+    enum kmeans_trace_event_type type;
+    char const *engine;
+    size_t call;
+
+    // iteration index (-1 for phases outside of iterations), number of
+    // iterations for calls
+    int iteration;
+    enum kmeans_phase phase;
+
+    double start;    // omp_get_wtime
+    double duration; // seconds
+
+    // iterations and calls only
+    size_t n_changed;
+    double inertia;
+    int converged;
+
+    // phases only (zero without hardware counters)
+    unsigned long long counters[KMEANS_COUNTERS];
+};
+
+// trace active for this thread (if any)
+struct kmeans_trace *kmeans_get_trace(void);
+
+// index of a new engine call
+size_t kmeans_trace_begin_call(struct kmeans_trace *trace);
+
+// current counter values (all zero if not available)
+void kmeans_trace_read_counters(struct kmeans_trace *trace,
+                                unsigned long long *values);
+
+void kmeans_trace_record(struct kmeans_trace *trace,
+                         struct kmeans_trace_event const *event);
+
+#endif
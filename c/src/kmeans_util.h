@@ -0,0 +1,89 @@
+#ifndef KMEANS_UTIL_H
+#define KMEANS_UTIL_H
+
+#include <float.h>
+#include <stdint.h>
+
+#include "kmeans.h"
+
+// compute squared euclidean distance between two pixel values
+static inline double pixel_dist2(struct pixel p1, struct pixel p2)
+{
+    double dr = p1.r - p2.r;
+    double dg = p1.g - p2.g;
+    double db = p1.b - p2.b;
+
+    return dr * dr + dg * dg + db * db;
+}
+
+// find index of centroid with least (squared, returned in dist2) distance to
+// some pixel
+static inline size_t find_closest_centroid(
+    struct pixel pixel, struct pixel const *centroids, size_t n_centroids,
+    double *dist2)
+{
+    size_t closest_centroid = 0u;
+    double min_dist = DBL_MAX;
+
+    for (size_t i = 0; i < n_centroids; ++i) {
+        double dist = pixel_dist2(pixel, centroids[i]);
+
+        if (dist < min_dist) {
+            closest_centroid = i;
+            min_dist = dist;
+        }
+    }
+
+    *dist2 = min_dist;
+
+    return closest_centroid;
+}
+
+// widen a single packed 8-bit BGR pixel
+static inline struct pixel bgr_widen(unsigned char const *p)
+{
+    struct pixel pixel = { p[2], p[1], p[0] };
+    return pixel;
+}
+
+// the i-th (in row-major order) pixel of a possibly padded BGR image
+static inline unsigned char const *bgr_at(struct pixel_bgr const *image,
+                                          size_t i)
+{
+    if (image->step == 3 * image->cols)
+        return &image->data[3 * i];
+
+    size_t y = i / image->cols;
+    size_t x = i % image->cols;
+
+    return &image->data[y * image->step + 3 * x];
+}
+
+// widen the i-th (in row-major order) pixel of a possibly padded BGR image
+static inline struct pixel bgr_get(struct pixel_bgr const *image, size_t i)
+{
+    return bgr_widen(bgr_at(image, i));
+}
+
+// splitmix64, used both as a sequential generator and as a stateless hash
+static inline uint64_t mix64(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+static inline uint64_t rng_next(uint64_t *state)
+{
+    *state += 0x9e3779b97f4a7c15ull;
+    return mix64(*state);
+}
+
+// uniform double in [0, 1)
+static inline double to_unit(uint64_t x)
+{
+    return (x >> 11) * (1.0 / 9007199254740992.0);
+}
+
+#endif
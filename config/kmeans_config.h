@@ -6,3 +6,93 @@
 #ifndef KMEANS_CUDA_BLOCKSIZE
   #define KMEANS_CUDA_BLOCKSIZE 256
 #endif
+#ifndef KMEANS_SIMD_CHUNKSIZE
+  #define KMEANS_SIMD_CHUNKSIZE 4096
+#endif
+#ifndef KMEANS_SEED_BLOCKSIZE
+  #define KMEANS_SEED_BLOCKSIZE 4096
+#endif
+#ifndef KMEANS_SEED_ROUNDS
+  #define KMEANS_SEED_ROUNDS 5
+#endif
+#ifndef KMEANS_SEED_OVERSAMPLING
+  #define KMEANS_SEED_OVERSAMPLING 2.0
+#endif
+#ifndef KMEANS_MINIBATCH_BATCHSIZE
+  #define KMEANS_MINIBATCH_BATCHSIZE 4096
+#endif
+#ifndef KMEANS_MINIBATCH_TOL
+  #define KMEANS_MINIBATCH_TOL 0.05
+#endif
+#ifndef KMEANS_CACHELINE
+  #define KMEANS_CACHELINE 64
+#endif
+#ifndef KMEANS_ARENA_BLOCKSIZE
+  #define KMEANS_ARENA_BLOCKSIZE (1 << 16)
+#endif
+#ifndef KMEANS_KDTREE_LEAFSIZE
+  #define KMEANS_KDTREE_LEAFSIZE 8
+#endif
+#ifndef KMEANS_BISECT_MAX_ITER
+  #define KMEANS_BISECT_MAX_ITER 10
+#endif
+#ifndef KMEANS_HISTOGRAM_BITS
+  #define KMEANS_HISTOGRAM_BITS 8
+#endif
+#ifndef KMEANS_HISTOGRAM_SHARDS
+  #define KMEANS_HISTOGRAM_SHARDS 64
+#endif
+#ifndef KMEANS_HISTOGRAM_BLOCKSIZE
+  #define KMEANS_HISTOGRAM_BLOCKSIZE 16384
+#endif
+#ifndef KMEANS_TASK_GRAINSIZE
+  #define KMEANS_TASK_GRAINSIZE 65536
+#endif
+#ifndef KMEANS_STREAM_TILESIZE
+  #define KMEANS_STREAM_TILESIZE 65536
+#endif
+#ifndef KMEANS_STREAM_SAMPLE
+  #define KMEANS_STREAM_SAMPLE 262144
+#endif
+#ifndef KMEANS_NUMA_MAX_NODES
+  #define KMEANS_NUMA_MAX_NODES 64
+#endif
+#ifndef KMEANS_GEMM_TILE_POINTS
+  #define KMEANS_GEMM_TILE_POINTS 64
+#endif
+#ifndef KMEANS_GEMM_TILE_CLUSTERS
+  #define KMEANS_GEMM_TILE_CLUSTERS 64
+#endif
+#ifndef KMEANS_GEMM_TILE_FEATURES
+  #define KMEANS_GEMM_TILE_FEATURES 64
+#endif
+#ifndef KMEANS_GEMM_MIN_CLUSTERS
+  #define KMEANS_GEMM_MIN_CLUSTERS 32
+#endif
+#ifndef KMEANS_GEMM_MIN_PRODUCT
+  #define KMEANS_GEMM_MIN_PRODUCT 1024
+#endif
+#ifndef KMEANS_PREDICT_CHUNKSIZE
+  #define KMEANS_PREDICT_CHUNKSIZE 256
+#endif
+#ifndef KMEANS_RESTARTS_BLOCKSIZE
+  #define KMEANS_RESTARTS_BLOCKSIZE 1024
+#endif
+#ifndef KMEANS_RESTARTS
+  #define KMEANS_RESTARTS 5
+#endif
+#ifndef KMEANS_CORESET_SAMPLE
+  #define KMEANS_CORESET_SAMPLE 65536
+#endif
+#ifndef KMEANS_CORESET_WEIGHT_SCALE
+  #define KMEANS_CORESET_WEIGHT_SCALE 256
+#endif
+#ifndef KMEANS_SLIC_MAX_ITER
+  #define KMEANS_SLIC_MAX_ITER 10
+#endif
+#ifndef KMEANS_SLIC_COMPACTNESS
+  #define KMEANS_SLIC_COMPACTNESS 20.0
+#endif
+#ifndef KMEANS_SHARD_WORKERS
+  #define KMEANS_SHARD_WORKERS 4
+#endif
@@ -1,27 +1,158 @@
 #pragma once
 
+#include <cassert>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
 #include <omp.h>
 #include <opencv2/core/core.hpp>
 
 extern "C" {
 #include "kmeans.h"
 }
+#include "kmeans_config.h"
+
+// owns the scratch memory of all engines called while it is active, so that
+// repeated calls on inputs of the same size do not allocate at all
+class KmeansContext
+{
+public:
+    KmeansContext() : ctx(kmeans_context_create()) {}
+    ~KmeansContext() { kmeans_context_destroy(ctx); }
+
+    KmeansContext(KmeansContext const &) = delete;
+    KmeansContext &operator=(KmeansContext const &) = delete;
+
+    // make engines called from this thread use this context
+    void activate() { kmeans_set_context(ctx); }
+    void deactivate() { kmeans_set_context(nullptr); }
+
+    kmeans_context_stats get_stats() const
+    { return kmeans_context_get_stats(ctx); }
+
+    void reset_stats() { kmeans_context_reset_stats(ctx); }
+
+    // resize a buffer kept by the caller, accounting for reallocations
+    template <typename T>
+    void resize(std::vector<T> &buf, size_t n)
+    {
+        if (n > buf.capacity())
+            kmeans_context_record_allocation(
+                ctx, (n - buf.capacity()) * sizeof(T));
+
+        buf.resize(n);
+    }
+
+    // account for a buffer allocated by the caller in some other way
+    void record_allocation(size_t size)
+    {
+        kmeans_context_record_allocation(ctx, size);
+    }
+
+    // to be called after cv::Mat::create, which reallocates on size changes
+    void record_mat(cv::Mat const &mat, unsigned char const *old_data)
+    {
+        if (mat.data != old_data)
+            kmeans_context_record_allocation(ctx, mat.total() * mat.elemSize());
+    }
+
+private:
+    kmeans_context *ctx;
+};
 
 class KmeansWrapper
 {
 public:
     virtual void exec(cv::Mat const &image, size_t n_centroids) = 0;
 
+    // like exec, but write the result into out, whose buffer is reused if it
+    // already has the right size and type
+    void exec_into(cv::Mat const &image, size_t n_centroids, cv::Mat &out)
+    {
+        result = out;
+        exec(image, n_centroids);
+        out = result;
+    }
+
     cv::Mat get_result() { return result; };
     double get_exec_time() { return _exec_time; };
 
+    // allocations made by this wrapper and the engines it called
+    kmeans_context_stats get_alloc_stats() const { return context.get_stats(); }
+    void reset_alloc_stats() { context.reset_stats(); }
+
+    void set_seeding(kmeans_init init, unsigned long seed = 0u)
+    {
+        seeding_init = init;
+        seeding_seed = seed;
+    }
+
+    // start each call from the centroids and labels of the previous one (as
+    // long as image size and number of clusters stay the same), consecutive
+    // video frames then typically converge within very few iterations
+    void set_warm_start(bool enable)
+    {
+        warm_start = enable;
+        warm_valid = false;
+    }
+
+    // forget the previous solution (e.g. on a scene cut)
+    void reset_warm_start() { warm_valid = false; }
+
+    // termination criteria for subsequent calls
+    void set_options(kmeans_options const &opts) { options = opts; }
+
+    // iterations, inertia etc. of the last call (iteration_times is only
+    // valid until the next call)
+    kmeans_result get_telemetry() const { return telemetry; }
+
     virtual ~KmeansWrapper() {}
 
+    // view of a CV_8UC3 image's buffer (respecting its row stride)
+    static pixel_bgr bgr_view(cv::Mat const &image);
+
 protected:
     void start_timer() { _start_time = omp_get_wtime(); };
     void stop_timer() { _exec_time = (double) (omp_get_wtime() - _start_time); }
     cv::Mat result;
 
+    // (re)allocate result if necessary and fill it with cluster colours
+    void map_result(cv::Mat const &image,
+                    void const *labels, kmeans_label_type label_type,
+                    std::vector<pixel> const &centroids);
+
+    kmeans_init seeding_init = KMEANS_INIT_RANDOM;
+    unsigned long seeding_seed = 0u;
+
+    // whether the previous solution can be reused for this call, remembers
+    // image size and number of clusters for the next one
+    bool begin_warm_start(cv::Mat const &image, size_t n_centroids);
+
+    // apply seeding configuration (none at all when warm starting) and
+    // options, activate context and telemetry for the engine call
+    void begin_engine(bool warm);
+    void end_engine();
+
+    bool warm_start = false;
+    bool warm_valid = false;
+    cv::Size warm_size;
+    size_t warm_centroids = 0u;
+
+    kmeans_options options = default_options();
+    kmeans_result telemetry = kmeans_result();
+    std::vector<double> iteration_times;
+
+    static kmeans_options default_options()
+    {
+        kmeans_options opts;
+        kmeans_default_options(&opts);
+        return opts;
+    }
+
+    KmeansContext context;
+
 private:
     double _start_time;
     double _exec_time;
@@ -32,6 +163,10 @@ class KmeansOpenCVWrapper : public KmeansWrapper
 public:
     KmeansOpenCVWrapper() {}
     void exec(cv::Mat const &image, size_t n_clusters);
+
+protected:
+    // kept for warm starts
+    cv::Mat labels;
 };
 
 class KmeansCWrapper : public KmeansWrapper
@@ -43,9 +178,129 @@ public:
 
     void exec(cv::Mat const &image, size_t n_clusters);
 
+    // write the centroids of the last call, its seed and inertia to a model
+    // file (see kmeans_model_save), throws std::system_error on failure
+    virtual void save_model(std::string const &filename) const;
+
 protected:
     void (*impl)(struct pixel *, size_t, struct pixel *, size_t, size_t *);
     int cores;
+
+    // buffers reused across calls
+    std::vector<pixel> pixels;
+    std::vector<pixel> centroids;
+    std::vector<size_t> labels;
+
+    // convert image into pixels (buffers are reused across calls)
+    void load_pixels(cv::Mat const &image);
+
+    // no-ops when warm starting
+    void reset_centroids(size_t n_centroids, bool warm);
+    void reset_labels(size_t n_pixels, bool warm);
+};
+
+class KmeansSIMDWrapper : public KmeansCWrapper
+{
+public:
+    KmeansSIMDWrapper(
+        void (*simd_impl)(struct pixel_planar, size_t,
+                          struct pixel *, size_t, size_t *) = kmeans_simd,
+        int cores = 1) : KmeansCWrapper(nullptr, cores), simd_impl(simd_impl) {}
+
+    void exec(cv::Mat const &image, size_t n_clusters);
+
+protected:
+    void (*simd_impl)(struct pixel_planar, size_t, struct pixel *, size_t, size_t *);
+
+    std::vector<float> planes;
+};
+
+class KmeansMiniBatchWrapper : public KmeansCWrapper
+{
+public:
+    KmeansMiniBatchWrapper(
+        void (*minibatch_impl)(struct pixel_bgr,
+                               struct pixel *, size_t, size_t *, size_t)
+            = kmeans_omp_minibatch,
+        int cores = 4,
+        size_t batch_size = KMEANS_MINIBATCH_BATCHSIZE)
+      : KmeansCWrapper(nullptr, cores),
+        minibatch_impl(minibatch_impl),
+        batch_size(batch_size) {}
+
+    void exec(cv::Mat const &image, size_t n_clusters);
+
+protected:
+    void (*minibatch_impl)(struct pixel_bgr,
+                           struct pixel *, size_t, size_t *, size_t);
+    size_t batch_size;
+};
+
+class KmeansCoresetWrapper : public KmeansCWrapper
+{
+public:
+    KmeansCoresetWrapper(
+        void (*coreset_impl)(struct pixel_bgr,
+                             struct pixel *, size_t, size_t *, size_t)
+            = kmeans_omp_coreset,
+        int cores = 4,
+        size_t sample_size = KMEANS_CORESET_SAMPLE)
+      : KmeansCWrapper(nullptr, cores),
+        coreset_impl(coreset_impl),
+        sample_size(sample_size) {}
+
+    void exec(cv::Mat const &image, size_t n_clusters);
+
+protected:
+    void (*coreset_impl)(struct pixel_bgr,
+                         struct pixel *, size_t, size_t *, size_t);
+    size_t sample_size;
+};
+
+class KmeansHistogramWrapper : public KmeansCWrapper
+{
+public:
+    KmeansHistogramWrapper(
+        void (*histogram_impl)(struct pixel_bgr,
+                               struct pixel *, size_t, size_t *, int)
+            = kmeans_omp_histogram,
+        int cores = 4,
+        int quant_bits = KMEANS_HISTOGRAM_BITS)
+      : KmeansCWrapper(nullptr, cores),
+        histogram_impl(histogram_impl),
+        quant_bits(quant_bits)
+    {
+        assert(quant_bits >= 1 && quant_bits <= 8);
+    }
+
+    void exec(cv::Mat const &image, size_t n_clusters);
+
+protected:
+    void (*histogram_impl)(struct pixel_bgr,
+                           struct pixel *, size_t, size_t *, int);
+    int quant_bits;
+};
+
+class KmeansCompactWrapper : public KmeansCWrapper
+{
+public:
+    KmeansCompactWrapper(
+        void (*compact_impl)(struct pixel_bgr, struct pixel *,
+                             size_t, void *, kmeans_label_type)
+            = kmeans_omp_compact,
+        int cores = 4)
+      : KmeansCWrapper(nullptr, cores), compact_impl(compact_impl) {}
+
+    void exec(cv::Mat const &image, size_t n_clusters);
+
+    // labels of the last call (CV_8U, CV_16U or CV_32S), valid until the next
+    cv::Mat get_labels() { return compact_labels; }
+
+protected:
+    void (*compact_impl)(struct pixel_bgr, struct pixel *,
+                         size_t, void *, kmeans_label_type);
+
+    cv::Mat compact_labels;
 };
 
 class KmeansCUDAWrapper : public KmeansCWrapper
@@ -54,14 +309,315 @@ public:
     KmeansCUDAWrapper() : KmeansCWrapper(kmeans_cuda) {}
 };
 
-class KmeansOMPWrapper : public KmeansCWrapper
+class KmeansHamerlyWrapper : public KmeansCWrapper
+{
+public:
+    KmeansHamerlyWrapper() : KmeansCWrapper(kmeans_hamerly) {}
+};
+
+class KmeansOMPHamerlyWrapper : public KmeansCWrapper
+{
+public:
+    KmeansOMPHamerlyWrapper(int cores = 4)
+      : KmeansCWrapper(kmeans_omp_hamerly, cores) {}
+};
+
+class KmeansBisectingWrapper : public KmeansCWrapper
+{
+public:
+    KmeansBisectingWrapper() : KmeansCWrapper(kmeans_bisecting) {}
+};
+
+class KmeansOMPBisectingWrapper : public KmeansCWrapper
+{
+public:
+    KmeansOMPBisectingWrapper(int cores = 4)
+      : KmeansCWrapper(kmeans_omp_bisecting, cores) {}
+};
+
+// clusters images (as 3 features per pixel) or arbitrary CV_32F matrices of
+// one point per row through the generic feature engines
+class KmeansFeatureWrapper : public KmeansCWrapper
+{
+public:
+    KmeansFeatureWrapper(
+        void (*features_impl)(struct kmeans_matrix,
+                              float *, size_t, size_t *)
+            = kmeans_omp_features,
+        int cores = 4)
+      : KmeansCWrapper(nullptr, cores), features_impl(features_impl) {}
+
+    void exec(cv::Mat const &image, size_t n_clusters);
+
+    // cluster the rows of a single channel CV_32F matrix, labels and
+    // centroids of the last call are valid until the next one
+    void exec_features(cv::Mat const &points, size_t n_clusters);
+
+    std::vector<size_t> const &get_labels() const { return labels; }
+
+    // n_clusters x dimension (CV_32F)
+    cv::Mat get_centroids() const { return feature_centroids; }
+
+    // saves feature_centroids as a KMEANS_DTYPE_F32 model
+    void save_model(std::string const &filename) const;
+
+protected:
+    void (*features_impl)(struct kmeans_matrix, float *, size_t, size_t *);
+
+    // runs features_impl on points, warm is decided by the caller
+    void run(cv::Mat const &points, size_t n_clusters, bool warm);
+
+    cv::Mat features;
+    cv::Mat feature_centroids;
+};
+
+// plain Lloyd's algorithm on images runs on the 3-feature specialization of
+// the feature engines, only engines with algorithms or data layouts of their
+// own (SIMD, Hamerly, CUDA, ...) keep dedicated wrappers
+class KmeansOMPWrapper : public KmeansFeatureWrapper
+{
+public:
+    KmeansOMPWrapper(int cores = 4)
+      : KmeansFeatureWrapper(kmeans_omp_features, cores) {}
+};
+
+class KmeansPureCWrapper : public KmeansFeatureWrapper
+{
+public:
+    KmeansPureCWrapper() : KmeansFeatureWrapper(kmeans_features, 1) {}
+};
+
+// kmeans_omp_numa on buffers whose pages are first touched by the same pinned
+// threads that later work on them, buffers are reused as long as image size
+// and thread count stay the same
+class KmeansNUMAWrapper : public KmeansCWrapper
+{
+public:
+    KmeansNUMAWrapper(int cores = 4) : KmeansCWrapper(kmeans_omp_numa, cores) {}
+    ~KmeansNUMAWrapper() { release_buffers(); }
+
+    void exec(cv::Mat const &image, size_t n_clusters);
+
+protected:
+    void release_buffers();
+
+    pixel *numa_pixels = nullptr;
+    size_t *numa_labels = nullptr;
+    size_t numa_size = 0u;
+    int numa_threads = 0;
+};
+
+// SLIC superpixels (see kmeans_slic), n_clusters is the number of superpixels
+// asked for and the result paints every pixel with its superpixel's mean
+// colour, superpixels are always seeded on a fresh grid
+class KmeansSLICWrapper : public KmeansCWrapper
+{
+public:
+    KmeansSLICWrapper(
+        size_t (*slic_impl)(struct pixel_bgr, struct kmeans_superpixel *,
+                            size_t, size_t *, double) = kmeans_omp_slic,
+        int cores = 4,
+        double compactness = KMEANS_SLIC_COMPACTNESS)
+      : KmeansCWrapper(nullptr, cores),
+        slic_impl(slic_impl),
+        compactness(compactness) {}
+
+    void exec(cv::Mat const &image, size_t n_clusters);
+
+    // superpixels and labels (rows * cols) of the last call
+    std::vector<kmeans_superpixel> const &get_superpixels() const
+    {
+        return superpixels;
+    }
+    std::vector<size_t> const &get_labels() const { return labels; }
+
+protected:
+    size_t (*slic_impl)(struct pixel_bgr, struct kmeans_superpixel *, size_t,
+                        size_t *, double);
+    double compactness;
+
+    std::vector<kmeans_superpixel> superpixels;
+};
+
+// fits n_restarts differently seeded solutions in one call (see
+// kmeans_restarts) and keeps the one of least inertia
+class KmeansRestartsWrapper : public KmeansCWrapper
+{
+public:
+    KmeansRestartsWrapper(
+        size_t (*restarts_impl)(struct pixel *, size_t, struct pixel *, size_t,
+                                size_t *, size_t, double *)
+            = kmeans_omp_restarts,
+        int cores = 4,
+        size_t n_restarts = KMEANS_RESTARTS)
+      : KmeansCWrapper(nullptr, cores),
+        restarts_impl(restarts_impl),
+        n_restarts(n_restarts) {}
+
+    void exec(cv::Mat const &image, size_t n_clusters);
+
+    // final inertia of every restart of the last call and which one was kept
+    std::vector<double> const &get_inertias() const { return inertias; }
+    size_t get_best_restart() const { return best_restart; }
+
+protected:
+    size_t (*restarts_impl)(struct pixel *, size_t, struct pixel *, size_t,
+                            size_t *, size_t, double *);
+    size_t n_restarts;
+
+    std::vector<double> inertias;
+    size_t best_restart = 0u;
+};
+
+// Lloyd's algorithm over n_workers local worker processes (see
+// kmeans_sharded), the coordinator seeds with as many threads, throws
+// std::system_error if the workers cannot be started or fail
+class KmeansShardedWrapper : public KmeansCWrapper
 {
 public:
-    KmeansOMPWrapper(int cores = 4) : KmeansCWrapper(kmeans_omp, cores) {}
+    KmeansShardedWrapper(int n_workers = KMEANS_SHARD_WORKERS)
+      : KmeansCWrapper(nullptr, n_workers), n_workers(n_workers) {}
+
+    void exec(cv::Mat const &image, size_t n_clusters);
+
+    // seconds spent communicating / computing (in the slowest worker) in
+    // every iteration of the last call, and its traffic
+    std::vector<double> get_comm_times() const;
+    std::vector<double> get_compute_times() const;
+    kmeans_shard_stats get_shard_stats() const { return shard_stats; }
+
+protected:
+    int n_workers;
+
+    std::vector<double> comm_times;
+    std::vector<double> compute_times;
+    kmeans_shard_stats shard_stats = kmeans_shard_stats();
 };
 
-class KmeansPureCWrapper : public KmeansCWrapper
+class KmeansOMPSIMDWrapper : public KmeansSIMDWrapper
 {
 public:
-    KmeansPureCWrapper() : KmeansCWrapper(kmeans_c) {}
+    KmeansOMPSIMDWrapper(int cores = 4)
+      : KmeansSIMDWrapper(kmeans_omp_simd, cores) {}
+};
+
+// labels images against centroids fitted earlier (e.g. loaded from a model
+// file) with nothing but the nearest-centroid pass of predict_impl, buffers
+// are reused as long as the image size stays the same
+class KmeansPredictor
+{
+public:
+    KmeansPredictor(
+        void (*predict_impl)(struct pixel_bgr, struct pixel const *, size_t,
+                             void *, kmeans_label_type) = kmeans_omp_predict,
+        int cores = 4) : predict_impl(predict_impl), cores(cores) {}
+
+    // throws std::system_error if the file cannot be read and
+    // std::invalid_argument unless it holds a pixel model (3 features)
+    void load_model(std::string const &filename);
+
+    void set_centroids(std::vector<pixel> const &centroids);
+    std::vector<pixel> const &get_centroids() const { return centroids; }
+
+    // seed and inertia of the fit the loaded model stems from
+    unsigned long get_seed() const { return seed; }
+    double get_inertia() const { return inertia; }
+
+    void predict(cv::Mat const &image);
+
+    // labels (CV_8U, CV_16U or CV_32S) and image of cluster colours of the
+    // last call, valid until the next one
+    cv::Mat get_labels() { return labels; }
+    cv::Mat get_result() { return result; }
+
+    // time spent labelling (excluding the colour mapping) in the last call
+    double get_exec_time() { return _exec_time; }
+
+    kmeans_context_stats get_alloc_stats() const { return context.get_stats(); }
+    void reset_alloc_stats() { context.reset_stats(); }
+
+protected:
+    void (*predict_impl)(struct pixel_bgr, struct pixel const *, size_t,
+                         void *, kmeans_label_type);
+    int cores;
+
+    std::vector<pixel> centroids;
+    unsigned long seed = 0u;
+    double inertia = -1.0;
+
+    cv::Mat labels;
+    cv::Mat result;
+
+    KmeansContext context;
+
+private:
+    double _exec_time = 0.0;
+};
+
+// clusters batches of independent images concurrently: every image becomes an
+// OpenMP task (idle threads of the team take over pending ones) and images of
+// more than KMEANS_TASK_GRAINSIZE pixels are additionally split into
+// pixel-range tasks in every iteration (see kmeans_task), the team has
+// exactly cores threads without touching the global thread count
+class KmeansBatch
+{
+public:
+    // invoked as soon as an image has been clustered, from whichever thread
+    // clustered it but never concurrently, result and telemetry are valid
+    // until the next call to exec
+    typedef std::function<void(size_t index, cv::Mat const &result,
+                               kmeans_result const &telemetry)> Callback;
+
+    KmeansBatch(int cores = 4) : cores(cores) {}
+
+    void set_seeding(kmeans_init init, unsigned long seed = 0u)
+    {
+        seeding_init = init;
+        seeding_seed = seed;
+    }
+
+    void set_options(kmeans_options const &opts) { options = opts; }
+
+    // blocks until all images have been clustered
+    void exec(std::vector<cv::Mat> const &images, size_t n_centroids,
+              Callback const &done);
+
+    double get_exec_time() { return _exec_time; };
+
+protected:
+    // per image buffers, reused across calls
+    struct Slot
+    {
+        std::vector<pixel> pixels;
+        std::vector<pixel> centroids;
+        std::vector<size_t> labels;
+        std::vector<double> iteration_times;
+
+        cv::Mat result;
+        kmeans_result telemetry;
+    };
+
+    void exec_one(Slot &slot, cv::Mat const &image, size_t n_centroids);
+
+    int cores;
+
+    kmeans_init seeding_init = KMEANS_INIT_RANDOM;
+    unsigned long seeding_seed = 0u;
+
+    kmeans_options options = default_options();
+
+    static kmeans_options default_options()
+    {
+        kmeans_options opts;
+        kmeans_default_options(&opts);
+        return opts;
+    }
+
+    std::vector<Slot> slots;
+
+    // scratch memory of each thread of the team
+    std::vector<std::unique_ptr<KmeansContext>> contexts;
+
+private:
+    double _exec_time = 0.0;
 };
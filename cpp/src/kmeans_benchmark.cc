@@ -1,19 +1,35 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
 #include <cstring>
 #include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <regex>
+#include <sstream>
+#include <string>
 #include <vector>
 
+#include <fcntl.h>
+#include <unistd.h>
+
 #include <opencv2/opencv.hpp>
 
 #include "kmeans_wrapper.h"
 
-static int parse_intarg(char const *arg)
+/* Argument Parsing ***********************************************************/
+
+static int parse_intarg(std::string const &arg)
 {
     int res = 0;
     try {
         size_t idx;
         res = std::stoi(arg, &idx);
 
-        if (idx != strlen(arg))
+        if (idx != arg.size())
             throw std::invalid_argument("trailing garbage");
 
     } catch (std::exception const &e) {
@@ -24,71 +40,1590 @@ static int parse_intarg(char const *arg)
     return res;
 }
 
-int main(int argc, char **argv)
+static double parse_doublearg(std::string const &arg)
+{
+    double res = 0.0;
+    try {
+        size_t idx;
+        res = std::stod(arg, &idx);
+
+        if (idx != arg.size())
+            throw std::invalid_argument("trailing garbage");
+
+    } catch (std::exception const &e) {
+        throw std::invalid_argument(
+            std::string("malformed floating point param: ") + e.what());
+    }
+
+    return res;
+}
+
+static std::vector<std::string> split(std::string const &arg, char sep)
+{
+    std::vector<std::string> parts;
+    std::stringstream ss(arg);
+
+    std::string part;
+    while (std::getline(ss, part, sep))
+        parts.push_back(part);
+
+    return parts;
+}
+
+// either MIN:MAX:STEP or a comma separated list
+static std::vector<int> parse_range(std::string const &arg)
+{
+    std::vector<int> values;
+
+    std::vector<std::string> range = split(arg, ':');
+    if (range.size() == 3u) {
+        int min = parse_intarg(range[0]);
+        int max = parse_intarg(range[1]);
+        int step = parse_intarg(range[2]);
+
+        if (step <= 0)
+            throw std::invalid_argument("range step must be positive");
+
+        for (int v = min; v <= max; v += step)
+            values.push_back(v);
+
+        return values;
+    }
+
+    for (auto const &v : split(arg, ','))
+        values.push_back(parse_intarg(v));
+
+    return values;
+}
+
+// 1 to 4 threads (as expected by tool/plot.py), then doubling up to the
+// number of processors
+static std::vector<int> thread_sweep()
+{
+    std::vector<int> threads = { 1, 2, 3, 4 };
+
+    int n_procs = omp_get_num_procs();
+    for (int t = 8; t < n_procs; t *= 2)
+        threads.push_back(t);
+
+    if (n_procs > 4)
+        threads.push_back(n_procs);
+
+    return threads;
+}
+
+struct Settings
+{
+    std::vector<int> dims = { 500, 1000, 1500 };
+    std::vector<int> clusters = { 5 };
+    std::vector<int> threads = { 1, 2, 3, 4 };
+    std::vector<std::string> data = { "uniform" };
+
+    std::string filter = ".*";
+    std::string image_dir = "images";
+
+    int warmup = 1;
+    int repetitions = 10;
+    double min_time = 0.0;
+
+    kmeans_init init = KMEANS_INIT_RANDOM;
+    unsigned long seed = 0u;
+
+    std::string out_dir = "benchmarks";
+    std::string baseline;
+    double threshold = 0.1;
+
+    int batch = 0;
+    std::string stream_dir;
+    std::vector<int> distance;
+    std::string predict_model;
+    int restarts = 0;
+    std::vector<int> coreset;
+    std::vector<int> shards;
+};
+
+static void usage(char const *prog)
 {
-    std::vector<std::pair<std::string, KmeansWrapper *>> wrappers;
+    std::cerr
+        << "Usage: " << prog << " [OPTION]...\n"
+        << "  --filter=REGEX        benchmarks to run (default: all)\n"
+        << "  --dims=RANGE          image widths/heights (MIN:MAX:STEP or list)\n"
+        << "  --clusters=RANGE      numbers of clusters\n"
+        << "  --threads=RANGE       thread counts of parallel implementations\n"
+        << "                        ('auto': 1 to 4, then doubling up to the\n"
+        << "                        number of processors, the default)\n"
+        << "  --data=LIST           uniform, blobs and/or photo\n"
+        << "  --images=DIR          photos used for 'photo' (default: images)\n"
+        << "  --warmup=N            untimed runs per case (default: 1)\n"
+        << "  --repetitions=N       timed runs per case (default: 10)\n"
+        << "  --min-time=SECONDS    repeat until at least this long\n"
+        << "  --init=INIT           random, plusplus or parallel\n"
+        << "  --seed=SEED           fixed seed for data and initialization\n"
+        << "  --out=DIR             output directory (default: benchmarks)\n"
+        << "  --baseline=FILE       summary.csv of an earlier run to compare to\n"
+        << "  --threshold=FRACTION  tolerated slowdown (default: 0.1)\n"
+        << "  --batch=N             instead compare clustering batches of N\n"
+        << "                        images via KmeansBatch to looping over\n"
+        << "                        KmeansOMPWrapper::exec\n"
+        << "  --stream=DIR          instead measure kmeans_omp_stream on raw\n"
+        << "                        pixel files written to DIR against read\n"
+        << "                        bandwidth from disk and page cache\n"
+        << "  --distance=RANGE      instead compare the scalar and the GEMM\n"
+        << "                        distance kernel over these dimensions\n"
+        << "  --predict=FILE        instead compare fitting to labelling\n"
+        << "                        against a model saved to FILE\n"
+        << "  --restarts=R          instead compare R restarts in one\n"
+        << "                        kmeans_omp_restarts call to R sequential\n"
+        << "                        kmeans_omp calls\n"
+        << "  --coreset=RANGE       instead compare kmeans_omp_coreset with\n"
+        << "                        these sample sizes to kmeans_omp\n"
+        << "  --shards=RANGE        instead compare kmeans_sharded with these\n"
+        << "                        numbers of worker processes to kmeans_omp\n"
+        << "                        with as many threads\n";
+}
 
-    int const dim_min = parse_intarg(argv[1]);
-    int const dim_max = parse_intarg(argv[2]);
-    int const dim_step = parse_intarg(argv[3]);
+static Settings parse_settings(int argc, char **argv)
+{
+    Settings s;
 
-    int const clusters_min = parse_intarg(argv[4]);
-    int const clusters_max = parse_intarg(argv[5]);
-    int const clusters_step = parse_intarg(argv[6]);
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
 
-    int const n_exec = parse_intarg(argv[7]);
+        size_t eq = arg.find('=');
+        if (arg.compare(0, 2, "--") != 0 || eq == std::string::npos)
+            throw std::invalid_argument("malformed option: " + arg);
 
-    std::string csvdir(argv[8]);
-    if (csvdir.back() != '/')
-        csvdir += '/';
+        std::string key = arg.substr(2, eq - 2);
+        std::string value = arg.substr(eq + 1);
 
-    KmeansOpenCVWrapper opencv_wrapper;
-    wrappers.push_back(std::make_pair("OpenCV", &opencv_wrapper));
+        if (key == "filter") {
+            s.filter = value;
+        } else if (key == "dims") {
+            s.dims = parse_range(value);
+        } else if (key == "clusters") {
+            s.clusters = parse_range(value);
+        } else if (key == "threads") {
+            s.threads = value == "auto" ? thread_sweep() : parse_range(value);
+        } else if (key == "data") {
+            s.data = split(value, ',');
+        } else if (key == "images") {
+            s.image_dir = value;
+        } else if (key == "warmup") {
+            s.warmup = parse_intarg(value);
+        } else if (key == "repetitions") {
+            s.repetitions = parse_intarg(value);
+        } else if (key == "min-time") {
+            s.min_time = parse_doublearg(value);
+        } else if (key == "init") {
+            if (value == "random")
+                s.init = KMEANS_INIT_RANDOM;
+            else if (value == "plusplus")
+                s.init = KMEANS_INIT_PLUSPLUS;
+            else if (value == "parallel")
+                s.init = KMEANS_INIT_PARALLEL;
+            else
+                throw std::invalid_argument("unknown initialization: " + value);
+        } else if (key == "seed") {
+            s.seed = parse_intarg(value);
+        } else if (key == "out") {
+            s.out_dir = value;
+        } else if (key == "baseline") {
+            s.baseline = value;
+        } else if (key == "threshold") {
+            s.threshold = parse_doublearg(value);
+        } else if (key == "batch") {
+            s.batch = parse_intarg(value);
+        } else if (key == "stream") {
+            s.stream_dir = value;
+        } else if (key == "distance") {
+            s.distance = parse_range(value);
+        } else if (key == "predict") {
+            s.predict_model = value;
+        } else if (key == "restarts") {
+            s.restarts = parse_intarg(value);
+        } else if (key == "coreset") {
+            s.coreset = parse_range(value);
+        } else if (key == "shards") {
+            s.shards = parse_range(value);
+        } else {
+            throw std::invalid_argument("unknown option: " + key);
+        }
+    }
+
+    if (s.repetitions < 2)
+        throw std::invalid_argument("at least two repetitions are needed");
 
-    KmeansPureCWrapper pure_c_wrapper;
-    wrappers.push_back(std::make_pair("C", &pure_c_wrapper));
+    if (s.out_dir.back() != '/')
+        s.out_dir += '/';
 
-    KmeansOMPWrapper omp_wrapper_single(1);
-    KmeansOMPWrapper omp_wrapper_double(2);
-    KmeansOMPWrapper omp_wrapper_triple(3);
-    KmeansOMPWrapper omp_wrapper_quad(4);
-    wrappers.push_back(std::make_pair("OpenMP_single", &omp_wrapper_single));
-    wrappers.push_back(std::make_pair("OpenMP_double", &omp_wrapper_double));
-    wrappers.push_back(std::make_pair("OpenMP_triple", &omp_wrapper_triple));
-    wrappers.push_back(std::make_pair("OpenMP_quad", &omp_wrapper_quad));
+    if (!s.stream_dir.empty() && s.stream_dir.back() != '/')
+        s.stream_dir += '/';
 
-    KmeansCUDAWrapper cuda_wrapper;
-    wrappers.push_back(std::make_pair("CUDA", &cuda_wrapper));
+    return s;
+}
 
-    for (size_t i = 0u; i < wrappers.size(); ++i) {
-        std::string &name = std::get<0>(wrappers[i]);
-        KmeansWrapper *wrapper = std::get<1>(wrappers[i]);
+/* Benchmark Registry *********************************************************/
 
-        std::string outfile(name + ".csv");
-        std::string csvfile(csvdir + outfile);
+struct Family
+{
+    std::string name;
+    bool threaded;
+    std::function<KmeansWrapper *(int)> create;
+};
 
-        std::ifstream is(csvfile);
-        if (is.good())
+static std::vector<Family> families()
+{
+    return {
+        { "OpenCV", false,
+          [](int) { return new KmeansOpenCVWrapper(); } },
+        { "C", false,
+          [](int) { return new KmeansPureCWrapper(); } },
+        { "OpenMP", true,
+          [](int t) { return new KmeansOMPWrapper(t); } },
+        { "Features", false,
+          [](int) { return new KmeansFeatureWrapper(kmeans_features, 1); } },
+        { "OpenMP_Features", true,
+          [](int t) { return new KmeansFeatureWrapper(
+                          kmeans_omp_features, t); } },
+        { "OpenMP_NUMA", true,
+          [](int t) { return new KmeansNUMAWrapper(t); } },
+        { "Hamerly", false,
+          [](int) { return new KmeansHamerlyWrapper(); } },
+        { "OpenMP_Hamerly", true,
+          [](int t) { return new KmeansOMPHamerlyWrapper(t); } },
+        { "SIMD", false,
+          [](int) { return new KmeansSIMDWrapper(); } },
+        { "OpenMP_SIMD", true,
+          [](int t) { return new KmeansOMPSIMDWrapper(t); } },
+        { "Bisecting", false,
+          [](int) { return new KmeansBisectingWrapper(); } },
+        { "OpenMP_Bisecting", true,
+          [](int t) { return new KmeansOMPBisectingWrapper(t); } },
+        { "OpenMP_MiniBatch", true,
+          [](int t) { return new KmeansMiniBatchWrapper(
+                          kmeans_omp_minibatch, t); } },
+        { "Histogram", false,
+          [](int) { return new KmeansHistogramWrapper(
+                        kmeans_histogram, 1); } },
+        { "OpenMP_Histogram", true,
+          [](int t) { return new KmeansHistogramWrapper(
+                          kmeans_omp_histogram, t); } },
+        { "OpenMP_Coreset", true,
+          [](int t) { return new KmeansCoresetWrapper(
+                          kmeans_omp_coreset, t); } },
+        { "Sharded", true,
+          [](int t) { return new KmeansShardedWrapper(t); } },
+        { "SLIC", false,
+          [](int) { return new KmeansSLICWrapper(kmeans_slic, 1); } },
+        { "OpenMP_SLIC", true,
+          [](int t) { return new KmeansSLICWrapper(kmeans_omp_slic, t); } },
+        { "OpenMP_Compact", true,
+          [](int t) { return new KmeansCompactWrapper(
+                          kmeans_omp_compact, t); } },
+        { "CUDA", false,
+          [](int) { return new KmeansCUDAWrapper(); } }
+    };
+}
+
+// benchmark names of parallel implementations carry the thread count, the
+// suffixes of up to four threads match those expected by tool/plot.py
+static std::string benchmark_name(Family const &family, int threads)
+{
+    static char const *suffixes[] = { "single", "double", "triple", "quad" };
+
+    if (!family.threaded)
+        return family.name;
+
+    if (threads >= 1 && threads <= 4)
+        return family.name + '_' + suffixes[threads - 1];
+
+    return family.name + '_' + std::to_string(threads) + "threads";
+}
+
+/* Input Data *****************************************************************/
+
+// gaussian blobs around a few random colours
+static cv::Mat make_blobs(int dim, cv::RNG &rng)
+{
+    int const n_blobs = 8;
+    double const sigma = 16.0;
+
+    std::vector<cv::Vec3d> centers(n_blobs);
+    for (auto &c : centers)
+        c = cv::Vec3d(rng.uniform(0.0, 255.0),
+                      rng.uniform(0.0, 255.0),
+                      rng.uniform(0.0, 255.0));
+
+    cv::Mat image(dim, dim, CV_8UC3);
+
+    for (int y = 0; y < dim; ++y) {
+        cv::Vec3b *row = image.ptr<cv::Vec3b>(y);
+
+        for (int x = 0; x < dim; ++x) {
+            cv::Vec3d const &c = centers[rng.uniform(0, n_blobs)];
+
+            for (int ch = 0; ch < 3; ++ch)
+                row[x][ch] = cv::saturate_cast<uchar>(
+                    c[ch] + rng.gaussian(sigma));
+        }
+    }
+
+    return image;
+}
+
+// (name, image) pairs of the requested distribution at the given size
+static std::vector<std::pair<std::string, cv::Mat>> make_inputs(
+    std::string const &data, int dim, Settings const &s)
+{
+    std::vector<std::pair<std::string, cv::Mat>> inputs;
+
+    cv::RNG rng(s.seed ? s.seed : 0x6b6d65616e73ull);
+
+    if (data == "uniform") {
+        cv::Mat image(dim, dim, CV_8UC3);
+        rng.fill(image, cv::RNG::UNIFORM, cv::Scalar::all(0), cv::Scalar::all(256));
+
+        inputs.push_back(std::make_pair(data, image));
+
+    } else if (data == "blobs") {
+        inputs.push_back(std::make_pair(data, make_blobs(dim, rng)));
+
+    } else if (data == "photo") {
+        std::vector<cv::String> files;
+        cv::glob(s.image_dir + "/*.jpg", files);
+
+        for (auto const &file : files) {
+            cv::Mat photo = cv::imread(file);
+            if (photo.empty())
+                continue;
+
+            std::string stem(file);
+            stem = stem.substr(stem.find_last_of('/') + 1);
+            stem = stem.substr(0, stem.find('.'));
+
+            cv::Mat image;
+            cv::resize(photo, image, cv::Size(dim, dim), 0, 0, cv::INTER_AREA);
+
+            inputs.push_back(std::make_pair("photo_" + stem, image));
+        }
+
+    } else {
+        throw std::invalid_argument("unknown data distribution: " + data);
+    }
+
+    return inputs;
+}
+
+/* Statistics *****************************************************************/
+
+struct Stats
+{
+    int n = 0;
+    double mean = 0.0;
+    double stddev = 0.0;
+    double median = 0.0;
+    double ci95 = 0.0; // half width of the 95% confidence interval of the mean
+};
+
+// two-sided 95% quantile of Student's t distribution
+static double t_quantile(int dof)
+{
+    static double const table[] = {
+        12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+        2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+        2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+    };
+
+    if (dof <= 30)
+        return table[dof - 1];
+
+    return 1.960;
+}
+
+static Stats compute_stats(std::vector<double> samples)
+{
+    Stats st;
+    st.n = static_cast<int>(samples.size());
+
+    for (double s : samples)
+        st.mean += s;
+    st.mean /= st.n;
+
+    for (double s : samples)
+        st.stddev += (s - st.mean) * (s - st.mean);
+    st.stddev = std::sqrt(st.stddev / (st.n - 1));
+
+    std::sort(samples.begin(), samples.end());
+    st.median = st.n % 2 ?
+        samples[st.n / 2] : 0.5 * (samples[st.n / 2 - 1] + samples[st.n / 2]);
+
+    st.ci95 = t_quantile(st.n - 1) * st.stddev / std::sqrt(st.n);
+
+    return st;
+}
+
+/* Baseline Comparison ********************************************************/
+
+struct SummaryRow
+{
+    Stats time;
+    double pixels_per_sec;
+    double time_per_iter;
+};
+
+static std::string summary_key(std::string const &name,
+                               std::string const &data, int dim, int clusters)
+{
+    return name + ',' + data + ',' + std::to_string(dim) + ',' +
+           std::to_string(clusters);
+}
+
+static char const *summary_header =
+    "benchmark,data,dim,clusters,threads,repetitions,"
+    "mean,stddev,median,ci95,pixels_per_sec,time_per_iter\n";
+
+static std::map<std::string, SummaryRow> read_summary(std::string const &file)
+{
+    std::map<std::string, SummaryRow> rows;
+
+    std::ifstream is(file);
+    if (!is.good())
+        throw std::invalid_argument("failed to open baseline: " + file);
+
+    std::string line;
+    std::getline(is, line);
+
+    while (std::getline(is, line)) {
+        std::vector<std::string> f = split(line, ',');
+        if (f.size() < 12u)
             continue;
 
+        SummaryRow row;
+        row.time.n = parse_intarg(f[5]);
+        row.time.mean = parse_doublearg(f[6]);
+        row.time.stddev = parse_doublearg(f[7]);
+        row.time.median = parse_doublearg(f[8]);
+        row.time.ci95 = parse_doublearg(f[9]);
+        row.pixels_per_sec = parse_doublearg(f[10]);
+        row.time_per_iter = parse_doublearg(f[11]);
+
+        rows[summary_key(f[0], f[1], parse_intarg(f[2]), parse_intarg(f[3]))] =
+            row;
+    }
+
+    return rows;
+}
+
+// a case has regressed if its median is slower by more than the threshold
+// and the confidence intervals of both runs do not overlap (so that noisy
+// cases do not fail the gate)
+static bool regressed(Stats const &base, Stats const &cur, double threshold)
+{
+    return cur.median > base.median * (1.0 + threshold) &&
+           cur.mean - cur.ci95 > base.mean + base.ci95;
+}
+
+/* Batch Throughput ***********************************************************/
+
+// clustering batch copies of every input per thread count, once one image at
+// a time through KmeansOMPWrapper and once concurrently through KmeansBatch
+static void run_batch(Settings const &s)
+{
+    std::ofstream csv(s.out_dir + "batch.csv");
+    csv << "mode,data,dim,clusters,threads,batch,repetitions,"
+           "mean,stddev,median,ci95,images_per_sec\n";
+
+    std::cout << std::left << std::setw(8) << "mode"
+              << std::setw(16) << "data" << std::right
+              << std::setw(6) << "dim" << std::setw(4) << "k"
+              << std::setw(4) << "t"
+              << std::setw(12) << "median[ms]" << std::setw(12) << "ci95[ms]"
+              << std::setw(12) << "images/s" << '\n';
+
+    for (auto const &data : s.data) {
+        for (int dim : s.dims) {
+            for (auto const &input : make_inputs(data, dim, s)) {
+                std::vector<cv::Mat> images(s.batch, input.second);
+
+                for (int c : s.clusters) {
+                    for (int t : s.threads) {
+                        KmeansOMPWrapper loop(t);
+                        loop.set_seeding(s.init, s.seed);
+
+                        KmeansBatch batch(t);
+                        batch.set_seeding(s.init, s.seed);
+
+                        auto looped = [&]() {
+                            double time = 0.0;
+                            for (auto const &image : images) {
+                                loop.exec(image, c);
+                                time += loop.get_exec_time();
+                            }
+                            return time;
+                        };
+
+                        auto batched = [&]() {
+                            batch.exec(images, c,
+                                       [](size_t, cv::Mat const &,
+                                          kmeans_result const &) {});
+                            return batch.get_exec_time();
+                        };
+
+                        std::vector<std::pair<std::string,
+                                              std::function<double()>>> modes;
+                        modes.push_back(std::make_pair("loop", looped));
+                        modes.push_back(std::make_pair("batch", batched));
+
+                        for (auto const &mode : modes) {
+                            for (int i = 0; i < s.warmup; ++i)
+                                mode.second();
+
+                            std::vector<double> times;
+                            double total = 0.0;
+
+                            while (static_cast<int>(times.size()) <
+                                       s.repetitions ||
+                                   total < s.min_time) {
+                                double time = mode.second();
+
+                                times.push_back(time);
+                                total += time;
+                            }
+
+                            Stats st = compute_stats(times);
+                            double images_per_sec = s.batch / st.mean;
+
+                            csv << mode.first << ',' << input.first << ','
+                                << dim << ',' << c << ',' << t << ','
+                                << s.batch << ',' << st.n << ',' << st.mean
+                                << ',' << st.stddev << ',' << st.median << ','
+                                << st.ci95 << ',' << images_per_sec << '\n';
+
+                            std::cout << std::left << std::setw(8) << mode.first
+                                      << std::setw(16) << input.first
+                                      << std::right << std::fixed
+                                      << std::setprecision(3)
+                                      << std::setw(6) << dim << std::setw(4) << c
+                                      << std::setw(4) << t
+                                      << std::setw(12) << 1e3 * st.median
+                                      << std::setw(12) << 1e3 * st.ci95
+                                      << std::setw(12) << images_per_sec
+                                      << '\n' << std::defaultfloat;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+/* Streaming Throughput *******************************************************/
+
+// write image as raw packed RGB triplets, returns the file size
+static size_t write_raw(cv::Mat const &image, std::string const &file)
+{
+    std::ofstream os(file, std::ios::binary | std::ios::trunc);
+    std::vector<unsigned char> row(3 * image.cols);
+
+    for (int y = 0; y < image.rows; ++y) {
+        cv::Vec3b const *src = image.ptr<cv::Vec3b>(y);
+
+        for (int x = 0; x < image.cols; ++x) {
+            row[3 * x] = src[x][2];
+            row[3 * x + 1] = src[x][1];
+            row[3 * x + 2] = src[x][0];
+        }
+
+        os.write(reinterpret_cast<char const *>(&row[0]), row.size());
+    }
+
+    if (!os.good())
+        throw std::runtime_error("failed to write " + file);
+
+    return row.size() * image.rows;
+}
+
+// evict a file from the page cache (best effort, needs no privileges)
+static void drop_cache(std::string const &file)
+{
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd == -1)
+        return;
+
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+// time a sequential read of the whole file
+static double time_read(std::string const &file)
+{
+    std::vector<char> buf(1 << 20);
+
+    double start = omp_get_wtime();
+
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd == -1)
+        throw std::runtime_error("failed to open " + file);
+
+    while (read(fd, &buf[0], buf.size()) > 0)
+        ;
+
+    close(fd);
+
+    return omp_get_wtime() - start;
+}
+
+// bytes per second of kmeans_omp_stream (input bytes of all assignment
+// passes) per thread count, each with the input evicted from the page cache
+// beforehand ("disk") and with the input cached ("cache"), next to the
+// bandwidth of plain sequential reads from either
+static void run_stream(Settings const &s)
+{
+    std::ofstream csv(s.out_dir + "stream.csv");
+    csv << "mode,data,dim,clusters,threads,bytes,repetitions,"
+           "mean,stddev,median,ci95,bytes_per_sec\n";
+
+    std::cout << std::left << std::setw(14) << "mode"
+              << std::setw(16) << "data" << std::right
+              << std::setw(6) << "dim" << std::setw(4) << "k"
+              << std::setw(4) << "t"
+              << std::setw(12) << "median[ms]" << std::setw(12) << "ci95[ms]"
+              << std::setw(12) << "MB/s" << '\n';
+
+    std::string pixel_file = s.stream_dir + "kmeans_stream.rgb";
+    std::string label_file = s.stream_dir + "kmeans_stream.labels";
+
+    for (auto const &data : s.data) {
+        for (int dim : s.dims) {
+            for (auto const &input : make_inputs(data, dim, s)) {
+                size_t size = write_raw(input.second, pixel_file);
+
+                for (int c : s.clusters) {
+                    for (int t : s.threads) {
+                        kmeans_label_type label_type =
+                            kmeans_label_type_for(c);
+
+                        auto read_disk = [&](double &bytes) {
+                            drop_cache(pixel_file);
+                            bytes = size;
+                            return time_read(pixel_file);
+                        };
+
+                        auto read_cache = [&](double &bytes) {
+                            bytes = size;
+                            return time_read(pixel_file);
+                        };
+
+                        auto stream = [&](double &bytes, bool cold) {
+                            std::vector<pixel> centroids(c);
+
+                            if (cold)
+                                drop_cache(pixel_file);
+
+                            kmeans_result telemetry = kmeans_result();
+                            kmeans_set_result(&telemetry);
+
+                            omp_set_num_threads(t);
+
+                            double start = omp_get_wtime();
+                            int err = kmeans_omp_stream(
+                                pixel_file.c_str(), label_file.c_str(),
+                                &centroids[0], c, label_type);
+                            double time = omp_get_wtime() - start;
+
+                            kmeans_set_result(nullptr);
+
+                            if (err)
+                                throw std::runtime_error(
+                                    "kmeans_omp_stream failed on " +
+                                    pixel_file);
+
+                            bytes = static_cast<double>(size) *
+                                    telemetry.iterations;
+                            return time;
+                        };
+
+                        auto stream_disk = [&](double &bytes) {
+                            return stream(bytes, true);
+                        };
+
+                        auto stream_cache = [&](double &bytes) {
+                            return stream(bytes, false);
+                        };
+
+                        std::vector<std::pair<std::string,
+                                              std::function<double(double &)>>>
+                            modes;
+                        modes.push_back(std::make_pair("read_disk", read_disk));
+                        modes.push_back(std::make_pair("read_cache",
+                                                       read_cache));
+                        modes.push_back(std::make_pair("stream_disk",
+                                                       stream_disk));
+                        modes.push_back(std::make_pair("stream_cache",
+                                                       stream_cache));
+
+                        kmeans_set_seeding(s.init, s.seed);
+
+                        for (auto const &mode : modes) {
+                            double bytes = 0.0;
+
+                            for (int i = 0; i < s.warmup; ++i)
+                                mode.second(bytes);
+
+                            std::vector<double> times;
+                            double total = 0.0;
+                            double total_bytes = 0.0;
+
+                            while (static_cast<int>(times.size()) <
+                                       s.repetitions ||
+                                   total < s.min_time) {
+                                double time = mode.second(bytes);
+
+                                times.push_back(time);
+                                total += time;
+                                total_bytes += bytes;
+                            }
+
+                            Stats st = compute_stats(times);
+                            double bytes_per_sec = total_bytes / total;
+
+                            csv << mode.first << ',' << input.first << ','
+                                << dim << ',' << c << ',' << t << ','
+                                << size << ',' << st.n << ',' << st.mean
+                                << ',' << st.stddev << ',' << st.median << ','
+                                << st.ci95 << ',' << bytes_per_sec << '\n';
+
+                            std::cout << std::left << std::setw(14)
+                                      << mode.first
+                                      << std::setw(16) << input.first
+                                      << std::right << std::fixed
+                                      << std::setprecision(3)
+                                      << std::setw(6) << dim << std::setw(4) << c
+                                      << std::setw(4) << t
+                                      << std::setw(12) << 1e3 * st.median
+                                      << std::setw(12) << 1e3 * st.ci95
+                                      << std::setw(12) << 1e-6 * bytes_per_sec
+                                      << '\n' << std::defaultfloat;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    std::remove(pixel_file.c_str());
+    std::remove(label_file.c_str());
+}
+
+/* Distance Kernels ***********************************************************/
+
+// dim x dim points of n_features features in gaussian blobs around a few
+// random centers
+static cv::Mat make_feature_blobs(int dim, int n_features, cv::RNG &rng)
+{
+    int const n_blobs = 8;
+    double const sigma = 16.0;
+
+    cv::Mat centers(n_blobs, n_features, CV_32F);
+    rng.fill(centers, cv::RNG::UNIFORM, 0.0, 255.0);
+
+    cv::Mat points(dim * dim, n_features, CV_32F);
+
+    for (int i = 0; i < points.rows; ++i) {
+        float const *c = centers.ptr<float>(rng.uniform(0, n_blobs));
+        float *row = points.ptr<float>(i);
+
+        for (int f = 0; f < n_features; ++f)
+            row[f] = static_cast<float>(c[f] + rng.gaussian(sigma));
+    }
+
+    return points;
+}
+
+// seconds per iteration of kmeans_omp_features with the scalar and the GEMM
+// distance kernel, the smallest number of clusters from which on GEMM wins is
+// reported per number of points, features and threads
+static void run_distance(Settings const &s)
+{
+    std::ofstream csv(s.out_dir + "distance.csv");
+    csv << "kernel,points,features,clusters,threads,repetitions,"
+           "mean,stddev,median,ci95,time_per_iter,auto\n";
+
+    std::cout << std::left << std::setw(8) << "kernel" << std::right
+              << std::setw(10) << "points" << std::setw(6) << "d"
+              << std::setw(6) << "k" << std::setw(4) << "t"
+              << std::setw(12) << "median[ms]" << std::setw(12) << "ci95[ms]"
+              << std::setw(12) << "iter[ms]" << std::setw(8) << "auto"
+              << '\n';
+
+    std::vector<std::string> crossovers;
+
+    for (int dim : s.dims) {
+        for (int d : s.distance) {
+            cv::RNG rng(s.seed ? s.seed : 0x6b6d65616e73ull);
+            cv::Mat points = make_feature_blobs(dim, d, rng);
+
+            kmeans_matrix matrix;
+            matrix.data = points.ptr<float>();
+            matrix.n_rows = points.rows;
+            matrix.n_cols = points.cols;
+            matrix.ld = points.step1();
+            matrix.layout = KMEANS_ROW_MAJOR;
+
+            for (int t : s.threads) {
+                int crossover = -1;
+
+                for (int c : s.clusters) {
+                    std::vector<float> centroids(c * d);
+                    std::vector<size_t> labels(points.rows);
+
+                    kmeans_distance selected =
+                        kmeans_select_distance(points.rows, c, d);
+
+                    std::vector<std::pair<std::string, kmeans_distance>>
+                        kernels;
+                    kernels.push_back(
+                        std::make_pair("scalar", KMEANS_DISTANCE_SCALAR));
+                    kernels.push_back(
+                        std::make_pair("gemm", KMEANS_DISTANCE_GEMM));
+
+                    double per_iter[2];
+
+                    for (size_t k = 0u; k < kernels.size(); ++k) {
+                        kmeans_set_distance(kernels[k].second);
+                        kmeans_set_seeding(s.init, s.seed);
+                        omp_set_num_threads(t);
+
+                        auto run = [&](int &iterations) {
+                            kmeans_result telemetry = kmeans_result();
+                            kmeans_set_result(&telemetry);
+
+                            double start = omp_get_wtime();
+                            kmeans_omp_features(matrix, &centroids[0], c,
+                                                &labels[0]);
+                            double time = omp_get_wtime() - start;
+
+                            kmeans_set_result(nullptr);
+
+                            iterations = telemetry.iterations;
+                            return time;
+                        };
+
+                        int iterations = 0;
+
+                        for (int i = 0; i < s.warmup; ++i)
+                            run(iterations);
+
+                        std::vector<double> times;
+                        double total = 0.0;
+                        long total_iterations = 0;
+
+                        while (static_cast<int>(times.size()) <
+                                   s.repetitions ||
+                               total < s.min_time) {
+                            double time = run(iterations);
+
+                            times.push_back(time);
+                            total += time;
+                            total_iterations += iterations;
+                        }
+
+                        Stats st = compute_stats(times);
+                        per_iter[k] = total / std::max(total_iterations, 1L);
+
+                        char const *chosen =
+                            kernels[k].second == selected ? "yes" : "no";
+
+                        csv << kernels[k].first << ',' << points.rows << ','
+                            << d << ',' << c << ',' << t << ',' << st.n << ','
+                            << st.mean << ',' << st.stddev << ','
+                            << st.median << ',' << st.ci95 << ','
+                            << per_iter[k] << ',' << chosen << '\n';
+
+                        std::cout << std::left << std::setw(8)
+                                  << kernels[k].first << std::right
+                                  << std::fixed << std::setprecision(3)
+                                  << std::setw(10) << points.rows
+                                  << std::setw(6) << d << std::setw(6) << c
+                                  << std::setw(4) << t
+                                  << std::setw(12) << 1e3 * st.median
+                                  << std::setw(12) << 1e3 * st.ci95
+                                  << std::setw(12) << 1e3 * per_iter[k]
+                                  << std::setw(8) << chosen
+                                  << '\n' << std::defaultfloat;
+                    }
+
+                    if (per_iter[1] < per_iter[0]) {
+                        if (crossover < 0)
+                            crossover = c;
+                    } else {
+                        crossover = -1;
+                    }
+                }
+
+                std::ostringstream os;
+                os << "points " << points.rows << ", features " << d
+                   << ", threads " << t << ": ";
+                if (crossover < 0)
+                    os << "scalar throughout";
+                else
+                    os << "gemm from " << crossover << " clusters";
+
+                crossovers.push_back(os.str());
+            }
+        }
+    }
+
+    kmeans_set_distance(KMEANS_DISTANCE_AUTO);
+
+    std::cout << "\ncrossover (clusters in ascending order):\n";
+    for (auto const &line : crossovers)
+        std::cout << "  " << line << '\n';
+}
+
+/* Prediction Throughput ******************************************************/
+
+// pixels per second of fitting an image from scratch ("fit") vs. labelling it
+// against the saved and reloaded model of that fit ("predict")
+static void run_predict(Settings const &s)
+{
+    std::ofstream csv(s.out_dir + "predict.csv");
+    csv << "mode,data,dim,clusters,threads,repetitions,"
+           "mean,stddev,median,ci95,pixels_per_sec\n";
+
+    std::cout << std::left << std::setw(8) << "mode"
+              << std::setw(16) << "data" << std::right
+              << std::setw(6) << "dim" << std::setw(4) << "k"
+              << std::setw(4) << "t"
+              << std::setw(12) << "median[ms]" << std::setw(12) << "ci95[ms]"
+              << std::setw(12) << "Mpixels/s" << '\n';
+
+    for (auto const &data : s.data) {
+        for (int dim : s.dims) {
+            for (auto const &input : make_inputs(data, dim, s)) {
+                cv::Mat const &image = input.second;
+                double pixels = static_cast<double>(image.rows) * image.cols;
+
+                for (int c : s.clusters) {
+                    for (int t : s.threads) {
+                        KmeansOMPWrapper wrapper(t);
+                        wrapper.set_seeding(s.init, s.seed);
+
+                        // model the predictor works with
+                        wrapper.exec(image, c);
+                        wrapper.save_model(s.predict_model);
+
+                        KmeansPredictor predictor(kmeans_omp_predict, t);
+                        predictor.load_model(s.predict_model);
+
+                        auto fit = [&]() {
+                            wrapper.exec(image, c);
+                            return wrapper.get_exec_time();
+                        };
+
+                        auto predict = [&]() {
+                            predictor.predict(image);
+                            return predictor.get_exec_time();
+                        };
+
+                        std::vector<std::pair<std::string,
+                                              std::function<double()>>> modes;
+                        modes.push_back(std::make_pair("fit", fit));
+                        modes.push_back(std::make_pair("predict", predict));
+
+                        for (auto const &mode : modes) {
+                            for (int i = 0; i < s.warmup; ++i)
+                                mode.second();
+
+                            std::vector<double> times;
+                            double total = 0.0;
+
+                            while (static_cast<int>(times.size()) <
+                                       s.repetitions ||
+                                   total < s.min_time) {
+                                double time = mode.second();
+
+                                times.push_back(time);
+                                total += time;
+                            }
+
+                            Stats st = compute_stats(times);
+                            double pixels_per_sec = pixels / st.mean;
+
+                            csv << mode.first << ',' << input.first << ','
+                                << dim << ',' << c << ',' << t << ','
+                                << st.n << ',' << st.mean << ','
+                                << st.stddev << ',' << st.median << ','
+                                << st.ci95 << ',' << pixels_per_sec << '\n';
+
+                            std::cout << std::left << std::setw(8) << mode.first
+                                      << std::setw(16) << input.first
+                                      << std::right << std::fixed
+                                      << std::setprecision(3)
+                                      << std::setw(6) << dim << std::setw(4) << c
+                                      << std::setw(4) << t
+                                      << std::setw(12) << 1e3 * st.median
+                                      << std::setw(12) << 1e3 * st.ci95
+                                      << std::setw(12) << 1e-6 * pixels_per_sec
+                                      << '\n' << std::defaultfloat;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+/* Multiple Restarts **********************************************************/
+
+// time and best inertia of R restarts advanced together by a single
+// kmeans_omp_restarts call ("shared") vs. R independently seeded
+// kmeans_omp calls ("sequential")
+static void run_restarts(Settings const &s)
+{
+    std::ofstream csv(s.out_dir + "restarts.csv");
+    csv << "mode,data,dim,clusters,threads,restarts,repetitions,"
+           "mean,stddev,median,ci95,best_inertia\n";
+
+    std::cout << std::left << std::setw(12) << "mode"
+              << std::setw(16) << "data" << std::right
+              << std::setw(6) << "dim" << std::setw(4) << "k"
+              << std::setw(4) << "t"
+              << std::setw(12) << "median[ms]" << std::setw(12) << "ci95[ms]"
+              << std::setw(16) << "best inertia" << '\n';
+
+    size_t n_restarts = static_cast<size_t>(s.restarts);
+
+    // fixed seeds so that both modes start from comparable seedings
+    unsigned long seed = s.seed ? s.seed : 1u;
+
+    for (auto const &data : s.data) {
+        for (int dim : s.dims) {
+            for (auto const &input : make_inputs(data, dim, s)) {
+                cv::Mat const &image = input.second;
+
+                for (int c : s.clusters) {
+                    for (int t : s.threads) {
+                        KmeansRestartsWrapper shared_wrapper(
+                            kmeans_omp_restarts, t, n_restarts);
+                        shared_wrapper.set_seeding(s.init, seed);
+
+                        // kmeans_omp itself, which restart 0 reproduces
+                        KmeansCWrapper wrapper(kmeans_omp, t);
+
+                        // each returns its time, best_inertia the least
+                        // inertia of the last call
+                        double best_inertia = 0.0;
+
+                        auto shared = [&]() {
+                            shared_wrapper.exec(image, c);
+
+                            best_inertia =
+                                shared_wrapper.get_telemetry().inertia;
+                            return shared_wrapper.get_exec_time();
+                        };
+
+                        auto sequential = [&]() {
+                            double time = 0.0;
+                            best_inertia = -1.0;
+
+                            for (size_t r = 0u; r < n_restarts; ++r) {
+                                wrapper.set_seeding(s.init, seed + r);
+                                wrapper.exec(image, c);
+
+                                double inertia =
+                                    wrapper.get_telemetry().inertia;
+                                if (best_inertia < 0.0 ||
+                                    inertia < best_inertia)
+                                    best_inertia = inertia;
+
+                                time += wrapper.get_exec_time();
+                            }
+
+                            return time;
+                        };
+
+                        std::vector<std::pair<std::string,
+                                              std::function<double()>>> modes;
+                        modes.push_back(std::make_pair("shared", shared));
+                        modes.push_back(
+                            std::make_pair("sequential", sequential));
+
+                        for (auto const &mode : modes) {
+                            for (int i = 0; i < s.warmup; ++i)
+                                mode.second();
+
+                            std::vector<double> times;
+                            double total = 0.0;
+
+                            while (static_cast<int>(times.size()) <
+                                       s.repetitions ||
+                                   total < s.min_time) {
+                                double time = mode.second();
+
+                                times.push_back(time);
+                                total += time;
+                            }
+
+                            Stats st = compute_stats(times);
+
+                            csv << mode.first << ',' << input.first << ','
+                                << dim << ',' << c << ',' << t << ','
+                                << n_restarts << ',' << st.n << ','
+                                << st.mean << ',' << st.stddev << ','
+                                << st.median << ',' << st.ci95 << ','
+                                << best_inertia << '\n';
+
+                            std::cout << std::left << std::setw(12)
+                                      << mode.first << std::setw(16)
+                                      << input.first << std::right
+                                      << std::fixed << std::setprecision(3)
+                                      << std::setw(6) << dim << std::setw(4) << c
+                                      << std::setw(4) << t
+                                      << std::setw(12) << 1e3 * st.median
+                                      << std::setw(12) << 1e3 * st.ci95
+                                      << std::setw(16) << std::setprecision(0)
+                                      << best_inertia
+                                      << '\n' << std::defaultfloat;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+/* Coreset Fitting ************************************************************/
+
+// fit time and inertia (over all pixels) of kmeans_omp_coreset for every
+// sample size relative to those of kmeans_omp on the same image ("full"),
+// the inertia gap is averaged over repetitions with consecutive seeds
+static void run_coreset(Settings const &s)
+{
+    std::ofstream csv(s.out_dir + "coreset.csv");
+    csv << "sample,data,dim,clusters,threads,repetitions,"
+           "mean,stddev,median,ci95,inertia,inertia_gap,speedup\n";
+
+    std::cout << std::left << std::setw(10) << "sample"
+              << std::setw(16) << "data" << std::right
+              << std::setw(6) << "dim" << std::setw(4) << "k"
+              << std::setw(4) << "t"
+              << std::setw(12) << "median[ms]" << std::setw(12) << "ci95[ms]"
+              << std::setw(10) << "gap[%]" << std::setw(10) << "speedup"
+              << '\n';
+
+    unsigned long seed = s.seed ? s.seed : 1u;
+
+    for (auto const &data : s.data) {
+        for (int dim : s.dims) {
+            for (auto const &input : make_inputs(data, dim, s)) {
+                cv::Mat const &image = input.second;
+
+                for (int c : s.clusters) {
+                    for (int t : s.threads) {
+                        // times of a wrapper over all repetitions, returns
+                        // their mean inertia
+                        auto measure = [&](KmeansWrapper &wrapper,
+                                           std::vector<double> &times) {
+                            double inertia = 0.0;
+
+                            for (int i = 0; i < s.warmup; ++i) {
+                                wrapper.set_seeding(s.init, seed);
+                                wrapper.exec(image, c);
+                            }
+
+                            double total = 0.0;
+
+                            while (static_cast<int>(times.size()) <
+                                       s.repetitions ||
+                                   total < s.min_time) {
+                                wrapper.set_seeding(s.init,
+                                                    seed + times.size());
+                                wrapper.exec(image, c);
+
+                                times.push_back(wrapper.get_exec_time());
+                                total += times.back();
+                                inertia += wrapper.get_telemetry().inertia;
+                            }
+
+                            return inertia / times.size();
+                        };
+
+                        // sample size 0 stands for kmeans_omp
+                        std::vector<int> samples = s.coreset;
+                        samples.insert(samples.begin(), 0);
+
+                        Stats full;
+                        double full_inertia = 0.0;
+
+                        for (int sample : samples) {
+                            std::unique_ptr<KmeansWrapper> wrapper;
+                            if (sample)
+                                wrapper.reset(new KmeansCoresetWrapper(
+                                    kmeans_omp_coreset, t,
+                                    static_cast<size_t>(sample)));
+                            else
+                                wrapper.reset(
+                                    new KmeansCWrapper(kmeans_omp, t));
+
+                            std::vector<double> times;
+                            double inertia = measure(*wrapper, times);
+
+                            Stats st = compute_stats(times);
+
+                            if (!sample) {
+                                full = st;
+                                full_inertia = inertia;
+                            }
+
+                            double gap = inertia / full_inertia - 1.0;
+                            double speedup = full.mean / st.mean;
+                            std::string name =
+                                sample ? std::to_string(sample) : "full";
+
+                            csv << name << ',' << input.first << ','
+                                << dim << ',' << c << ',' << t << ','
+                                << st.n << ',' << st.mean << ','
+                                << st.stddev << ',' << st.median << ','
+                                << st.ci95 << ',' << inertia << ','
+                                << gap << ',' << speedup << '\n';
+
+                            std::cout << std::left << std::setw(10) << name
+                                      << std::setw(16) << input.first
+                                      << std::right << std::fixed
+                                      << std::setprecision(3)
+                                      << std::setw(6) << dim << std::setw(4) << c
+                                      << std::setw(4) << t
+                                      << std::setw(12) << 1e3 * st.median
+                                      << std::setw(12) << 1e3 * st.ci95
+                                      << std::setw(10) << 1e2 * gap
+                                      << std::setw(10) << speedup
+                                      << '\n' << std::defaultfloat;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+/* Sharded Fitting ************************************************************/
+
+// fit time of kmeans_sharded for every number of workers relative to that of
+// kmeans_omp with as many threads, with the share of it spent communicating
+// and the coordinator's traffic per iteration
+static void run_shards(Settings const &s)
+{
+    std::ofstream csv(s.out_dir + "shards.csv");
+    csv << "mode,data,dim,clusters,workers,repetitions,"
+           "mean,stddev,median,ci95,iterations,comm_fraction,"
+           "bytes_per_iteration\n";
+
+    std::cout << std::left << std::setw(10) << "mode"
+              << std::setw(16) << "data" << std::right
+              << std::setw(6) << "dim" << std::setw(4) << "k"
+              << std::setw(4) << "w"
+              << std::setw(12) << "median[ms]" << std::setw(12) << "ci95[ms]"
+              << std::setw(10) << "comm[%]" << std::setw(12) << "kB/iter"
+              << '\n';
+
+    // fixed seed so that both modes run the same iterations
+    unsigned long seed = s.seed ? s.seed : 1u;
+
+    for (auto const &data : s.data) {
+        for (int dim : s.dims) {
+            for (auto const &input : make_inputs(data, dim, s)) {
+                cv::Mat const &image = input.second;
+
+                for (int c : s.clusters) {
+                    for (int w : s.shards) {
+                        KmeansShardedWrapper sharded(w);
+                        KmeansCWrapper omp(kmeans_omp, w);
+
+                        std::vector<std::pair<std::string, KmeansWrapper *>>
+                            modes;
+                        modes.push_back(std::make_pair("omp", &omp));
+                        modes.push_back(std::make_pair("sharded", &sharded));
+
+                        for (auto const &mode : modes) {
+                            KmeansWrapper &wrapper = *mode.second;
+                            wrapper.set_seeding(s.init, seed);
+
+                            std::vector<double> times;
+                            double total = 0.0;
+                            double comm = 0.0;
+                            double bytes = 0.0;
+                            int iterations = 0;
+
+                            try {
+                                for (int i = 0; i < s.warmup; ++i)
+                                    wrapper.exec(image, c);
+
+                                while (static_cast<int>(times.size()) <
+                                           s.repetitions ||
+                                       total < s.min_time) {
+                                    wrapper.exec(image, c);
+
+                                    times.push_back(wrapper.get_exec_time());
+                                    total += times.back();
+                                    iterations =
+                                        wrapper.get_telemetry().iterations;
+
+                                    if (&wrapper != &sharded)
+                                        continue;
+
+                                    kmeans_shard_stats st =
+                                        sharded.get_shard_stats();
+                                    comm += st.comm_time;
+                                    bytes += static_cast<double>(
+                                        st.bytes_sent + st.bytes_received);
+                                }
+                            } catch (std::exception const &e) {
+                                std::cerr << mode.first << ": " << e.what()
+                                          << '\n';
+                                continue;
+                            }
+
+                            Stats st = compute_stats(times);
+
+                            double comm_fraction = comm / total;
+                            double per_iteration =
+                                bytes / times.size() /
+                                (iterations ? iterations : 1);
+
+                            csv << mode.first << ',' << input.first << ','
+                                << dim << ',' << c << ',' << w << ','
+                                << st.n << ',' << st.mean << ','
+                                << st.stddev << ',' << st.median << ','
+                                << st.ci95 << ',' << iterations << ','
+                                << comm_fraction << ',' << per_iteration
+                                << '\n';
+
+                            std::cout << std::left << std::setw(10)
+                                      << mode.first << std::setw(16)
+                                      << input.first << std::right
+                                      << std::fixed << std::setprecision(3)
+                                      << std::setw(6) << dim << std::setw(4) << c
+                                      << std::setw(4) << w
+                                      << std::setw(12) << 1e3 * st.median
+                                      << std::setw(12) << 1e3 * st.ci95
+                                      << std::setw(10) << 1e2 * comm_fraction
+                                      << std::setw(12) << 1e-3 * per_iteration
+                                      << '\n' << std::defaultfloat;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+/* Main Function **************************************************************/
+
+int main(int argc, char **argv)
+{
+    Settings s;
+
+    try {
+        s = parse_settings(argc, argv);
+    } catch (std::exception const &e) {
+        std::cerr << e.what() << '\n';
+        usage(argv[0]);
+        return -1;
+    }
+
+    if (s.batch > 0) {
+        run_batch(s);
+        return 0;
+    }
+
+    if (!s.stream_dir.empty()) {
+        try {
+            run_stream(s);
+        } catch (std::exception const &e) {
+            std::cerr << e.what() << '\n';
+            return -1;
+        }
+
+        return 0;
+    }
+
+    if (!s.distance.empty()) {
+        run_distance(s);
+        return 0;
+    }
+
+    if (!s.predict_model.empty()) {
+        try {
+            run_predict(s);
+        } catch (std::exception const &e) {
+            std::cerr << e.what() << '\n';
+            return -1;
+        }
+
+        return 0;
+    }
+
+    if (s.restarts > 0) {
+        run_restarts(s);
+        return 0;
+    }
+
+    if (!s.coreset.empty()) {
+        run_coreset(s);
+        return 0;
+    }
+
+    if (!s.shards.empty()) {
+        run_shards(s);
+        return 0;
+    }
+
+    std::map<std::string, SummaryRow> baseline;
+
+    try {
+        if (!s.baseline.empty())
+            baseline = read_summary(s.baseline);
+    } catch (std::exception const &e) {
+        std::cerr << e.what() << '\n';
+        return -1;
+    }
+
+    std::regex filter(s.filter);
+
+    // instantiate all selected benchmarks
+    std::vector<std::pair<std::string, std::unique_ptr<KmeansWrapper>>> benches;
+    std::vector<int> bench_threads;
+
+    for (auto const &family : families()) {
+        std::vector<int> threads(1, 1);
+        if (family.threaded)
+            threads = s.threads;
+
+        for (int t : threads) {
+            std::string name = benchmark_name(family, t);
+            if (!std::regex_search(name, filter))
+                continue;
+
+            std::unique_ptr<KmeansWrapper> wrapper(family.create(t));
+            wrapper->set_seeding(s.init, s.seed);
+
+            benches.push_back(std::make_pair(name, std::move(wrapper)));
+            bench_threads.push_back(t);
+        }
+    }
+
+    std::ofstream summary(s.out_dir + "summary.csv");
+    summary << summary_header;
+
+    std::vector<std::ofstream> raw(benches.size());
+    for (size_t b = 0u; b < benches.size(); ++b) {
+        std::string csvfile(s.out_dir + benches[b].first + ".csv");
         std::cout << "creating: " << csvfile << '\n';
 
-        std::ofstream os(csvfile);
-        os << "dim,clusters,time\n";
+        raw[b].open(csvfile);
+        raw[b] << "dim,clusters,threads,data,time,iterations,time_per_iter\n";
+    }
+
+    int n_regressions = 0;
+
+    std::cout << std::left << std::setw(24) << "benchmark"
+              << std::setw(16) << "data" << std::right
+              << std::setw(6) << "dim" << std::setw(4) << "k"
+              << std::setw(12) << "median[ms]" << std::setw(12) << "ci95[ms]"
+              << std::setw(12) << "Mpx/s" << std::setw(12) << "iter[ms]"
+              << '\n';
+
+    for (auto const &data : s.data) {
+        for (int dim : s.dims) {
+            for (auto const &input : make_inputs(data, dim, s)) {
+                std::string const &data_name = input.first;
+                cv::Mat const &image = input.second;
+
+                double n_pixels = static_cast<double>(image.total());
+
+                for (int c : s.clusters) {
+                    for (size_t b = 0u; b < benches.size(); ++b) {
+                        std::string const &name = benches[b].first;
+                        KmeansWrapper *wrapper = benches[b].second.get();
+
+                        for (int i = 0; i < s.warmup; ++i)
+                            wrapper->exec(image, c);
+
+                        std::vector<double> times;
+                        std::vector<double> iter_times;
+                        double total = 0.0;
 
-        for (int dim = dim_min; dim <= dim_max; dim += dim_step) {
-            std::cout << dim << "x" << dim << "...\n";
+                        while (static_cast<int>(times.size()) < s.repetitions ||
+                               total < s.min_time) {
+                            wrapper->exec(image, c);
+                            double t = wrapper->get_exec_time();
 
-            cv::Mat image = cv::Mat::zeros(dim, dim, CV_8UC3);
-            cv::randu(image, cv::Scalar(0, 0, 0), cv::Scalar(255, 255, 255));
+                            // zero if the implementation does not report
+                            // iterations
+                            int iterations = wrapper->get_telemetry().iterations;
+                            double t_iter = iterations ? t / iterations : 0.0;
 
-            for (int c = clusters_min; c <= clusters_max; c += clusters_step) {
-                for (int i = 0; i <= n_exec; ++i) {
-                    wrapper->exec(image, c);
-                    double t = wrapper->get_exec_time();
-                    os << dim << ',' << c << ',' << t << '\n';
+                            raw[b] << dim << ',' << c << ',' << bench_threads[b]
+                                   << ',' << data_name << ',' << t << ','
+                                   << iterations << ',' << t_iter << '\n';
+
+                            times.push_back(t);
+                            iter_times.push_back(t_iter);
+                            total += t;
+                        }
+
+                        SummaryRow row;
+                        row.time = compute_stats(times);
+                        row.pixels_per_sec = n_pixels / row.time.mean;
+                        row.time_per_iter = compute_stats(iter_times).mean;
+
+                        summary << name << ',' << data_name << ',' << dim << ','
+                                << c << ',' << bench_threads[b] << ','
+                                << row.time.n << ',' << row.time.mean << ','
+                                << row.time.stddev << ',' << row.time.median
+                                << ',' << row.time.ci95 << ','
+                                << row.pixels_per_sec << ','
+                                << row.time_per_iter << '\n';
+
+                        std::cout << std::left << std::setw(24) << name
+                                  << std::setw(16) << data_name << std::right
+                                  << std::fixed << std::setprecision(3)
+                                  << std::setw(6) << dim << std::setw(4) << c
+                                  << std::setw(12) << 1e3 * row.time.median
+                                  << std::setw(12) << 1e3 * row.time.ci95
+                                  << std::setw(12) << 1e-6 * row.pixels_per_sec
+                                  << std::setw(12) << 1e3 * row.time_per_iter;
+
+                        auto base = baseline.find(
+                            summary_key(name, data_name, dim, c));
+
+                        if (base != baseline.end()) {
+                            double change =
+                                row.time.median / base->second.time.median - 1.0;
+
+                            std::cout << std::showpos << std::setw(9)
+                                      << 1e2 * change << '%' << std::noshowpos;
+
+                            if (regressed(base->second.time, row.time,
+                                          s.threshold)) {
+                                std::cout << "  REGRESSION";
+                                ++n_regressions;
+                            }
+                        }
+
+                        std::cout << '\n' << std::defaultfloat;
+                    }
                 }
             }
         }
     }
+
+    if (!baseline.empty()) {
+        std::cout << n_regressions << " regression(s) beyond "
+                  << 1e2 * s.threshold << "%\n";
+    }
+
+    return n_regressions ? 1 : 0;
 }
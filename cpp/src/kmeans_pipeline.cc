@@ -0,0 +1,443 @@
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <omp.h>
+#include <opencv2/opencv.hpp>
+
+#include "kmeans_wrapper.h"
+
+/* Argument Parsing ***********************************************************/
+
+static int parse_intarg(std::string const &arg)
+{
+    int res = 0;
+    try {
+        size_t idx;
+        res = std::stoi(arg, &idx);
+
+        if (idx != arg.size())
+            throw std::invalid_argument("trailing garbage");
+
+    } catch (std::exception const &e) {
+        throw std::invalid_argument(
+            std::string("malformed integer param: ") + e.what());
+    }
+
+    if (res < 1)
+        throw std::invalid_argument("expected a positive number: " + arg);
+
+    return res;
+}
+
+struct Settings
+{
+    std::string in_dir;
+    std::string out_dir;
+    int clusters = 0;
+
+    int decoders = 4;
+    int encoders = 4;
+    int threads = 4;
+    int queue = 8;
+    unsigned long seed = 0u;
+};
+
+static void usage(char const *prog)
+{
+    std::cerr
+        << "Usage: " << prog << " IN_DIR OUT_DIR CLUSTERS [OPTION]...\n"
+        << "Quantizes every image in IN_DIR and writes it to OUT_DIR under\n"
+        << "the same name, decoding, clustering and encoding concurrently.\n"
+        << "  --decoders=N  decoder threads (default: 4)\n"
+        << "  --encoders=N  encoder threads (default: 4)\n"
+        << "  --threads=N   OpenMP threads of the clustering stage (default: 4)\n"
+        << "  --queue=N     images held between two stages (default: 8)\n"
+        << "  --seed=SEED   fixed seed for initialization\n";
+}
+
+static Settings parse_settings(int argc, char **argv)
+{
+    if (argc < 4)
+        throw std::invalid_argument("missing arguments");
+
+    Settings s;
+    s.in_dir = argv[1];
+    s.out_dir = argv[2];
+    s.clusters = parse_intarg(argv[3]);
+
+    for (int i = 4; i < argc; ++i) {
+        std::string arg(argv[i]);
+
+        size_t eq = arg.find('=');
+        if (arg.compare(0, 2, "--") != 0 || eq == std::string::npos)
+            throw std::invalid_argument("malformed option: " + arg);
+
+        std::string key = arg.substr(2, eq - 2);
+        std::string value = arg.substr(eq + 1);
+
+        if (key == "decoders")
+            s.decoders = parse_intarg(value);
+        else if (key == "encoders")
+            s.encoders = parse_intarg(value);
+        else if (key == "threads")
+            s.threads = parse_intarg(value);
+        else if (key == "queue")
+            s.queue = parse_intarg(value);
+        else if (key == "seed")
+            s.seed = parse_intarg(value);
+        else
+            throw std::invalid_argument("unknown option: " + key);
+    }
+
+    return s;
+}
+
+// image files of a directory (by extension), sorted by name
+static std::vector<std::string> list_images(std::string const &dir)
+{
+    static char const *extensions[] = { ".jpg", ".jpeg", ".png", ".bmp",
+                                        ".tif", ".tiff", ".webp", ".ppm" };
+
+    std::vector<cv::String> paths;
+    cv::glob(dir + "/*", paths, false);
+
+    std::vector<std::string> images;
+
+    for (auto const &path : paths) {
+        std::string name(path);
+
+        size_t dot = name.rfind('.');
+        if (dot == std::string::npos)
+            continue;
+
+        std::string ext = name.substr(dot);
+        std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+
+        for (char const *known : extensions) {
+            if (ext == known) {
+                images.push_back(name);
+                break;
+            }
+        }
+    }
+
+    std::sort(images.begin(), images.end());
+
+    return images;
+}
+
+static std::string base_name(std::string const &path)
+{
+    size_t slash = path.find_last_of('/');
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+/* Pipeline *******************************************************************/
+
+// an image on its way through the stages
+struct Job
+{
+    std::string name;
+    cv::Mat image;
+};
+
+// bounded FIFO between two stages: push blocks while it is full, so that a
+// slow stage throttles the ones before it instead of letting decoded images
+// pile up, pop blocks while it is empty until all producers have finished
+class StageQueue
+{
+public:
+    StageQueue(size_t capacity, int producers)
+      : capacity(capacity), producers(producers) {}
+
+    // returns the seconds spent waiting for room
+    double push(Job &&job)
+    {
+        double start = omp_get_wtime();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [this]() { return jobs.size() < capacity; });
+
+        jobs.push_back(std::move(job));
+        not_empty.notify_one();
+
+        return omp_get_wtime() - start;
+    }
+
+    // false once all producers have finished and the queue is drained,
+    // waited receives the seconds spent waiting for a job
+    bool pop(Job &job, double &waited)
+    {
+        double start = omp_get_wtime();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [this]() { return !jobs.empty() || !producers; });
+
+        waited = omp_get_wtime() - start;
+
+        if (jobs.empty())
+            return false;
+
+        job = std::move(jobs.front());
+        jobs.pop_front();
+        not_full.notify_one();
+
+        return true;
+    }
+
+    // called by every producer once it is done
+    void finish()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (--producers == 0)
+            not_empty.notify_all();
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable not_full;
+    std::condition_variable not_empty;
+    std::deque<Job> jobs;
+
+    size_t capacity;
+    int producers;
+};
+
+// where the workers of a stage spent their time (seconds, summed over them)
+struct StageStats
+{
+    int workers = 0;
+    size_t images = 0u;
+    size_t failures = 0u;
+
+    double busy = 0.0;    // decoding, clustering or encoding
+    double starved = 0.0; // waiting for input
+    double blocked = 0.0; // waiting for room in the next queue
+
+    void add(StageStats const &other)
+    {
+        images += other.images;
+        failures += other.failures;
+        busy += other.busy;
+        starved += other.starved;
+        blocked += other.blocked;
+    }
+};
+
+static void decode_worker(std::vector<std::string> const &files,
+                          std::atomic<size_t> &next, StageQueue &out,
+                          StageStats &stats)
+{
+    for (;;) {
+        size_t i = next++;
+        if (i >= files.size())
+            break;
+
+        double start = omp_get_wtime();
+
+        Job job;
+        job.name = base_name(files[i]);
+
+        try {
+            job.image = cv::imread(files[i], cv::IMREAD_COLOR);
+        } catch (std::exception const &) {
+            job.image.release();
+        }
+
+        stats.busy += omp_get_wtime() - start;
+
+        if (job.image.empty()) {
+            std::cerr << "Failed to load image file '" << files[i] << "'\n";
+            ++stats.failures;
+            continue;
+        }
+
+        ++stats.images;
+        stats.blocked += out.push(std::move(job));
+    }
+
+    out.finish();
+}
+
+static void cluster_stage(Settings const &s, StageQueue &in, StageQueue &out,
+                          StageStats &stats)
+{
+    KmeansOMPWrapper wrapper(s.threads);
+    wrapper.set_seeding(KMEANS_INIT_RANDOM, s.seed);
+
+    Job job;
+    double waited;
+
+    while (in.pop(job, waited)) {
+        stats.starved += waited;
+
+        double start = omp_get_wtime();
+
+        // a fresh result buffer per image, the previous one may still be
+        // queued for encoding
+        cv::Mat result;
+        wrapper.exec_into(job.image, s.clusters, result);
+        job.image = result;
+
+        stats.busy += omp_get_wtime() - start;
+        ++stats.images;
+
+        stats.blocked += out.push(std::move(job));
+    }
+
+    stats.starved += waited;
+
+    out.finish();
+}
+
+static void encode_worker(std::string const &out_dir, StageQueue &in,
+                          StageStats &stats)
+{
+    Job job;
+    double waited;
+
+    while (in.pop(job, waited)) {
+        stats.starved += waited;
+
+        double start = omp_get_wtime();
+        std::string file = out_dir + '/' + job.name;
+
+        bool written = false;
+        try {
+            written = cv::imwrite(file, job.image);
+        } catch (std::exception const &) {
+            written = false;
+        }
+
+        stats.busy += omp_get_wtime() - start;
+
+        if (!written) {
+            std::cerr << "Failed to write '" << file << "'\n";
+            ++stats.failures;
+            continue;
+        }
+
+        ++stats.images;
+    }
+
+    stats.starved += waited;
+}
+
+/* Main Function **************************************************************/
+
+int main(int argc, char **argv)
+{
+    Settings s;
+
+    try {
+        s = parse_settings(argc, argv);
+    } catch (std::exception const &e) {
+        std::cerr << e.what() << '\n';
+        usage(argv[0]);
+        return -1;
+    }
+
+    std::vector<std::string> files = list_images(s.in_dir);
+    if (files.empty()) {
+        std::cerr << "No images found in '" << s.in_dir << "'\n";
+        return -1;
+    }
+
+    StageQueue decoded(s.queue, s.decoders);
+    StageQueue clustered(s.queue, 1);
+
+    std::vector<StageStats> decode_stats(s.decoders);
+    std::vector<StageStats> encode_stats(s.encoders);
+    StageStats cluster_stats;
+
+    std::atomic<size_t> next(0u);
+
+    double start = omp_get_wtime();
+
+    std::vector<std::thread> workers;
+
+    for (int i = 0; i < s.decoders; ++i)
+        workers.emplace_back(decode_worker, std::cref(files), std::ref(next),
+                             std::ref(decoded), std::ref(decode_stats[i]));
+
+    for (int i = 0; i < s.encoders; ++i)
+        workers.emplace_back(encode_worker, std::cref(s.out_dir),
+                             std::ref(clustered), std::ref(encode_stats[i]));
+
+    // the clustering stage runs on this thread (and its OpenMP team)
+    cluster_stage(s, decoded, clustered, cluster_stats);
+
+    for (auto &worker : workers)
+        worker.join();
+
+    double wall = omp_get_wtime() - start;
+
+    // summarize stages, utilisation is busy time over the time all workers of
+    // a stage were available
+    StageStats decode, encode;
+    decode.workers = s.decoders;
+    encode.workers = s.encoders;
+    cluster_stats.workers = 1;
+
+    for (auto const &st : decode_stats)
+        decode.add(st);
+    for (auto const &st : encode_stats)
+        encode.add(st);
+
+    std::vector<std::pair<char const *, StageStats const *>> stages;
+    stages.push_back(std::make_pair("decode", &decode));
+    stages.push_back(std::make_pair("cluster", &cluster_stats));
+    stages.push_back(std::make_pair("encode", &encode));
+
+    std::cout << std::left << std::setw(10) << "stage" << std::right
+              << std::setw(8) << "workers" << std::setw(8) << "images"
+              << std::setw(10) << "failed" << std::setw(10) << "busy[%]"
+              << std::setw(12) << "starved[%]" << std::setw(12)
+              << "blocked[%]" << std::setw(12) << "ms/image" << '\n';
+
+    char const *bottleneck = stages[0].first;
+    double max_utilisation = -1.0;
+
+    for (auto const &stage : stages) {
+        StageStats const &st = *stage.second;
+        double available = st.workers * wall;
+        double utilisation = st.busy / available;
+
+        if (utilisation > max_utilisation) {
+            max_utilisation = utilisation;
+            bottleneck = stage.first;
+        }
+
+        size_t handled = st.images + st.failures;
+
+        std::cout << std::left << std::setw(10) << stage.first << std::right
+                  << std::setw(8) << st.workers << std::setw(8) << st.images
+                  << std::setw(10) << st.failures << std::fixed
+                  << std::setprecision(1)
+                  << std::setw(10) << 1e2 * utilisation
+                  << std::setw(12) << 1e2 * st.starved / available
+                  << std::setw(12) << 1e2 * st.blocked / available
+                  << std::setw(12) << std::setprecision(3)
+                  << (handled ? 1e3 * st.busy / handled : 0.0)
+                  << '\n' << std::defaultfloat;
+    }
+
+    std::cout << encode.images << " of " << files.size() << " images in "
+              << std::fixed << std::setprecision(3) << wall << "s ("
+              << std::setprecision(2) << encode.images / wall
+              << " images/s), bottleneck: " << bottleneck << '\n'
+              << std::defaultfloat;
+
+    return decode.failures || encode.failures ? -1 : 0;
+}
@@ -0,0 +1,139 @@
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+#include <opencv2/opencv.hpp>
+
+#include "kmeans_wrapper.h"
+
+static unsigned long parse_seedarg(char const *arg)
+{
+    unsigned long res = 0u;
+    try {
+        size_t idx;
+        res = std::stoul(arg, &idx);
+
+        if (idx != strlen(arg))
+            throw std::invalid_argument("trailing garbage");
+
+    } catch (std::exception const &e) {
+        throw std::invalid_argument(
+            std::string("failed to parse seed: ") + e.what());
+    }
+
+    return res;
+}
+
+static void usage(char const *prog)
+{
+    std::cerr << "Usage: " << prog << " fit IMAGE CLUSTERS MODEL_OUT [SEED]\n"
+              << "       " << prog
+              << " MODEL IMAGE RESULT_OUT [IMAGE RESULT_OUT]...\n"
+              << "The first form fits a model with k-means++ seeding (SEED 0,"
+              << " the default, seeds\nfrom the current time), the second"
+              << " labels images against a saved model\nwithout refitting.\n";
+}
+
+// fit centroids to a single image and save them
+static int fit(int argc, char **argv)
+{
+    cv::Mat image = cv::imread(argv[2]);
+    if (image.empty()) {
+        std::cerr << "Failed to load image file '" << argv[2] << "'\n";
+        return -1;
+    }
+
+    int n_clusters;
+    unsigned long seed = 0u;
+
+    try {
+        size_t idx;
+        n_clusters = std::stoi(argv[3], &idx);
+
+        if (idx != strlen(argv[3]) || n_clusters < 1)
+            throw std::invalid_argument("expected a positive number");
+
+        if (argc > 5)
+            seed = parse_seedarg(argv[5]);
+
+    } catch (std::exception const &e) {
+        std::cerr << "Failed to parse arguments: " << e.what() << '\n';
+        return -1;
+    }
+
+    KmeansOMPWrapper wrapper;
+    wrapper.set_seeding(KMEANS_INIT_PLUSPLUS, seed);
+    wrapper.exec(image, n_clusters);
+
+    kmeans_result telemetry = wrapper.get_telemetry();
+
+    try {
+        wrapper.save_model(argv[4]);
+    } catch (std::exception const &e) {
+        std::cerr << e.what() << '\n';
+        return -1;
+    }
+
+    std::cout << "fitted " << n_clusters << " clusters in "
+              << telemetry.iterations << " iterations ("
+              << wrapper.get_exec_time() << "s), inertia "
+              << telemetry.inertia << ", saved to " << argv[4] << '\n';
+
+    return 0;
+}
+
+// label images against a saved model
+static int apply(int argc, char **argv)
+{
+    KmeansPredictor predictor;
+
+    try {
+        predictor.load_model(argv[1]);
+    } catch (std::exception const &e) {
+        std::cerr << e.what() << '\n';
+        return -1;
+    }
+
+    std::cout << "model " << argv[1] << ": "
+              << predictor.get_centroids().size() << " clusters, seed "
+              << predictor.get_seed() << ", inertia "
+              << predictor.get_inertia() << '\n';
+
+    for (int i = 2; i + 1 < argc; i += 2) {
+        cv::Mat image = cv::imread(argv[i]);
+        if (image.empty()) {
+            std::cerr << "Failed to load image file '" << argv[i] << "'\n";
+            return -1;
+        }
+
+        predictor.predict(image);
+
+        if (!cv::imwrite(argv[i + 1], predictor.get_result())) {
+            std::cerr << "Failed to write '" << argv[i + 1] << "'\n";
+            return -1;
+        }
+
+        double time = predictor.get_exec_time();
+        double pixels = static_cast<double>(image.rows) * image.cols;
+
+        std::cout << argv[i] << " -> " << argv[i + 1] << ": " << std::fixed
+                  << std::setprecision(3) << 1e3 * time << "ms ("
+                  << 1e-6 * pixels / time << " Mpixels/s)\n"
+                  << std::defaultfloat;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc >= 5 && std::string(argv[1]) == "fit")
+        return fit(argc, argv);
+
+    if (argc >= 4 && argc % 2 == 0 && std::string(argv[1]) != "fit")
+        return apply(argc, argv);
+
+    usage(argv[0]);
+    return -1;
+}
@@ -1,39 +1,173 @@
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+
 #include <opencv2/opencv.hpp>
 
 #include "kmeans_wrapper.h"
 
-int main(int argc, char **argv)
+static int parse_intarg(char const *arg, char const *what)
 {
-    cv::Mat image;
-    int n_clusters;
+    int res = 0;
+    try {
+        size_t idx;
+        res = std::stoi(arg, &idx);
 
+        if (idx != strlen(arg))
+            throw std::invalid_argument("trailing garbage");
+
+    } catch (std::exception const &e) {
+        throw std::invalid_argument(
+            std::string("failed to parse ") + what + ": " + e.what());
+    }
+
+    return res;
+}
+
+static KmeansWrapper *create_wrapper(std::string const &engine)
+{
+    if (engine == "c")
+        return new KmeansPureCWrapper();
+    if (engine == "omp")
+        return new KmeansOMPWrapper();
+    if (engine == "hamerly")
+        return new KmeansHamerlyWrapper();
+    if (engine == "omp_hamerly")
+        return new KmeansOMPHamerlyWrapper();
+    if (engine == "simd")
+        return new KmeansSIMDWrapper();
+    if (engine == "omp_simd")
+        return new KmeansOMPSIMDWrapper();
+    if (engine == "minibatch")
+        return new KmeansMiniBatchWrapper(kmeans_minibatch, 1);
+    if (engine == "omp_minibatch")
+        return new KmeansMiniBatchWrapper();
+    if (engine == "compact")
+        return new KmeansCompactWrapper(kmeans_compact, 1);
+    if (engine == "omp_compact")
+        return new KmeansCompactWrapper();
+    if (engine == "histogram")
+        return new KmeansHistogramWrapper(kmeans_histogram, 1);
+    if (engine == "omp_histogram")
+        return new KmeansHistogramWrapper();
+    if (engine == "coreset")
+        return new KmeansCoresetWrapper(kmeans_coreset, 1);
+    if (engine == "omp_coreset")
+        return new KmeansCoresetWrapper();
+    if (engine == "slic")
+        return new KmeansSLICWrapper(kmeans_slic, 1);
+    if (engine == "omp_slic")
+        return new KmeansSLICWrapper();
+    if (engine == "bisecting")
+        return new KmeansBisectingWrapper();
+    if (engine == "omp_bisecting")
+        return new KmeansOMPBisectingWrapper();
+    if (engine == "features")
+        return new KmeansFeatureWrapper(kmeans_features, 1);
+    if (engine == "omp_features")
+        return new KmeansFeatureWrapper();
+    if (engine == "omp_numa")
+        return new KmeansNUMAWrapper();
+    if (engine == "sharded")
+        return new KmeansShardedWrapper();
+
+    return nullptr;
+}
+
+int main(int argc, char **argv)
+{
     if (argc < 3) {
-        std::cerr << "Usage: " << argv[0] << " IMAGE CLUSTERS\n";
+        std::cerr << "Usage: " << argv[0]
+                  << " IMAGE CLUSTERS [ENGINE] [TRACE] [RUNS]\n"
+                  << "ENGINE is one of c (default), omp, hamerly, omp_hamerly,"
+                  << " simd, omp_simd,\nminibatch, omp_minibatch, compact,"
+                  << " omp_compact, histogram,\nomp_histogram, coreset,"
+                  << " omp_coreset, slic, omp_slic,\nbisecting, omp_bisecting,"
+                  << " features, omp_features, omp_numa,\nsharded, TRACE is written in"
+                  << " Chrome trace event format (default: profile.json)\n";
         return -1;
     }
 
     // load image
-    image = cv::imread(argv[1]);
+    cv::Mat image = cv::imread(argv[1]);
     if (image.empty()) {
         std::cerr << "Failed to load image file '" << argv[1] << "'\n";
         return -1;
     }
 
-    // parse number of clusters
+    int n_clusters;
+    int n_runs = 1;
+
     try {
-        size_t idx;
-        n_clusters = std::stoi(argv[2], &idx);
+        n_clusters = parse_intarg(argv[2], "number of clusters");
 
-        if (idx != strlen(argv[2]))
-            throw std::invalid_argument("trailing garbage");
+        if (argc > 5)
+            n_runs = parse_intarg(argv[5], "number of runs");
 
     } catch (std::exception const &e) {
-        std::cerr << "Failed to parse number of clusters: " << e.what() << '\n';
+        std::cerr << e.what() << '\n';
+        return -1;
+    }
+
+    std::string engine(argc > 3 ? argv[3] : "c");
+    std::string trace_file(argc > 4 ? argv[4] : "profile.json");
+
+    std::unique_ptr<KmeansWrapper> wrapper(create_wrapper(engine));
+    if (!wrapper) {
+        std::cerr << "Unknown engine '" << engine << "'\n";
+        return -1;
+    }
+
+    // record all engine calls made from this thread
+    kmeans_trace *trace = kmeans_trace_create(1);
+    kmeans_set_trace(trace);
+
+    for (int i = 0; i < n_runs; ++i)
+        wrapper->exec(image, n_clusters);
+
+    kmeans_set_trace(nullptr);
+
+    // summarize phases
+    bool counters = kmeans_trace_has_counters(trace);
+
+    std::printf("%-8s %8s %12s %12s", "phase", "count", "total [s]", "mean [s]");
+    if (counters)
+        std::printf(" %14s %14s %14s", "cycles", "instructions", "cache misses");
+    std::printf("\n");
+
+    for (int p = 0; p < KMEANS_PHASES; ++p) {
+        kmeans_phase phase = static_cast<kmeans_phase>(p);
+        kmeans_phase_stats stats = kmeans_trace_get_phase_stats(trace, phase);
+
+        if (!stats.count)
+            continue;
+
+        std::printf("%-8s %8zu %12.3e %12.3e", kmeans_phase_name(phase),
+                    stats.count, stats.time, stats.time / stats.count);
+
+        if (counters) {
+            std::printf(" %14llu %14llu %14llu",
+                        stats.counters[KMEANS_COUNTER_CYCLES],
+                        stats.counters[KMEANS_COUNTER_INSTRUCTIONS],
+                        stats.counters[KMEANS_COUNTER_CACHE_MISSES]);
+        }
+        std::printf("\n");
+    }
+
+    if (!counters)
+        std::cout << "(hardware counters not available)\n";
+
+    int err = kmeans_trace_write(trace, trace_file.c_str());
+    kmeans_trace_destroy(trace);
+
+    if (err) {
+        std::cerr << "Failed to write trace file '" << trace_file << "'\n";
         return -1;
     }
 
-    KmeansPureCWrapper wrapper;
-    wrapper.exec(image, n_clusters);
+    std::cout << "trace written to: " << trace_file << '\n';
 
     return 0;
 }
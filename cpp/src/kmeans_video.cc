@@ -0,0 +1,152 @@
+#include <cmath>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <omp.h>
+#include <opencv2/opencv.hpp>
+
+#include "kmeans_wrapper.h"
+
+static int parse_intarg(char const *arg)
+{
+    int res = 0;
+    try {
+        size_t idx;
+        res = std::stoi(arg, &idx);
+
+        if (idx != strlen(arg))
+            throw std::invalid_argument("trailing garbage");
+
+    } catch (std::exception const &e) {
+        throw std::invalid_argument(
+            std::string("malformed integer param: ") + e.what());
+    }
+
+    return res;
+}
+
+// synthetic frame: a slowly drifting colour gradient with a few discs moving
+// across it and a little per-frame noise
+static void render_frame(cv::Mat &frame, int index)
+{
+    int const n_discs = 4;
+    double const t = 0.02 * index;
+
+    for (int y = 0; y < frame.rows; ++y) {
+        cv::Vec3b *row = frame.ptr<cv::Vec3b>(y);
+
+        for (int x = 0; x < frame.cols; ++x) {
+            double u = (double) x / frame.cols;
+            double v = (double) y / frame.rows;
+
+            double b = 128.0 + 100.0 * std::sin(2.0 * u + t);
+            double g = 128.0 + 100.0 * std::sin(3.0 * v - t);
+            double r = 128.0 + 100.0 * std::cos(u + v + 0.5 * t);
+
+            for (int d = 0; d < n_discs; ++d) {
+                double cx = 0.5 + 0.35 * std::cos(t + 1.7 * d);
+                double cy = 0.5 + 0.35 * std::sin(1.3 * t + 2.3 * d);
+
+                double du = u - cx;
+                double dv = v - cy;
+
+                if (du * du + dv * dv < 0.01) {
+                    b = 60.0 * d;
+                    g = 255.0 - 60.0 * d;
+                    r = 40.0 * (d + 1);
+                }
+            }
+
+            // cheap deterministic noise
+            unsigned hash = (unsigned) (x * 73856093) ^
+                            (unsigned) (y * 19349663) ^
+                            (unsigned) (index * 83492791);
+
+            double noise = (double) (hash % 9u) - 4.0;
+
+            row[x][0] = cv::saturate_cast<unsigned char>(b + noise);
+            row[x][1] = cv::saturate_cast<unsigned char>(g + noise);
+            row[x][2] = cv::saturate_cast<unsigned char>(r + noise);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 5) {
+        std::cerr << "Usage: " << argv[0]
+                  << " WIDTH HEIGHT FRAMES CLUSTERS [SEED]\n";
+        return -1;
+    }
+
+    int width, height, n_frames, n_clusters;
+    unsigned long seed = 42u;
+
+    try {
+        width = parse_intarg(argv[1]);
+        height = parse_intarg(argv[2]);
+        n_frames = parse_intarg(argv[3]);
+        n_clusters = parse_intarg(argv[4]);
+
+        if (argc > 5)
+            seed = parse_intarg(argv[5]);
+
+    } catch (std::exception const &e) {
+        std::cerr << e.what() << '\n';
+        return -1;
+    }
+
+    // render frame stream up front so that only clustering is timed
+    std::vector<cv::Mat> frames(n_frames);
+    for (int i = 0; i < n_frames; ++i) {
+        frames[i] = cv::Mat(height, width, CV_8UC3);
+        render_frame(frames[i], i);
+    }
+
+    // initialize implementation variants
+    std::vector<std::pair<char const *, KmeansWrapper *>> impl;
+
+    KmeansOMPWrapper omp_wrapper;
+    impl.push_back(std::make_pair("C + OpenMP", &omp_wrapper));
+
+    KmeansOMPSIMDWrapper omp_simd_wrapper;
+    impl.push_back(std::make_pair("C + OpenMP + SIMD", &omp_simd_wrapper));
+
+    KmeansCompactWrapper compact_wrapper;
+    impl.push_back(std::make_pair("C + OpenMP (compact)", &compact_wrapper));
+
+    KmeansCUDAWrapper cuda_wrapper;
+    impl.push_back(std::make_pair("C + CUDA", &cuda_wrapper));
+
+    std::cout << std::fixed << std::setprecision(2);
+
+    for (auto const &variant: impl) {
+        char const *title = std::get<0>(variant);
+        KmeansWrapper *wrapper = std::get<1>(variant);
+
+        wrapper->set_seeding(KMEANS_INIT_PLUSPLUS, seed);
+
+        double fps[2];
+        for (int warm = 0; warm < 2; ++warm) {
+            wrapper->set_warm_start(warm);
+
+            cv::Mat result;
+
+            double start = omp_get_wtime();
+            for (auto const &frame: frames)
+                wrapper->exec_into(frame, n_clusters, result);
+
+            fps[warm] = n_frames / (omp_get_wtime() - start);
+        }
+
+        std::cout << title << ": "
+                  << fps[0] << " frames/sec (cold), "
+                  << fps[1] << " frames/sec (warm start), speedup "
+                  << fps[1] / fps[0] << '\n';
+    }
+
+    return 0;
+}
@@ -1,87 +1,856 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
 #include <omp.h>
 #include <opencv2/core/core.hpp>
 
 #include "kmeans_config.h"
 #include "kmeans_wrapper.h"
 
+// matrix type holding labels of the given type
+static int label_mat_type(kmeans_label_type label_type) {
+    switch (label_type) {
+    case KMEANS_LABEL_U8:
+        return CV_8U;
+    case KMEANS_LABEL_U16:
+        return CV_16U;
+    default:
+        return CV_32S;
+    }
+}
+
+// write model, throwing on failure
+static void save(kmeans_model const &model, std::string const &filename) {
+    if (kmeans_model_save(&model, filename.c_str()))
+        throw std::system_error(errno, std::generic_category(),
+                                "failed to save model to " + filename);
+}
+
+pixel_bgr KmeansWrapper::bgr_view(cv::Mat const &image) {
+    pixel_bgr view;
+    view.data = image.data;
+    view.rows = image.rows;
+    view.cols = image.cols;
+    view.step = image.step;
+
+    return view;
+}
+
+void KmeansWrapper::map_result(cv::Mat const &image,
+                               void const *labels, kmeans_label_type label_type,
+                               std::vector<pixel> const &centroids) {
+
+    // no-op if result already has the right size and type
+    unsigned char const *old_data = result.data;
+    result.create(image.size(), image.type());
+    context.record_mat(result, old_data);
+
+    kmeans_palette_map(labels, label_type, &centroids[0], centroids.size(),
+                       bgr_view(result));
+}
+
+bool KmeansWrapper::begin_warm_start(cv::Mat const &image,
+                                     size_t n_centroids) {
+
+    bool warm = warm_start && warm_valid &&
+                image.size() == warm_size && n_centroids == warm_centroids;
+
+    warm_valid = warm_start;
+    warm_size = image.size();
+    warm_centroids = n_centroids;
+
+    return warm;
+}
+
+void KmeansWrapper::begin_engine(bool warm) {
+    kmeans_set_seeding(warm ? KMEANS_INIT_PROVIDED : seeding_init,
+                       seeding_seed);
+
+    kmeans_set_options(&options);
+
+    context.resize(iteration_times, options.max_iter);
+
+    telemetry = kmeans_result();
+    telemetry.iteration_times = iteration_times.data();
+    telemetry.iteration_times_size = iteration_times.size();
+    kmeans_set_result(&telemetry);
+
+    context.activate();
+}
+
+void KmeansWrapper::end_engine() {
+    kmeans_set_result(nullptr);
+    kmeans_set_options(nullptr);
+
+    // don't leave a warm start selected for later calls on this thread
+    kmeans_set_seeding(seeding_init, seeding_seed);
+
+    context.deactivate();
+}
+
+void KmeansCWrapper::reset_centroids(size_t n_centroids, bool warm) {
+    if (warm)
+        return;
+
+    pixel zero = { 0.0, 0.0, 0.0 };
+
+    context.resize(centroids, n_centroids);
+    std::fill(centroids.begin(), centroids.end(), zero);
+}
+
+void KmeansCWrapper::reset_labels(size_t n_pixels, bool warm) {
+    if (warm)
+        return;
+
+    // stale labels from a previous call could end the first iteration early
+    context.resize(labels, n_pixels);
+    std::fill(labels.begin(), labels.end(), 0u);
+}
+
+void KmeansCWrapper::load_pixels(cv::Mat const &image) {
+    context.resize(pixels, static_cast<size_t>(image.rows) * image.cols);
+
+    for (int y = 0; y < image.rows; ++y) {
+        cv::Vec3b const *row = image.ptr<cv::Vec3b>(y);
+        pixel *dst = &pixels[y * image.cols];
+
+        for (int x = 0; x < image.cols; ++x) {
+            dst[x].r = row[x][2];
+            dst[x].g = row[x][1];
+            dst[x].b = row[x][0];
+        }
+    }
+}
+
 void KmeansCWrapper::exec(cv::Mat const &image, size_t n_centroids) {
 
     size_t n_pixels = image.rows * image.cols;
+    bool warm = begin_warm_start(image, n_centroids);
+
+    // convert pixels (buffers are reused across calls)
+    load_pixels(image);
+
+    reset_centroids(n_centroids, warm);
+    reset_labels(n_pixels, warm);
+
+    // perform calculations
+    if (cores)
+        omp_set_num_threads(cores);
+
+    begin_engine(warm);
+
+    start_timer();
+    impl(&pixels[0], n_pixels, &centroids[0], n_centroids, &labels[0]);
+    stop_timer();
+
+    // rebuild image from results
+    map_result(image, &labels[0], KMEANS_LABEL_SIZE, centroids);
+
+    end_engine();
+}
+
+void KmeansCWrapper::save_model(std::string const &filename) const {
+    if (centroids.empty())
+        throw std::logic_error("no centroids to save yet");
+
+    kmeans_model model;
+    model.dtype = KMEANS_DTYPE_F64;
+    model.dim = 3;
+    model.n_centroids = centroids.size();
+    model.centroids = const_cast<pixel *>(&centroids[0]);
+    model.seed = seeding_seed;
+    model.inertia = telemetry.inertia;
+
+    save(model, filename);
+}
+
+void KmeansSLICWrapper::exec(cv::Mat const &image, size_t n_superpixels) {
+
+    size_t n_pixels = image.rows * image.cols;
+
+    context.resize(superpixels, n_superpixels);
+    reset_labels(n_pixels, false);
+
+    // perform calculations
+    if (cores)
+        omp_set_num_threads(cores);
+
+    begin_engine(false);
+
+    // pixels are read straight from the image buffer
+    start_timer();
+    size_t n_placed = slic_impl(bgr_view(image), &superpixels[0],
+                                n_superpixels, &labels[0], compactness);
+    stop_timer();
+
+    superpixels.resize(n_placed);
+
+    // rebuild image from superpixel colours
+    context.resize(centroids, n_placed);
+    for (size_t j = 0u; j < n_placed; ++j)
+        centroids[j] = superpixels[j].colour;
+
+    map_result(image, &labels[0], KMEANS_LABEL_SIZE, centroids);
+
+    end_engine();
+}
+
+void KmeansRestartsWrapper::exec(cv::Mat const &image, size_t n_centroids) {
+
+    size_t n_pixels = image.rows * image.cols;
+    bool warm = begin_warm_start(image, n_centroids);
+
+    // convert pixels (buffers are reused across calls)
+    load_pixels(image);
+
+    reset_centroids(n_centroids, warm);
+    reset_labels(n_pixels, warm);
+
+    inertias.assign(n_restarts ? n_restarts : 1u, 0.0);
+
+    // perform calculations
+    if (cores)
+        omp_set_num_threads(cores);
+
+    begin_engine(warm);
+
+    start_timer();
+    best_restart = restarts_impl(&pixels[0], n_pixels, &centroids[0],
+                                 n_centroids, &labels[0], n_restarts,
+                                 &inertias[0]);
+    stop_timer();
+
+    // rebuild image from results
+    map_result(image, &labels[0], KMEANS_LABEL_SIZE, centroids);
+
+    end_engine();
+}
+
+void KmeansShardedWrapper::exec(cv::Mat const &image, size_t n_centroids) {
+
+    size_t n_pixels = image.rows * image.cols;
+    bool warm = begin_warm_start(image, n_centroids);
+
+    // workers are forked with (copy-on-write views of) the converted pixels
+    load_pixels(image);
+
+    reset_centroids(n_centroids, warm);
+    reset_labels(n_pixels, warm);
+
+    context.resize(comm_times, options.max_iter);
+    context.resize(compute_times, options.max_iter);
+
+    shard_stats = kmeans_shard_stats();
+    shard_stats.comm_times = comm_times.data();
+    shard_stats.compute_times = compute_times.data();
+    shard_stats.times_size = comm_times.size();
+
+    // seeding on the coordinator
+    if (cores)
+        omp_set_num_threads(cores);
+
+    begin_engine(warm);
+
+    start_timer();
+    int res = kmeans_sharded(&pixels[0], n_pixels, &centroids[0], n_centroids,
+                             &labels[0], n_workers, &shard_stats);
+    stop_timer();
+
+    if (res) {
+        int err = errno;
+
+        // the labels are incomplete, don't warm start from them
+        warm_valid = false;
+        end_engine();
+
+        throw std::system_error(err, std::generic_category(),
+                                "sharded clustering failed");
+    }
+
+    // rebuild image from results
+    map_result(image, &labels[0], KMEANS_LABEL_SIZE, centroids);
+
+    end_engine();
+}
+
+std::vector<double> KmeansShardedWrapper::get_comm_times() const {
+    size_t n = std::min(static_cast<size_t>(telemetry.iterations),
+                        comm_times.size());
+    return std::vector<double>(comm_times.begin(), comm_times.begin() + n);
+}
+
+std::vector<double> KmeansShardedWrapper::get_compute_times() const {
+    size_t n = std::min(static_cast<size_t>(telemetry.iterations),
+                        compute_times.size());
+    return std::vector<double>(compute_times.begin(),
+                               compute_times.begin() + n);
+}
+
+void KmeansSIMDWrapper::exec(cv::Mat const &image, size_t n_centroids) {
+
+    size_t n_pixels = image.rows * image.cols;
+    bool warm = begin_warm_start(image, n_centroids);
+
+    // convert pixels (one plane per channel)
+    context.resize(planes, 3 * n_pixels);
+
+    pixel_planar pixels;
+    pixels.r = &planes[0];
+    pixels.g = &planes[n_pixels];
+    pixels.b = &planes[2 * n_pixels];
 
-    // allocate memory
-    std::vector<pixel> pixels(n_pixels);
     for (int y = 0; y < image.rows; ++y) {
-        for(int x = 0; x < image.cols; ++x) {
-            int idx = y * image.cols + x;
-            pixels[idx].r = image.at<cv::Vec3b>(y, x)[2];
-            pixels[idx].g = image.at<cv::Vec3b>(y, x)[1];
-            pixels[idx].b = image.at<cv::Vec3b>(y, x)[0];
+        cv::Vec3b const *row = image.ptr<cv::Vec3b>(y);
+        size_t offs = y * image.cols;
+
+        for (int x = 0; x < image.cols; ++x) {
+            pixels.r[offs + x] = row[x][2];
+            pixels.g[offs + x] = row[x][1];
+            pixels.b[offs + x] = row[x][0];
         }
     }
 
-    std::vector<pixel> centroids(n_centroids);
-    for (size_t i = 0; i < n_centroids; ++i) {
-        centroids[i].r = 0.0;
-        centroids[i].g = 0.0;
-        centroids[i].b = 0.0;
-    }
+    reset_centroids(n_centroids, warm);
+    reset_labels(n_pixels, warm);
+
+    // perform calculations
+    if (cores)
+        omp_set_num_threads(cores);
+
+    begin_engine(warm);
+
+    start_timer();
+    simd_impl(pixels, n_pixels, &centroids[0], n_centroids, &labels[0]);
+    stop_timer();
+
+    // rebuild image from results
+    map_result(image, &labels[0], KMEANS_LABEL_SIZE, centroids);
 
-    std::vector<size_t> labels(n_pixels);
+    end_engine();
+}
+
+void KmeansMiniBatchWrapper::exec(cv::Mat const &image, size_t n_centroids) {
+
+    size_t n_pixels = image.rows * image.cols;
+    bool warm = begin_warm_start(image, n_centroids);
+
+    reset_centroids(n_centroids, warm);
+    reset_labels(n_pixels, warm);
 
     // perform calculations
     if (cores)
         omp_set_num_threads(cores);
 
+    begin_engine(warm);
+
+    // pixels are sampled straight from the image buffer
     start_timer();
-    impl(&pixels[0], n_pixels, &centroids[0], n_centroids, &labels[0]);
+    minibatch_impl(bgr_view(image), &centroids[0], n_centroids,
+                   &labels[0], batch_size);
+    stop_timer();
+
+    // rebuild image from results
+    map_result(image, &labels[0], KMEANS_LABEL_SIZE, centroids);
+
+    end_engine();
+}
+
+void KmeansCoresetWrapper::exec(cv::Mat const &image, size_t n_centroids) {
+
+    size_t n_pixels = image.rows * image.cols;
+    bool warm = begin_warm_start(image, n_centroids);
+
+    reset_centroids(n_centroids, warm);
+    reset_labels(n_pixels, warm);
+
+    // perform calculations
+    if (cores)
+        omp_set_num_threads(cores);
+
+    begin_engine(warm);
+
+    // the coreset is sampled straight from the image buffer
+    start_timer();
+    coreset_impl(bgr_view(image), &centroids[0], n_centroids, &labels[0],
+                 sample_size);
+    stop_timer();
+
+    // rebuild image from results
+    map_result(image, &labels[0], KMEANS_LABEL_SIZE, centroids);
+
+    end_engine();
+}
+
+void KmeansHistogramWrapper::exec(cv::Mat const &image, size_t n_centroids) {
+
+    size_t n_pixels = image.rows * image.cols;
+    bool warm = begin_warm_start(image, n_centroids);
+
+    reset_centroids(n_centroids, warm);
+    reset_labels(n_pixels, warm);
+
+    // perform calculations
+    if (cores)
+        omp_set_num_threads(cores);
+
+    begin_engine(warm);
+
+    // the colour histogram is built straight from the image buffer
+    start_timer();
+    histogram_impl(bgr_view(image), &centroids[0], n_centroids,
+                   &labels[0], quant_bits);
     stop_timer();
 
     // rebuild image from results
-    result = cv::Mat(image.size(), image.type());
+    map_result(image, &labels[0], KMEANS_LABEL_SIZE, centroids);
+
+    end_engine();
+}
+
+void KmeansCompactWrapper::exec(cv::Mat const &image, size_t n_centroids) {
+
+    bool warm = begin_warm_start(image, n_centroids);
+
+    reset_centroids(n_centroids, warm);
+
+    // use narrowest possible labels
+    kmeans_label_type label_type = kmeans_label_type_for(n_centroids);
+
+    unsigned char const *old_labels = compact_labels.data;
+    compact_labels.create(image.rows, image.cols, label_mat_type(label_type));
+    context.record_mat(compact_labels, old_labels);
+
+    if (!warm) {
+        std::fill(compact_labels.data,
+                  compact_labels.data +
+                      compact_labels.total() * kmeans_label_size(label_type),
+                  0u);
+    }
+
+    // perform calculations
+    if (cores)
+        omp_set_num_threads(cores);
+
+    begin_engine(warm);
+
+    // pixels are read straight from the image buffer
+    start_timer();
+    compact_impl(bgr_view(image), &centroids[0], n_centroids,
+                 compact_labels.data, label_type);
+    stop_timer();
+
+    // rebuild image from results
+    map_result(image, compact_labels.data, label_type, centroids);
+
+    end_engine();
+}
+
+void KmeansFeatureWrapper::run(cv::Mat const &points, size_t n_centroids,
+                               bool warm) {
+
+    size_t n_points = points.rows;
+
+    // centroids are only kept when warm starting
+    unsigned char const *old_centroids = feature_centroids.data;
+    feature_centroids.create(n_centroids, points.cols, CV_32F);
+    context.record_mat(feature_centroids, old_centroids);
+
+    if (!warm)
+        feature_centroids.setTo(0.0f);
+
+    reset_labels(n_points, warm);
+
+    kmeans_matrix matrix;
+    matrix.data = points.ptr<float>(0);
+    matrix.n_rows = n_points;
+    matrix.n_cols = points.cols;
+    matrix.ld = points.step1();
+    matrix.layout = KMEANS_ROW_MAJOR;
+
+    // perform calculations
+    if (cores)
+        omp_set_num_threads(cores);
+
+    begin_engine(warm);
+
+    start_timer();
+    features_impl(matrix, feature_centroids.ptr<float>(0), n_centroids,
+                  &labels[0]);
+    stop_timer();
+}
+
+void KmeansFeatureWrapper::exec_features(cv::Mat const &points,
+                                         size_t n_centroids) {
+
+    CV_Assert(points.type() == CV_32F && points.rows > 0);
+
+    // warm starts only apply to images
+    warm_valid = false;
+
+    run(points, n_centroids, false);
+
+    end_engine();
+}
+
+void KmeansFeatureWrapper::exec(cv::Mat const &image, size_t n_centroids) {
+
+    size_t n_pixels = image.rows * image.cols;
+    bool warm = begin_warm_start(image, n_centroids);
+
+    // convert pixels into rows of r, g, b (buffer is reused across calls)
+    unsigned char const *old_features = features.data;
+    features.create(n_pixels, 3, CV_32F);
+    context.record_mat(features, old_features);
+
     for (int y = 0; y < image.rows; ++y) {
+        cv::Vec3b const *row = image.ptr<cv::Vec3b>(y);
+        float *dst = features.ptr<float>(y * image.cols);
+
         for (int x = 0; x < image.cols; ++x) {
-            int label = labels[y * image.cols + x];
-            result.at<cv::Vec3b>(y, x)[2] = centroids[label].r;
-            result.at<cv::Vec3b>(y, x)[1] = centroids[label].g;
-            result.at<cv::Vec3b>(y, x)[0] = centroids[label].b;
+            dst[3 * x] = row[x][2];
+            dst[3 * x + 1] = row[x][1];
+            dst[3 * x + 2] = row[x][0];
+        }
+    }
+
+    run(features, n_centroids, warm);
+
+    // rebuild image from results
+    context.resize(centroids, n_centroids);
+    for (size_t j = 0u; j < n_centroids; ++j) {
+        float const *centroid = feature_centroids.ptr<float>(j);
+
+        centroids[j].r = centroid[0];
+        centroids[j].g = centroid[1];
+        centroids[j].b = centroid[2];
+    }
+
+    map_result(image, &labels[0], KMEANS_LABEL_SIZE, centroids);
+
+    end_engine();
+}
+
+void KmeansFeatureWrapper::save_model(std::string const &filename) const {
+    if (feature_centroids.empty())
+        throw std::logic_error("no centroids to save yet");
+
+    // rows may be padded
+    cv::Mat dense = feature_centroids.clone();
+
+    kmeans_model model;
+    model.dtype = KMEANS_DTYPE_F32;
+    model.dim = dense.cols;
+    model.n_centroids = dense.rows;
+    model.centroids = dense.ptr<float>(0);
+    model.seed = seeding_seed;
+    model.inertia = telemetry.inertia;
+
+    save(model, filename);
+}
+
+void KmeansNUMAWrapper::release_buffers() {
+    kmeans_numa_free(numa_pixels, numa_size * sizeof(pixel));
+    kmeans_numa_free(numa_labels, numa_size * sizeof(size_t));
+
+    numa_pixels = nullptr;
+    numa_labels = nullptr;
+    numa_size = 0u;
+}
+
+void KmeansNUMAWrapper::exec(cv::Mat const &image, size_t n_centroids) {
+
+    size_t n_pixels = image.rows * image.cols;
+    bool warm = begin_warm_start(image, n_centroids);
+
+    if (cores)
+        omp_set_num_threads(cores);
+
+    int n_threads = omp_get_max_threads();
+
+    // pages stay where they were first touched, so buffers are only reused
+    // while they are partitioned among the threads the same way
+    if (n_pixels != numa_size || n_threads != numa_threads) {
+        release_buffers();
+
+        numa_pixels = static_cast<pixel *>(
+            kmeans_numa_alloc(n_pixels * sizeof(pixel)));
+        numa_labels = static_cast<size_t *>(
+            kmeans_numa_alloc(n_pixels * sizeof(size_t)));
+
+        if (!numa_pixels || !numa_labels) {
+            release_buffers();
+            throw std::bad_alloc();
+        }
+
+        numa_size = n_pixels;
+        numa_threads = n_threads;
+
+        context.record_allocation(n_pixels * (sizeof(pixel) + sizeof(size_t)));
+
+        warm = false;
+    }
+
+    // convert pixels (and reset labels) on the threads which own them
+    #pragma omp parallel
+    {
+        kmeans_numa_bind();
+
+        size_t begin, end;
+        kmeans_numa_range(n_pixels, &begin, &end);
+
+        for (size_t i = begin; i < end; ) {
+            int y = i / image.cols;
+            int x = i % image.cols;
+
+            cv::Vec3b const *row = image.ptr<cv::Vec3b>(y);
+
+            for (; x < image.cols && i < end; ++x, ++i) {
+                numa_pixels[i].r = row[x][2];
+                numa_pixels[i].g = row[x][1];
+                numa_pixels[i].b = row[x][0];
+
+                if (!warm)
+                    numa_labels[i] = 0u;
+            }
         }
     }
+
+    // unpin the whole team again, the engine binds it for itself
+    #pragma omp parallel
+    kmeans_numa_unbind();
+
+    reset_centroids(n_centroids, warm);
+
+    // perform calculations
+    begin_engine(warm);
+
+    start_timer();
+    impl(numa_pixels, n_pixels, &centroids[0], n_centroids, numa_labels);
+    stop_timer();
+
+    // rebuild image from results
+    map_result(image, numa_labels, KMEANS_LABEL_SIZE, centroids);
+
+    end_engine();
 }
 
 void KmeansOpenCVWrapper::exec(cv::Mat const &image, size_t n_centroids) {
 
+    bool warm = begin_warm_start(image, n_centroids);
+
     // construct input data points vector
     cv::Mat data_points(image.rows * image.cols, 3, CV_32F);
     for (int y = 0; y < image.rows; ++y) {
+        cv::Vec3b const *row = image.ptr<cv::Vec3b>(y);
+
         for (int x = 0; x < image.cols; ++x) {
+            float *point = data_points.ptr<float>(y * image.cols + x);
             for (int channel = 0; channel < 3; ++channel)
-                data_points.at<float>(y *  image.cols + x, channel) =
-                    image.at<cv::Vec3b>(y, x)[channel];
+                point[channel] = row[x][channel];
         }
     }
 
-    // allocate space for labels
-    cv::Mat labels;
-
     // transform cluster centers into **double format
-    cv::Mat centroids;
+    cv::Mat centers;
+
+    // specify termination criteria (OpenCV only supports a centroid shift
+    // tolerance in addition to the iteration limit)
+    int term_type = CV_TERMCRIT_ITER;
+    if (options.shift_tol > 0.0)
+        term_type |= CV_TERMCRIT_EPS;
+
+    cv::TermCriteria term(term_type, options.max_iter, options.shift_tol);
+
+    // choose closest equivalent of our seeding (k-means|| is not available)
+    int flags = seeding_init == KMEANS_INIT_RANDOM ?
+        cv::KMEANS_RANDOM_CENTERS : cv::KMEANS_PP_CENTERS;
+
+    // labels of the previous call are kept in the labels member
+    if (warm)
+        flags = cv::KMEANS_USE_INITIAL_LABELS;
 
-    // specify termination criteria
-    cv::TermCriteria term(CV_TERMCRIT_ITER, KMEANS_MAX_ITER, 0);
+    if (seeding_seed)
+        cv::theRNG().state = seeding_seed;
 
     // perform calculations
     start_timer();
-    cv::kmeans(data_points, n_centroids, labels, term, 1,
-               cv::KMEANS_RANDOM_CENTERS, centroids);
+    double compactness =
+        cv::kmeans(data_points, n_centroids, labels, term, 1, flags, centers);
     stop_timer();
 
-    // rebuild image from results
-    result = cv::Mat(image.size(), image.type());
+    // the number of iterations is not reported by OpenCV
+    telemetry = kmeans_result();
+    telemetry.inertia = compactness;
+    telemetry.time = get_exec_time();
+
+    // rebuild image from results (centers are in BGR order)
+    std::vector<pixel> centroids(n_centroids);
+    for (size_t i = 0; i < n_centroids; ++i) {
+        centroids[i].r = centers.at<float>(i, 2);
+        centroids[i].g = centers.at<float>(i, 1);
+        centroids[i].b = centers.at<float>(i, 0);
+    }
+
+    map_result(image, labels.data, KMEANS_LABEL_U32, centroids);
+}
+
+void KmeansPredictor::load_model(std::string const &filename) {
+    kmeans_model model;
+
+    if (kmeans_model_load(&model, filename.c_str()))
+        throw std::system_error(errno, std::generic_category(),
+                                "failed to load model from " + filename);
+
+    if (model.dim != 3) {
+        kmeans_model_free(&model);
+        throw std::invalid_argument(filename + " is not a model of pixels");
+    }
+
+    centroids.resize(model.n_centroids);
+    for (size_t j = 0u; j < model.n_centroids; ++j) {
+        double value[3];
+
+        for (int c = 0; c < 3; ++c)
+            value[c] = model.dtype == KMEANS_DTYPE_F32
+                ? static_cast<float const *>(model.centroids)[3 * j + c]
+                : static_cast<double const *>(model.centroids)[3 * j + c];
+
+        centroids[j].r = value[0];
+        centroids[j].g = value[1];
+        centroids[j].b = value[2];
+    }
+
+    seed = model.seed;
+    inertia = model.inertia;
+
+    kmeans_model_free(&model);
+}
+
+void KmeansPredictor::set_centroids(std::vector<pixel> const &c) {
+    centroids = c;
+    seed = 0u;
+    inertia = -1.0;
+}
+
+void KmeansPredictor::predict(cv::Mat const &image) {
+
+    CV_Assert(image.type() == CV_8UC3 && !centroids.empty());
+
+    size_t n_centroids = centroids.size();
+    kmeans_label_type label_type = kmeans_label_type_for(n_centroids);
+
+    // no-ops if labels and result already have the right size and type
+    unsigned char const *old_labels = labels.data;
+    labels.create(image.rows, image.cols, label_mat_type(label_type));
+    context.record_mat(labels, old_labels);
+
+    unsigned char const *old_result = result.data;
+    result.create(image.size(), image.type());
+    context.record_mat(result, old_result);
+
+    if (cores)
+        omp_set_num_threads(cores);
+
+    context.activate();
+
+    double start = omp_get_wtime();
+    predict_impl(KmeansWrapper::bgr_view(image), &centroids[0], n_centroids,
+                 labels.data, label_type);
+    _exec_time = omp_get_wtime() - start;
+
+    kmeans_palette_map(labels.data, label_type, &centroids[0], n_centroids,
+                       KmeansWrapper::bgr_view(result));
+
+    context.deactivate();
+}
+
+void KmeansBatch::exec_one(Slot &slot, cv::Mat const &image,
+                           size_t n_centroids) {
+
+    size_t n_pixels = image.rows * image.cols;
+
+    // convert pixels
+    slot.pixels.resize(n_pixels);
     for (int y = 0; y < image.rows; ++y) {
+        cv::Vec3b const *row = image.ptr<cv::Vec3b>(y);
+        pixel *dst = &slot.pixels[y * image.cols];
+
         for (int x = 0; x < image.cols; ++x) {
-            int idx = labels.at<int>(y * image.cols +  x, 0);
-            for (int i = 0; i < 3; ++i)
-                result.at<cv::Vec3b>(y, x)[i] = centroids.at<float>(idx, i);
+            dst[x].r = row[x][2];
+            dst[x].g = row[x][1];
+            dst[x].b = row[x][0];
         }
     }
+
+    pixel zero = { 0.0, 0.0, 0.0 };
+    slot.centroids.assign(n_centroids, zero);
+    slot.labels.assign(n_pixels, 0u);
+
+    slot.iteration_times.resize(options.max_iter);
+    slot.telemetry = kmeans_result();
+    slot.telemetry.iteration_times = slot.iteration_times.data();
+    slot.telemetry.iteration_times_size = slot.iteration_times.size();
+
+    // image tasks are tied, so no other image runs on this thread until this
+    // one is done and the per-thread result can be used
+    kmeans_set_result(&slot.telemetry);
+
+    kmeans_task(&slot.pixels[0], n_pixels, &slot.centroids[0], n_centroids,
+                &slot.labels[0]);
+
+    kmeans_set_result(nullptr);
+
+    // rebuild image from results
+    slot.result.create(image.size(), image.type());
+    kmeans_palette_map(&slot.labels[0], KMEANS_LABEL_SIZE,
+                       &slot.centroids[0], n_centroids,
+                       KmeansWrapper::bgr_view(slot.result));
+}
+
+void KmeansBatch::exec(std::vector<cv::Mat> const &images, size_t n_centroids,
+                       Callback const &done) {
+
+    if (slots.size() < images.size())
+        slots.resize(images.size());
+
+    while (contexts.size() < static_cast<size_t>(cores))
+        contexts.emplace_back(new KmeansContext());
+
+    double start = omp_get_wtime();
+
+    #pragma omp parallel num_threads(cores)
+    {
+        KmeansContext &context = *contexts[omp_get_thread_num()];
+
+        // seeding and options are per thread, every thread of the team may
+        // run image tasks
+        context.activate();
+        kmeans_set_seeding(seeding_init, seeding_seed);
+        kmeans_set_options(&options);
+
+        // all tasks are finished at the implicit barrier
+        #pragma omp single
+        {
+            for (size_t i = 0u; i < images.size(); ++i) {
+                #pragma omp task
+                {
+                    exec_one(slots[i], images[i], n_centroids);
+
+                    #pragma omp critical (kmeans_batch_done)
+                    done(i, slots[i].result, slots[i].telemetry);
+                }
+            }
+        }
+
+        kmeans_set_options(nullptr);
+        context.deactivate();
+    }
+
+    _exec_time = omp_get_wtime() - start;
 }
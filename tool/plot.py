@@ -19,6 +19,11 @@ def parse_benchmarks(benchmarks):
             results[name] = {}
 
         for row in data:
+            # only plot uniform random images (and results predating other
+            # data distributions)
+            if row.get('data', 'uniform') != 'uniform':
+                continue
+
             n_clusters = int(row['clusters'])
             if n_clusters not in results[name]:
                 results[name][n_clusters] = {}
@@ -132,6 +137,9 @@ if __name__ == '__main__':
     for root, dirs, files in os.walk(sys.argv[1]):
         csv_files = []
         for filename in files:
+            if filename in ('summary.csv', 'baseline.csv'):
+                continue
+
             if filename.endswith('.csv'):
                 csv_files.append(filename)
 
@@ -163,12 +171,22 @@ if __name__ == '__main__':
     _, omp4_runtimes = parse_runtimes(results['OpenMP_quad'][k])
 
     # simple plot
-    plot_simple(dims, [('C', c_runtimes),
-                       ('CUDA C', cuda_runtimes),
-                       ('C + OpenMP (1 core)', omp1_runtimes),
-                       ('C + OpenMP (2 cores)', omp2_runtimes),
-                       ('C + OpenMP (3 cores)', omp3_runtimes),
-                       ('C + OpenMP (4 cores)', omp4_runtimes)])
+    all_runtimes = [('C', c_runtimes),
+                    ('CUDA C', cuda_runtimes),
+                    ('C + OpenMP (1 core)', omp1_runtimes),
+                    ('C + OpenMP (2 cores)', omp2_runtimes),
+                    ('C + OpenMP (3 cores)', omp3_runtimes),
+                    ('C + OpenMP (4 cores)', omp4_runtimes)]
+
+    # results recorded before the SIMD engines existed (such as the checked-in
+    # ones) have no SIMD series
+    for name, label in (('SIMD', 'C + SIMD'),
+                        ('OpenMP_SIMD_quad', 'C + OpenMP + SIMD (4 cores)')):
+        if k in results.get(name, {}):
+            _, runtimes = parse_runtimes(results[name][k])
+            all_runtimes.append((label, runtimes))
+
+    plot_simple(dims, all_runtimes)
 
     save_plot('All_plot')
 